@@ -0,0 +1,350 @@
+#include "platform.h"
+#include "chunk_store.h"
+
+#include "common.h"
+#include "durable.h"
+#include "fs_utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INITIAL_CAPACITY 1024
+#define TMP_PREFIX "tmp-"
+
+static size_t home_slot(const chunk_store_t *store, const unsigned char hash[HASH_SIZE]) {
+    return (size_t)get_le64(hash) & (store->capacity - 1);
+}
+
+/* index of the slot holding hash, or of the empty slot where it would go */
+static size_t probe(const chunk_store_t *store, const unsigned char hash[HASH_SIZE]) {
+    size_t i = home_slot(store, hash);
+    while (store->slots[i].length != 0 && memcmp(store->slots[i].hash, hash, HASH_SIZE) != 0) {
+        i = (i + 1) & (store->capacity - 1);
+    }
+    return i;
+}
+
+static int resize(chunk_store_t *store, size_t capacity) {
+    chunk_slot_t *old_slots = store->slots;
+    size_t old_capacity = store->capacity;
+    chunk_slot_t *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) {
+        return -1;
+    }
+    store->slots = slots;
+    store->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_slots[i].length != 0) {
+            store->slots[probe(store, old_slots[i].hash)] = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return 0;
+}
+
+static chunk_slot_t *insert(chunk_store_t *store, const unsigned char hash[HASH_SIZE], uint32_t length) {
+    /* keep the load under 70% so probe runs stay short */
+    if ((store->count + 1) * 10 > store->capacity * 7 && resize(store, store->capacity * 2) < 0) {
+        return NULL;
+    }
+    chunk_slot_t *slot = &store->slots[probe(store, hash)];
+    memcpy(slot->hash, hash, HASH_SIZE);
+    slot->length = length;
+    slot->refs = 0;
+    ++store->count;
+    store->bytes += length;
+    return slot;
+}
+
+/* backward-shift deletion keeps every remaining entry reachable from its home slot */
+static void remove_slot(chunk_store_t *store, size_t i) {
+    size_t mask = store->capacity - 1;
+    store->bytes -= store->slots[i].length;
+    --store->count;
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (store->slots[j].length == 0) {
+            break;
+        }
+        size_t home = home_slot(store, store->slots[j].hash);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            store->slots[i] = store->slots[j];
+            i = j;
+        }
+    }
+    memset(&store->slots[i], 0, sizeof(store->slots[i]));
+}
+
+int chunk_store_path(const chunk_store_t *store, const unsigned char hash[HASH_SIZE], char *out, size_t out_len) {
+    char hex[HASH_HEX_SIZE];
+    hash_to_hex(hash, hex);
+    if (snprintf(out, out_len, "%s/%.2s/%s", store->dir, hex, hex + 2) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_hex(const char *hex, size_t digits, unsigned char *out) {
+    for (size_t i = 0; i < digits; ++i) {
+        int value;
+        char c = hex[i];
+        if (c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value = c - 'a' + 10;
+        } else {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            out[i / 2] = (unsigned char)(value << 4);
+        } else {
+            out[i / 2] |= (unsigned char)value;
+        }
+    }
+    return hex[digits] == '\0' ? 0 : -1;
+}
+
+/* indexes what is on disk with no references; the world store then counts them and sweeps */
+static int load_chunks(chunk_store_t *store) {
+    DIR *top = opendir(store->dir);
+    if (!top) {
+        return -1;
+    }
+    struct dirent *sub;
+    while ((sub = readdir(top)) != NULL) {
+        char sub_path[PATH_MAX];
+        if (snprintf(sub_path, sizeof(sub_path), "%s/%s", store->dir, sub->d_name) >= (int)sizeof(sub_path)) {
+            continue;
+        }
+        if (strncmp(sub->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) {
+            unlink(sub_path);
+            continue;
+        }
+        unsigned char hash[HASH_SIZE];
+        if (parse_hex(sub->d_name, 2, hash) < 0) {
+            continue;
+        }
+        DIR *dir = opendir(sub_path);
+        if (!dir) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (parse_hex(entry->d_name, HASH_SIZE * 2 - 2, hash + 1) < 0) {
+                continue;
+            }
+            char path[PATH_MAX];
+            struct stat st;
+            if (chunk_store_path(store, hash, path, sizeof(path)) < 0 || stat(path, &st) < 0 ||
+                st.st_size == 0 || st.st_size > UINT32_MAX) {
+                continue;
+            }
+            if (!insert(store, hash, (uint32_t)st.st_size)) {
+                closedir(dir);
+                closedir(top);
+                return -1;
+            }
+        }
+        closedir(dir);
+    }
+    closedir(top);
+    return 0;
+}
+
+int chunk_store_open(chunk_store_t *store, const char *dir) {
+    memset(store, 0, sizeof(*store));
+    if (snprintf(store->dir, sizeof(store->dir), "%s", dir) >= (int)sizeof(store->dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (ensure_directory(dir, 0755) < 0) {
+        return -1;
+    }
+    store->slots = calloc(INITIAL_CAPACITY, sizeof(*store->slots));
+    if (!store->slots) {
+        return -1;
+    }
+    store->capacity = INITIAL_CAPACITY;
+    pthread_mutex_init(&store->lock, NULL);
+    return load_chunks(store);
+}
+
+void chunk_store_close(chunk_store_t *store) {
+    free(store->slots);
+    store->slots = NULL;
+    store->capacity = store->count = 0;
+    pthread_mutex_destroy(&store->lock);
+}
+
+/* 1 and pinned if the chunk is stored, 0 if it is not */
+int chunk_store_ref(chunk_store_t *store, const unsigned char hash[HASH_SIZE]) {
+    pthread_mutex_lock(&store->lock);
+    chunk_slot_t *slot = &store->slots[probe(store, hash)];
+    int found = slot->length != 0;
+    if (found) {
+        ++slot->refs;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return found;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/* stores and pins a chunk; data that does not match its hash is rejected with EBADMSG */
+int chunk_store_put(chunk_store_t *store, const unsigned char hash[HASH_SIZE], const void *data, size_t length) {
+    unsigned char actual[HASH_SIZE];
+    hash_buffer(data, length, actual);
+    if (length == 0 || length > UINT32_MAX || memcmp(actual, hash, HASH_SIZE) != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (chunk_store_ref(store, hash) == 1) {
+        return 0;
+    }
+    char tmp_path[PATH_MAX];
+    char final_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/" TMP_PREFIX "XXXXXX", store->dir) >= (int)sizeof(tmp_path) ||
+        chunk_store_path(store, hash, final_path, sizeof(final_path)) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write_all(fd, data, length) < 0 || fchmod(fd, 0644) < 0 || durable_file(fd) < 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    durable_written(fd);
+    close(fd);
+
+    /* the rename happens under the lock so it cannot race an unref deleting the same chunk */
+    pthread_mutex_lock(&store->lock);
+    chunk_slot_t *slot = &store->slots[probe(store, hash)];
+    int rc = 0;
+    int stored = 0;
+    char sub_dir[PATH_MAX];
+    if (slot->length != 0) {
+        ++slot->refs;
+        unlink(tmp_path);
+    } else {
+        snprintf(sub_dir, sizeof(sub_dir), "%.*s", (int)(strrchr(final_path, '/') - final_path), final_path);
+        if ((mkdir(sub_dir, 0755) < 0 && errno != EEXIST) || rename(tmp_path, final_path) < 0) {
+            rc = -1;
+        } else if ((slot = insert(store, hash, (uint32_t)length)) == NULL) {
+            unlink(final_path);
+            rc = -1;
+        } else {
+            slot->refs = 1;
+            stored = 1;
+        }
+        if (rc < 0) {
+            int saved = errno;
+            unlink(tmp_path);
+            errno = saved;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    /* the chunk's name has to last as long as the manifests that will list it */
+    if (stored && durable_dir(sub_dir) < 0) {
+        int saved = errno;
+        chunk_store_unref(store, hash);
+        errno = saved;
+        return -1;
+    }
+    return rc;
+}
+
+void chunk_store_unref(chunk_store_t *store, const unsigned char hash[HASH_SIZE]) {
+    pthread_mutex_lock(&store->lock);
+    size_t i = probe(store, hash);
+    chunk_slot_t *slot = &store->slots[i];
+    if (slot->length != 0 && slot->refs > 0 && --slot->refs == 0) {
+        char path[PATH_MAX];
+        if (chunk_store_path(store, hash, path, sizeof(path)) == 0) {
+            unlink(path);
+        }
+        remove_slot(store, i);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+/* pins every chunk of a manifest, or none of them with ENOENT if one is missing */
+int chunk_store_ref_manifest(chunk_store_t *store, const manifest_t *manifest) {
+    for (size_t i = 0; i < manifest->chunk_count; ++i) {
+        if (chunk_store_ref(store, manifest->chunks[i].hash) != 1) {
+            chunk_store_unref_manifest(store, manifest, i);
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void chunk_store_unref_manifest(chunk_store_t *store, const manifest_t *manifest, size_t chunk_count) {
+    for (size_t i = 0; i < chunk_count; ++i) {
+        chunk_store_unref(store, manifest->chunks[i].hash);
+    }
+}
+
+/* deletes chunks nothing references, e.g. leftovers of pushes cut short by a crash */
+int chunk_store_sweep(chunk_store_t *store) {
+    pthread_mutex_lock(&store->lock);
+    chunk_slot_t *old_slots = store->slots;
+    size_t old_capacity = store->capacity;
+    chunk_slot_t *slots = calloc(old_capacity, sizeof(*slots));
+    if (!slots) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    store->slots = slots;
+    store->count = 0;
+    store->bytes = 0;
+    int removed = 0;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        chunk_slot_t *old = &old_slots[i];
+        if (old->length == 0) {
+            continue;
+        }
+        if (old->refs == 0) {
+            char path[PATH_MAX];
+            if (chunk_store_path(store, old->hash, path, sizeof(path)) == 0) {
+                unlink(path);
+            }
+            ++removed;
+            continue;
+        }
+        chunk_slot_t *slot = &store->slots[probe(store, old->hash)];
+        *slot = *old;
+        ++store->count;
+        store->bytes += old->length;
+    }
+    free(old_slots);
+    pthread_mutex_unlock(&store->lock);
+    return removed;
+}
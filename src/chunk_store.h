@@ -0,0 +1,45 @@
+#ifndef MCSYNC_CHUNK_STORE_H
+#define MCSYNC_CHUNK_STORE_H
+
+#include "platform.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "manifest.h"
+
+/*
+ * Unique chunks live once under <dir>/<first two hex digits>/<rest of the
+ * hash>. An in-memory index counts the manifest references to each chunk;
+ * a push pins the chunks it relies on before it publishes, and a chunk file
+ * is deleted when its last reference goes away.
+ */
+typedef struct {
+    unsigned char hash[HASH_SIZE];
+    /* 0 marks an empty slot; chunks are never empty */
+    uint32_t length;
+    uint32_t refs;
+} chunk_slot_t;
+
+typedef struct {
+    char dir[PATH_MAX];
+    pthread_mutex_t lock;
+    chunk_slot_t *slots;
+    size_t capacity;
+    size_t count;
+    unsigned long long bytes;
+} chunk_store_t;
+
+int chunk_store_open(chunk_store_t *store, const char *dir);
+void chunk_store_close(chunk_store_t *store);
+int chunk_store_path(const chunk_store_t *store, const unsigned char hash[HASH_SIZE], char *out, size_t out_len);
+int chunk_store_ref(chunk_store_t *store, const unsigned char hash[HASH_SIZE]);
+int chunk_store_put(chunk_store_t *store, const unsigned char hash[HASH_SIZE], const void *data, size_t length);
+void chunk_store_unref(chunk_store_t *store, const unsigned char hash[HASH_SIZE]);
+int chunk_store_ref_manifest(chunk_store_t *store, const manifest_t *manifest);
+void chunk_store_unref_manifest(chunk_store_t *store, const manifest_t *manifest, size_t chunk_count);
+int chunk_store_sweep(chunk_store_t *store);
+
+#endif /* MCSYNC_CHUNK_STORE_H */
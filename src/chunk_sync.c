@@ -0,0 +1,321 @@
+#include "platform.h"
+#include "chunk_sync.h"
+
+#include "chunker.h"
+#include "fs_utils.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    const unsigned char *hash;
+    uint32_t index;
+} missing_chunk_t;
+
+static int compare_missing(const void *a, const void *b) {
+    const missing_chunk_t *left = a;
+    const missing_chunk_t *right = b;
+    int cmp = memcmp(left->hash, right->hash, HASH_SIZE);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return left->index < right->index ? -1 : left->index > right->index;
+}
+
+static int compare_index(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+static int receive_manifest(mc_conn_t *conn, manifest_t *manifest) {
+    proto_msg_t msg;
+    while (1) {
+        if (proto_recv(conn, &msg) < 0) {
+            return -1;
+        }
+        if (msg.type == PROTO_END) {
+            return 0;
+        }
+        if ((msg.type != PROTO_ENTRY_DIR && msg.type != PROTO_ENTRY_CHUNKED) || proto_check_path(msg.text, msg.text_len) < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        int type = msg.type == PROTO_ENTRY_DIR ? MANIFEST_DIR : MANIFEST_FILE;
+        if (manifest_add_entry(manifest, type, msg.text, msg.text_len, msg.size) < 0) {
+            return -1;
+        }
+        if (type == MANIFEST_DIR) {
+            continue;
+        }
+        size_t first = manifest->chunk_count;
+        if (proto_recv_chunk_refs(conn, manifest, msg.count) < 0) {
+            return -1;
+        }
+        unsigned long long total = 0;
+        for (size_t i = first; i < manifest->chunk_count; ++i) {
+            uint32_t length = manifest->chunks[i].length;
+            if (length == 0 || length > CHUNK_MAX_SIZE) {
+                errno = EPROTO;
+                return -1;
+            }
+            total += length;
+        }
+        if (total != msg.size || manifest->chunk_count > UINT32_MAX) {
+            errno = EPROTO;
+            return -1;
+        }
+        manifest_finish_file(manifest);
+        conn->received.files++;
+    }
+}
+
+/* pins what the store already has and lists the first reference to each chunk it lacks */
+static int plan_wants(chunk_store_t *store, const manifest_t *manifest, unsigned char *pinned, uint32_t **wanted, size_t *wanted_count) {
+    missing_chunk_t *missing = malloc((manifest->chunk_count + 1) * sizeof(*missing));
+    if (!missing) {
+        return -1;
+    }
+    size_t missing_count = 0;
+    for (size_t i = 0; i < manifest->chunk_count; ++i) {
+        if (chunk_store_ref(store, manifest->chunks[i].hash) == 1) {
+            pinned[i] = 1;
+        } else {
+            missing[missing_count].hash = manifest->chunks[i].hash;
+            missing[missing_count].index = (uint32_t)i;
+            ++missing_count;
+        }
+    }
+    qsort(missing, missing_count, sizeof(*missing), compare_missing);
+    *wanted = malloc((missing_count + 1) * sizeof(**wanted));
+    if (!*wanted) {
+        free(missing);
+        return -1;
+    }
+    *wanted_count = 0;
+    for (size_t i = 0; i < missing_count; ++i) {
+        if (i == 0 || memcmp(missing[i].hash, missing[i - 1].hash, HASH_SIZE) != 0) {
+            (*wanted)[(*wanted_count)++] = missing[i].index;
+        }
+    }
+    free(missing);
+    /* ascending, so the client can stream the chunks in file order */
+    qsort(*wanted, *wanted_count, sizeof(**wanted), compare_index);
+    return 0;
+}
+
+static int receive_chunks(mc_conn_t *conn, chunk_store_t *store, const manifest_t *manifest,
+                          const uint32_t *wanted, size_t wanted_count, unsigned char *pinned) {
+    unsigned char *buffer = malloc(CHUNK_MAX_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    proto_msg_t msg;
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < wanted_count; ++i) {
+        const manifest_chunk_t *chunk = &manifest->chunks[wanted[i]];
+        if (proto_recv(conn, &msg) < 0) {
+            rc = -1;
+        } else if (msg.type != PROTO_CHUNK_DATA || msg.size != chunk->length ||
+                   memcmp(msg.hash, chunk->hash, HASH_SIZE) != 0) {
+            errno = EPROTO;
+            rc = -1;
+        } else if (conn_read(conn, buffer, chunk->length) < 0 ||
+                   chunk_store_put(store, chunk->hash, buffer, chunk->length) < 0) {
+            rc = -1;
+        } else {
+            pinned[wanted[i]] = 1;
+            conn->received.bytes += chunk->length;
+        }
+    }
+    free(buffer);
+    if (rc == 0 && (proto_recv(conn, &msg) < 0 || msg.type != PROTO_END)) {
+        errno = EPROTO;
+        rc = -1;
+    }
+    return rc;
+}
+
+int chunk_sync_receive(mc_conn_t *conn, chunk_store_t *store, manifest_t *manifest, size_t *new_chunks) {
+    *new_chunks = 0;
+    manifest_init(manifest);
+    if (receive_manifest(conn, manifest) < 0) {
+        manifest_free(manifest);
+        return -1;
+    }
+    unsigned char *pinned = calloc(manifest->chunk_count + 1, 1);
+    uint32_t *wanted = NULL;
+    size_t wanted_count = 0;
+    int rc = pinned ? plan_wants(store, manifest, pinned, &wanted, &wanted_count) : -1;
+    if (rc == 0) {
+        rc = proto_send_wants(conn, wanted, wanted_count);
+    }
+    if (rc == 0) {
+        rc = receive_chunks(conn, store, manifest, wanted, wanted_count, pinned);
+    }
+    /* repeats of a chunk that just arrived; the first reference keeps it alive meanwhile */
+    for (size_t i = 0; rc == 0 && i < manifest->chunk_count; ++i) {
+        if (!pinned[i]) {
+            if (chunk_store_ref(store, manifest->chunks[i].hash) != 1) {
+                errno = ENOENT;
+                rc = -1;
+            } else {
+                pinned[i] = 1;
+            }
+        }
+    }
+    if (rc < 0) {
+        int saved = errno;
+        for (size_t i = 0; pinned && i < manifest->chunk_count; ++i) {
+            if (pinned[i]) {
+                chunk_store_unref(store, manifest->chunks[i].hash);
+            }
+        }
+        manifest_free(manifest);
+        errno = saved;
+    }
+    *new_chunks = wanted_count;
+    free(wanted);
+    free(pinned);
+    return rc;
+}
+
+typedef struct {
+    chunk_store_t *store;
+    size_t pinned;
+} import_ctx_t;
+
+static int import_chunk(const manifest_chunk_t *chunk, const unsigned char *data, void *arg) {
+    import_ctx_t *ctx = arg;
+    if (chunk_store_put(ctx->store, chunk->hash, data, chunk->length) < 0) {
+        return -1;
+    }
+    ++ctx->pinned;
+    return 0;
+}
+
+/* chunks a tree received over the plain protocol into the store */
+int chunk_sync_import_tree(chunk_store_t *store, const char *tree_dir, manifest_t *manifest) {
+    manifest_init(manifest);
+    import_ctx_t ctx = { store, 0 };
+    if (manifest_scan_dir(manifest, tree_dir, import_chunk, &ctx) < 0) {
+        int saved = errno;
+        chunk_store_unref_manifest(store, manifest, ctx.pinned);
+        manifest_free(manifest);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static int read_chunk(const chunk_store_t *store, const manifest_chunk_t *chunk, unsigned char *out) {
+    char path[PATH_MAX];
+    if (chunk_store_path(store, chunk->hash, path, sizeof(path)) < 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < chunk->length) {
+        ssize_t got = pread(fd, out + done, chunk->length - done, (off_t)done);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            if (got == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    close(fd);
+    return 0;
+}
+
+static int send_chunk_file(mc_conn_t *conn, const chunk_store_t *store, const manifest_chunk_t *chunk) {
+    char path[PATH_MAX];
+    if (chunk_store_path(store, chunk->hash, path, sizeof(path)) < 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = conn_send_file(conn, fd, 0, chunk->length);
+    close(fd);
+    return rc;
+}
+
+/*
+ * Streams a manifest as ordinary entries, so pulls look the same whatever
+ * the storage format. wanted holds ascending entry indexes to send, or is
+ * NULL for all of them.
+ */
+int chunk_sync_send_world(mc_conn_t *conn, chunk_store_t *store, const manifest_t *manifest, const uint32_t *wanted, size_t wanted_count,
+                          delta_basis_set_t *bases) {
+    proto_batch_t batch;
+    int batching = (conn->caps & PROTO_CAP_BATCH) != 0;
+    if (batching && proto_batch_init(&batch) < 0) {
+        return -1;
+    }
+    int rc = 0;
+    size_t count = wanted ? wanted_count : manifest->entry_count;
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        const manifest_entry_t *entry = &manifest->entries[wanted ? wanted[i] : i];
+        size_t path_len = strlen(entry->path);
+        if (entry->type == MANIFEST_DIR) {
+            rc = proto_send_entry_dir(conn, entry->path, path_len);
+            continue;
+        }
+        const manifest_chunk_t *chunks = &manifest->chunks[entry->first_chunk];
+        const delta_signature_t *signature = entry->size >= DELTA_MIN_SIZE ? delta_basis_set_find(bases, entry->path) : NULL;
+        if (signature) {
+            /* a delta needs the whole file in view, so the chunks are gathered first */
+            unsigned char *data = malloc((size_t)entry->size);
+            rc = data ? 0 : -1;
+            unsigned char *out = data;
+            for (size_t c = 0; rc == 0 && c < entry->chunk_count; ++c) {
+                rc = read_chunk(store, &chunks[c], out);
+                out += chunks[c].length;
+            }
+            if (rc == 0) {
+                rc = send_delta_entry(conn, entry->path, signature, data, (size_t)entry->size);
+            }
+            free(data);
+            continue;
+        }
+        if (batching && entry->size < PROTO_BATCH_FILE_MAX) {
+            unsigned char *body = proto_batch_reserve(conn, &batch, entry->path, path_len, (size_t)entry->size);
+            rc = body ? 0 : -1;
+            for (size_t c = 0; rc == 0 && c < entry->chunk_count; ++c) {
+                rc = read_chunk(store, &chunks[c], body);
+                body += chunks[c].length;
+            }
+        } else {
+            rc = proto_send_entry_file(conn, entry->path, path_len, entry->size);
+            for (size_t c = 0; rc == 0 && c < entry->chunk_count; ++c) {
+                rc = send_chunk_file(conn, store, &chunks[c]);
+            }
+        }
+        if (rc == 0) {
+            conn->sent.files++;
+            conn->sent.bytes += entry->size;
+        }
+    }
+    if (batching) {
+        if (rc == 0) {
+            rc = proto_batch_flush(conn, &batch);
+        }
+        proto_batch_free(&batch);
+    }
+    return rc;
+}
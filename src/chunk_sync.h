@@ -0,0 +1,22 @@
+#ifndef MCSYNC_CHUNK_SYNC_H
+#define MCSYNC_CHUNK_SYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk_store.h"
+#include "conn.h"
+#include "delta.h"
+#include "manifest.h"
+
+/*
+ * Server side of chunk-backed worlds. On success every chunk the returned
+ * manifest lists is pinned once in the store, ready to be published; on
+ * failure nothing stays pinned.
+ */
+int chunk_sync_receive(mc_conn_t *conn, chunk_store_t *store, manifest_t *manifest, size_t *new_chunks);
+int chunk_sync_import_tree(chunk_store_t *store, const char *tree_dir, manifest_t *manifest);
+int chunk_sync_send_world(mc_conn_t *conn, chunk_store_t *store, const manifest_t *manifest, const uint32_t *wanted, size_t wanted_count,
+                          delta_basis_set_t *bases);
+
+#endif /* MCSYNC_CHUNK_SYNC_H */
@@ -0,0 +1,47 @@
+#include "chunker.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* more bits before the average size make early cuts rarer, fewer after make late ones likelier */
+#define MASK_SMALL (~UINT64_C(0) << (64 - 17))
+#define MASK_LARGE (~UINT64_C(0) << (64 - 13))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* the table must be identical on every peer, so it comes from a fixed splitmix64 sequence */
+static void init_gear(void) {
+    uint64_t seed = UINT64_C(0x6d63737963686e6b);
+    for (int i = 0; i < 256; ++i) {
+        seed += UINT64_C(0x9E3779B97F4A7C15);
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t chunker_cut(const unsigned char *data, size_t length) {
+    pthread_once(&gear_once, init_gear);
+    if (length <= CHUNK_MIN_SIZE) {
+        return length;
+    }
+    size_t limit = length < CHUNK_MAX_SIZE ? length : CHUNK_MAX_SIZE;
+    size_t normal = limit < CHUNK_AVG_SIZE ? limit : CHUNK_AVG_SIZE;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; ++i) {
+        h = (h << 1) + gear[data[i]];
+        if ((h & MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; ++i) {
+        h = (h << 1) + gear[data[i]];
+        if ((h & MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
@@ -0,0 +1,18 @@
+#ifndef MCSYNC_CHUNKER_H
+#define MCSYNC_CHUNKER_H
+
+#include <stddef.h>
+
+/*
+ * Content-defined chunking (FastCDC-style gear hash with normalized cut
+ * masks). Boundaries depend only on nearby bytes, so an insertion or an
+ * edit inside one region of a file only changes the chunks around it.
+ */
+#define CHUNK_MIN_SIZE (8 * 1024)
+#define CHUNK_AVG_SIZE (32 * 1024)
+#define CHUNK_MAX_SIZE (128 * 1024)
+
+/* length of the first chunk of data; the caller passes at least CHUNK_MAX_SIZE bytes unless at EOF */
+size_t chunker_cut(const unsigned char *data, size_t length);
+
+#endif /* MCSYNC_CHUNKER_H */
@@ -2,9 +2,6 @@
 #include "common.h"
 
 #include <errno.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -46,39 +43,39 @@ int recv_all(int sock, void *buffer, size_t length) {
     return 0;
 }
 
-int recv_line(int sock, char *buffer, size_t max_len) {
-    size_t pos = 0;
-    while (pos + 1 < max_len) {
-        char c;
-        ssize_t received = recv(sock, &c, 1, 0);
-        if (received < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            return -1;
-        }
-        if (received == 0) {
-            return -1;
-        }
-        if (c == '\n') {
-            buffer[pos] = '\0';
-            return 0;
-        }
-        buffer[pos++] = c;
+void put_le16(unsigned char *out, uint16_t value) {
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+}
+
+void put_le32(unsigned char *out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+void put_le64(unsigned char *out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+uint16_t get_le16(const unsigned char *in) {
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+uint32_t get_le32(const unsigned char *in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | in[i];
     }
-    errno = EMSGSIZE;
-    return -1;
+    return value;
 }
 
-int send_fmt(int sock, const char *fmt, ...) {
-    char buffer[MCSYNC_MAX_LINE];
-    va_list args;
-    va_start(args, fmt);
-    int written = vsnprintf(buffer, sizeof(buffer), fmt, args);
-    va_end(args);
-    if (written < 0 || (size_t)written >= sizeof(buffer)) {
-        errno = EMSGSIZE;
-        return -1;
+uint64_t get_le64(const unsigned char *in) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+        value = (value << 8) | in[i];
     }
-    return send_all(sock, buffer, (size_t)written);
+    return value;
 }
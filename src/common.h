@@ -2,13 +2,20 @@
 #define MCSYNC_COMMON_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* max line length */
 #define MCSYNC_MAX_LINE 1024
 
 int send_all(int sock, const void *buffer, size_t length);
 int recv_all(int sock, void *buffer, size_t length);
-int recv_line(int sock, char *buffer, size_t max_len);
-int send_fmt(int sock, const char *fmt, ...);
+
+/* little-endian encoding shared by the wire protocol and the on-disk formats */
+void put_le16(unsigned char *out, uint16_t value);
+void put_le32(unsigned char *out, uint32_t value);
+void put_le64(unsigned char *out, uint64_t value);
+uint16_t get_le16(const unsigned char *in);
+uint32_t get_le32(const unsigned char *in);
+uint64_t get_le64(const unsigned char *in);
 
 #endif /* MCSYNC_COMMON_H */
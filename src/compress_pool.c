@@ -0,0 +1,119 @@
+#include "platform.h"
+#include "compress_pool.h"
+
+#include "lz4.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static compress_job_t *queue_head;
+static compress_job_t *queue_tail;
+/* workers that actually started; with none, jobs run on the caller */
+static int pool_workers;
+
+int compress_pool_threads(void) {
+    const char *env = getenv("MCSYNC_COMPRESS_THREADS");
+    if (env && atoi(env) > 0) {
+        return atoi(env);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static void run_job(compress_job_t *job) {
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job->out_len = lz4_compress(job->in, job->in_len, job->out, job->out_cap, job->level);
+    if (job->out_len >= job->in_len) {
+        job->out_len = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->nanos = (unsigned long long)(end.tv_sec - start.tv_sec) * 1000000000ULL + (unsigned long long)end.tv_nsec -
+                 (unsigned long long)start.tv_nsec;
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (!queue_head) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        compress_job_t *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        run_job(job);
+        pthread_mutex_lock(&pool_lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool_done);
+    }
+    return NULL;
+}
+
+static void start_pool(void) {
+    int threads = compress_pool_threads();
+    /* a single core gains nothing from handing blocks to another thread */
+    if (threads < 2) {
+        return;
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int rc = pthread_create(&thread, &attr, worker, NULL);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            break;
+        }
+        ++pool_workers;
+    }
+}
+
+int compress_pool_submit(compress_job_t *job) {
+    pthread_once(&pool_once, start_pool);
+    job->out_len = 0;
+    job->nanos = 0;
+    job->done = 0;
+    job->next = NULL;
+    if (pool_workers == 0) {
+        run_job(job);
+        job->done = 1;
+        return 1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+int compress_pool_done(compress_job_t *job) {
+    pthread_mutex_lock(&pool_lock);
+    int done = job->done;
+    pthread_mutex_unlock(&pool_lock);
+    return done;
+}
+
+void compress_pool_wait(compress_job_t *job) {
+    pthread_mutex_lock(&pool_lock);
+    while (!job->done) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
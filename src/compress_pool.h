@@ -0,0 +1,31 @@
+#ifndef MCSYNC_COMPRESS_POOL_H
+#define MCSYNC_COMPRESS_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Compresses connection output blocks on threads shared by every
+ * connection of the process, so one fast link can keep several cores busy.
+ * A connection queues a block, keeps filling the next one and writes the
+ * results out in the order it queued them.
+ */
+typedef struct compress_job {
+    const unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_cap;
+    int level;
+    /* set by the pool; out_len is 0 when the block did not get smaller */
+    size_t out_len;
+    unsigned long long nanos;
+    int done;
+    struct compress_job *next;
+} compress_job_t;
+
+int compress_pool_threads(void);
+/* 1 if the job already ran on the calling thread, 0 if it was queued */
+int compress_pool_submit(compress_job_t *job);
+int compress_pool_done(compress_job_t *job);
+void compress_pool_wait(compress_job_t *job);
+
+#endif /* MCSYNC_COMPRESS_POOL_H */
@@ -0,0 +1,320 @@
+#include "platform.h"
+#include "compressed_tree.h"
+
+#include "durable.h"
+#include "lz4.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the chained search gains little on world data for three times the cpu of a push */
+#define CTREE_LEVEL 2
+#define RECORD_MAX (CONN_RECORD_HEADER_SIZE + CONN_BUFFER_SIZE + CONN_BUFFER_SIZE / 255 + 16)
+
+static void put_le(unsigned char *p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/* a file that ends early is damaged */
+static int read_full(int fd, unsigned char *out, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(fd, out + done, length - done, offset + (off_t)done);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+/* a temporary file beside path, named after it */
+static int open_beside(const char *path, char *tmp_path, size_t tmp_len) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    if (snprintf(tmp_path, tmp_len, "%.*s.%s.lz4XXXXXX", (int)(name - path), path, name) >= (int)tmp_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return mkstemp(tmp_path);
+}
+
+static int compress_into(int in, int out, unsigned char *block, unsigned char *record) {
+    unsigned char header[CTREE_HEADER_SIZE];
+    struct stat st;
+    if (fstat(in, &st) < 0) {
+        return -1;
+    }
+    memcpy(header, CTREE_MAGIC, 8);
+    put_le(header + 8, (uint64_t)st.st_size, 8);
+    if (write_all(out, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    unsigned long long left = (unsigned long long)st.st_size;
+    off_t offset = 0;
+    while (left > 0) {
+        size_t want = left < CONN_BUFFER_SIZE ? (size_t)left : CONN_BUFFER_SIZE;
+        if (read_full(in, block, want, offset) < 0) {
+            return -1;
+        }
+        size_t packed = lz4_compress(block, want, record + CONN_RECORD_HEADER_SIZE, RECORD_MAX - CONN_RECORD_HEADER_SIZE, CTREE_LEVEL);
+        int stored = packed == 0 || packed >= want;
+        if (stored) {
+            memcpy(record + CONN_RECORD_HEADER_SIZE, block, want);
+            packed = want;
+        }
+        put_le(record, stored ? CONN_RECORD_STORED : CONN_RECORD_LZ4, 4);
+        put_le(record + 4, packed, 4);
+        put_le(record + 8, want, 4);
+        if (write_all(out, record, CONN_RECORD_HEADER_SIZE + packed) < 0) {
+            return -1;
+        }
+        offset += (off_t)want;
+        left -= want;
+    }
+    return 0;
+}
+
+int ctree_compress_file(const char *path) {
+    int in = open(path, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    char tmp_path[PATH_MAX];
+    int out = open_beside(path, tmp_path, sizeof(tmp_path));
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    unsigned char *block = malloc(CONN_BUFFER_SIZE);
+    unsigned char *record = malloc(RECORD_MAX);
+    int rc = block && record ? compress_into(in, out, block, record) : -1;
+    free(block);
+    free(record);
+    if (rc == 0) {
+        rc = fchmod(out, 0644);
+    }
+    close(in);
+    durable_written(out);
+    if (close(out) < 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = rename(tmp_path, path);
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+    }
+    return rc;
+}
+
+int ctree_open(const char *path, unsigned long long *size) {
+    return ctree_openat(AT_FDCWD, path, size);
+}
+
+int ctree_openat(int dir_fd, const char *path, unsigned long long *size) {
+    int fd = openat(dir_fd, path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char header[CTREE_HEADER_SIZE];
+    if (read_full(fd, header, sizeof(header), 0) < 0 || memcmp(header, CTREE_MAGIC, 8) != 0) {
+        close(fd);
+        errno = EBADMSG;
+        return -1;
+    }
+    *size = get_le(header + 8, 8);
+    return fd;
+}
+
+/* expands the record at *offset into out, which has room for any block */
+static int next_block(int fd, off_t *offset, unsigned char *scratch, unsigned char *out, size_t *raw_len) {
+    unsigned char header[CONN_RECORD_HEADER_SIZE];
+    if (read_full(fd, header, sizeof(header), *offset) < 0) {
+        return -1;
+    }
+    uint32_t kind = (uint32_t)get_le(header, 4);
+    size_t length = (size_t)get_le(header + 4, 4);
+    size_t raw = (size_t)get_le(header + 8, 4);
+    *offset += CONN_RECORD_HEADER_SIZE;
+    if (raw > CONN_BUFFER_SIZE || length > RECORD_MAX - CONN_RECORD_HEADER_SIZE ||
+        (kind == CONN_RECORD_STORED && length != raw) || (kind != CONN_RECORD_STORED && kind != CONN_RECORD_LZ4)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (kind == CONN_RECORD_STORED) {
+        if (read_full(fd, out, raw, *offset) < 0) {
+            return -1;
+        }
+    } else if (read_full(fd, scratch, length, *offset) < 0 || lz4_decompress(scratch, length, out, raw) < 0) {
+        if (errno != EIO) {
+            errno = EBADMSG;
+        }
+        return -1;
+    }
+    *offset += (off_t)length;
+    *raw_len = raw;
+    return 0;
+}
+
+int ctree_read(int fd, unsigned char *out, size_t size) {
+    unsigned char *scratch = malloc(RECORD_MAX);
+    unsigned char *block = malloc(CONN_BUFFER_SIZE);
+    int rc = scratch && block ? 0 : -1;
+    off_t offset = CTREE_HEADER_SIZE;
+    size_t done = 0;
+    while (rc == 0 && done < size) {
+        size_t raw;
+        rc = next_block(fd, &offset, scratch, block, &raw);
+        if (rc == 0 && raw > size - done) {
+            errno = EBADMSG;
+            rc = -1;
+        }
+        if (rc == 0) {
+            memcpy(out + done, block, raw);
+            done += raw;
+        }
+    }
+    free(scratch);
+    free(block);
+    return rc;
+}
+
+static int expand_to(int fd, int out, unsigned long long size) {
+    unsigned char *scratch = malloc(RECORD_MAX);
+    unsigned char *block = malloc(CONN_BUFFER_SIZE);
+    int rc = scratch && block ? 0 : -1;
+    off_t offset = CTREE_HEADER_SIZE;
+    while (rc == 0 && size > 0) {
+        size_t raw;
+        rc = next_block(fd, &offset, scratch, block, &raw);
+        if (rc == 0 && raw > size) {
+            errno = EBADMSG;
+            rc = -1;
+        }
+        if (rc == 0) {
+            rc = write_all(out, block, raw);
+            size -= raw;
+        }
+    }
+    free(scratch);
+    free(block);
+    return rc;
+}
+
+int ctree_open_expanded(const char *path, unsigned long long *size) {
+    int fd = ctree_open(path, size);
+    if (fd < 0) {
+        return -1;
+    }
+    char tmp_path[PATH_MAX];
+    int out = open_beside(path, tmp_path, sizeof(tmp_path));
+    if (out < 0) {
+        close(fd);
+        return -1;
+    }
+    unlink(tmp_path);
+    int rc = expand_to(fd, out, *size);
+    close(fd);
+    if (rc < 0) {
+        int saved = errno;
+        close(out);
+        errno = saved;
+        return -1;
+    }
+    return out;
+}
+
+int ctree_expand_file(const char *source, const char *target) {
+    unsigned long long size;
+    int fd = ctree_open(source, &size);
+    if (fd < 0) {
+        return -1;
+    }
+    int out = open(target, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        close(fd);
+        return -1;
+    }
+    int rc = expand_to(fd, out, size);
+    close(fd);
+    durable_written(out);
+    if (close(out) < 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(target);
+        errno = saved;
+    }
+    return rc;
+}
+
+int ctree_send_body(mc_conn_t *conn, int fd, unsigned long long size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (conn->codec) {
+        return conn_send_records(conn, fd, CTREE_HEADER_SIZE, (unsigned long long)st.st_size - CTREE_HEADER_SIZE, size);
+    }
+    unsigned char *scratch = malloc(RECORD_MAX);
+    int rc = scratch ? 0 : -1;
+    off_t offset = CTREE_HEADER_SIZE;
+    while (rc == 0 && size > 0) {
+        /* each block expands straight into the write buffer */
+        unsigned char *slot = conn_write_reserve(conn, CONN_BUFFER_SIZE);
+        size_t raw;
+        rc = slot ? next_block(fd, &offset, scratch, slot, &raw) : -1;
+        if (rc == 0 && raw > size) {
+            errno = EBADMSG;
+            rc = -1;
+        }
+        if (rc == 0) {
+            conn_write_commit(conn, raw);
+            size -= raw;
+        }
+    }
+    free(scratch);
+    return rc;
+}
@@ -0,0 +1,33 @@
+#ifndef MCSYNC_COMPRESSED_TREE_H
+#define MCSYNC_COMPRESSED_TREE_H
+
+#include "platform.h"
+
+#include "conn.h"
+
+/*
+ * Files of a compressed tree version: a 16-byte header, the magic
+ * "MCSYNCZ1" and the u64 little-endian size of the contents, followed by
+ * the contents in the records conn.h describes, one per 64 KiB block. A
+ * pull over a compressing connection sends those records as they are;
+ * anyone else gets the contents expanded on the way out.
+ */
+#define CTREE_MAGIC "MCSYNCZ1"
+#define CTREE_HEADER_SIZE 16
+
+/* replaces the file at path with its compressed form */
+int ctree_compress_file(const char *path);
+/* a descriptor of a compressed file, with size set to the length of its contents */
+int ctree_open(const char *path, unsigned long long *size);
+/* the same with path relative to dir_fd */
+int ctree_openat(int dir_fd, const char *path, unsigned long long *size);
+/* reads all size bytes of contents of a file from ctree_open into out */
+int ctree_read(int fd, unsigned char *out, size_t size);
+/* the contents in an unlinked temporary file, for code that maps the whole file */
+int ctree_open_expanded(const char *path, unsigned long long *size);
+/* writes the contents of the compressed file source to a new file at target */
+int ctree_expand_file(const char *source, const char *target);
+/* an entry body: the records as they are when the connection compresses, the contents otherwise */
+int ctree_send_body(mc_conn_t *conn, int fd, unsigned long long size);
+
+#endif /* MCSYNC_COMPRESSED_TREE_H */
@@ -0,0 +1,981 @@
+#include "platform.h"
+#include "conn.h"
+
+#include "common.h"
+#include "compress_pool.h"
+#include "lz4.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* room for a block expanded next to the unread tail of the previous one */
+#define CODEC_RBUF_SIZE (2 * CONN_BUFFER_SIZE)
+#define CODEC_ZIN_SIZE (2 * CONN_BUFFER_SIZE)
+#define CODEC_MAX_SLOTS 16
+#define CODEC_DEFAULT_LEVEL 2
+/* blocks between level adjustments; uncompressed, only now and then try compressing again */
+#define CODEC_WINDOW 32
+#define CODEC_IDLE_WINDOW 256
+/* a sample that shrinks by less than an eighth is taken for already compressed data */
+#define CODEC_SAMPLE_SIZE CONN_BUFFER_SIZE
+#define CODEC_STORED_RUN_MAX (1UL << 30)
+
+typedef struct {
+    compress_job_t job;
+    unsigned char *raw;
+    unsigned char *out;
+} codec_slot_t;
+
+struct conn_codec {
+    /* 0 sends blocks stored, 1..LZ4_LEVEL_MAX compress them */
+    int level;
+    int fixed_level;
+    /* blocks queued for compression, written out in order from head */
+    codec_slot_t slots[CODEC_MAX_SLOTS];
+    size_t slot_count;
+    size_t head;
+    size_t queued;
+    /* since the level last changed: time blocked on the link and on compressors */
+    unsigned long long link_nanos;
+    unsigned long long cpu_nanos;
+    unsigned window_blocks;
+    unsigned char *sample_in;
+    unsigned char *sample_out;
+    /* received records not yet expanded into rbuf */
+    unsigned char *zin;
+    size_t zpos;
+    size_t zlen;
+    /* bytes of the current stored record still to come */
+    unsigned long long stored_left;
+};
+
+static unsigned long long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int conn_init(mc_conn_t *conn, int fd) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    struct stat st;
+    conn->is_socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    conn->use_sendfile = conn->is_socket && getenv("MCSYNC_NO_SENDFILE") == NULL;
+    conn->use_splice = conn->is_socket && getenv("MCSYNC_NO_SPLICE") == NULL;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->proto_version = 1;
+    if (conn->is_socket) {
+        /* we batch ourselves, so Nagle would only delay the last segment of each reply */
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    conn->rbuf = malloc(CONN_BUFFER_SIZE);
+    conn->wbuf = malloc(CONN_BUFFER_SIZE);
+    if (!conn->rbuf || !conn->wbuf) {
+        conn_destroy(conn);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_pipe(mc_conn_t *conn) {
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+}
+
+static void free_codec(struct conn_codec *codec) {
+    if (!codec) {
+        return;
+    }
+    /* a failed send can leave blocks with the pool; they still point into our buffers */
+    for (size_t i = 0; i < codec->queued; ++i) {
+        compress_pool_wait(&codec->slots[(codec->head + i) % codec->slot_count].job);
+    }
+    for (size_t i = 0; i < codec->slot_count; ++i) {
+        free(codec->slots[i].raw);
+        free(codec->slots[i].out);
+    }
+    free(codec->sample_in);
+    free(codec->sample_out);
+    free(codec->zin);
+    free(codec);
+}
+
+int conn_start_compression(mc_conn_t *conn) {
+    struct conn_codec *codec = calloc(1, sizeof(*codec));
+    unsigned char *rbuf = realloc(conn->rbuf, CODEC_RBUF_SIZE);
+    if (!codec || !rbuf) {
+        free(codec);
+        errno = ENOMEM;
+        return -1;
+    }
+    conn->rbuf = rbuf;
+    codec->level = CODEC_DEFAULT_LEVEL;
+    const char *env = getenv("MCSYNC_COMPRESS_LEVEL");
+    if (env) {
+        int level = atoi(env);
+        codec->level = level < 0 ? 0 : level > LZ4_LEVEL_MAX ? LZ4_LEVEL_MAX : level;
+        codec->fixed_level = 1;
+    }
+    /* enough blocks in flight to keep every compressor busy while one is written */
+    size_t slots = (size_t)compress_pool_threads() * 2;
+    codec->slot_count = slots < 2 ? 2 : slots > CODEC_MAX_SLOTS ? CODEC_MAX_SLOTS : slots;
+    int ok = 1;
+    for (size_t i = 0; i < codec->slot_count; ++i) {
+        codec->slots[i].raw = malloc(CONN_BUFFER_SIZE);
+        codec->slots[i].out = malloc(lz4_bound(CONN_BUFFER_SIZE));
+        ok = ok && codec->slots[i].raw && codec->slots[i].out;
+    }
+    codec->sample_in = malloc(CODEC_SAMPLE_SIZE);
+    codec->sample_out = malloc(lz4_bound(CODEC_SAMPLE_SIZE));
+    codec->zin = malloc(CODEC_ZIN_SIZE);
+    if (!ok || !codec->sample_in || !codec->sample_out || !codec->zin) {
+        free_codec(codec);
+        errno = ENOMEM;
+        return -1;
+    }
+    conn->codec = codec;
+    return 0;
+}
+
+void conn_destroy(mc_conn_t *conn) {
+    free_codec(conn->codec);
+    conn->codec = NULL;
+    close_pipe(conn);
+    free(conn->rbuf);
+    free(conn->wbuf);
+    conn->rbuf = NULL;
+    conn->wbuf = NULL;
+    conn->rpos = conn->rlen = conn->wlen = 0;
+}
+
+static int send_iov(mc_conn_t *conn, struct iovec *iov, int iovcnt, int more) {
+    while (iovcnt > 0) {
+        ssize_t sent;
+        if (conn->is_socket) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)iovcnt;
+            sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        } else {
+            sent = writev(conn->fd, iov, iovcnt);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        size_t left = (size_t)sent;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+/* compression follows the link: drop a level while compressors hold up sending, add one while the link does */
+static void adapt_level(struct conn_codec *codec) {
+    if (codec->fixed_level || ++codec->window_blocks < (codec->level == 0 ? CODEC_IDLE_WINDOW : CODEC_WINDOW)) {
+        return;
+    }
+    if (codec->cpu_nanos > codec->link_nanos && codec->level > 0) {
+        --codec->level;
+    } else if (codec->link_nanos > 2 * codec->cpu_nanos && codec->level < LZ4_LEVEL_MAX) {
+        ++codec->level;
+    }
+    codec->link_nanos = codec->cpu_nanos = 0;
+    codec->window_blocks = 0;
+}
+
+static int send_record_header(mc_conn_t *conn, uint32_t kind, uint32_t length, uint32_t raw_length, const void *payload, int more) {
+    unsigned char header[CONN_RECORD_HEADER_SIZE];
+    put_u32(header, kind);
+    put_u32(header + 4, length);
+    put_u32(header + 8, raw_length);
+    struct iovec iov[2] = {
+        { header, sizeof(header) },
+        { (void *)payload, payload ? length : 0 }
+    };
+    conn->sent.wire_bytes += sizeof(header) + (payload ? length : 0);
+    return send_iov(conn, iov, payload ? 2 : 1, more);
+}
+
+static int write_oldest(mc_conn_t *conn, int more) {
+    struct conn_codec *codec = conn->codec;
+    codec_slot_t *slot = &codec->slots[codec->head];
+    unsigned long long start = now_nanos();
+    compress_pool_wait(&slot->job);
+    unsigned long long sending = now_nanos();
+    codec->cpu_nanos += sending - start;
+    codec->head = (codec->head + 1) % codec->slot_count;
+    --codec->queued;
+    compress_job_t *job = &slot->job;
+    conn->sent.codec_bytes += job->in_len;
+    conn->sent.compressor_bytes += job->in_len;
+    conn->sent.codec_nanos += job->nanos;
+    int rc = job->out_len > 0
+                 ? send_record_header(conn, CONN_RECORD_LZ4, (uint32_t)job->out_len, (uint32_t)job->in_len, job->out, more)
+                 : send_record_header(conn, CONN_RECORD_STORED, (uint32_t)job->in_len, (uint32_t)job->in_len, job->in, more);
+    codec->link_nanos += now_nanos() - sending;
+    return rc;
+}
+
+/* hands the write buffer to the pool and writes whatever is done; more == 0 waits for everything */
+static int flush_records(mc_conn_t *conn, int more) {
+    struct conn_codec *codec = conn->codec;
+    if (conn->wlen > 0) {
+        if (codec->queued == codec->slot_count && write_oldest(conn, 1) < 0) {
+            return -1;
+        }
+        codec_slot_t *slot = &codec->slots[(codec->head + codec->queued) % codec->slot_count];
+        unsigned char *empty = slot->raw;
+        slot->raw = conn->wbuf;
+        conn->wbuf = empty;
+        slot->job.in = slot->raw;
+        slot->job.in_len = conn->wlen;
+        slot->job.out = slot->out;
+        slot->job.out_cap = lz4_bound(CONN_BUFFER_SIZE);
+        slot->job.level = codec->level;
+        conn->wlen = 0;
+        ++codec->queued;
+        if (codec->level == 0) {
+            slot->job.out_len = 0;
+            slot->job.nanos = 0;
+            slot->job.done = 1;
+        } else if (compress_pool_submit(&slot->job)) {
+            /* no pool: compressing held up this thread just as waiting for a worker would */
+            codec->cpu_nanos += slot->job.nanos;
+        }
+        adapt_level(codec);
+    }
+    while (codec->queued > 0 && (!more || compress_pool_done(&codec->slots[codec->head].job))) {
+        if (write_oldest(conn, more || codec->queued > 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int pending_output(const mc_conn_t *conn) {
+    return conn->wlen > 0 || (conn->codec && conn->codec->queued > 0);
+}
+
+static int flush_buffer(mc_conn_t *conn, int more) {
+    if (conn->codec) {
+        return flush_records(conn, more);
+    }
+    if (conn->wlen == 0) {
+        return 0;
+    }
+    struct iovec iov = { conn->wbuf, conn->wlen };
+    conn->wlen = 0;
+    return send_iov(conn, &iov, 1, more);
+}
+
+int conn_flush(mc_conn_t *conn) {
+    return flush_buffer(conn, 0);
+}
+
+/* with compression everything goes through the buffer a block at a time */
+static int write_blocks(mc_conn_t *conn, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    while (length > 0) {
+        if (conn->wlen == CONN_BUFFER_SIZE && flush_buffer(conn, 1) < 0) {
+            return -1;
+        }
+        size_t take = CONN_BUFFER_SIZE - conn->wlen;
+        take = take < length ? take : length;
+        memcpy(conn->wbuf + conn->wlen, bytes, take);
+        conn->wlen += take;
+        bytes += take;
+        length -= take;
+    }
+    return 0;
+}
+
+int conn_write(mc_conn_t *conn, const void *data, size_t length) {
+    if (conn->wlen + length <= CONN_BUFFER_SIZE) {
+        memcpy(conn->wbuf + conn->wlen, data, length);
+        conn->wlen += length;
+        return 0;
+    }
+    if (conn->codec) {
+        return write_blocks(conn, data, length);
+    }
+    if (length < CONN_BUFFER_SIZE / 2) {
+        if (flush_buffer(conn, 1) < 0) {
+            return -1;
+        }
+        memcpy(conn->wbuf, data, length);
+        conn->wlen = length;
+        return 0;
+    }
+    /* large payloads go out together with whatever header is pending */
+    struct iovec iov[2] = {
+        { conn->wbuf, conn->wlen },
+        { (void *)data, length }
+    };
+    conn->wlen = 0;
+    return send_iov(conn, iov, 2, 1);
+}
+
+static int copy_file_body(mc_conn_t *conn, int fd, off_t offset, unsigned long long length) {
+    while (length > 0) {
+        size_t want = length < CONN_BUFFER_SIZE ? (size_t)length : CONN_BUFFER_SIZE;
+        /* read straight into the write buffer, next to the header */
+        void *slot = conn_write_reserve(conn, want);
+        if (!slot) {
+            return -1;
+        }
+        ssize_t read_bytes = pread(fd, slot, want, offset);
+        if (read_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (read_bytes == 0) {
+            /* file shrank after the header went out; the stream can't be kept in sync */
+            errno = EIO;
+            return -1;
+        }
+        conn_write_commit(conn, (size_t)read_bytes);
+        offset += read_bytes;
+        length -= (unsigned long long)read_bytes;
+    }
+    return 0;
+}
+
+/* 1 if sendfile refused the source before anything went out */
+static int sendfile_body(mc_conn_t *conn, int fd, off_t offset, unsigned long long length) {
+    unsigned long long remaining = length;
+    while (remaining > 0) {
+        size_t want = remaining < (1UL << 30) ? (size_t)remaining : (1UL << 30);
+        ssize_t sent = sendfile(conn->fd, fd, &offset, want);
+        if (sent < 0) {
+            /* the socket is blocking, so EAGAIN means its send timeout ran out */
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) && remaining == length) {
+                /* source can't be mmapped (e.g. some FUSE mounts); copy instead */
+                conn->use_sendfile = 0;
+                return 1;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            errno = EIO;
+            return -1;
+        }
+        remaining -= (unsigned long long)sent;
+        conn->sent.zero_copy_bytes += (unsigned long long)sent;
+    }
+    return 0;
+}
+
+/* the body of a stored record sendfile can't send; the write buffer is empty right after a flush */
+static int send_stored_copy(mc_conn_t *conn, int fd, off_t offset, unsigned long long length) {
+    while (length > 0) {
+        size_t want = length < CONN_BUFFER_SIZE ? (size_t)length : CONN_BUFFER_SIZE;
+        ssize_t read_bytes = pread(fd, conn->wbuf, want, offset);
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes <= 0) {
+            if (read_bytes == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        struct iovec iov = { conn->wbuf, (size_t)read_bytes };
+        if (send_iov(conn, &iov, 1, 1) < 0) {
+            return -1;
+        }
+        offset += read_bytes;
+        length -= (unsigned long long)read_bytes;
+    }
+    return 0;
+}
+
+/* compresses the start of the file quickly to see whether compressing the rest is worth it */
+static int looks_compressed(mc_conn_t *conn, int fd, off_t offset, unsigned long long length) {
+    struct conn_codec *codec = conn->codec;
+    size_t want = length < CODEC_SAMPLE_SIZE ? (size_t)length : CODEC_SAMPLE_SIZE;
+    ssize_t got = pread(fd, codec->sample_in, want, offset);
+    if (got <= 0) {
+        /* the copy that follows reports the error */
+        return 0;
+    }
+    size_t packed = lz4_compress(codec->sample_in, (size_t)got, codec->sample_out, lz4_bound(CODEC_SAMPLE_SIZE), LZ4_LEVEL_MIN);
+    return packed == 0 || packed > (size_t)got - (size_t)got / 8;
+}
+
+static int send_file_records(mc_conn_t *conn, int fd, off_t offset, unsigned long long length) {
+    /* uncompressed blocks gain nothing over a stored run either */
+    if (!conn->use_sendfile || length < CONN_SENDFILE_MIN || (conn->codec->level > 0 && !looks_compressed(conn, fd, offset, length))) {
+        return copy_file_body(conn, fd, offset, length);
+    }
+    /* already compressed: what is queued goes out first, then the file as stored records */
+    if (flush_buffer(conn, 1) < 0) {
+        return -1;
+    }
+    while (conn->codec->queued > 0) {
+        if (write_oldest(conn, 1) < 0) {
+            return -1;
+        }
+    }
+    while (length > 0) {
+        unsigned long long run = length < CODEC_STORED_RUN_MAX ? length : CODEC_STORED_RUN_MAX;
+        if (send_record_header(conn, CONN_RECORD_STORED, (uint32_t)run, (uint32_t)run, NULL, 1) < 0) {
+            return -1;
+        }
+        int rc = conn->use_sendfile ? sendfile_body(conn, fd, offset, run) : 1;
+        if (rc == 1) {
+            rc = send_stored_copy(conn, fd, offset, run);
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        conn->sent.codec_bytes += run;
+        conn->sent.wire_bytes += run;
+        offset += (off_t)run;
+        length -= run;
+    }
+    return 0;
+}
+
+int conn_send_file(mc_conn_t *conn, int fd, off_t offset, unsigned long long length) {
+    if (conn->codec) {
+        return send_file_records(conn, fd, offset, length);
+    }
+    if (!conn->use_sendfile || length < CONN_SENDFILE_MIN) {
+        return copy_file_body(conn, fd, offset, length);
+    }
+    if (flush_buffer(conn, 1) < 0) {
+        return -1;
+    }
+    int rc = sendfile_body(conn, fd, offset, length);
+    return rc == 1 ? copy_file_body(conn, fd, offset, length) : rc;
+}
+
+int conn_send_records(mc_conn_t *conn, int fd, off_t offset, unsigned long long length, unsigned long long raw_length) {
+    if (!conn->codec) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* they must not land in the middle of a block still being compressed */
+    if (flush_buffer(conn, 1) < 0) {
+        return -1;
+    }
+    while (conn->codec->queued > 0) {
+        if (write_oldest(conn, 1) < 0) {
+            return -1;
+        }
+    }
+    int rc = conn->use_sendfile && length >= CONN_SENDFILE_MIN ? sendfile_body(conn, fd, offset, length) : 1;
+    if (rc == 1) {
+        rc = send_stored_copy(conn, fd, offset, length);
+    }
+    if (rc < 0) {
+        return -1;
+    }
+    conn->sent.codec_bytes += raw_length;
+    conn->sent.wire_bytes += length;
+    return 0;
+}
+
+int conn_printf(mc_conn_t *conn, const char *fmt, ...) {
+    char buffer[MCSYNC_MAX_LINE];
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (written < 0 || (size_t)written >= sizeof(buffer)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return conn_write(conn, buffer, (size_t)written);
+}
+
+void *conn_write_reserve(mc_conn_t *conn, size_t length) {
+    if (length > CONN_BUFFER_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    if (conn->wlen + length > CONN_BUFFER_SIZE && flush_buffer(conn, 1) < 0) {
+        return NULL;
+    }
+    return conn->wbuf + conn->wlen;
+}
+
+void conn_write_commit(mc_conn_t *conn, size_t length) {
+    conn->wlen += length;
+}
+
+static ssize_t read_fd(mc_conn_t *conn, void *buffer, size_t length, int flags) {
+    while (1) {
+        ssize_t received = conn->is_socket ? recv(conn->fd, buffer, length, flags) : read(conn->fd, buffer, length);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        return received;
+    }
+}
+
+/* expands the records staged in zin into rbuf as far as both allow */
+static ssize_t decode_records(mc_conn_t *conn) {
+    struct conn_codec *codec = conn->codec;
+    size_t added = 0;
+    while (1) {
+        size_t space = CODEC_RBUF_SIZE - conn->rlen;
+        size_t staged = codec->zlen - codec->zpos;
+        const unsigned char *record = codec->zin + codec->zpos;
+        if (codec->stored_left > 0) {
+            size_t take = staged < space ? staged : space;
+            take = codec->stored_left < take ? (size_t)codec->stored_left : take;
+            if (take == 0) {
+                break;
+            }
+            memcpy(conn->rbuf + conn->rlen, record, take);
+            conn->rlen += take;
+            codec->zpos += take;
+            codec->stored_left -= take;
+            conn->received.codec_bytes += take;
+            added += take;
+            continue;
+        }
+        if (staged < CONN_RECORD_HEADER_SIZE) {
+            break;
+        }
+        uint32_t kind = get_u32(record);
+        uint32_t length = get_u32(record + 4);
+        uint32_t raw_length = get_u32(record + 8);
+        if (kind == CONN_RECORD_STORED) {
+            codec->stored_left = length;
+            codec->zpos += CONN_RECORD_HEADER_SIZE;
+            continue;
+        }
+        if (kind != CONN_RECORD_LZ4 || raw_length > CONN_BUFFER_SIZE || length > lz4_bound(CONN_BUFFER_SIZE)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (staged < CONN_RECORD_HEADER_SIZE + length || space < raw_length) {
+            break;
+        }
+        if (lz4_decompress(record + CONN_RECORD_HEADER_SIZE, length, conn->rbuf + conn->rlen, raw_length) < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        conn->rlen += raw_length;
+        codec->zpos += CONN_RECORD_HEADER_SIZE + length;
+        conn->received.codec_bytes += raw_length;
+        added += raw_length;
+    }
+    return (ssize_t)added;
+}
+
+static ssize_t fill_records(mc_conn_t *conn, int flags) {
+    struct conn_codec *codec = conn->codec;
+    while (1) {
+        ssize_t added = decode_records(conn);
+        if (added != 0) {
+            return added;
+        }
+        int direct = codec->stored_left > 0 && codec->zpos == codec->zlen;
+        ssize_t received;
+        if (direct) {
+            /* the rest of a stored record needs no staging */
+            size_t want = CODEC_RBUF_SIZE - conn->rlen;
+            want = codec->stored_left < want ? (size_t)codec->stored_left : want;
+            received = read_fd(conn, conn->rbuf + conn->rlen, want, flags);
+        } else {
+            if (codec->zpos == codec->zlen) {
+                codec->zpos = codec->zlen = 0;
+            } else if (codec->zpos > 0) {
+                memmove(codec->zin, codec->zin + codec->zpos, codec->zlen - codec->zpos);
+                codec->zlen -= codec->zpos;
+                codec->zpos = 0;
+            }
+            received = read_fd(conn, codec->zin + codec->zlen, CODEC_ZIN_SIZE - codec->zlen, flags);
+        }
+        if (received < 0) {
+            if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            return -1;
+        }
+        conn->received.wire_bytes += (unsigned long long)received;
+        if (!direct) {
+            codec->zlen += (size_t)received;
+            continue;
+        }
+        conn->rlen += (size_t)received;
+        codec->stored_left -= (unsigned long long)received;
+        conn->received.codec_bytes += (unsigned long long)received;
+        return received;
+    }
+}
+
+/* returns bytes added, 0 if a non-blocking fill would block, -1 on EOF or error */
+static ssize_t fill(mc_conn_t *conn, int flags) {
+    if (pending_output(conn) && conn_flush(conn) < 0) {
+        return -1;
+    }
+    if (conn->rpos == conn->rlen) {
+        conn->rpos = conn->rlen = 0;
+    } else if (conn->rpos > 0) {
+        memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+        conn->rlen -= conn->rpos;
+        conn->rpos = 0;
+    }
+    if (conn->codec) {
+        return fill_records(conn, flags);
+    }
+    ssize_t received = read_fd(conn, conn->rbuf + conn->rlen, CONN_BUFFER_SIZE - conn->rlen, flags);
+    if (received < 0) {
+        if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+    conn->rlen += (size_t)received;
+    return received;
+}
+
+int conn_read(mc_conn_t *conn, void *buffer, size_t length) {
+    unsigned char *out = buffer;
+    while (length > 0) {
+        size_t available = conn->rlen - conn->rpos;
+        if (available > 0) {
+            size_t take = available < length ? available : length;
+            memcpy(out, conn->rbuf + conn->rpos, take);
+            conn->rpos += take;
+            out += take;
+            length -= take;
+            continue;
+        }
+        if (length >= CONN_BUFFER_SIZE && !conn->codec) {
+            if (conn->wlen > 0 && conn_flush(conn) < 0) {
+                return -1;
+            }
+            ssize_t received = read_fd(conn, out, length, 0);
+            if (received < 0) {
+                return -1;
+            }
+            out += received;
+            length -= (size_t)received;
+            continue;
+        }
+        if (fill(conn, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ssize_t conn_read_some(mc_conn_t *conn, const void **data, size_t max_len) {
+    if (conn->rpos == conn->rlen && fill(conn, 0) < 0) {
+        return -1;
+    }
+    size_t available = conn->rlen - conn->rpos;
+    size_t take = available < max_len ? available : max_len;
+    *data = conn->rbuf + conn->rpos;
+    conn->rpos += take;
+    return (ssize_t)take;
+}
+
+static int write_fully(int fd, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+static int copy_to_file(mc_conn_t *conn, int fd, unsigned long long length) {
+    while (length > 0) {
+        const void *data;
+        size_t want = length < CONN_BUFFER_SIZE ? (size_t)length : CONN_BUFFER_SIZE;
+        ssize_t got = conn_read_some(conn, &data, want);
+        if (got < 0 || write_fully(fd, data, (size_t)got) < 0) {
+            return -1;
+        }
+        length -= (unsigned long long)got;
+    }
+    return 0;
+}
+
+static int open_pipe(mc_conn_t *conn) {
+    if (conn->pipe_fds[0] >= 0) {
+        return 0;
+    }
+    if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        return -1;
+    }
+    int size = fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, CONN_PIPE_SIZE);
+    if (size < 0) {
+        size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+    }
+    conn->pipe_size = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+/* moves what is parked in the pipe to the file; falls back to read/write if the fs refuses splice */
+static int drain_pipe(mc_conn_t *conn, int fd, size_t pending) {
+    while (pending > 0) {
+        ssize_t out = conn->use_splice ? splice(conn->pipe_fds[0], NULL, fd, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE) : -1;
+        if (out < 0) {
+            if (conn->use_splice && errno == EINTR) {
+                continue;
+            }
+            if (conn->use_splice && errno != EINVAL) {
+                return -1;
+            }
+            conn->use_splice = 0;
+            char buffer[16384];
+            size_t take = pending < sizeof(buffer) ? pending : sizeof(buffer);
+            out = read(conn->pipe_fds[0], buffer, take);
+            if (out <= 0 || write_fully(fd, buffer, (size_t)out) < 0) {
+                return -1;
+            }
+        }
+        pending -= (size_t)out;
+    }
+    return 0;
+}
+
+static int splice_body(mc_conn_t *conn, int fd, unsigned long long length) {
+    if (open_pipe(conn) < 0) {
+        return copy_to_file(conn, fd, length);
+    }
+    while (length > 0) {
+        size_t want = length < conn->pipe_size ? (size_t)length : conn->pipe_size;
+        ssize_t in = splice(conn->fd, NULL, conn->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL) {
+                conn->use_splice = 0;
+                return copy_to_file(conn, fd, length);
+            }
+            close_pipe(conn);
+            return -1;
+        }
+        if (in == 0) {
+            close_pipe(conn);
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (drain_pipe(conn, fd, (size_t)in) < 0) {
+            close_pipe(conn);
+            return -1;
+        }
+        length -= (unsigned long long)in;
+        conn->received.zero_copy_bytes += (unsigned long long)in;
+        if (conn->codec) {
+            conn->codec->stored_left -= (unsigned long long)in;
+            conn->received.codec_bytes += (unsigned long long)in;
+            conn->received.wire_bytes += (unsigned long long)in;
+        }
+    }
+    return 0;
+}
+
+/* only a stored record can skip the codec, once none of it is staged */
+static int recv_file_records(mc_conn_t *conn, int fd, unsigned long long length) {
+    struct conn_codec *codec = conn->codec;
+    while (length > 0) {
+        unsigned long long run = length < codec->stored_left ? length : codec->stored_left;
+        if (conn->use_splice && run >= CONN_SPLICE_MIN && conn->rpos == conn->rlen && codec->zpos == codec->zlen) {
+            if (splice_body(conn, fd, run) < 0) {
+                return -1;
+            }
+            length -= run;
+            continue;
+        }
+        const void *data;
+        ssize_t got = conn_read_some(conn, &data, length < CONN_BUFFER_SIZE ? (size_t)length : CONN_BUFFER_SIZE);
+        if (got < 0 || write_fully(fd, data, (size_t)got) < 0) {
+            return -1;
+        }
+        length -= (unsigned long long)got;
+    }
+    return 0;
+}
+
+int conn_recv_file(mc_conn_t *conn, int fd, unsigned long long length) {
+    if (!conn->use_splice || length < CONN_SPLICE_MIN) {
+        return copy_to_file(conn, fd, length);
+    }
+    if (conn->codec) {
+        return recv_file_records(conn, fd, length);
+    }
+    /* whatever the line parser already pulled in goes first */
+    size_t buffered = conn->rlen - conn->rpos;
+    size_t take = buffered < length ? buffered : (size_t)length;
+    if (take > 0) {
+        if (write_fully(fd, conn->rbuf + conn->rpos, take) < 0) {
+            return -1;
+        }
+        conn->rpos += take;
+        length -= take;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    return splice_body(conn, fd, length);
+}
+
+/* 1 when a line was taken from the buffer, 0 when more input is needed */
+static int take_line(mc_conn_t *conn, char *buffer, size_t max_len) {
+    const unsigned char *start = conn->rbuf + conn->rpos;
+    size_t available = conn->rlen - conn->rpos;
+    const unsigned char *newline = memchr(start, '\n', available);
+    if (!newline) {
+        if (available + 1 >= max_len) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        return 0;
+    }
+    size_t len = (size_t)(newline - start);
+    if (len + 1 > max_len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buffer, start, len);
+    buffer[len] = '\0';
+    conn->rpos += len + 1;
+    return 1;
+}
+
+int conn_read_line(mc_conn_t *conn, char *buffer, size_t max_len) {
+    while (1) {
+        int rc = take_line(conn, buffer, max_len);
+        if (rc != 0) {
+            return rc > 0 ? 0 : -1;
+        }
+        if (fill(conn, 0) < 0) {
+            return -1;
+        }
+    }
+}
+
+void conn_stats_begin(mc_conn_t *conn) {
+    memset(&conn->sent, 0, sizeof(conn->sent));
+    memset(&conn->received, 0, sizeof(conn->received));
+    clock_gettime(CLOCK_MONOTONIC, &conn->stats_wall);
+    getrusage(RUSAGE_THREAD, &conn->stats_cpu);
+}
+
+static double timeval_ms(const struct timeval *end, const struct timeval *start) {
+    return (double)(end->tv_sec - start->tv_sec) * 1000.0 + (double)(end->tv_usec - start->tv_usec) / 1000.0;
+}
+
+void conn_stats_format(const mc_conn_t *conn, const conn_stats_t *stats, char *out, size_t out_len) {
+    struct timespec now;
+    struct rusage cpu;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_THREAD, &cpu);
+    double seconds = (double)(now.tv_sec - conn->stats_wall.tv_sec) + (double)(now.tv_nsec - conn->stats_wall.tv_nsec) / 1e9;
+    double mib = (double)stats->bytes / 1048576.0;
+    snprintf(out, out_len, "%llu files, %.1f MiB in %.2fs (%.1f MiB/s), %.1f MiB zero-copy, cpu %.0f ms user + %.0f ms sys",
+             stats->files, mib, seconds, seconds > 0 ? mib / seconds : 0.0,
+             (double)stats->zero_copy_bytes / 1048576.0,
+             timeval_ms(&cpu.ru_utime, &conn->stats_cpu.ru_utime),
+             timeval_ms(&cpu.ru_stime, &conn->stats_cpu.ru_stime));
+    if (!conn->codec || stats->wire_bytes == 0) {
+        return;
+    }
+    size_t used = strlen(out);
+    double ratio = (double)stats->codec_bytes / (double)stats->wire_bytes;
+    if (stats == &conn->sent) {
+        /* the compressors' own time, not counted in this thread's cpu */
+        double codec_mib = (double)stats->compressor_bytes / 1048576.0;
+        double codec_seconds = (double)stats->codec_nanos / 1e9;
+        snprintf(out + used, out_len - used, ", lz4 %.2fx to %.1f MiB, %.0f MiB/s per compressor, level %d now",
+                 ratio, (double)stats->wire_bytes / 1048576.0, codec_seconds > 0 ? codec_mib / codec_seconds : 0.0, conn->codec->level);
+    } else {
+        snprintf(out + used, out_len - used, ", lz4 %.2fx from %.1f MiB", ratio, (double)stats->wire_bytes / 1048576.0);
+    }
+}
+
+/* 1 once `need` bytes are buffered, 0 if that would block, -1 on EOF or error */
+int conn_try_buffer(mc_conn_t *conn, size_t need) {
+    if (need > CONN_BUFFER_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    while (conn->rlen - conn->rpos < need) {
+        ssize_t added = fill(conn, MSG_DONTWAIT);
+        if (added <= 0) {
+            return (int)added;
+        }
+    }
+    return 1;
+}
+
+const unsigned char *conn_peek(const mc_conn_t *conn) {
+    return conn->rbuf + conn->rpos;
+}
+
+size_t conn_buffered(const mc_conn_t *conn) {
+    return conn->rlen - conn->rpos;
+}
+
+void conn_consume(mc_conn_t *conn, size_t length) {
+    conn->rpos += length;
+}
@@ -0,0 +1,101 @@
+#ifndef MCSYNC_CONN_H
+#define MCSYNC_CONN_H
+
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CONN_BUFFER_SIZE 65536
+/* smaller bodies are cheaper to copy next to their header than to sendfile/splice */
+#define CONN_SENDFILE_MIN 65536
+#define CONN_SPLICE_MIN 65536
+#define CONN_PIPE_SIZE (256 * 1024)
+
+typedef struct {
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long zero_copy_bytes;
+    /* paths an incremental pull removed from the destination */
+    unsigned long long deleted;
+    /* with compression: bytes through the codec, what they took on the wire, compressor time */
+    unsigned long long codec_bytes;
+    unsigned long long wire_bytes;
+    unsigned long long codec_nanos;
+    /* the part of codec_bytes the compressors saw; stored runs and stored records skip them */
+    unsigned long long compressor_bytes;
+} conn_stats_t;
+
+/*
+ * Once compression is on, each direction is a sequence of records with a
+ * 12-byte little-endian header:
+ *
+ *   u32 kind | u32 length on the wire | u32 length once expanded
+ *
+ * An LZ4 record holds one compressed block of at most CONN_BUFFER_SIZE
+ * bytes. A stored record is passed through as is and may be far longer,
+ * so files that are already compressed still leave with sendfile and
+ * arrive with splice.
+ */
+#define CONN_RECORD_HEADER_SIZE 12
+#define CONN_RECORD_STORED 0u
+#define CONN_RECORD_LZ4 1u
+
+struct conn_codec;
+
+/*
+ * Buffered connection used by both binaries. Writes are coalesced and leave
+ * in one sendmsg per buffer; reads refill a buffer and lines are parsed out
+ * of it. Pending output is flushed before any blocking read.
+ */
+typedef struct {
+    int fd;
+    int is_socket;
+    int use_sendfile;
+    int use_splice;
+    int pipe_fds[2];
+    size_t pipe_size;
+    /* negotiated wire protocol, see protocol.h */
+    int proto_version;
+    unsigned int caps;
+    unsigned int request_id;
+    unsigned char *rbuf;
+    size_t rpos;
+    size_t rlen;
+    unsigned char *wbuf;
+    size_t wlen;
+    /* NULL until both sides agreed on compression */
+    struct conn_codec *codec;
+    conn_stats_t sent;
+    conn_stats_t received;
+    struct timespec stats_wall;
+    struct rusage stats_cpu;
+} mc_conn_t;
+
+int conn_init(mc_conn_t *conn, int fd);
+void conn_destroy(mc_conn_t *conn);
+/* switches both directions to records; call with no input buffered and output flushed */
+int conn_start_compression(mc_conn_t *conn);
+
+int conn_write(mc_conn_t *conn, const void *data, size_t length);
+int conn_printf(mc_conn_t *conn, const char *fmt, ...);
+void *conn_write_reserve(mc_conn_t *conn, size_t length);
+void conn_write_commit(mc_conn_t *conn, size_t length);
+int conn_flush(mc_conn_t *conn);
+int conn_send_file(mc_conn_t *conn, int fd, off_t offset, unsigned long long length);
+/* passes records already in the format above through untouched; needs compression on */
+int conn_send_records(mc_conn_t *conn, int fd, off_t offset, unsigned long long length, unsigned long long raw_length);
+
+int conn_read(mc_conn_t *conn, void *buffer, size_t length);
+ssize_t conn_read_some(mc_conn_t *conn, const void **data, size_t max_len);
+int conn_read_line(mc_conn_t *conn, char *buffer, size_t max_len);
+int conn_recv_file(mc_conn_t *conn, int fd, unsigned long long length);
+int conn_try_buffer(mc_conn_t *conn, size_t need);
+const unsigned char *conn_peek(const mc_conn_t *conn);
+size_t conn_buffered(const mc_conn_t *conn);
+void conn_consume(mc_conn_t *conn, size_t length);
+
+void conn_stats_begin(mc_conn_t *conn);
+void conn_stats_format(const mc_conn_t *conn, const conn_stats_t *stats, char *out, size_t out_len);
+
+#endif /* MCSYNC_CONN_H */
@@ -0,0 +1,556 @@
+#include "platform.h"
+#include "delta.h"
+
+#include "common.h"
+#include "protocol.h"
+#include "region.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* literal runs are cut at this size so the sender never buffers much */
+#define DELTA_DATA_MAX (64 * 1024)
+
+/* about sqrt(size), as rsync does, rounded to a power of two */
+uint32_t delta_block_size(unsigned long long size) {
+    uint32_t block = DELTA_BLOCK_MIN;
+    while (block < DELTA_BLOCK_MAX && (unsigned long long)block * block < size) {
+        block *= 2;
+    }
+    return block;
+}
+
+int delta_signature_init(delta_signature_t *signature, unsigned long long size, uint32_t block_size) {
+    memset(signature, 0, sizeof(*signature));
+    if (block_size == 0 || size / block_size > SIZE_MAX / sizeof(delta_block_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+    signature->size = size;
+    signature->block_size = block_size;
+    signature->block_count = (size_t)(size / block_size);
+    signature->block_capacity = signature->block_count;
+    signature->blocks = malloc((signature->block_count + 1) * sizeof(delta_block_t));
+    return signature->blocks ? 0 : -1;
+}
+
+void delta_signature_begin(delta_signature_t *signature, unsigned long long size, uint32_t block_size) {
+    memset(signature, 0, sizeof(*signature));
+    signature->size = size;
+    signature->block_size = block_size;
+}
+
+/* grown by what arrived, never by what the peer announced */
+int delta_signature_add_block(delta_signature_t *signature, const unsigned char wire[DELTA_BLOCK_WIRE_SIZE]) {
+    if (signature->block_count == signature->block_capacity) {
+        size_t capacity = signature->block_capacity ? signature->block_capacity * 2 : 256;
+        delta_block_t *blocks = realloc(signature->blocks, capacity * sizeof(*blocks));
+        if (!blocks) {
+            return -1;
+        }
+        signature->blocks = blocks;
+        signature->block_capacity = capacity;
+    }
+    delta_block_t *block = &signature->blocks[signature->block_count++];
+    block->weak = get_le32(wire);
+    memcpy(block->strong, wire + 4, DELTA_STRONG_SIZE);
+    return 0;
+}
+
+void delta_signature_free(delta_signature_t *signature) {
+    free(signature->blocks);
+    memset(signature, 0, sizeof(*signature));
+}
+
+/* the rsync checksum: a is the byte sum and b the position-weighted sum, both mod 2^16 */
+static uint32_t weak_sum(const unsigned char *data, size_t length, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < length; ++i) {
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    *a_out = a;
+    *b_out = b;
+    return (a & 0xffff) | (b << 16);
+}
+
+static void strong_sum(const unsigned char *data, size_t length, unsigned char out[DELTA_STRONG_SIZE]) {
+    unsigned char full[HASH_SIZE];
+    hash_buffer(data, length, full);
+    memcpy(out, full, DELTA_STRONG_SIZE);
+}
+
+int delta_signature_compute(delta_signature_t *signature, const unsigned char *data, size_t size) {
+    if (delta_signature_init(signature, size, delta_block_size(size)) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < signature->block_count; ++i) {
+        const unsigned char *block = data + i * signature->block_size;
+        uint32_t a;
+        uint32_t b;
+        signature->blocks[i].weak = weak_sum(block, signature->block_size, &a, &b);
+        strong_sum(block, signature->block_size, signature->blocks[i].strong);
+    }
+    return 0;
+}
+
+int delta_region_signature_init(delta_signature_t *signature, unsigned long long size) {
+    memset(signature, 0, sizeof(*signature));
+    signature->size = size;
+    signature->block_size = REGION_SECTOR_SIZE;
+    signature->block_count = REGION_CHUNKS;
+    signature->block_capacity = REGION_CHUNKS;
+    signature->region = 1;
+    /* empty slots stay zero */
+    signature->blocks = calloc(REGION_CHUNKS, sizeof(delta_block_t));
+    return signature->blocks ? 0 : -1;
+}
+
+int delta_region_signature_compute(delta_signature_t *signature, const unsigned char *data, size_t size) {
+    uint32_t locations[REGION_CHUNKS];
+    if (region_read_locations(data, size, locations) < 0 || delta_region_signature_init(signature, size) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < REGION_CHUNKS; ++i) {
+        if (locations[i] == 0) {
+            continue;
+        }
+        signature->blocks[i].weak = locations[i];
+        strong_sum(data + (size_t)REGION_FIRST_SECTOR(locations[i]) * REGION_SECTOR_SIZE,
+                   (size_t)REGION_SECTOR_COUNT(locations[i]) * REGION_SECTOR_SIZE, signature->blocks[i].strong);
+    }
+    return 0;
+}
+
+void delta_basis_set_init(delta_basis_set_t *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+void delta_basis_set_free(delta_basis_set_t *set) {
+    for (size_t i = 0; i < set->count; ++i) {
+        free(set->items[i].path);
+        delta_signature_free(&set->items[i].signature);
+    }
+    free(set->items);
+    delta_basis_set_init(set);
+}
+
+/* the returned signature is for the caller to fill in */
+delta_signature_t *delta_basis_set_add(delta_basis_set_t *set, const char *path, size_t path_len) {
+    if (set->count == set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        delta_basis_t *items = realloc(set->items, capacity * sizeof(*items));
+        if (!items) {
+            return NULL;
+        }
+        set->items = items;
+        set->capacity = capacity;
+    }
+    delta_basis_t *item = &set->items[set->count];
+    item->path = malloc(path_len + 1);
+    if (!item->path) {
+        return NULL;
+    }
+    memcpy(item->path, path, path_len);
+    item->path[path_len] = '\0';
+    memset(&item->signature, 0, sizeof(item->signature));
+    ++set->count;
+    set->sorted = 0;
+    return &item->signature;
+}
+
+static int compare_basis(const void *a, const void *b) {
+    return strcmp(((const delta_basis_t *)a)->path, ((const delta_basis_t *)b)->path);
+}
+
+const delta_signature_t *delta_basis_set_find(delta_basis_set_t *set, const char *path) {
+    if (!set || set->count == 0) {
+        return NULL;
+    }
+    if (!set->sorted) {
+        qsort(set->items, set->count, sizeof(*set->items), compare_basis);
+        set->sorted = 1;
+    }
+    delta_basis_t key;
+    key.path = (char *)path;
+    const delta_basis_t *found = bsearch(&key, set->items, set->count, sizeof(*set->items), compare_basis);
+    return found ? &found->signature : NULL;
+}
+
+/* open addressing over block indexes, keyed by weak checksum; 0 marks an empty slot */
+typedef struct {
+    uint32_t *slots;
+    size_t mask;
+    const delta_signature_t *signature;
+} block_table_t;
+
+static size_t weak_slot(uint32_t weak, size_t mask) {
+    return (size_t)((weak * 2654435761u) ^ (weak >> 15)) & mask;
+}
+
+static int table_build(block_table_t *table, const delta_signature_t *signature) {
+    size_t capacity = 16;
+    while (capacity < signature->block_count * 2) {
+        capacity *= 2;
+    }
+    table->slots = calloc(capacity, sizeof(*table->slots));
+    if (!table->slots) {
+        return -1;
+    }
+    table->mask = capacity - 1;
+    table->signature = signature;
+    for (size_t i = 0; i < signature->block_count; ++i) {
+        size_t slot = weak_slot(signature->blocks[i].weak, table->mask);
+        while (table->slots[slot] != 0) {
+            slot = (slot + 1) & table->mask;
+        }
+        table->slots[slot] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+/* a basis block equal to the window, preferring `expected` so runs of copies coalesce */
+static long table_match(const block_table_t *table, uint32_t weak, const unsigned char *window, size_t expected) {
+    const delta_signature_t *signature = table->signature;
+    unsigned char strong[DELTA_STRONG_SIZE];
+    int have_strong = 0;
+    if (expected < signature->block_count && signature->blocks[expected].weak == weak) {
+        strong_sum(window, signature->block_size, strong);
+        have_strong = 1;
+        if (memcmp(strong, signature->blocks[expected].strong, DELTA_STRONG_SIZE) == 0) {
+            return (long)expected;
+        }
+    }
+    for (size_t slot = weak_slot(weak, table->mask); table->slots[slot] != 0; slot = (slot + 1) & table->mask) {
+        size_t index = table->slots[slot] - 1;
+        if (signature->blocks[index].weak != weak) {
+            continue;
+        }
+        if (!have_strong) {
+            strong_sum(window, signature->block_size, strong);
+            have_strong = 1;
+        }
+        if (memcmp(strong, signature->blocks[index].strong, DELTA_STRONG_SIZE) == 0) {
+            return (long)index;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    mc_conn_t *conn;
+    unsigned long long copy_offset;
+    unsigned long long copy_length;
+    size_t data_bytes;
+} delta_writer_t;
+
+static int flush_copy(delta_writer_t *writer) {
+    if (writer->copy_length == 0) {
+        return 0;
+    }
+    int rc = proto_send_delta_copy(writer->conn, writer->copy_offset, writer->copy_length);
+    writer->copy_length = 0;
+    return rc;
+}
+
+static int emit_data(delta_writer_t *writer, const unsigned char *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (flush_copy(writer) < 0) {
+        return -1;
+    }
+    writer->data_bytes += length;
+    return proto_send_delta_data(writer->conn, data, length);
+}
+
+static int emit_copy(delta_writer_t *writer, unsigned long long offset, unsigned long long length) {
+    if (writer->copy_length > 0 && writer->copy_offset + writer->copy_length == offset) {
+        writer->copy_length += length;
+        return 0;
+    }
+    if (flush_copy(writer) < 0) {
+        return -1;
+    }
+    writer->copy_offset = offset;
+    writer->copy_length = length;
+    return 0;
+}
+
+static int emit_literal(delta_writer_t *writer, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        size_t piece = length < DELTA_DATA_MAX ? length : DELTA_DATA_MAX;
+        if (emit_data(writer, data, piece) < 0) {
+            return -1;
+        }
+        data += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+static int block_delta(delta_writer_t *writer, const delta_signature_t *signature, const unsigned char *data, size_t size) {
+    size_t block = signature->block_size;
+    size_t literal = 0;
+    size_t pos = 0;
+    if (signature->block_count > 0 && size >= block) {
+        block_table_t table;
+        if (table_build(&table, signature) < 0) {
+            return -1;
+        }
+        size_t expected = 0;
+        uint32_t a;
+        uint32_t b;
+        uint32_t weak = weak_sum(data, block, &a, &b);
+        while (pos + block <= size) {
+            long index = table_match(&table, weak, data + pos, expected);
+            if (index >= 0) {
+                if (emit_data(writer, data + literal, pos - literal) < 0 ||
+                    emit_copy(writer, (unsigned long long)index * block, block) < 0) {
+                    free(table.slots);
+                    return -1;
+                }
+                expected = (size_t)index + 1;
+                pos += block;
+                literal = pos;
+                if (pos + block <= size) {
+                    weak = weak_sum(data + pos, block, &a, &b);
+                }
+                continue;
+            }
+            if (pos + block < size) {
+                /* slide the window one byte: drop data[pos], take in data[pos + block] */
+                a += data[pos + block] - data[pos];
+                b += a - (uint32_t)block * data[pos];
+                weak = (a & 0xffff) | (b << 16);
+            }
+            ++pos;
+            if (pos - literal >= DELTA_DATA_MAX) {
+                if (emit_data(writer, data + literal, pos - literal) < 0) {
+                    free(table.slots);
+                    return -1;
+                }
+                literal = pos;
+            }
+        }
+        free(table.slots);
+    }
+    return emit_literal(writer, data + literal, size - literal);
+}
+
+typedef struct {
+    uint32_t first;
+    uint32_t slot;
+} region_extent_t;
+
+static int compare_extents(const void *a, const void *b) {
+    uint32_t left = ((const region_extent_t *)a)->first;
+    uint32_t right = ((const region_extent_t *)b)->first;
+    return left < right ? -1 : left > right;
+}
+
+/* the slots that hold a chunk, in file order */
+static size_t region_extents(const uint32_t *locations, region_extent_t *extents) {
+    size_t count = 0;
+    for (uint32_t i = 0; i < REGION_CHUNKS; ++i) {
+        if (REGION_SECTOR_COUNT(locations[i]) != 0) {
+            extents[count].first = REGION_FIRST_SECTOR(locations[i]);
+            extents[count].slot = i;
+            ++count;
+        }
+    }
+    qsort(extents, count, sizeof(*extents), compare_extents);
+    return count;
+}
+
+/* whether the basis keeps exactly the sectors data has at `first` in the given slot */
+static int region_matches(const delta_signature_t *signature, uint32_t slot, const unsigned char *data, uint32_t first, uint32_t count) {
+    uint32_t basis = signature->blocks[slot].weak;
+    if (REGION_SECTOR_COUNT(basis) != count ||
+        ((unsigned long long)REGION_FIRST_SECTOR(basis) + count) * REGION_SECTOR_SIZE > signature->size) {
+        return 0;
+    }
+    unsigned char strong[DELTA_STRONG_SIZE];
+    strong_sum(data + (size_t)first * REGION_SECTOR_SIZE, (size_t)count * REGION_SECTOR_SIZE, strong);
+    return memcmp(strong, signature->blocks[slot].strong, DELTA_STRONG_SIZE) == 0;
+}
+
+static int region_copy(delta_writer_t *writer, const unsigned char *data, size_t *literal, uint32_t first, uint32_t basis) {
+    size_t start = (size_t)first * REGION_SECTOR_SIZE;
+    size_t length = (size_t)REGION_SECTOR_COUNT(basis) * REGION_SECTOR_SIZE;
+    if (emit_literal(writer, data + *literal, start - *literal) < 0) {
+        return -1;
+    }
+    *literal = start + length;
+    return emit_copy(writer, (unsigned long long)REGION_FIRST_SECTOR(basis) * REGION_SECTOR_SIZE, length);
+}
+
+/*
+ * Chunks are matched slot by slot, wherever either side keeps them. Free
+ * sectors are checked against what the basis keeps at the same place, as
+ * they usually still hold a chunk the game has since moved elsewhere.
+ */
+static int region_delta(delta_writer_t *writer, const delta_signature_t *signature, const unsigned char *data, size_t size) {
+    uint32_t locations[REGION_CHUNKS];
+    if (region_read_locations(data, size, locations) < 0) {
+        /* not a region file on this side after all */
+        return emit_literal(writer, data, size);
+    }
+    region_extent_t extents[REGION_CHUNKS];
+    region_extent_t basis[REGION_CHUNKS];
+    uint32_t basis_locations[REGION_CHUNKS];
+    for (size_t i = 0; i < REGION_CHUNKS; ++i) {
+        basis_locations[i] = signature->blocks[i].weak;
+    }
+    size_t extent_count = region_extents(locations, extents);
+    size_t basis_count = region_extents(basis_locations, basis);
+    uint32_t sectors = (uint32_t)(size / REGION_SECTOR_SIZE);
+    uint32_t cursor = REGION_HEADER_SIZE / REGION_SECTOR_SIZE;
+    size_t literal = 0;
+    for (size_t e = 0; e <= extent_count; ++e) {
+        uint32_t end = e < extent_count ? extents[e].first : sectors;
+        for (uint32_t sector = cursor; sector < end;) {
+            region_extent_t key = { sector, 0 };
+            const region_extent_t *found = bsearch(&key, basis, basis_count, sizeof(*basis), compare_extents);
+            uint32_t count = found ? REGION_SECTOR_COUNT(basis_locations[found->slot]) : 1;
+            if (found && sector + count <= end && region_matches(signature, found->slot, data, sector, count)) {
+                if (region_copy(writer, data, &literal, sector, basis_locations[found->slot]) < 0) {
+                    return -1;
+                }
+                sector += count;
+            } else {
+                ++sector;
+            }
+        }
+        if (e == extent_count) {
+            break;
+        }
+        uint32_t first = extents[e].first;
+        uint32_t count = REGION_SECTOR_COUNT(locations[extents[e].slot]);
+        /* a chunk overlapping the previous one is left to go as data */
+        if (first >= cursor && region_matches(signature, extents[e].slot, data, first, count) &&
+            region_copy(writer, data, &literal, first, basis_locations[extents[e].slot]) < 0) {
+            return -1;
+        }
+        if (first + count > cursor) {
+            cursor = first + count;
+        }
+    }
+    return emit_literal(writer, data + literal, size - literal);
+}
+
+/* streams the instructions that turn the basis into data, then END */
+int delta_send(mc_conn_t *conn, const delta_signature_t *signature, const unsigned char *data, size_t size) {
+    delta_writer_t writer = { conn, 0, 0, 0 };
+    int rc = signature->region ? region_delta(&writer, signature, data, size) : block_delta(&writer, signature, data, size);
+    if (rc < 0 || flush_copy(&writer) < 0) {
+        return -1;
+    }
+    conn->sent.bytes += writer.data_bytes;
+    return proto_send_end(conn);
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+static int copy_range(int basis_fd, int out_fd, unsigned long long offset, unsigned long long length,
+                      unsigned char *buffer, hash_state_t *state) {
+    while (length > 0) {
+        size_t want = length < DELTA_DATA_MAX ? (size_t)length : DELTA_DATA_MAX;
+        ssize_t got = pread(basis_fd, buffer, want, (off_t)offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got == 0) {
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        hash_update(state, buffer, (size_t)got);
+        if (write_all(out_fd, buffer, (size_t)got) < 0) {
+            return -1;
+        }
+        offset += (unsigned long long)got;
+        length -= (unsigned long long)got;
+    }
+    return 0;
+}
+
+/* rebuilds the new file into out_fd and checks it against the sender's size and hash */
+int delta_apply(mc_conn_t *conn, int basis_fd, int out_fd, unsigned long long size, const unsigned char hash[HASH_SIZE]) {
+    struct stat st;
+    if (fstat(basis_fd, &st) < 0) {
+        return -1;
+    }
+    unsigned long long basis_size = (unsigned long long)st.st_size;
+    unsigned char *buffer = malloc(DELTA_DATA_MAX);
+    if (!buffer) {
+        return -1;
+    }
+    hash_state_t state;
+    hash_init(&state);
+    unsigned long long written = 0;
+    proto_msg_t msg;
+    int rc = 0;
+    while (rc == 0) {
+        if (proto_recv(conn, &msg) < 0) {
+            rc = -1;
+            break;
+        }
+        if (msg.type == PROTO_END) {
+            break;
+        }
+        if (msg.type == PROTO_DELTA_COPY) {
+            if (msg.offset > basis_size || msg.size > basis_size - msg.offset || msg.size > size - written) {
+                errno = EPROTO;
+                rc = -1;
+            } else {
+                rc = copy_range(basis_fd, out_fd, msg.offset, msg.size, buffer, &state);
+                written += msg.size;
+            }
+        } else if (msg.type == PROTO_DELTA_DATA) {
+            if (msg.size > DELTA_DATA_MAX || msg.size > size - written) {
+                errno = EPROTO;
+                rc = -1;
+            } else if (conn_read(conn, buffer, (size_t)msg.size) < 0) {
+                rc = -1;
+            } else {
+                hash_update(&state, buffer, (size_t)msg.size);
+                rc = write_all(out_fd, buffer, (size_t)msg.size);
+                written += msg.size;
+                conn->received.bytes += msg.size;
+            }
+        } else {
+            errno = EPROTO;
+            rc = -1;
+        }
+    }
+    free(buffer);
+    if (rc < 0) {
+        return -1;
+    }
+    unsigned char actual[HASH_SIZE];
+    hash_final(&state, actual);
+    if (written != size || memcmp(actual, hash, HASH_SIZE) != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
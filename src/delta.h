@@ -0,0 +1,85 @@
+#ifndef MCSYNC_DELTA_H
+#define MCSYNC_DELTA_H
+
+#include "platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "hash.h"
+
+/*
+ * rsync-style deltas. The side holding an old copy (the basis) describes it
+ * as a signature: a weak rolling checksum and a short strong hash per
+ * block. The side holding the new file rolls the weak checksum over it byte
+ * by byte and answers with DELTA_COPY frames for ranges the basis already
+ * has and DELTA_DATA frames for everything else, so an edit that shifts
+ * data around still costs only the bytes that changed.
+ *
+ * Region files get a signature of their own: one block per chunk slot,
+ * the slot's location as the weak sum and a hash of its sectors as the
+ * strong one. The sender then copies every chunk whose sectors still hash
+ * the same from wherever the basis keeps it and sends the header tables
+ * and the changed chunks as data.
+ */
+#define DELTA_MIN_SIZE CONN_SENDFILE_MIN
+/* region files are laid out in 4 KiB sectors, so smaller blocks buy nothing */
+#define DELTA_BLOCK_MIN 4096
+#define DELTA_BLOCK_MAX (128 * 1024)
+#define DELTA_STRONG_SIZE 8
+#define DELTA_BLOCK_WIRE_SIZE (4 + DELTA_STRONG_SIZE)
+/* a received signature covers at most this many blocks, 128 GiB at DELTA_BLOCK_MAX */
+#define DELTA_SIGNATURE_BLOCKS_MAX (1u << 20)
+/* and one transfer's signatures this many in all; files past it are sent whole */
+#define DELTA_SET_BLOCKS_MAX (1u << 25)
+
+typedef struct {
+    uint32_t weak;
+    unsigned char strong[DELTA_STRONG_SIZE];
+} delta_block_t;
+
+typedef struct {
+    unsigned long long size;
+    uint32_t block_size;
+    /* whole blocks only; a short tail is always sent as data */
+    size_t block_count;
+    size_t block_capacity;
+    delta_block_t *blocks;
+    /* blocks are the REGION_CHUNKS slots of a region file rather than a grid */
+    int region;
+} delta_signature_t;
+
+/* signatures by path, as received before a transfer */
+typedef struct {
+    char *path;
+    delta_signature_t signature;
+} delta_basis_t;
+
+typedef struct {
+    delta_basis_t *items;
+    size_t count;
+    size_t capacity;
+    int sorted;
+} delta_basis_set_t;
+
+uint32_t delta_block_size(unsigned long long size);
+int delta_signature_init(delta_signature_t *signature, unsigned long long size, uint32_t block_size);
+/* an empty signature that grows by delta_signature_add_block as blocks are received */
+void delta_signature_begin(delta_signature_t *signature, unsigned long long size, uint32_t block_size);
+int delta_signature_add_block(delta_signature_t *signature, const unsigned char wire[DELTA_BLOCK_WIRE_SIZE]);
+int delta_signature_compute(delta_signature_t *signature, const unsigned char *data, size_t size);
+int delta_region_signature_init(delta_signature_t *signature, unsigned long long size);
+/* fails with EINVAL if data is not a well-formed region file */
+int delta_region_signature_compute(delta_signature_t *signature, const unsigned char *data, size_t size);
+void delta_signature_free(delta_signature_t *signature);
+
+void delta_basis_set_init(delta_basis_set_t *set);
+void delta_basis_set_free(delta_basis_set_t *set);
+delta_signature_t *delta_basis_set_add(delta_basis_set_t *set, const char *path, size_t path_len);
+const delta_signature_t *delta_basis_set_find(delta_basis_set_t *set, const char *path);
+
+int delta_send(mc_conn_t *conn, const delta_signature_t *signature, const unsigned char *data, size_t size);
+int delta_apply(mc_conn_t *conn, int basis_fd, int out_fd, unsigned long long size, const unsigned char hash[HASH_SIZE]);
+
+#endif /* MCSYNC_DELTA_H */
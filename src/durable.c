@@ -0,0 +1,169 @@
+#include "platform.h"
+#include "durable.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* set once at startup, before any thread writes */
+static enum durable_mode mode = DURABLE_NONE;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long total_syncs;
+static unsigned long long total_nanos;
+
+static unsigned long long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static void account(unsigned long long started) {
+    unsigned long long elapsed = now_nanos() - started;
+    pthread_mutex_lock(&stats_lock);
+    ++total_syncs;
+    total_nanos += elapsed;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void durable_set_mode(enum durable_mode new_mode) {
+    mode = new_mode;
+}
+
+enum durable_mode durable_get_mode(void) {
+    return mode;
+}
+
+const char *durable_mode_name(enum durable_mode which) {
+    switch (which) {
+    case DURABLE_BATCH:
+        return "batch";
+    case DURABLE_STRICT:
+        return "strict";
+    default:
+        return "none";
+    }
+}
+
+void durable_written(int fd) {
+    if (mode != DURABLE_NONE) {
+        /* queues the dirty pages without waiting for them */
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+}
+
+int durable_file(int fd) {
+    if (mode != DURABLE_STRICT) {
+        return 0;
+    }
+    unsigned long long started = now_nanos();
+    int rc = fdatasync(fd);
+    account(started);
+    return rc;
+}
+
+/* syncfs covers every file and directory of the filesystem path lives on */
+static int sync_filesystem(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned long long started = now_nanos();
+    int rc = syncfs(fd);
+    account(started);
+    close(fd);
+    return rc;
+}
+
+static int sync_one(const char *path, int directory) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | (directory ? O_DIRECTORY : O_NOFOLLOW));
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned long long started = now_nanos();
+    int rc = directory ? fsync(fd) : fdatasync(fd);
+    account(started);
+    close(fd);
+    return rc;
+}
+
+int durable_dir(const char *dir) {
+    return mode == DURABLE_STRICT ? sync_one(dir, 1) : 0;
+}
+
+/* every file, then the directory holding it, so each entry is durable before the name pointing at it */
+static int sync_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        /* a second link is an unchanged file shared with a version committed before */
+        return st.st_nlink > 1 ? 0 : sync_one(path, 0);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) {
+            closedir(dir);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (sync_tree(child) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    return sync_one(path, 1);
+}
+
+int durable_commit(const char *const *paths, int count) {
+    if (mode == DURABLE_BATCH && count > 0) {
+        return sync_filesystem(paths[0]);
+    }
+    if (mode == DURABLE_STRICT) {
+        for (int i = 0; i < count; ++i) {
+            if (sync_tree(paths[i]) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int durable_sync_dirs(const char *const *dirs, int count) {
+    if (mode == DURABLE_BATCH && count > 0) {
+        return sync_filesystem(dirs[0]);
+    }
+    if (mode == DURABLE_STRICT) {
+        for (int i = 0; i < count; ++i) {
+            if (sync_one(dirs[i], 1) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void durable_stats(unsigned long long *syncs, unsigned long long *nanos) {
+    pthread_mutex_lock(&stats_lock);
+    *syncs = total_syncs;
+    *nanos = total_nanos;
+    pthread_mutex_unlock(&stats_lock);
+}
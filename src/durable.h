@@ -0,0 +1,38 @@
+#ifndef MCSYNC_DURABLE_H
+#define MCSYNC_DURABLE_H
+
+/*
+ * How hard the server works to keep a published version across a power
+ * loss. Writers start writeback of every file as they close it, so by the
+ * time a version is committed most of its data is already on the way.
+ *
+ * DURABLE_BATCH commits a version with one syncfs() of the storage
+ * filesystem before it is renamed into place and one after, whatever its
+ * file count: a group commit. DURABLE_STRICT instead fdatasync()s every
+ * file and fsync()s every directory of the version, and each new chunk as
+ * it is stored, so it never waits on anyone else's dirty data but pays per
+ * file. DURABLE_NONE leaves it all to the kernel.
+ */
+enum durable_mode {
+    DURABLE_NONE,
+    DURABLE_BATCH,
+    DURABLE_STRICT
+};
+
+void durable_set_mode(enum durable_mode mode);
+enum durable_mode durable_get_mode(void);
+const char *durable_mode_name(enum durable_mode mode);
+/* called on a file just written, before it is closed */
+void durable_written(int fd);
+/* called on a file about to be renamed into place on its own; only strict waits for it */
+int durable_file(int fd);
+/* called after such a rename into dir; only strict waits for it */
+int durable_dir(const char *dir);
+/* makes the trees and files at paths durable before they are published */
+int durable_commit(const char *const *paths, int count);
+/* makes renames into these directories durable */
+int durable_sync_dirs(const char *const *dirs, int count);
+/* the calls that waited on the disk so far and how long they took */
+void durable_stats(unsigned long long *syncs, unsigned long long *nanos);
+
+#endif /* MCSYNC_DURABLE_H */
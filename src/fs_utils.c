@@ -2,6 +2,13 @@
 #include "fs_utils.h"
 
 #include "common.h"
+#include "durable.h"
+#include "compressed_tree.h"
+#include "conn.h"
+#include "io_ring.h"
+#include "protocol.h"
+#include "region.h"
+#include "walker.h"
 
 #include <ctype.h>
 #include <dirent.h>
@@ -11,11 +18,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define FILE_CHUNK_SIZE 65536
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
 
 static int join_paths(const char *a, const char *b, char *out, size_t out_len) {
     if (snprintf(out, out_len, "%s/%s", a, b) >= (int)out_len) {
@@ -46,7 +57,7 @@ static int ensure_parent_dirs(const char *path) {
 }
 
 int sanitize_name(const char *name) {
-    if (name == NULL || *name == '\0') {
+    if (name == NULL || *name == '\0' || *name == '.') {
         return -1;
     }
     if (strstr(name, "..") != NULL) {
@@ -60,6 +71,26 @@ int sanitize_name(const char *name) {
     return 0;
 }
 
+int parse_world_ref(const char *ref, char *name, size_t name_len, unsigned long *version) {
+    const char *at = strchr(ref, '@');
+    size_t length = at ? (size_t)(at - ref) : strlen(ref);
+    if (length >= name_len) {
+        return -1;
+    }
+    memcpy(name, ref, length);
+    name[length] = '\0';
+    *version = 0;
+    if (at) {
+        char *end;
+        errno = 0;
+        *version = at[1] >= '0' && at[1] <= '9' ? strtoul(at + 1, &end, 10) : 0;
+        if (errno != 0 || *version == 0 || *end != '\0') {
+            return -1;
+        }
+    }
+    return sanitize_name(name);
+}
+
 int ensure_directory(const char *path, mode_t mode) {
     if (mkdir(path, mode) == 0) {
         return 0;
@@ -118,174 +149,715 @@ int remove_recursive(const char *path) {
     return 0;
 }
 
-static int send_directory_recursive(int sock, const char *base_dir, const char *relative_path) {
-    char full_path[PATH_MAX];
-    if (relative_path[0] == '\0') {
-        snprintf(full_path, sizeof(full_path), "%s", base_dir);
-    } else if (join_paths(base_dir, relative_path, full_path, sizeof(full_path)) < 0) {
-        return -1;
+static int write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
     }
+    return 0;
+}
 
-    DIR *dir = opendir(full_path);
-    if (!dir) {
+static int copy_by_reading(int in, int out) {
+    unsigned char *buffer = malloc(CONN_BUFFER_SIZE);
+    if (!buffer) {
         return -1;
     }
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    int rc = 0;
+    while (rc == 0) {
+        ssize_t got = read(in, buffer, CONN_BUFFER_SIZE);
+        if (got < 0 && errno == EINTR) {
             continue;
         }
-        char child_relative[PATH_MAX];
-        if (relative_path[0] == '\0') {
-            snprintf(child_relative, sizeof(child_relative), "%s", entry->d_name);
-        } else if (snprintf(child_relative, sizeof(child_relative), "%s/%s", relative_path, entry->d_name) >= (int)sizeof(child_relative)) {
-            closedir(dir);
-            errno = ENAMETOOLONG;
-            return -1;
+        if (got <= 0) {
+            rc = got < 0 ? -1 : 0;
+            break;
         }
+        rc = write_all(out, buffer, (size_t)got);
+    }
+    free(buffer);
+    return rc;
+}
 
-        char child_full[PATH_MAX];
-        if (join_paths(full_path, entry->d_name, child_full, sizeof(child_full)) < 0) {
-            closedir(dir);
-            return -1;
+/* a reflink where the filesystem can share extents, else an in-kernel copy, else plain reads and writes */
+static int copy_contents(int in, int out) {
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        return 0;
+    }
+#endif
+    unsigned long long total = 0;
+    while (1) {
+        ssize_t copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
         }
-
-        struct stat st;
-        if (lstat(child_full, &st) < 0) {
-            closedir(dir);
-            return -1;
+        if (copied < 0 && total == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            return copy_by_reading(in, out);
         }
+        if (copied <= 0) {
+            return copied < 0 ? -1 : 0;
+        }
+        total += (unsigned long long)copied;
+    }
+}
 
-        if (S_ISDIR(st.st_mode)) {
-            size_t path_len = strnlen(child_relative, sizeof(child_relative));
-            if (send_fmt(sock, "ENTRY 2 %zu 0\n", path_len) < 0) {
-                closedir(dir);
-                return -1;
-            }
-            if (send_all(sock, child_relative, path_len) < 0) {
-                closedir(dir);
-                return -1;
+/* length bytes from in_offset in one file to out_offset in another, falling back to pread and pwrite as copy_contents does */
+int copy_file_span(int in, off_t in_offset, int out, off_t out_offset, unsigned long long length) {
+    unsigned long long done = 0;
+    while (done < length) {
+        unsigned long long left = length - done;
+        ssize_t copied = copy_file_range(in, &in_offset, out, &out_offset, left < (1u << 30) ? (size_t)left : (1u << 30), 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0 && done == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break;
+        }
+        if (copied <= 0) {
+            /* the source ended early */
+            if (copied == 0) {
+                errno = EIO;
             }
-            if (send_directory_recursive(sock, base_dir, child_relative) < 0) {
-                closedir(dir);
-                return -1;
+            return -1;
+        }
+        done += (unsigned long long)copied;
+    }
+    if (done == length) {
+        return 0;
+    }
+    unsigned char *buffer = malloc(CONN_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    int rc = 0;
+    while (rc == 0 && done < length) {
+        size_t want = length - done < CONN_BUFFER_SIZE ? (size_t)(length - done) : CONN_BUFFER_SIZE;
+        ssize_t got = pread(in, buffer, want, in_offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got == 0) {
+                errno = EIO;
             }
-        } else if (S_ISREG(st.st_mode)) {
-            size_t path_len = strnlen(child_relative, sizeof(child_relative));
-            if (send_fmt(sock, "ENTRY 1 %zu %lld\n", path_len, (long long)st.st_size) < 0) {
-                closedir(dir);
-                return -1;
+            rc = -1;
+            break;
+        }
+        ssize_t put = 0;
+        while (rc == 0 && put < got) {
+            ssize_t written = pwrite(out, buffer + put, (size_t)(got - put), out_offset + put);
+            if (written < 0) {
+                rc = errno == EINTR ? 0 : -1;
+                continue;
             }
-            if (send_all(sock, child_relative, path_len) < 0) {
-                closedir(dir);
+            put += written;
+        }
+        in_offset += got;
+        out_offset += got;
+        done += (unsigned long long)got;
+    }
+    free(buffer);
+    return rc;
+}
+
+static int copy_file(const char *source, const char *target) {
+    int in = open(source, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(target, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    int rc = copy_contents(in, out);
+    close(in);
+    durable_written(out);
+    if (close(out) < 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(target);
+        errno = saved;
+    }
+    return rc;
+}
+
+/* versions never change, so an unchanged file can share its inode with the previous one */
+int link_or_copy(const char *source, const char *target) {
+    if (link(source, target) == 0) {
+        return 0;
+    }
+    if (errno != EMLINK && errno != EPERM && errno != EXDEV) {
+        return -1;
+    }
+    return copy_file(source, target);
+}
+
+/* the file as instructions against the peer's old copy; the mapping covers the whole body */
+int send_delta_entry(mc_conn_t *conn, const char *relative, const delta_signature_t *signature, const unsigned char *data, size_t size) {
+    unsigned char hash[HASH_SIZE];
+    hash_buffer(data, size, hash);
+    if (proto_send_entry_delta(conn, relative, strlen(relative), size, hash) < 0 ||
+        delta_send(conn, signature, data, size) < 0) {
+        return -1;
+    }
+    conn->sent.files++;
+    return 0;
+}
+
+static int send_delta_file(mc_conn_t *conn, int fd, const char *relative, const delta_signature_t *signature, size_t size) {
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    int rc = send_delta_entry(conn, relative, signature, data, size);
+    munmap(data, size);
+    return rc;
+}
+
+static int open_sized(int dir_fd, const char *path, unsigned long long *size) {
+    int fd = openat(dir_fd, path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    *size = (unsigned long long)st.st_size;
+    return fd;
+}
+
+/*
+ * Small files join the batch when there is one, files the peer has an old
+ * copy of go as deltas, the rest with sendfile. path is opened relative to
+ * dir_fd; relative names the file on the wire and under base_dir. In a
+ * compressed tree (compressed set) the stored records of big files pass
+ * through as they are.
+ */
+static int send_file(mc_conn_t *conn, proto_batch_t *batch, delta_basis_set_t *bases, const char *base_dir, int dir_fd, const char *path,
+                     const char *relative, int compressed) {
+    unsigned long long size;
+    int fd = compressed ? ctree_openat(dir_fd, path, &size) : open_sized(dir_fd, path, &size);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t path_len = strlen(relative);
+    const delta_signature_t *signature = size >= DELTA_MIN_SIZE ? delta_basis_set_find(bases, relative) : NULL;
+    int rc;
+    if (signature) {
+        if (compressed) {
+            /* the expanded copy goes in a temporary file beside the stored one */
+            char full_path[PATH_MAX];
+            close(fd);
+            if (join_paths(base_dir, relative, full_path, sizeof(full_path)) < 0 || (fd = ctree_open_expanded(full_path, &size)) < 0) {
                 return -1;
             }
-            int fd = open(child_full, O_RDONLY);
-            if (fd < 0) {
-                closedir(dir);
-                return -1;
+        }
+        rc = send_delta_file(conn, fd, relative, signature, (size_t)size);
+        close(fd);
+        return rc;
+    }
+    if (batch && size < PROTO_BATCH_FILE_MAX) {
+        if (compressed) {
+            unsigned char *body = proto_batch_reserve(conn, batch, relative, path_len, (size_t)size);
+            rc = body ? ctree_read(fd, body, (size_t)size) : -1;
+        } else {
+            rc = proto_batch_add_file(conn, batch, relative, path_len, fd, (size_t)size);
+        }
+    } else {
+        rc = proto_send_entry_file(conn, relative, path_len, size);
+        if (rc == 0) {
+            rc = compressed ? ctree_send_body(conn, fd, size) : conn_send_file(conn, fd, 0, size);
+        }
+    }
+    close(fd);
+    if (rc == 0) {
+        conn->sent.files++;
+        conn->sent.bytes += size;
+    }
+    return rc;
+}
+
+/* the SIGNATURE frame of the file open at fd, which it closes; nothing for files too small for a delta to pay off */
+static int send_signature_of(mc_conn_t *conn, int fd, const char *relative) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < DELTA_MIN_SIZE) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    delta_signature_t signature;
+    int rc = -1;
+    if ((conn->caps & PROTO_CAP_REGION) && region_is_path(relative)) {
+        rc = delta_region_signature_compute(&signature, data, size);
+    }
+    if (rc < 0) {
+        rc = delta_signature_compute(&signature, data, size);
+    }
+    munmap(data, size);
+    if (rc == 0) {
+        rc = proto_send_signature(conn, relative, &signature);
+        delta_signature_free(&signature);
+    }
+    return rc;
+}
+
+/*
+ * A SIGNATURE frame for one file, if it is big enough for a delta to pay
+ * off; region files get one per chunk slot. compressed says the file is
+ * stored in a compressed tree.
+ */
+int send_file_signature(mc_conn_t *conn, const char *full_path, const char *relative, int compressed) {
+    unsigned long long expanded_size;
+    int fd = compressed ? ctree_open_expanded(full_path, &expanded_size) : open(full_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    return send_signature_of(conn, fd, relative);
+}
+
+/* signatures of every file in dir that a delta could rebuild, then END */
+int send_tree_signatures(mc_conn_t *conn, const char *dir) {
+    walker_t walker;
+    if (walker_open(&walker, dir) < 0) {
+        return -1;
+    }
+    walker_entry_t entry;
+    int rc;
+    while ((rc = walker_next(&walker, &entry)) > 0) {
+        if (entry.kind != WALKER_FILE || entry.st->st_size < DELTA_MIN_SIZE) {
+            continue;
+        }
+        int fd = openat(entry.dir_fd, entry.name, O_RDONLY);
+        if (fd < 0 || send_signature_of(conn, fd, entry.path) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    walker_close(&walker);
+    if (rc < 0) {
+        return -1;
+    }
+    return proto_send_end(conn);
+}
+
+/*
+ * Reserves the file's record in the batch and queues the read of its body
+ * straight into it. Anything that would flush the batch flushes the ring
+ * first, so no frame leaves with a body still being read.
+ */
+static int queue_small_file(mc_conn_t *conn, proto_batch_t *batch, io_ring_t *ring, int dir_fd, const char *name, const char *relative,
+                            size_t size) {
+    size_t path_len = strlen(relative);
+    if (batch->len + PROTO_ENTRY_META_SIZE + path_len + size > PROTO_BATCH_MAX && io_ring_flush(ring) < 0) {
+        return -1;
+    }
+    unsigned char *body = proto_batch_reserve(conn, batch, relative, path_len, size);
+    if (!body || io_ring_read(ring, dir_fd, name, body, size) < 0) {
+        return -1;
+    }
+    conn->sent.files++;
+    conn->sent.bytes += size;
+    return 0;
+}
+
+/* ring is set when small files of an uncompressed tree are read through io_uring */
+static int send_tree(mc_conn_t *conn, proto_batch_t *batch, io_ring_t *ring, delta_basis_set_t *bases, const char *base_dir, int compressed) {
+    walker_t walker;
+    if (walker_open(&walker, base_dir) < 0) {
+        return -1;
+    }
+    walker_entry_t entry;
+    int rc;
+    while ((rc = walker_next(&walker, &entry)) > 0) {
+        if (entry.kind == WALKER_DIR) {
+            rc = proto_send_entry_dir(conn, entry.path, entry.path_len);
+        } else if (entry.kind == WALKER_FILE) {
+            off_t size = entry.st->st_size;
+            if (ring && size < PROTO_BATCH_FILE_MAX && (size < DELTA_MIN_SIZE || !delta_basis_set_find(bases, entry.path))) {
+                rc = queue_small_file(conn, batch, ring, entry.dir_fd, entry.name, entry.path, (size_t)size);
+            } else {
+                rc = send_file(conn, batch, bases, base_dir, entry.dir_fd, entry.name, entry.path, compressed);
             }
-            char buffer[FILE_CHUNK_SIZE];
-            ssize_t read_bytes;
-            while ((read_bytes = read(fd, buffer, sizeof(buffer))) > 0) {
-                if (send_all(sock, buffer, (size_t)read_bytes) < 0) {
+        } else if (entry.kind == WALKER_DIR_DONE && ring) {
+            /* the queued opens are relative to this directory, which closes next */
+            rc = io_ring_flush(ring);
+        }
+        if (rc < 0) {
+            break;
+        }
+    }
+    walker_close(&walker);
+    return rc;
+}
+
+/* bases holds the peer's signatures, if it asked for deltas; compressed says base_dir is a compressed tree */
+int send_directory_entries(mc_conn_t *conn, const char *base_dir, delta_basis_set_t *bases, int compressed) {
+    if (!(conn->caps & PROTO_CAP_BATCH)) {
+        return send_tree(conn, NULL, NULL, bases, base_dir, compressed);
+    }
+    proto_batch_t batch;
+    if (proto_batch_init(&batch) < 0) {
+        return -1;
+    }
+    /* compressed trees decode each body on the way, which the ring cannot */
+    io_ring_t ring;
+    int use_ring = !compressed && io_ring_open(&ring, batch.data, PROTO_BATCH_MAX) == 0;
+    int rc = send_tree(conn, &batch, use_ring ? &ring : NULL, bases, base_dir, compressed);
+    if (rc == 0) {
+        rc = proto_batch_flush(conn, &batch);
+    }
+    if (use_ring) {
+        io_ring_close(&ring);
+    }
+    proto_batch_free(&batch);
+    return rc;
+}
+
+/* with_chunks sends each file's chunk list for a chunked push, otherwise just its digest */
+int send_manifest(mc_conn_t *conn, const manifest_t *manifest, int with_chunks) {
+    for (size_t i = 0; i < manifest->entry_count; ++i) {
+        const manifest_entry_t *entry = &manifest->entries[i];
+        int rc;
+        if (entry->type == MANIFEST_DIR) {
+            rc = proto_send_entry_dir(conn, entry->path, strlen(entry->path));
+        } else if (with_chunks) {
+            rc = proto_send_entry_chunked(conn, manifest, entry);
+            conn->sent.files++;
+        } else {
+            rc = proto_send_entry_digest(conn, entry);
+        }
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    return proto_send_end(conn);
+}
+
+/* wanted holds ascending entry indexes; the caller ends the stream */
+int send_wanted_files(mc_conn_t *conn, const char *base_dir, int compressed, const manifest_t *manifest, const uint32_t *wanted,
+                      size_t wanted_count, delta_basis_set_t *bases) {
+    proto_batch_t batch;
+    int batching = (conn->caps & PROTO_CAP_BATCH) != 0;
+    if (batching && proto_batch_init(&batch) < 0) {
+        return -1;
+    }
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < wanted_count; ++i) {
+        const manifest_entry_t *entry = &manifest->entries[wanted[i]];
+        if (entry->type == MANIFEST_DIR) {
+            rc = proto_send_entry_dir(conn, entry->path, strlen(entry->path));
+            continue;
+        }
+        char full_path[PATH_MAX];
+        rc = join_paths(base_dir, entry->path, full_path, sizeof(full_path));
+        if (rc == 0) {
+            rc = send_file(conn, batching ? &batch : NULL, bases, base_dir, AT_FDCWD, full_path, entry->path, compressed);
+        }
+    }
+    if (batching) {
+        if (rc == 0) {
+            rc = proto_batch_flush(conn, &batch);
+        }
+        proto_batch_free(&batch);
+    }
+    return rc;
+}
+
+/* wanted holds ascending chunk indexes; each file is opened once and its chunks go out with sendfile */
+int send_wanted_chunks(mc_conn_t *conn, const char *base_dir, const manifest_t *manifest, const uint32_t *wanted, size_t wanted_count) {
+    size_t next = 0;
+    for (size_t e = 0; e < manifest->entry_count && next < wanted_count; ++e) {
+        const manifest_entry_t *entry = &manifest->entries[e];
+        size_t end = entry->first_chunk + entry->chunk_count;
+        if (entry->type != MANIFEST_FILE || wanted[next] >= end) {
+            continue;
+        }
+        char full_path[PATH_MAX];
+        if (join_paths(base_dir, entry->path, full_path, sizeof(full_path)) < 0) {
+            return -1;
+        }
+        int fd = open(full_path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        off_t offset = 0;
+        for (size_t c = entry->first_chunk; c < end && next < wanted_count; ++c) {
+            const manifest_chunk_t *chunk = &manifest->chunks[c];
+            if (wanted[next] == c) {
+                if (proto_send_chunk_data(conn, chunk) < 0 || conn_send_file(conn, fd, offset, chunk->length) < 0) {
                     close(fd);
-                    closedir(dir);
                     return -1;
                 }
+                conn->sent.bytes += chunk->length;
+                ++next;
             }
-            close(fd);
-            if (read_bytes < 0) {
-                closedir(dir);
-                return -1;
+            offset += chunk->length;
+        }
+        close(fd);
+    }
+    if (next != wanted_count) {
+        errno = EPROTO;
+        return -1;
+    }
+    return proto_send_end(conn);
+}
+
+/*
+ * Batched files mostly share a handful of directories (playerdata, stats,
+ * advancements), so the parent is created and opened once per run of
+ * records and each file is created relative to it. With a ring (set when
+ * payload is the buffer registered with it) the writes go IO_RING_DEPTH at
+ * a time.
+ */
+static int write_batch(mc_conn_t *conn, io_ring_t *ring, const char *target_dir, const unsigned char *payload, size_t length) {
+    char dir_relative[PATH_MAX] = "";
+    int dir_fd = -1;
+    size_t offset = 0;
+    proto_batch_record_t record;
+    int rc;
+    while ((rc = proto_batch_next(payload, length, &offset, &record)) > 0) {
+        char path[PATH_MAX];
+        if (proto_check_path(record.path, record.path_len) < 0) {
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+        memcpy(path, record.path, record.path_len);
+        path[record.path_len] = '\0';
+        char full_path[PATH_MAX];
+        if (join_paths(target_dir, path, full_path, sizeof(full_path)) < 0) {
+            rc = -1;
+            break;
+        }
+        const char *slash = strrchr(path, '/');
+        const char *name = slash ? slash + 1 : path;
+        size_t parent_len = slash ? (size_t)(slash - path) : 0;
+        if (dir_fd < 0 || strlen(dir_relative) != parent_len || memcmp(dir_relative, path, parent_len) != 0) {
+            if (dir_fd >= 0) {
+                close(dir_fd);
+            }
+            /* full_path is "<target_dir>/<path>"; its prefix up to the name's slash is the parent */
+            char dir_full[PATH_MAX];
+            size_t dir_len = strlen(target_dir) + (slash ? 1 + parent_len : 0);
+            memcpy(dir_full, full_path, dir_len);
+            dir_full[dir_len] = '\0';
+            dir_fd = ensure_parent_dirs(full_path) == 0 ? open(dir_full, O_RDONLY | O_DIRECTORY) : -1;
+            if (dir_fd < 0) {
+                rc = -1;
+                break;
             }
+            memcpy(dir_relative, path, parent_len);
+            dir_relative[parent_len] = '\0';
         }
+        if (ring) {
+            if (io_ring_write(ring, dir_fd, name, record.body, record.size) < 0) {
+                rc = -1;
+                break;
+            }
+            conn->received.files++;
+            conn->received.bytes += record.size;
+            continue;
+        }
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            rc = -1;
+            break;
+        }
+        if (write_all(fd, record.body, record.size) < 0) {
+            close(fd);
+            rc = -1;
+            break;
+        }
+        durable_written(fd);
+        close(fd);
+        conn->received.files++;
+        conn->received.bytes += record.size;
     }
-    closedir(dir);
-    return 0;
+    if (ring) {
+        /* the next payload overwrites the bodies */
+        if (rc == 0) {
+            rc = io_ring_flush(ring);
+        } else {
+            io_ring_discard(ring);
+        }
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    return rc;
 }
 
-int send_directory_entries(int sock, const char *base_dir, const char *relative_prefix) {
-    (void)relative_prefix;
-    return send_directory_recursive(sock, base_dir, "");
+/*
+ * Rebuilds a file from the old copy at basis_dir/<path> into a temporary
+ * file beside its destination, which replaces the destination only once
+ * it has checked out. basis_dir may be the target itself.
+ */
+static int receive_delta(mc_conn_t *conn, const char *target_dir, const char *basis_dir, int basis_compressed, const proto_msg_t *msg) {
+    char full_path[PATH_MAX];
+    char basis_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (!basis_dir) {
+        errno = EPROTO;
+        return -1;
+    }
+    const char *slash = strrchr(msg->text, '/');
+    const char *name = slash ? slash + 1 : msg->text;
+    if (join_paths(target_dir, msg->text, full_path, sizeof(full_path)) < 0 ||
+        join_paths(basis_dir, msg->text, basis_path, sizeof(basis_path)) < 0 ||
+        snprintf(tmp_path, sizeof(tmp_path), "%.*s.%s.deltaXXXXXX", (int)(strlen(full_path) - strlen(name)), full_path, name) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    unsigned long long basis_size;
+    int basis_fd = basis_compressed ? ctree_open_expanded(basis_path, &basis_size) : open(basis_path, O_RDONLY);
+    if (basis_fd < 0) {
+        return -1;
+    }
+    int fd = ensure_parent_dirs(full_path) == 0 ? mkstemp(tmp_path) : -1;
+    if (fd < 0) {
+        close(basis_fd);
+        return -1;
+    }
+    int rc = delta_apply(conn, basis_fd, fd, msg->size, msg->hash);
+    if (rc == 0) {
+        rc = fchmod(fd, 0644);
+    }
+    close(basis_fd);
+    durable_written(fd);
+    if (close(fd) < 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = rename(tmp_path, full_path);
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    conn->received.files++;
+    return 0;
 }
 
-int receive_world_entries(int sock, const char *target_dir) {
-    char line[MCSYNC_MAX_LINE];
+static int receive_entries(mc_conn_t *conn, const char *target_dir, const char *basis_dir, int basis_compressed, unsigned char **batch_buffer,
+                           io_ring_t *ring) {
+    proto_msg_t msg;
     while (1) {
-        if (recv_line(sock, line, sizeof(line)) < 0) {
+        if (proto_recv(conn, &msg) < 0) {
             return -1;
         }
-        if (strcmp(line, "END") == 0) {
+        if (msg.type == PROTO_END) {
             return 0;
         }
-        int type;
-        unsigned long path_len;
-        unsigned long long size;
-        if (sscanf(line, "ENTRY %d %lu %llu", &type, &path_len, &size) != 3) {
-            errno = EPROTO;
-            return -1;
-        }
-        if (path_len == 0 || path_len >= PATH_MAX) {
-            errno = ENAMETOOLONG;
-            return -1;
-        }
-        char *path_buffer = malloc(path_len + 1);
-        if (!path_buffer) {
-            return -1;
+        if (msg.type == PROTO_ENTRY_BATCH) {
+            /* one read for the whole frame, then the files are written back to back */
+            if (!*batch_buffer && !(*batch_buffer = malloc(PROTO_BATCH_MAX))) {
+                return -1;
+            }
+            if (conn_read(conn, *batch_buffer, (size_t)msg.size) < 0 ||
+                write_batch(conn, ring, target_dir, *batch_buffer, (size_t)msg.size) < 0) {
+                return -1;
+            }
+            continue;
         }
-        if (recv_all(sock, path_buffer, path_len) < 0) {
-            free(path_buffer);
+        if ((msg.type != PROTO_ENTRY_DIR && msg.type != PROTO_ENTRY_FILE && msg.type != PROTO_ENTRY_DELTA &&
+             msg.type != PROTO_ENTRY_DELETE) || msg.text_len == 0) {
+            errno = EPROTO;
             return -1;
         }
-        path_buffer[path_len] = '\0';
-        if (strstr(path_buffer, "..") != NULL) {
-            free(path_buffer);
+        unsigned long long size = msg.size;
+        /* a DELETE of "." or "/" would take the whole destination with it */
+        if (proto_check_path(msg.text, msg.text_len) < 0) {
             errno = EINVAL;
             return -1;
         }
+        if (msg.type == PROTO_ENTRY_DELTA) {
+            if (receive_delta(conn, target_dir, basis_dir, basis_compressed, &msg) < 0) {
+                return -1;
+            }
+            continue;
+        }
         char full_path[PATH_MAX];
-        if (join_paths(target_dir, path_buffer, full_path, sizeof(full_path)) < 0) {
-            free(path_buffer);
+        if (join_paths(target_dir, msg.text, full_path, sizeof(full_path)) < 0) {
             return -1;
         }
-        if (type == 2) {
+        if (msg.type == PROTO_ENTRY_DELETE) {
+            if (remove_recursive(full_path) < 0) {
+                return -1;
+            }
+            conn->received.deleted++;
+        } else if (msg.type == PROTO_ENTRY_DIR) {
             if (ensure_directory(full_path, 0755) < 0) {
-                free(path_buffer);
                 return -1;
             }
-        } else if (type == 1) {
+        } else {
             if (ensure_parent_dirs(full_path) < 0) {
-                free(path_buffer);
                 return -1;
             }
             int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
             if (fd < 0) {
-                free(path_buffer);
                 return -1;
             }
-            unsigned long long remaining = size;
-            char buffer[FILE_CHUNK_SIZE];
-            while (remaining > 0) {
-                size_t to_read = remaining < sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
-                if (recv_all(sock, buffer, to_read) < 0) {
-                    close(fd);
-                    free(path_buffer);
-                    return -1;
-                }
-                if (write(fd, buffer, to_read) != (ssize_t)to_read) {
-                    close(fd);
-                    free(path_buffer);
-                    return -1;
-                }
-                remaining -= to_read;
+            /* reserve the final size up front so big .mca files land contiguously */
+            if (size > 0 && fallocate(fd, 0, 0, (off_t)size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+                close(fd);
+                return -1;
+            }
+            if (conn_recv_file(conn, fd, size) < 0) {
+                close(fd);
+                return -1;
             }
+            durable_written(fd);
             close(fd);
-        } else {
-            free(path_buffer);
-            errno = EPROTO;
+            conn->received.files++;
+            conn->received.bytes += size;
+        }
+    }
+}
+
+/*
+ * basis_dir holds the old copies ENTRY_DELTA frames refer to, or is NULL if
+ * none were offered; basis_compressed says it is a compressed tree.
+ */
+int receive_world_entries(mc_conn_t *conn, const char *target_dir, const char *basis_dir, int basis_compressed) {
+    unsigned char *batch_buffer = NULL;
+    io_ring_t ring;
+    int use_ring = 0;
+    if (conn->caps & PROTO_CAP_BATCH) {
+        /* batches always land in the same buffer, so it is registered with the ring once */
+        if (!(batch_buffer = malloc(PROTO_BATCH_MAX))) {
             return -1;
         }
-        free(path_buffer);
+        use_ring = io_ring_open(&ring, batch_buffer, PROTO_BATCH_MAX) == 0;
+    }
+    int rc = receive_entries(conn, target_dir, basis_dir, basis_compressed, &batch_buffer, use_ring ? &ring : NULL);
+    if (use_ring) {
+        io_ring_close(&ring);
     }
+    free(batch_buffer);
+    return rc;
 }
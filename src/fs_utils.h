@@ -1,13 +1,29 @@
 #ifndef MCSYNC_FS_UTILS_H
 #define MCSYNC_FS_UTILS_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "conn.h"
+#include "delta.h"
+#include "manifest.h"
+
 int sanitize_name(const char *name);
+/* splits "<world>[@<version>]" into name; version is 0 when none is given */
+int parse_world_ref(const char *ref, char *name, size_t name_len, unsigned long *version);
 int ensure_directory(const char *path, mode_t mode);
 int remove_recursive(const char *path);
-int send_directory_entries(int sock, const char *base_dir, const char *relative_prefix);
-int receive_world_entries(int sock, const char *target_dir);
+int link_or_copy(const char *source, const char *target);
+int copy_file_span(int in, off_t in_offset, int out, off_t out_offset, unsigned long long length);
+int send_directory_entries(mc_conn_t *conn, const char *base_dir, delta_basis_set_t *bases, int compressed);
+int receive_world_entries(mc_conn_t *conn, const char *target_dir, const char *basis_dir, int basis_compressed);
+int send_manifest(mc_conn_t *conn, const manifest_t *manifest, int with_chunks);
+int send_wanted_files(mc_conn_t *conn, const char *base_dir, int compressed, const manifest_t *manifest, const uint32_t *wanted,
+                      size_t wanted_count, delta_basis_set_t *bases);
+int send_delta_entry(mc_conn_t *conn, const char *relative, const delta_signature_t *signature, const unsigned char *data, size_t size);
+int send_file_signature(mc_conn_t *conn, const char *full_path, const char *relative, int compressed);
+int send_tree_signatures(mc_conn_t *conn, const char *dir);
+int send_wanted_chunks(mc_conn_t *conn, const char *base_dir, const manifest_t *manifest, const uint32_t *wanted, size_t wanted_count);
 
 #endif /* MCSYNC_FS_UTILS_H */
@@ -0,0 +1,350 @@
+#include "platform.h"
+#include "hash.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLAG_CHUNK_START 1u
+#define FLAG_CHUNK_END 2u
+#define FLAG_PARENT 4u
+#define FLAG_ROOT 8u
+
+static const uint32_t IV[8] = {
+    0x6A09E667u, 0xBB67AE85u, 0x3C6EF372u, 0xA54FF53Au,
+    0x510E527Fu, 0x9B05688Cu, 0x1F83D9ABu, 0x5BE0CD19u
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+static uint32_t rotr32(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static uint32_t load32(const uint8_t *in) {
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static void g(uint32_t *state, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+    state[a] = state[a] + state[b] + x;
+    state[d] = rotr32(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = rotr32(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + y;
+    state[d] = rotr32(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+static void compress(const uint32_t cv[8], const uint8_t block[HASH_BLOCK_LEN], uint8_t block_len,
+                     uint64_t counter, uint8_t flags, uint32_t out[16]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i) {
+        m[i] = load32(block + 4 * i);
+    }
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags
+    };
+    for (int r = 0; r < 7; ++r) {
+        const uint8_t *sched = MSG_SCHEDULE[r];
+        g(s, 0, 4, 8, 12, m[sched[0]], m[sched[1]]);
+        g(s, 1, 5, 9, 13, m[sched[2]], m[sched[3]]);
+        g(s, 2, 6, 10, 14, m[sched[4]], m[sched[5]]);
+        g(s, 3, 7, 11, 15, m[sched[6]], m[sched[7]]);
+        g(s, 0, 5, 10, 15, m[sched[8]], m[sched[9]]);
+        g(s, 1, 6, 11, 12, m[sched[10]], m[sched[11]]);
+        g(s, 2, 7, 8, 13, m[sched[12]], m[sched[13]]);
+        g(s, 3, 4, 9, 14, m[sched[14]], m[sched[15]]);
+    }
+    for (int i = 0; i < 8; ++i) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint8_t flags, uint32_t out[8]) {
+    uint8_t block[HASH_BLOCK_LEN];
+    for (int i = 0; i < 8; ++i) {
+        for (int b = 0; b < 4; ++b) {
+            block[4 * i + b] = (uint8_t)(left[i] >> (8 * b));
+            block[32 + 4 * i + b] = (uint8_t)(right[i] >> (8 * b));
+        }
+    }
+    uint32_t full[16];
+    compress(IV, block, HASH_BLOCK_LEN, 0, (uint8_t)(FLAG_PARENT | flags), full);
+    memcpy(out, full, 8 * sizeof(uint32_t));
+}
+
+/*
+ * Whole chunks are independent until their chaining values are merged, so
+ * runs of HASH_LANES chunks are compressed together, one chunk per vector
+ * lane. The lane kernel is compiled for each x86 instruction set and the
+ * widest one the CPU supports is picked on first use.
+ */
+#define HASH_LANES 8
+
+typedef void (*chunks_fn)(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]);
+
+static void chunks_portable(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]) {
+    for (int lane = 0; lane < HASH_LANES; ++lane) {
+        const uint8_t *chunk = input + (size_t)lane * HASH_CHUNK_LEN;
+        uint32_t cv[8];
+        memcpy(cv, IV, sizeof(cv));
+        for (int block = 0; block < HASH_CHUNK_LEN / HASH_BLOCK_LEN; ++block) {
+            uint8_t flags = (uint8_t)((block == 0 ? FLAG_CHUNK_START : 0) | (block == HASH_CHUNK_LEN / HASH_BLOCK_LEN - 1 ? FLAG_CHUNK_END : 0));
+            uint32_t full[16];
+            compress(cv, chunk + block * HASH_BLOCK_LEN, HASH_BLOCK_LEN, counter + (uint64_t)lane, flags, full);
+            memcpy(cv, full, sizeof(cv));
+        }
+        memcpy(out[lane], cv, sizeof(cv));
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASH_HAVE_LANES 1
+
+typedef uint32_t lanes_t __attribute__((vector_size(HASH_LANES * sizeof(uint32_t))));
+
+#define LANES_INLINE static inline __attribute__((always_inline))
+
+/* vectors stay in macros and behind pointers, so no function passes one by value across the per-target wrappers */
+#define ROTR_LANES(v, bits) (((v) >> (bits)) | ((v) << (32 - (bits))))
+#define SPLAT(value) ((lanes_t){ 0 } + (uint32_t)(value))
+
+LANES_INLINE void g_lanes(lanes_t *s, const lanes_t *m, int a, int b, int c, int d, int x, int y) {
+    s[a] = s[a] + s[b] + m[x];
+    s[d] = ROTR_LANES(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = ROTR_LANES(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + m[y];
+    s[d] = ROTR_LANES(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = ROTR_LANES(s[b] ^ s[c], 7);
+}
+
+LANES_INLINE void chunks_lanes(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]) {
+    lanes_t cv[8];
+    lanes_t counter_lo;
+    lanes_t counter_hi;
+    for (int i = 0; i < 8; ++i) {
+        cv[i] = SPLAT(IV[i]);
+    }
+    for (int lane = 0; lane < HASH_LANES; ++lane) {
+        counter_lo[lane] = (uint32_t)(counter + (uint64_t)lane);
+        counter_hi[lane] = (uint32_t)((counter + (uint64_t)lane) >> 32);
+    }
+    for (int block = 0; block < HASH_CHUNK_LEN / HASH_BLOCK_LEN; ++block) {
+        /* word w of this block of every lane's chunk */
+        lanes_t m[16];
+        for (int w = 0; w < 16; ++w) {
+            for (int lane = 0; lane < HASH_LANES; ++lane) {
+                m[w][lane] = load32(input + (size_t)lane * HASH_CHUNK_LEN + (size_t)block * HASH_BLOCK_LEN + 4 * (size_t)w);
+            }
+        }
+        uint32_t flags = (block == 0 ? FLAG_CHUNK_START : 0) | (block == HASH_CHUNK_LEN / HASH_BLOCK_LEN - 1 ? FLAG_CHUNK_END : 0);
+        lanes_t s[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            SPLAT(IV[0]), SPLAT(IV[1]), SPLAT(IV[2]), SPLAT(IV[3]),
+            counter_lo, counter_hi, SPLAT(HASH_BLOCK_LEN), SPLAT(flags)
+        };
+        for (int r = 0; r < 7; ++r) {
+            const uint8_t *sched = MSG_SCHEDULE[r];
+            g_lanes(s, m, 0, 4, 8, 12, sched[0], sched[1]);
+            g_lanes(s, m, 1, 5, 9, 13, sched[2], sched[3]);
+            g_lanes(s, m, 2, 6, 10, 14, sched[4], sched[5]);
+            g_lanes(s, m, 3, 7, 11, 15, sched[6], sched[7]);
+            g_lanes(s, m, 0, 5, 10, 15, sched[8], sched[9]);
+            g_lanes(s, m, 1, 6, 11, 12, sched[10], sched[11]);
+            g_lanes(s, m, 2, 7, 8, 13, sched[12], sched[13]);
+            g_lanes(s, m, 3, 4, 9, 14, sched[14], sched[15]);
+        }
+        for (int i = 0; i < 8; ++i) {
+            cv[i] = s[i] ^ s[i + 8];
+        }
+    }
+    for (int lane = 0; lane < HASH_LANES; ++lane) {
+        for (int i = 0; i < 8; ++i) {
+            out[lane][i] = cv[i][lane];
+        }
+    }
+}
+
+static void chunks_sse2(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]) {
+    chunks_lanes(input, counter, out);
+}
+
+__attribute__((target("sse4.1"))) static void chunks_sse41(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]) {
+    chunks_lanes(input, counter, out);
+}
+
+__attribute__((target("avx2"))) static void chunks_avx2(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]) {
+    chunks_lanes(input, counter, out);
+}
+
+__attribute__((target("avx512f,avx512vl"))) static void chunks_avx512(const uint8_t *input, uint64_t counter, uint32_t out[HASH_LANES][8]) {
+    chunks_lanes(input, counter, out);
+}
+#endif
+
+static chunks_fn chunks_kernel = chunks_portable;
+static const char *chunks_kernel_name = "portable";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernel(void) {
+#ifdef HASH_HAVE_LANES
+    if (getenv("MCSYNC_NO_SIMD")) {
+        return;
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+        chunks_kernel = chunks_avx512;
+        chunks_kernel_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        chunks_kernel = chunks_avx2;
+        chunks_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        chunks_kernel = chunks_sse41;
+        chunks_kernel_name = "sse4.1";
+    } else {
+        chunks_kernel = chunks_sse2;
+        chunks_kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *hash_kernel(void) {
+    pthread_once(&kernel_once, pick_kernel);
+    return chunks_kernel_name;
+}
+
+static uint8_t start_flag(const hash_state_t *state) {
+    return state->blocks_compressed == 0 ? FLAG_CHUNK_START : 0;
+}
+
+static size_t chunk_len(const hash_state_t *state) {
+    return (size_t)HASH_BLOCK_LEN * state->blocks_compressed + state->block_len;
+}
+
+/* merges completed subtrees; the number of trailing zero bits in total_chunks is how many */
+static void push_chunk_cv(hash_state_t *state, uint32_t cv[8], uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        --state->cv_stack_len;
+        parent_cv(state->cv_stack[state->cv_stack_len], cv, 0, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(state->cv_stack[state->cv_stack_len], cv, 8 * sizeof(uint32_t));
+    ++state->cv_stack_len;
+}
+
+void hash_init(hash_state_t *state) {
+    memset(state, 0, sizeof(*state));
+    memcpy(state->cv, IV, sizeof(IV));
+}
+
+void hash_update(hash_state_t *state, const void *data, size_t length) {
+    const uint8_t *in = data;
+    if (length > HASH_LANES * HASH_CHUNK_LEN) {
+        pthread_once(&kernel_once, pick_kernel);
+    }
+    while (length > 0) {
+        if (chunk_len(state) == HASH_CHUNK_LEN) {
+            uint32_t out[16];
+            compress(state->cv, state->block, state->block_len, state->chunk_counter,
+                     (uint8_t)(start_flag(state) | FLAG_CHUNK_END), out);
+            uint64_t total_chunks = state->chunk_counter + 1;
+            push_chunk_cv(state, out, total_chunks);
+            memcpy(state->cv, IV, sizeof(IV));
+            state->chunk_counter = total_chunks;
+            state->block_len = 0;
+            state->blocks_compressed = 0;
+        }
+        /* at a chunk boundary with more than a run left; the last chunk stays behind for hash_final */
+        if (chunk_len(state) == 0 && length > HASH_LANES * HASH_CHUNK_LEN) {
+            uint32_t cvs[HASH_LANES][8];
+            chunks_kernel(in, state->chunk_counter, cvs);
+            for (int lane = 0; lane < HASH_LANES; ++lane) {
+                push_chunk_cv(state, cvs[lane], state->chunk_counter + 1);
+                ++state->chunk_counter;
+            }
+            in += HASH_LANES * HASH_CHUNK_LEN;
+            length -= HASH_LANES * HASH_CHUNK_LEN;
+            continue;
+        }
+        if (state->block_len == HASH_BLOCK_LEN) {
+            uint32_t out[16];
+            compress(state->cv, state->block, HASH_BLOCK_LEN, state->chunk_counter, start_flag(state), out);
+            memcpy(state->cv, out, 8 * sizeof(uint32_t));
+            ++state->blocks_compressed;
+            state->block_len = 0;
+        }
+        size_t want = HASH_BLOCK_LEN - state->block_len;
+        size_t take = want < length ? want : length;
+        memcpy(state->block + state->block_len, in, take);
+        state->block_len = (uint8_t)(state->block_len + take);
+        in += take;
+        length -= take;
+    }
+}
+
+void hash_final(const hash_state_t *state, unsigned char out[HASH_SIZE]) {
+    /* the last chunk's final block, or a parent node, is the root output */
+    uint32_t input_cv[8];
+    uint8_t block[HASH_BLOCK_LEN];
+    uint8_t block_len = state->block_len;
+    uint64_t counter = state->chunk_counter;
+    uint8_t flags = (uint8_t)(start_flag(state) | FLAG_CHUNK_END);
+    memcpy(input_cv, state->cv, sizeof(input_cv));
+    memset(block, 0, sizeof(block));
+    memcpy(block, state->block, state->block_len);
+
+    for (int level = state->cv_stack_len; level > 0; --level) {
+        uint32_t full[16];
+        compress(input_cv, block, block_len, counter, flags, full);
+        uint32_t right[8];
+        memcpy(right, full, sizeof(right));
+        const uint32_t *left = state->cv_stack[level - 1];
+        for (int i = 0; i < 8; ++i) {
+            for (int b = 0; b < 4; ++b) {
+                block[4 * i + b] = (uint8_t)(left[i] >> (8 * b));
+                block[32 + 4 * i + b] = (uint8_t)(right[i] >> (8 * b));
+            }
+        }
+        memcpy(input_cv, IV, sizeof(input_cv));
+        block_len = HASH_BLOCK_LEN;
+        counter = 0;
+        flags = FLAG_PARENT;
+    }
+    uint32_t root[16];
+    compress(input_cv, block, block_len, 0, (uint8_t)(flags | FLAG_ROOT), root);
+    for (int i = 0; i < 8; ++i) {
+        for (int b = 0; b < 4; ++b) {
+            out[4 * i + b] = (unsigned char)(root[i] >> (8 * b));
+        }
+    }
+}
+
+void hash_buffer(const void *data, size_t length, unsigned char out[HASH_SIZE]) {
+    hash_state_t state;
+    hash_init(&state);
+    hash_update(&state, data, length);
+    hash_final(&state, out);
+}
+
+void hash_to_hex(const unsigned char hash[HASH_SIZE], char out[HASH_HEX_SIZE]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < HASH_SIZE; ++i) {
+        out[2 * i] = digits[hash[i] >> 4];
+        out[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    out[HASH_SIZE * 2] = '\0';
+}
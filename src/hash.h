@@ -0,0 +1,33 @@
+#ifndef MCSYNC_HASH_H
+#define MCSYNC_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* BLAKE3, unkeyed, 256-bit output */
+#define HASH_SIZE 32
+#define HASH_HEX_SIZE (HASH_SIZE * 2 + 1)
+
+#define HASH_BLOCK_LEN 64
+#define HASH_CHUNK_LEN 1024
+#define HASH_MAX_DEPTH 54
+
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[HASH_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+    uint32_t cv_stack[HASH_MAX_DEPTH][8];
+    uint8_t cv_stack_len;
+} hash_state_t;
+
+void hash_init(hash_state_t *state);
+void hash_update(hash_state_t *state, const void *data, size_t length);
+void hash_final(const hash_state_t *state, unsigned char out[HASH_SIZE]);
+void hash_buffer(const void *data, size_t length, unsigned char out[HASH_SIZE]);
+/* the SIMD kernel runs of whole chunks are hashed with, as picked for this CPU */
+const char *hash_kernel(void);
+void hash_to_hex(const unsigned char hash[HASH_SIZE], char out[HASH_HEX_SIZE]);
+
+#endif /* MCSYNC_HASH_H */
@@ -0,0 +1,149 @@
+#include "platform.h"
+#include "hash_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    manifest_t *manifest;
+    const char *base_dir;
+    const uint32_t *pending;
+    size_t pending_count;
+    size_t threads;
+    /* one single-entry manifest per pending file */
+    manifest_t *results;
+    pthread_mutex_t lock;
+    size_t next;
+    int error;
+} pool_t;
+
+int hash_pool_threads(void) {
+    const char *env = getenv("MCSYNC_HASH_THREADS");
+    if (env && atoi(env) > 0) {
+        return atoi(env);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static int full_path_of(const pool_t *pool, size_t job, char *out, size_t out_len) {
+    const char *relative = pool->manifest->entries[pool->pending[job]].path;
+    if (snprintf(out, out_len, "%s/%s", pool->base_dir, relative) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static void read_ahead(const pool_t *pool, size_t job) {
+    char full_path[PATH_MAX];
+    if (job >= pool->pending_count || full_path_of(pool, job, full_path, sizeof(full_path)) < 0) {
+        return;
+    }
+    int fd = open(full_path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+static void *worker(void *arg) {
+    pool_t *pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        size_t job = pool->next++;
+        int stop = pool->error != 0 || job >= pool->pending_count;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            return NULL;
+        }
+        read_ahead(pool, job + pool->threads);
+        char full_path[PATH_MAX];
+        const char *relative = pool->manifest->entries[pool->pending[job]].path;
+        if (full_path_of(pool, job, full_path, sizeof(full_path)) < 0 ||
+            manifest_scan_file(&pool->results[job], full_path, relative, NULL, NULL) < 0) {
+            pthread_mutex_lock(&pool->lock);
+            if (pool->error == 0) {
+                pool->error = errno ? errno : EIO;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+    }
+}
+
+/* rebuilds the manifest with each pending entry replaced by its result */
+static int merge_results(pool_t *pool) {
+    manifest_t merged;
+    manifest_init(&merged);
+    size_t job = 0;
+    for (size_t i = 0; i < pool->manifest->entry_count; ++i) {
+        int rc;
+        if (job < pool->pending_count && pool->pending[job] == i) {
+            rc = manifest_copy_entry(&merged, &pool->results[job], &pool->results[job].entries[0]);
+            ++job;
+        } else {
+            rc = manifest_copy_entry(&merged, pool->manifest, &pool->manifest->entries[i]);
+        }
+        if (rc < 0) {
+            manifest_free(&merged);
+            return -1;
+        }
+    }
+    manifest_free(pool->manifest);
+    *pool->manifest = merged;
+    return 0;
+}
+
+int hash_pool_scan(manifest_t *manifest, const char *base_dir, const uint32_t *pending, size_t pending_count) {
+    if (pending_count == 0) {
+        return 0;
+    }
+    pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.manifest = manifest;
+    pool.base_dir = base_dir;
+    pool.pending = pending;
+    pool.pending_count = pending_count;
+    pool.threads = (size_t)hash_pool_threads();
+    if (pool.threads > pending_count) {
+        pool.threads = pending_count;
+    }
+    pool.results = calloc(pending_count, sizeof(*pool.results));
+    if (!pool.results) {
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    for (size_t job = 0; job < pool.threads; ++job) {
+        read_ahead(&pool, job);
+    }
+    /* the calling thread is one of the workers */
+    pthread_t *threads = calloc(pool.threads, sizeof(*threads));
+    size_t started = 0;
+    while (threads && started + 1 < pool.threads && pthread_create(&threads[started], NULL, worker, &pool) == 0) {
+        ++started;
+    }
+    worker(&pool);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    int rc = 0;
+    if (pool.error != 0) {
+        errno = pool.error;
+        rc = -1;
+    } else {
+        rc = merge_results(&pool);
+    }
+    for (size_t i = 0; i < pending_count; ++i) {
+        manifest_free(&pool.results[i]);
+    }
+    free(pool.results);
+    return rc;
+}
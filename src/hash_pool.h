@@ -0,0 +1,23 @@
+#ifndef MCSYNC_HASH_POOL_H
+#define MCSYNC_HASH_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "manifest.h"
+
+/*
+ * Reads and hashes files on a pool of threads, one file per job, since a
+ * world is mostly many independent region files. A worker asks the kernel
+ * to read ahead the file a round of jobs later, so the disk stays busy
+ * while the current ones are chunked and hashed.
+ */
+int hash_pool_threads(void);
+/*
+ * Fills in the file entries of manifest at the ascending indexes in
+ * pending, added with just their path, from base_dir/<path>. The manifest
+ * ends up as if it had been scanned in walk order.
+ */
+int hash_pool_scan(manifest_t *manifest, const char *base_dir, const uint32_t *pending, size_t pending_count);
+
+#endif /* MCSYNC_HASH_POOL_H */
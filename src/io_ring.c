@@ -0,0 +1,388 @@
+#include "platform.h"
+#include "io_ring.h"
+
+#include "durable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+/* the ops of one file's chain, which also number its completions */
+enum {
+    OP_OPEN,
+    OP_DATA,
+    OP_SYNC,
+    OP_CLOSE,
+    OPS_PER_FILE
+};
+
+#define RING_ENTRIES (IO_RING_DEPTH * OPS_PER_FILE)
+
+#if defined(__linux__) && defined(IORING_RSRC_REGISTER_SPARSE)
+
+static int ring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int supports_ops(int fd) {
+    static const int needed[] = {
+        IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_SYNC_FILE_RANGE
+    };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) {
+        return 0;
+    }
+    int ok = ring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); ++i) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static void unmap_rings(io_ring_t *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+}
+
+static int map_rings(io_ring_t *ring, const struct io_uring_params *params) {
+    ring->sq_ring_len = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+    ring->cq_ring_len = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_ring_len > ring->sq_ring_len) {
+        ring->sq_ring_len = ring->cq_ring_len;
+    }
+    void *sq = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -1;
+    }
+    ring->sq_ring = sq;
+    if (single) {
+        ring->cq_ring = sq;
+    } else {
+        void *cq = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return -1;
+        }
+        ring->cq_ring = cq;
+    }
+    ring->sqes_len = params->sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return -1;
+    }
+    ring->sqes = sqes;
+    unsigned char *sq_base = ring->sq_ring;
+    unsigned char *cq_base = ring->cq_ring;
+    ring->sq_tail = (unsigned int *)(sq_base + params->sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq_base + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq_base + params->sq_off.array);
+    ring->cq_head = (unsigned int *)(cq_base + params->cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq_base + params->cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq_base + params->cq_off.ring_mask);
+    ring->cqes = cq_base + params->cq_off.cqes;
+    return 0;
+}
+
+int io_ring_open(io_ring_t *ring, unsigned char *buffer, size_t buffer_len) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if (getenv("MCSYNC_NO_URING")) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    /* one direct descriptor slot per queued file, so a chain needs no fd back from its openat */
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = IO_RING_DEPTH;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (map_rings(ring, &params) < 0 || !supports_ops(ring->fd) ||
+        ring_register(ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0 ||
+        !(ring->queue = calloc(IO_RING_DEPTH, sizeof(*ring->queue)))) {
+        int saved = errno;
+        io_ring_close(ring);
+        errno = saved;
+        return -1;
+    }
+    struct iovec region = { buffer, buffer_len };
+    /* not fatal: over RLIMIT_MEMLOCK the same chains just use plain read and write */
+    ring->fixed_buffer = ring_register(ring->fd, IORING_REGISTER_BUFFERS, &region, 1) == 0;
+    ring->buffer = buffer;
+    ring->buffer_len = buffer_len;
+    return 0;
+}
+
+void io_ring_close(io_ring_t *ring) {
+    if (ring->queue) {
+        io_ring_discard(ring);
+    }
+    unmap_rings(ring);
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->queue);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static struct io_uring_sqe *next_sqe(io_ring_t *ring, unsigned int *tail) {
+    unsigned int index = *tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++*tail;
+    return sqe;
+}
+
+/*
+ * Hard links keep a chain going past a failure, so the close always runs;
+ * ops after a failed open just fail with EBADF. A read opens its file into
+ * direct descriptor slot; a write got its fd when it was queued.
+ */
+static unsigned int prepare(io_ring_t *ring, unsigned int slot, unsigned int *tail) {
+    io_ring_file_t *file = &ring->queue[slot];
+    int fixed = ring->fixed_buffer && file->data >= ring->buffer && file->data + file->size <= ring->buffer + ring->buffer_len;
+    int direct = file->fd < 0;
+    unsigned int count = 0;
+    struct io_uring_sqe *sqe;
+
+    if (direct) {
+        sqe = next_sqe(ring, tail);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = file->dir_fd;
+        sqe->addr = (uint64_t)(uintptr_t)file->name;
+        /* openat refuses O_CLOEXEC for a direct descriptor, which has no fd table entry anyway */
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = slot + 1;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = (uint64_t)slot * OPS_PER_FILE + OP_OPEN;
+        ++count;
+    }
+
+    sqe = next_sqe(ring, tail);
+    if (file->writing) {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    }
+    sqe->fd = direct ? (int)slot : file->fd;
+    sqe->addr = (uint64_t)(uintptr_t)file->data;
+    sqe->len = (uint32_t)file->size;
+    sqe->flags = (direct ? IOSQE_FIXED_FILE : 0) | IOSQE_IO_HARDLINK;
+    sqe->user_data = (uint64_t)slot * OPS_PER_FILE + OP_DATA;
+    ++count;
+
+    if (file->writing && durable_get_mode() != DURABLE_NONE) {
+        /* what durable_written does on the synchronous path */
+        sqe = next_sqe(ring, tail);
+        sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+        sqe->fd = file->fd;
+        sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = (uint64_t)slot * OPS_PER_FILE + OP_SYNC;
+        ++count;
+    }
+
+    sqe = next_sqe(ring, tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    if (direct) {
+        sqe->file_index = slot + 1;
+    } else {
+        sqe->fd = file->fd;
+    }
+    sqe->user_data = (uint64_t)slot * OPS_PER_FILE + OP_CLOSE;
+    return count + 1;
+}
+
+/* keeps the error of the earliest op in the chain, which caused the ones after it */
+static void complete(io_ring_t *ring, const struct io_uring_cqe *cqe) {
+    io_ring_file_t *file = &ring->queue[cqe->user_data / OPS_PER_FILE];
+    int op = (int)(cqe->user_data % OPS_PER_FILE);
+    int error = 0;
+    if (cqe->res < 0) {
+        error = -cqe->res;
+    } else if (op == OP_DATA && (size_t)cqe->res != file->size) {
+        /* a short read means the file shrank after it was stat'ed */
+        error = file->writing ? ENOSPC : EIO;
+    }
+    if (op == OP_CLOSE) {
+        file->closed = 1;
+    } else if (error && (!file->error || op < file->error_op)) {
+        file->error = error;
+        file->error_op = op;
+    }
+}
+
+static unsigned int reap(io_ring_t *ring) {
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int count = 0;
+    while (head != tail) {
+        complete(ring, (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask));
+        ++head;
+        ++count;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+int io_ring_flush(io_ring_t *ring) {
+    if (ring->queued == 0) {
+        return 0;
+    }
+    unsigned int tail = *ring->sq_tail;
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < ring->queued; ++i) {
+        total += prepare(ring, i, &tail);
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int rc = 0;
+    int saved = 0;
+    unsigned int submitted = 0;
+    while (submitted < total) {
+        int got = ring_enter(ring->fd, total - submitted, 0, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            /* the buffer may not be let go while anything submitted still runs */
+            rc = -1;
+            saved = got < 0 ? errno : EIO;
+            break;
+        }
+        submitted += (unsigned int)got;
+    }
+    unsigned int completed = reap(ring);
+    while (completed < submitted) {
+        if (ring_enter(ring->fd, 0, submitted - completed, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            rc = -1;
+            saved = errno;
+            break;
+        }
+        completed += reap(ring);
+    }
+    for (unsigned int i = 0; i < ring->queued; ++i) {
+        io_ring_file_t *file = &ring->queue[i];
+        if (rc == 0 && file->error) {
+            rc = -1;
+            saved = file->error;
+        }
+        if (!file->closed && file->fd >= 0) {
+            /* its chain never ran */
+            close(file->fd);
+        }
+    }
+    ring->queued = 0;
+    if (rc < 0) {
+        errno = saved;
+    }
+    return rc;
+}
+
+#else
+
+int io_ring_open(io_ring_t *ring, unsigned char *buffer, size_t buffer_len) {
+    (void)buffer;
+    (void)buffer_len;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void io_ring_close(io_ring_t *ring) {
+    free(ring->queue);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int io_ring_flush(io_ring_t *ring) {
+    ring->queued = 0;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+static int enqueue(io_ring_t *ring, int dir_fd, const char *name, unsigned char *data, size_t size, int writing) {
+    size_t name_len = strlen(name);
+    if (name_len >= sizeof(ring->queue[0].name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (size > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (ring->queued == IO_RING_DEPTH && io_ring_flush(ring) < 0) {
+        return -1;
+    }
+    /*
+     * Creating a file takes its directory's lock, so an openat with O_CREAT
+     * always goes to an io_uring worker and creates in one directory still
+     * run one at a time; done here it costs less than the hand-off.
+     */
+    int fd = -1;
+    if (writing && (fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    io_ring_file_t *file = &ring->queue[ring->queued++];
+    file->fd = fd;
+    file->dir_fd = dir_fd;
+    memcpy(file->name, name, name_len + 1);
+    file->data = data;
+    file->size = size;
+    file->writing = writing;
+    file->error = 0;
+    file->error_op = 0;
+    file->closed = 0;
+    return 0;
+}
+
+int io_ring_read(io_ring_t *ring, int dir_fd, const char *name, unsigned char *data, size_t size) {
+    return enqueue(ring, dir_fd, name, data, size, 0);
+}
+
+int io_ring_write(io_ring_t *ring, int dir_fd, const char *name, const unsigned char *data, size_t size) {
+    /* the ring only reads from it */
+    return enqueue(ring, dir_fd, name, (unsigned char *)data, size, 1);
+}
+
+void io_ring_discard(io_ring_t *ring) {
+    for (unsigned int i = 0; i < ring->queued; ++i) {
+        if (ring->queue[i].fd >= 0) {
+            close(ring->queue[i].fd);
+        }
+    }
+    ring->queued = 0;
+}
@@ -0,0 +1,74 @@
+#ifndef MCSYNC_IO_RING_H
+#define MCSYNC_IO_RING_H
+
+#include "platform.h"
+
+#include <stddef.h>
+
+/*
+ * Reads and writes small files through io_uring, up to IO_RING_DEPTH of
+ * them per io_uring_enter() instead of three or four syscalls each, so a
+ * batch of playerdata or stats files has all its I/O in flight at once.
+ * A read is one linked chain openat -> read -> close on a direct
+ * descriptor; a write is created when it is queued, then write ->
+ * sync_file_range (unless durability is off) -> close. Bodies lie in the
+ * one buffer registered with the ring: the ENTRY_BATCH payload being
+ * filled or just received.
+ *
+ * io_ring_open fails where io_uring is missing, forbidden or too old for
+ * these opcodes, and always with MCSYNC_NO_URING set; callers then keep to
+ * plain read and write.
+ */
+#define IO_RING_DEPTH 64
+
+typedef struct {
+    /* a write's, opened when it was queued; -1 for a read, which opens into a direct descriptor */
+    int fd;
+    int dir_fd;
+    char name[NAME_MAX + 1];
+    unsigned char *data;
+    size_t size;
+    int writing;
+    int error;
+    int error_op;
+    int closed;
+} io_ring_file_t;
+
+typedef struct {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    void *sqes;
+    size_t sqes_len;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+    unsigned char *buffer;
+    size_t buffer_len;
+    /* the buffer is registered, so reads and writes inside it skip pinning pages each time */
+    int fixed_buffer;
+    io_ring_file_t *queue;
+    unsigned int queued;
+} io_ring_t;
+
+int io_ring_open(io_ring_t *ring, unsigned char *buffer, size_t buffer_len);
+void io_ring_close(io_ring_t *ring);
+/*
+ * Queue dir_fd/name to be read into data, or created now and written from
+ * it; a full queue is flushed first. data, and a read's dir_fd, must stay
+ * valid until the next flush.
+ */
+int io_ring_read(io_ring_t *ring, int dir_fd, const char *name, unsigned char *data, size_t size);
+int io_ring_write(io_ring_t *ring, int dir_fd, const char *name, const unsigned char *data, size_t size);
+/* runs everything queued and waits for it; -1 with the errno of the first file that failed */
+int io_ring_flush(io_ring_t *ring);
+/* forgets what is queued without running it, after the caller gave up */
+void io_ring_discard(io_ring_t *ring);
+
+#endif /* MCSYNC_IO_RING_H */
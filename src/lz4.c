@@ -0,0 +1,223 @@
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+/* the format wants the last 5 bytes as literals and no match starting in the last 12 */
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define HASH_LOG 14
+#define CHAIN_SIZE LZ4_BLOCK_MAX
+#define MAX_OFFSET 65535
+
+typedef struct {
+    uint32_t table[1u << HASH_LOG];
+    /* distance back to the previous position with the same hash, level 3 only */
+    uint16_t chain[CHAIN_SIZE];
+} lz4_state_t;
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash4(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_LOG);
+}
+
+size_t lz4_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+static size_t match_length(const unsigned char *a, const unsigned char *b, const unsigned char *limit) {
+    const unsigned char *start = b;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* eight bytes at a time; the lowest differing bit marks the first differing byte */
+    while (limit - b >= 8) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        if (x != y) {
+            return (size_t)(b - start) + (size_t)(__builtin_ctzll(x ^ y) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+#endif
+    while (b < limit && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return (size_t)(b - start);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/* one sequence: literals then a match; offset 0 marks the closing literals-only sequence */
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *literals, size_t literal_len, size_t offset, size_t match_len) {
+    unsigned char *token = op++;
+    *token = (unsigned char)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15) {
+        op = put_length(op, literal_len - 15);
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (offset == 0) {
+        return op;
+    }
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    size_t extra = match_len - MIN_MATCH;
+    *token |= (unsigned char)(extra >= 15 ? 15 : extra);
+    if (extra >= 15) {
+        op = put_length(op, extra - 15);
+    }
+    return op;
+}
+
+static void insert(lz4_state_t *state, const unsigned char *in, size_t pos, int chained) {
+    uint32_t h = hash4(read32(in + pos));
+    if (chained) {
+        size_t delta = pos - state->table[h];
+        state->chain[pos & (CHAIN_SIZE - 1)] = (uint16_t)(delta > MAX_OFFSET ? 0 : delta);
+    }
+    state->table[h] = (uint32_t)pos;
+}
+
+size_t lz4_compress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level) {
+    if (length > LZ4_BLOCK_MAX || capacity < lz4_bound(length)) {
+        return 0;
+    }
+    lz4_state_t state;
+    int chained = level >= LZ4_LEVEL_MAX;
+    /* how quickly the search skips ahead through bytes that never match */
+    unsigned skip_shift = level <= LZ4_LEVEL_MIN ? 3 : 6;
+    int depth = chained ? 16 : 1;
+    memset(state.table, 0, sizeof(state.table));
+    unsigned char *op = out;
+    size_t anchor = 0;
+    size_t pos = 1;
+    if (length > MATCH_LIMIT) {
+        size_t limit = length - MATCH_LIMIT;
+        const unsigned char *match_end = in + length - LAST_LITERALS;
+        insert(&state, in, 0, chained);
+        unsigned misses = 1u << skip_shift;
+        while (pos < limit) {
+            uint32_t sequence = read32(in + pos);
+            size_t candidate = state.table[hash4(sequence)];
+            size_t best_len = 0;
+            size_t best_offset = 0;
+            for (int tries = 0; tries < depth && candidate < pos && pos - candidate <= MAX_OFFSET; ++tries) {
+                if (read32(in + candidate) == sequence) {
+                    size_t len = MIN_MATCH + match_length(in + candidate + MIN_MATCH, in + pos + MIN_MATCH, match_end);
+                    if (len > best_len) {
+                        best_len = len;
+                        best_offset = pos - candidate;
+                    }
+                }
+                uint16_t back = chained ? state.chain[candidate & (CHAIN_SIZE - 1)] : 0;
+                if (back == 0 || back > candidate) {
+                    break;
+                }
+                candidate -= back;
+            }
+            insert(&state, in, pos, chained);
+            if (best_len == 0) {
+                pos += misses++ >> skip_shift;
+                continue;
+            }
+            misses = 1u << skip_shift;
+            /* stretch the match backwards over literals that also match */
+            while (pos > anchor && pos - best_offset > 0 && in[pos - 1] == in[pos - best_offset - 1]) {
+                --pos;
+                ++best_len;
+            }
+            op = put_sequence(op, in + anchor, pos - anchor, best_offset, best_len);
+            size_t next = pos + best_len;
+            for (size_t p = pos + 1; p < next && p < limit; p += chained ? 1 : 2) {
+                insert(&state, in, p, chained);
+            }
+            pos = next;
+            anchor = next;
+        }
+    }
+    op = put_sequence(op, in + anchor, length - anchor, 0, 0);
+    return (size_t)(op - out);
+}
+
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lz4_decompress(const unsigned char *in, size_t length, unsigned char *out, size_t expected) {
+    const unsigned char *ip = in;
+    const unsigned char *end = in + length;
+    unsigned char *op = out;
+    unsigned char *out_end = out + expected;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && get_length(&ip, end, &literal_len) < 0) {
+            return -1;
+        }
+        if (literal_len > (size_t)(end - ip) || literal_len > (size_t)(out_end - op)) {
+            return -1;
+        }
+        /* short runs copy a fixed 16 bytes when both buffers have room past them */
+        if (literal_len <= 16 && end - ip >= 16 && out_end - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, literal_len);
+        }
+        ip += literal_len;
+        op += literal_len;
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, end, &match_len) < 0) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || match_len > (size_t)(out_end - op)) {
+            return -1;
+        }
+        const unsigned char *match = op - offset;
+        if (offset >= 8 && (size_t)(out_end - op) >= match_len + 8) {
+            /* eight bytes at a time, overshooting into room the next sequence overwrites */
+            for (size_t i = 0; i < match_len; i += 8) {
+                memcpy(op + i, match + i, 8);
+            }
+            op += match_len;
+        } else {
+            /* byte by byte, since an overlapping match repeats what it just wrote */
+            for (size_t i = 0; i < match_len; ++i) {
+                *op++ = match[i];
+            }
+        }
+    }
+    return op == out_end ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+#ifndef MCSYNC_LZ4_H
+#define MCSYNC_LZ4_H
+
+#include <stddef.h>
+
+/*
+ * Compressor and decompressor for the LZ4 block format, for blocks of at
+ * most 64 KiB so every match offset fits. Level 1 skips ahead quickly
+ * over data that does not match, 2 tries every position and 3 also walks
+ * a chain of earlier candidates for the longest match.
+ */
+#define LZ4_BLOCK_MAX 65536
+#define LZ4_LEVEL_MIN 1
+#define LZ4_LEVEL_MAX 3
+
+/* worst case output size for length input bytes */
+size_t lz4_bound(size_t length);
+/* compressed size, or 0 if it would not fit in capacity */
+size_t lz4_compress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity, int level);
+/* -1 unless the block expands to exactly expected bytes */
+int lz4_decompress(const unsigned char *in, size_t length, unsigned char *out, size_t expected);
+
+#endif /* MCSYNC_LZ4_H */
@@ -0,0 +1,395 @@
+#include "platform.h"
+#include "manifest.h"
+
+#include "chunker.h"
+#include "common.h"
+#include "hash_pool.h"
+#include "walker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC "MCSYNCM2"
+/* written before entries carried an mtime; still read */
+#define MANIFEST_MAGIC_V1 "MCSYNCM1"
+#define MANIFEST_HEADER_SIZE 24
+/* type, path length, size, mtime, first chunk, chunk count, digest */
+#define MANIFEST_ENTRY_SIZE (4 + 4 + 8 + 8 + 8 + 8 + HASH_SIZE)
+#define MANIFEST_ENTRY_SIZE_V1 (MANIFEST_ENTRY_SIZE - 8)
+#define MANIFEST_CHUNK_SIZE (HASH_SIZE + 4)
+
+void manifest_init(manifest_t *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+void manifest_free(manifest_t *manifest) {
+    for (size_t i = 0; i < manifest->entry_count; ++i) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    free(manifest->chunks);
+    manifest_init(manifest);
+}
+
+static int grow(void **items, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *resized = realloc(*items, new_capacity * item_size);
+    if (!resized) {
+        return -1;
+    }
+    *items = resized;
+    *capacity = new_capacity;
+    return 0;
+}
+
+int manifest_add_entry(manifest_t *manifest, int type, const char *path, size_t path_len, unsigned long long size) {
+    if (grow((void **)&manifest->entries, &manifest->entry_capacity, manifest->entry_count + 1, sizeof(manifest_entry_t)) < 0) {
+        return -1;
+    }
+    manifest_entry_t *entry = &manifest->entries[manifest->entry_count];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = malloc(path_len + 1);
+    if (!entry->path) {
+        return -1;
+    }
+    memcpy(entry->path, path, path_len);
+    entry->path[path_len] = '\0';
+    entry->type = type;
+    entry->size = size;
+    entry->first_chunk = manifest->chunk_count;
+    ++manifest->entry_count;
+    return 0;
+}
+
+/* appends to the file entry added last */
+int manifest_add_chunk(manifest_t *manifest, const unsigned char hash[HASH_SIZE], uint32_t length) {
+    if (grow((void **)&manifest->chunks, &manifest->chunk_capacity, manifest->chunk_count + 1, sizeof(manifest_chunk_t)) < 0) {
+        return -1;
+    }
+    manifest_chunk_t *chunk = &manifest->chunks[manifest->chunk_count++];
+    memcpy(chunk->hash, hash, HASH_SIZE);
+    chunk->length = length;
+    manifest->entries[manifest->entry_count - 1].chunk_count++;
+    return 0;
+}
+
+/* appends an entry of another manifest, chunk list and digest included */
+int manifest_copy_entry(manifest_t *manifest, const manifest_t *source, const manifest_entry_t *entry) {
+    if (manifest_add_entry(manifest, entry->type, entry->path, strlen(entry->path), entry->size) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < entry->chunk_count; ++i) {
+        const manifest_chunk_t *chunk = &source->chunks[entry->first_chunk + i];
+        if (manifest_add_chunk(manifest, chunk->hash, chunk->length) < 0) {
+            return -1;
+        }
+    }
+    manifest_entry_t *copy = &manifest->entries[manifest->entry_count - 1];
+    copy->mtime = entry->mtime;
+    memcpy(copy->digest, entry->digest, HASH_SIZE);
+    return 0;
+}
+
+void manifest_finish_file(manifest_t *manifest) {
+    manifest_entry_t *entry = &manifest->entries[manifest->entry_count - 1];
+    hash_state_t state;
+    hash_init(&state);
+    for (size_t i = 0; i < entry->chunk_count; ++i) {
+        hash_update(&state, manifest->chunks[entry->first_chunk + i].hash, HASH_SIZE);
+    }
+    hash_final(&state, entry->digest);
+}
+
+/* appends the file at full_path as an entry named relative */
+int manifest_scan_file(manifest_t *manifest, const char *full_path, const char *relative, manifest_chunk_fn on_chunk, void *ctx) {
+    return manifest_scan_fileat(manifest, AT_FDCWD, full_path, relative, on_chunk, ctx);
+}
+
+int manifest_scan_fileat(manifest_t *manifest, int dir_fd, const char *path, const char *relative, manifest_chunk_fn on_chunk, void *ctx) {
+    int fd = openat(dir_fd, path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (manifest_add_entry(manifest, MANIFEST_FILE, relative, strlen(relative), (unsigned long long)size) < 0) {
+        close(fd);
+        return -1;
+    }
+    manifest->entries[manifest->entry_count - 1].mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    int rc = 0;
+    if (size > 0) {
+        unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        size_t offset = 0;
+        while (rc == 0 && offset < size) {
+            size_t length = chunker_cut(data + offset, size - offset);
+            unsigned char hash[HASH_SIZE];
+            hash_buffer(data + offset, length, hash);
+            rc = manifest_add_chunk(manifest, hash, (uint32_t)length);
+            if (rc == 0 && on_chunk) {
+                rc = on_chunk(&manifest->chunks[manifest->chunk_count - 1], data + offset, ctx);
+            }
+            offset += length;
+        }
+        munmap(data, size);
+    }
+    close(fd);
+    if (rc == 0) {
+        manifest_finish_file(manifest);
+    }
+    return rc;
+}
+
+/* indexes of the file entries a scan left for the hash pool */
+typedef struct {
+    uint32_t *indexes;
+    size_t count;
+    size_t capacity;
+} pending_t;
+
+/* with pending, files are only listed and read later on the hash pool */
+static int scan_tree(manifest_t *manifest, const char *base_dir, manifest_chunk_fn on_chunk, void *ctx, pending_t *pending) {
+    walker_t walker;
+    if (walker_open(&walker, base_dir) < 0) {
+        return -1;
+    }
+    walker_entry_t entry;
+    int rc;
+    while ((rc = walker_next(&walker, &entry)) > 0) {
+        if (entry.kind == WALKER_DIR) {
+            rc = manifest_add_entry(manifest, MANIFEST_DIR, entry.path, entry.path_len, 0);
+        } else if (entry.kind == WALKER_FILE && pending) {
+            rc = grow((void **)&pending->indexes, &pending->capacity, pending->count + 1, sizeof(*pending->indexes));
+            if (rc == 0) {
+                pending->indexes[pending->count++] = (uint32_t)manifest->entry_count;
+                rc = manifest_add_entry(manifest, MANIFEST_FILE, entry.path, entry.path_len, (unsigned long long)entry.st->st_size);
+            }
+        } else if (entry.kind == WALKER_FILE) {
+            rc = manifest_scan_fileat(manifest, entry.dir_fd, entry.name, entry.path, on_chunk, ctx);
+        }
+        if (rc < 0) {
+            break;
+        }
+    }
+    walker_close(&walker);
+    return rc;
+}
+
+/* without a chunk callback, which would have to be thread-safe, files are hashed in parallel */
+int manifest_scan_dir(manifest_t *manifest, const char *dir, manifest_chunk_fn on_chunk, void *ctx) {
+    if (on_chunk) {
+        return scan_tree(manifest, dir, on_chunk, ctx, NULL);
+    }
+    pending_t pending;
+    memset(&pending, 0, sizeof(pending));
+    int rc = scan_tree(manifest, dir, NULL, NULL, &pending);
+    if (rc == 0) {
+        rc = hash_pool_scan(manifest, dir, pending.indexes, pending.count);
+    }
+    free(pending.indexes);
+    return rc;
+}
+
+static int compare_entry_paths(const void *a, const void *b) {
+    const manifest_entry_t *left = *(const manifest_entry_t *const *)a;
+    const manifest_entry_t *right = *(const manifest_entry_t *const *)b;
+    return strcmp(left->path, right->path);
+}
+
+static const manifest_entry_t **sort_by_path(const manifest_t *manifest) {
+    const manifest_entry_t **sorted = malloc((manifest->entry_count + 1) * sizeof(*sorted));
+    if (!sorted) {
+        return NULL;
+    }
+    for (size_t i = 0; i < manifest->entry_count; ++i) {
+        sorted[i] = &manifest->entries[i];
+    }
+    qsort(sorted, manifest->entry_count, sizeof(*sorted), compare_entry_paths);
+    return sorted;
+}
+
+static const manifest_entry_t *find_path(const manifest_entry_t **sorted, size_t count, const manifest_entry_t *entry) {
+    const manifest_entry_t **found = bsearch(&entry, sorted, count, sizeof(*sorted), compare_entry_paths);
+    return found ? *found : NULL;
+}
+
+static int same_entry(const manifest_entry_t *a, const manifest_entry_t *b) {
+    if (!a || !b || a->type != b->type) {
+        return 0;
+    }
+    return a->type == MANIFEST_DIR || (a->size == b->size && memcmp(a->digest, b->digest, HASH_SIZE) == 0);
+}
+
+int manifest_diff(const manifest_t *from, const manifest_t *to, uint32_t **changed, size_t *changed_count,
+                  uint32_t **removed, size_t *removed_count) {
+    *changed_count = 0;
+    *removed_count = 0;
+    const manifest_entry_t **from_sorted = sort_by_path(from);
+    const manifest_entry_t **to_sorted = sort_by_path(to);
+    *changed = malloc((to->entry_count + 1) * sizeof(**changed));
+    *removed = malloc((from->entry_count + 1) * sizeof(**removed));
+    if (!from_sorted || !to_sorted || !*changed || !*removed) {
+        free(from_sorted);
+        free(to_sorted);
+        free(*changed);
+        free(*removed);
+        *changed = NULL;
+        *removed = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < to->entry_count; ++i) {
+        if (!same_entry(find_path(from_sorted, from->entry_count, &to->entries[i]), &to->entries[i])) {
+            (*changed)[(*changed_count)++] = (uint32_t)i;
+        }
+    }
+    for (size_t i = 0; i < from->entry_count; ++i) {
+        const manifest_entry_t *kept = find_path(to_sorted, to->entry_count, &from->entries[i]);
+        if (!kept || kept->type != from->entries[i].type) {
+            (*removed)[(*removed_count)++] = (uint32_t)i;
+        }
+    }
+    free(from_sorted);
+    free(to_sorted);
+    return 0;
+}
+
+int manifest_save(const manifest_t *manifest, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return -1;
+    }
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    memcpy(header, MANIFEST_MAGIC, 8);
+    put_le64(header + 8, manifest->entry_count);
+    put_le64(header + 16, manifest->chunk_count);
+    int ok = fwrite(header, sizeof(header), 1, fp) == 1;
+    for (size_t i = 0; ok && i < manifest->entry_count; ++i) {
+        const manifest_entry_t *entry = &manifest->entries[i];
+        size_t path_len = strlen(entry->path);
+        unsigned char record[MANIFEST_ENTRY_SIZE];
+        put_le32(record, (uint32_t)entry->type);
+        put_le32(record + 4, (uint32_t)path_len);
+        put_le64(record + 8, entry->size);
+        put_le64(record + 16, (uint64_t)entry->mtime);
+        put_le64(record + 24, entry->first_chunk);
+        put_le64(record + 32, entry->chunk_count);
+        memcpy(record + 40, entry->digest, HASH_SIZE);
+        ok = fwrite(record, sizeof(record), 1, fp) == 1 && fwrite(entry->path, 1, path_len, fp) == path_len;
+    }
+    for (size_t i = 0; ok && i < manifest->chunk_count; ++i) {
+        unsigned char record[MANIFEST_CHUNK_SIZE];
+        memcpy(record, manifest->chunks[i].hash, HASH_SIZE);
+        put_le32(record + HASH_SIZE, manifest->chunks[i].length);
+        ok = fwrite(record, sizeof(record), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        if (errno == 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int read_exact(FILE *fp, void *buffer, size_t length) {
+    if (fread(buffer, 1, length, fp) != length) {
+        errno = ferror(fp) ? EIO : EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+int manifest_load(manifest_t *manifest, const char *path) {
+    manifest_init(manifest);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    if (read_exact(fp, header, sizeof(header)) < 0 ||
+        (memcmp(header, MANIFEST_MAGIC, 8) != 0 && memcmp(header, MANIFEST_MAGIC_V1, 8) != 0)) {
+        fclose(fp);
+        errno = EBADMSG;
+        return -1;
+    }
+    /* a version 1 record is the same minus the mtime */
+    int has_mtime = memcmp(header, MANIFEST_MAGIC, 8) == 0;
+    size_t entry_size = has_mtime ? MANIFEST_ENTRY_SIZE : MANIFEST_ENTRY_SIZE_V1;
+    uint64_t entry_count = get_le64(header + 8);
+    uint64_t chunk_count = get_le64(header + 16);
+    int rc = 0;
+    for (uint64_t i = 0; rc == 0 && i < entry_count; ++i) {
+        unsigned char record[MANIFEST_ENTRY_SIZE];
+        char entry_path[PATH_MAX];
+        rc = read_exact(fp, record, entry_size);
+        if (rc == 0 && !has_mtime) {
+            memmove(record + 24, record + 16, MANIFEST_ENTRY_SIZE_V1 - 16);
+            put_le64(record + 16, 0);
+        }
+        uint32_t path_len = rc == 0 ? get_le32(record + 4) : 0;
+        if (rc == 0 && (path_len == 0 || path_len >= PATH_MAX)) {
+            errno = EBADMSG;
+            rc = -1;
+        }
+        if (rc == 0) {
+            rc = read_exact(fp, entry_path, path_len);
+        }
+        if (rc == 0) {
+            rc = manifest_add_entry(manifest, (int)get_le32(record), entry_path, path_len, get_le64(record + 8));
+        }
+        if (rc == 0) {
+            manifest_entry_t *entry = &manifest->entries[manifest->entry_count - 1];
+            entry->mtime = (int64_t)get_le64(record + 16);
+            entry->first_chunk = (size_t)get_le64(record + 24);
+            entry->chunk_count = (size_t)get_le64(record + 32);
+            memcpy(entry->digest, record + 40, HASH_SIZE);
+            if (entry->first_chunk > chunk_count || entry->chunk_count > chunk_count - entry->first_chunk) {
+                errno = EBADMSG;
+                rc = -1;
+            }
+        }
+    }
+    if (rc == 0 && grow((void **)&manifest->chunks, &manifest->chunk_capacity, (size_t)chunk_count, sizeof(manifest_chunk_t)) < 0) {
+        rc = -1;
+    }
+    for (uint64_t i = 0; rc == 0 && i < chunk_count; ++i) {
+        unsigned char record[MANIFEST_CHUNK_SIZE];
+        rc = read_exact(fp, record, sizeof(record));
+        if (rc == 0) {
+            memcpy(manifest->chunks[i].hash, record, HASH_SIZE);
+            manifest->chunks[i].length = get_le32(record + HASH_SIZE);
+            manifest->chunk_count = (size_t)i + 1;
+        }
+    }
+    fclose(fp);
+    if (rc < 0) {
+        int saved = errno;
+        manifest_free(manifest);
+        errno = saved;
+    }
+    return rc;
+}
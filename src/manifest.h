@@ -0,0 +1,68 @@
+#ifndef MCSYNC_MANIFEST_H
+#define MCSYNC_MANIFEST_H
+
+#include "platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+/*
+ * A world as a list of entries in walk order. Files reference a run of
+ * content-defined chunks; a file's digest is the hash of its chunk hashes,
+ * so equal digests mean equal contents.
+ */
+#define MANIFEST_DIR 1
+#define MANIFEST_FILE 2
+
+typedef struct {
+    unsigned char hash[HASH_SIZE];
+    uint32_t length;
+} manifest_chunk_t;
+
+typedef struct {
+    int type;
+    char *path;
+    unsigned long long size;
+    /* nanoseconds since the epoch, as the file was scanned */
+    int64_t mtime;
+    unsigned char digest[HASH_SIZE];
+    size_t first_chunk;
+    size_t chunk_count;
+} manifest_entry_t;
+
+typedef struct {
+    manifest_entry_t *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    manifest_chunk_t *chunks;
+    size_t chunk_count;
+    size_t chunk_capacity;
+} manifest_t;
+
+/* called for every chunk as a directory is scanned; data is only valid during the call */
+typedef int (*manifest_chunk_fn)(const manifest_chunk_t *chunk, const unsigned char *data, void *ctx);
+
+void manifest_init(manifest_t *manifest);
+void manifest_free(manifest_t *manifest);
+int manifest_add_entry(manifest_t *manifest, int type, const char *path, size_t path_len, unsigned long long size);
+int manifest_add_chunk(manifest_t *manifest, const unsigned char hash[HASH_SIZE], uint32_t length);
+int manifest_copy_entry(manifest_t *manifest, const manifest_t *source, const manifest_entry_t *entry);
+void manifest_finish_file(manifest_t *manifest);
+int manifest_scan_file(manifest_t *manifest, const char *full_path, const char *relative, manifest_chunk_fn on_chunk, void *ctx);
+/* the same with path relative to dir_fd */
+int manifest_scan_fileat(manifest_t *manifest, int dir_fd, const char *path, const char *relative, manifest_chunk_fn on_chunk, void *ctx);
+int manifest_scan_dir(manifest_t *manifest, const char *dir, manifest_chunk_fn on_chunk, void *ctx);
+/*
+ * What turns the tree from describes into the one to describes: ascending
+ * indexes into to of the directories and files from lacks or holds with
+ * other contents, and indexes into from of the paths to has nothing of
+ * that type at.
+ */
+int manifest_diff(const manifest_t *from, const manifest_t *to, uint32_t **changed, size_t *changed_count,
+                  uint32_t **removed, size_t *removed_count);
+int manifest_save(const manifest_t *manifest, const char *path);
+int manifest_load(manifest_t *manifest, const char *path);
+
+#endif /* MCSYNC_MANIFEST_H */
@@ -1,11 +1,17 @@
 #include "platform.h"
 #include "common.h"
+#include "conn.h"
 #include "fs_utils.h"
+#include "hash_pool.h"
+#include "protocol.h"
+#include "stat_index.h"
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef struct {
@@ -24,10 +31,14 @@ static void print_usage(const char *prog) {
     fprintf(stderr,
             "Usage:\n"
             "  %s init <host> <port>\n"
-            "  %s list\n"
+            "  %s list [prefix]\n"
+            "  %s log <world_name>\n"
             "  %s push <world_dir> [world_name]\n"
-            "  %s pull <world_name> <destination_dir>\n",
-            prog, prog, prog, prog);
+            "  %s pull <world_name>[@version] <destination_dir>\n"
+            "  %s clone <world_name>[@version] <new_world_name>\n"
+            "  %s session   (reads list/log/push/pull/clone commands from stdin over one connection)\n"
+            "  %s hash <dir>\n",
+            prog, prog, prog, prog, prog, prog, prog, prog);
 }
 
 static int load_config(const char *config_path, mc_config_t *config) {
@@ -118,6 +129,37 @@ static int connect_to_remote(const mc_config_t *config) {
     return -1;
 }
 
+static int open_connection(const mc_config_t *config, mc_conn_t *conn) {
+    int negotiate = 1;
+    while (1) {
+        int sock = connect_to_remote(config);
+        if (sock < 0) {
+            return -1;
+        }
+        if (conn_init(conn, sock) < 0) {
+            close(sock);
+            return -1;
+        }
+        int rc = negotiate ? proto_client_hello(conn) : 0;
+        if (rc == 0) {
+            return 0;
+        }
+        close(sock);
+        conn_destroy(conn);
+        if (rc < 0) {
+            return -1;
+        }
+        /* the server predates HELLO and hung up on it; talk version 1 instead */
+        negotiate = 0;
+    }
+}
+
+static void close_connection(mc_conn_t *conn) {
+    conn_flush(conn);
+    close(conn->fd);
+    conn_destroy(conn);
+}
+
 static const char *basename_safely(const char *path) {
     const char *end = path + strlen(path);
     while (end > path && end[-1] == '/') {
@@ -159,201 +201,651 @@ static int cmd_init(const char *host, const char *port_str) {
     return 0;
 }
 
-static int wait_for_done_or_error(int sock) {
-    char line[MCSYNC_MAX_LINE];
-    if (recv_line(sock, line, sizeof(line)) < 0) {
-        return -1;
+/* prints the digest, size and path of every file in dir, then how fast they were read */
+static int cmd_hash(const char *dir) {
+    struct timespec start;
+    struct timespec end;
+    manifest_t manifest;
+    manifest_init(&manifest);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (manifest_scan_dir(&manifest, dir, NULL, NULL) < 0) {
+        perror("scan");
+        manifest_free(&manifest);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long long bytes = 0;
+    size_t files = 0;
+    for (size_t i = 0; i < manifest.entry_count; ++i) {
+        const manifest_entry_t *entry = &manifest.entries[i];
+        if (entry->type != MANIFEST_FILE) {
+            continue;
+        }
+        char hex[HASH_HEX_SIZE];
+        hash_to_hex(entry->digest, hex);
+        printf("%s %12llu %s\n", hex, entry->size, entry->path);
+        bytes += entry->size;
+        ++files;
+    }
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    double mib = (double)bytes / 1048576.0;
+    fprintf(stderr, "Hashed %zu files, %.1f MiB in %.2fs (%.1f MiB/s), %d threads, %s kernel\n", files, mib, seconds,
+            seconds > 0 ? mib / seconds : 0.0, hash_pool_threads(), hash_kernel());
+    manifest_free(&manifest);
+    return 0;
+}
+
+/*
+ * Command outcomes. A request the server refused leaves the connection in
+ * sync and a session can carry on; a broken stream cannot.
+ */
+#define CMD_OK 0
+#define CMD_REFUSED -1
+#define CMD_BROKEN -2
+
+/* pulls that may be in flight on one session before their replies are read */
+#define PIPELINE_DEPTH 16
+
+/* reads the next reply to request_id and checks it is the expected type; ERR is reported and refused */
+static int read_reply(mc_conn_t *conn, unsigned long request_id, proto_msg_t *msg, int expected_type) {
+    if (proto_recv(conn, msg) < 0) {
+        perror("recv");
+        return CMD_BROKEN;
     }
-    if (strncmp(line, "ERR ", 4) == 0) {
-        fprintf(stderr, "Server error: %s\n", line + 4);
-        return -1;
+    if (msg->request_id != request_id) {
+        fprintf(stderr, "Unexpected response for request %u\n", (unsigned int)msg->request_id);
+        return CMD_BROKEN;
     }
-    if (strcmp(line, "DONE") == 0) {
-        return 0;
+    if (msg->type == PROTO_ERR) {
+        fprintf(stderr, "Server error: %s\n", msg->text);
+        return CMD_REFUSED;
     }
-    fprintf(stderr, "Unexpected response: %s\n", line);
-    return -1;
+    if (expected_type != PROTO_UNKNOWN && msg->type != expected_type) {
+        fprintf(stderr, "Unexpected response type 0x%02x\n", (unsigned int)msg->type);
+        return CMD_BROKEN;
+    }
+    return CMD_OK;
 }
 
-static int cmd_list(const mc_config_t *config) {
-    int sock = connect_to_remote(config);
-    if (sock < 0) {
-        perror("connect");
-        return -1;
-    }
-    if (send_fmt(sock, "LIST\n") < 0) {
+static int send_request(mc_conn_t *conn, unsigned long request_id, int type, uint16_t flags, const char *name) {
+    if (proto_send_request(conn, type, flags, (uint32_t)request_id, name) < 0) {
         perror("send");
-        close(sock);
-        return -1;
+        return CMD_BROKEN;
     }
-    char line[MCSYNC_MAX_LINE];
-    if (recv_line(sock, line, sizeof(line)) < 0) {
-        perror("recv");
-        close(sock);
-        return -1;
+    return CMD_OK;
+}
+
+static void format_time(int64_t when, char *out, size_t out_len) {
+    time_t seconds = (time_t)when;
+    struct tm tm;
+    if (!localtime_r(&seconds, &tm) || strftime(out, out_len, "%Y-%m-%d %H:%M:%S", &tm) == 0) {
+        snprintf(out, out_len, "%lld", (long long)when);
     }
-    if (strncmp(line, "ERR ", 4) == 0) {
-        fprintf(stderr, "Server error: %s\n", line + 4);
-        close(sock);
-        return -1;
+}
+
+/* servers without a catalog list every world, so the prefix is applied here as well */
+static int run_list(mc_conn_t *conn, unsigned long request_id, const char *prefix) {
+    int rc = send_request(conn, request_id, PROTO_LIST, 0, prefix && (conn->caps & PROTO_CAP_CATALOG) ? prefix : NULL);
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    proto_msg_t msg;
+    while (rc == CMD_OK) {
+        rc = read_reply(conn, request_id, &msg, PROTO_UNKNOWN);
+        if (rc != CMD_OK || msg.type == PROTO_DONE) {
+            break;
+        }
+        if ((msg.type == PROTO_WORLD || msg.type == PROTO_WORLD_INFO) && strncmp(msg.text, prefix ? prefix : "", prefix_len) != 0) {
+            continue;
+        }
+        if (msg.type == PROTO_WORLD) {
+            printf("%s\n", msg.text);
+        } else if (msg.type == PROTO_WORLD_INFO) {
+            char when[64];
+            format_time(msg.mtime, when, sizeof(when));
+            printf("%s@%llu  %s  %u files, %.1f MiB\n", msg.text, msg.seq, when, msg.count, (double)msg.size / 1048576.0);
+        } else if (msg.type != PROTO_COUNT) {
+            fprintf(stderr, "Unexpected response type 0x%02x\n", (unsigned int)msg.type);
+            rc = CMD_BROKEN;
+        }
     }
-    unsigned long count;
-    if (sscanf(line, "COUNT %lu", &count) != 1) {
-        fprintf(stderr, "Unexpected response: %s\n", line);
-        close(sock);
-        return -1;
+    return rc;
+}
+
+static int run_log(mc_conn_t *conn, unsigned long request_id, const char *world_name) {
+    if (sanitize_name(world_name) < 0) {
+        fprintf(stderr, "Invalid world name: %s\n", world_name);
+        return CMD_REFUSED;
+    }
+    if (!(conn->caps & PROTO_CAP_HISTORY)) {
+        fprintf(stderr, "Server keeps no history\n");
+        return CMD_REFUSED;
+    }
+    int rc = send_request(conn, request_id, PROTO_LOG, 0, world_name);
+    proto_msg_t msg;
+    int first = 1;
+    while (rc == CMD_OK) {
+        rc = read_reply(conn, request_id, &msg, PROTO_UNKNOWN);
+        if (rc != CMD_OK || msg.type == PROTO_DONE) {
+            break;
+        }
+        if (msg.type == PROTO_VERSION) {
+            char when[64];
+            format_time(msg.mtime, when, sizeof(when));
+            printf("%s@%llu  %s  %-6s  %u files, %.1f MiB%s\n", world_name, msg.seq, when, msg.text, msg.count,
+                   (double)msg.size / 1048576.0, first ? "  (current)" : "");
+            first = 0;
+        } else if (msg.type != PROTO_COUNT) {
+            fprintf(stderr, "Unexpected response type 0x%02x\n", (unsigned int)msg.type);
+            rc = CMD_BROKEN;
+        }
     }
-    for (unsigned long i = 0; i < count; ++i) {
-        if (recv_line(sock, line, sizeof(line)) < 0) {
-            perror("recv");
-            close(sock);
-            return -1;
+    return rc;
+}
+
+/* the copy is made on the server; nothing but the names crosses the wire */
+static int run_clone(mc_conn_t *conn, unsigned long request_id, const char *source, const char *target) {
+    char name[PATH_MAX];
+    unsigned long version;
+    if (parse_world_ref(source, name, sizeof(name), &version) < 0) {
+        fprintf(stderr, "Invalid world name: %s\n", source);
+        return CMD_REFUSED;
+    }
+    if (sanitize_name(target) < 0) {
+        fprintf(stderr, "Invalid world name: %s\n", target);
+        return CMD_REFUSED;
+    }
+    if (!(conn->caps & PROTO_CAP_CLONE) || (version != 0 && !(conn->caps & PROTO_CAP_HISTORY))) {
+        fprintf(stderr, "Server cannot clone worlds\n");
+        return CMD_REFUSED;
+    }
+    char request[2 * PATH_MAX + 2];
+    if (snprintf(request, sizeof(request), "%s %s", source, target) >= (int)sizeof(request)) {
+        fprintf(stderr, "Invalid world name: %s\n", target);
+        return CMD_REFUSED;
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = send_request(conn, request_id, PROTO_CLONE, 0, request);
+    proto_msg_t msg;
+    unsigned long long files = 0;
+    if (rc == CMD_OK) {
+        rc = read_reply(conn, request_id, &msg, PROTO_COUNT);
+        files = msg.size;
+    }
+    if (rc == CMD_OK) {
+        rc = read_reply(conn, request_id, &msg, PROTO_DONE);
+    }
+    if (rc != CMD_OK) {
+        return rc;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Cloned world '%s' to '%s' (%llu files in %.1f ms)\n", source, target, files,
+           (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+    return CMD_OK;
+}
+
+/* collects the WANT frames of a reply; the indexes must ascend and stay below limit */
+static int read_wants(mc_conn_t *conn, unsigned long request_id, size_t limit, uint32_t **wanted, size_t *wanted_count) {
+    *wanted = NULL;
+    *wanted_count = 0;
+    proto_msg_t msg;
+    int rc;
+    while ((rc = read_reply(conn, request_id, &msg, PROTO_UNKNOWN)) == CMD_OK && msg.type == PROTO_WANT) {
+        uint32_t *grown = realloc(*wanted, (*wanted_count + msg.count + 1) * sizeof(**wanted));
+        if (!grown) {
+            return CMD_BROKEN;
         }
-        unsigned long name_len;
-        if (sscanf(line, "WORLD %lu", &name_len) != 1) {
-            fprintf(stderr, "Unexpected response: %s\n", line);
-            close(sock);
-            return -1;
+        *wanted = grown;
+        if (proto_recv_indexes(conn, grown + *wanted_count, msg.count) < 0) {
+            return CMD_BROKEN;
         }
-        char *name = malloc(name_len + 1);
-        if (!name) {
-            fprintf(stderr, "Out of memory\n");
-            close(sock);
-            return -1;
+        *wanted_count += msg.count;
+    }
+    if (rc == CMD_OK && msg.type != PROTO_END) {
+        fprintf(stderr, "Unexpected response type 0x%02x\n", (unsigned int)msg.type);
+        rc = CMD_BROKEN;
+    }
+    for (size_t i = 0; rc == CMD_OK && i < *wanted_count; ++i) {
+        if ((*wanted)[i] >= limit || (i > 0 && (*wanted)[i] <= (*wanted)[i - 1])) {
+            fprintf(stderr, "Server asked for an invalid index\n");
+            rc = CMD_BROKEN;
         }
-        if (recv_all(sock, name, name_len) < 0) {
-            perror("recv");
-            free(name);
-            close(sock);
-            return -1;
+    }
+    return rc;
+}
+
+/* sends the chunk list first, then only the chunks the server asks for */
+static int push_chunks(mc_conn_t *conn, unsigned long request_id, const char *world_dir, const manifest_t *manifest, size_t *sent_chunks) {
+    if (send_manifest(conn, manifest, 1) < 0) {
+        perror("send world data");
+        return CMD_BROKEN;
+    }
+    uint32_t *wanted;
+    size_t wanted_count;
+    int rc = read_wants(conn, request_id, manifest->chunk_count, &wanted, &wanted_count);
+    if (rc == CMD_OK && send_wanted_chunks(conn, world_dir, manifest, wanted, wanted_count) < 0) {
+        perror("send world data");
+        rc = CMD_BROKEN;
+    }
+    *sent_chunks = wanted_count;
+    free(wanted);
+    return rc;
+}
+
+/* sends every file's digest, then only the files the server has no identical copy of */
+static int push_changed_files(mc_conn_t *conn, unsigned long request_id, const char *world_dir, const manifest_t *manifest, size_t *sent_files) {
+    if (send_manifest(conn, manifest, 0) < 0) {
+        perror("send world data");
+        return CMD_BROKEN;
+    }
+    uint32_t *wanted;
+    size_t wanted_count;
+    int rc = read_wants(conn, request_id, manifest->entry_count, &wanted, &wanted_count);
+    for (size_t i = 0; rc == CMD_OK && i < wanted_count; ++i) {
+        if (manifest->entries[wanted[i]].type != MANIFEST_FILE) {
+            fprintf(stderr, "Server asked for an invalid index\n");
+            rc = CMD_BROKEN;
         }
-        name[name_len] = '\0';
-        printf("%s\n", name);
-        free(name);
     }
-    if (wait_for_done_or_error(sock) < 0) {
-        close(sock);
+    /* the server's signatures of its old copies, so changed files can go as deltas */
+    delta_basis_set_t bases;
+    delta_basis_set_init(&bases);
+    if (rc == CMD_OK && (conn->caps & PROTO_CAP_DELTA) && proto_recv_signatures(conn, &bases) < 0) {
+        perror("recv");
+        rc = CMD_BROKEN;
+    }
+    if (rc == CMD_OK && (send_wanted_files(conn, world_dir, 0, manifest, wanted, wanted_count, &bases) < 0 || proto_send_end(conn) < 0)) {
+        perror("send world data");
+        rc = CMD_BROKEN;
+    }
+    *sent_files = wanted_count;
+    delta_basis_set_free(&bases);
+    free(wanted);
+    return rc;
+}
+
+/* scans a tree, reading only the files whose stat changed since the index was saved; index stays open */
+static int scan_tree(stat_index_t *index, const char *dir, manifest_t *manifest, size_t *hashed) {
+    if (stat_index_open(index, ".mcsync", dir) < 0) {
+        return -1;
+    }
+    if (stat_index_scan(index, dir, manifest, hashed) < 0) {
+        int saved = errno;
+        stat_index_close(index);
+        errno = saved;
         return -1;
     }
-    close(sock);
     return 0;
 }
 
-static int cmd_push(const mc_config_t *config, const char *world_dir, const char *world_name_override) {
+/* the index only saves rescanning, so failing to update it is not worth failing the command */
+static void save_index(stat_index_t *index, const manifest_t *manifest) {
+    if (stat_index_save(index, manifest) < 0) {
+        perror("save index");
+    }
+}
+
+static void refresh_index(const char *dir) {
+    stat_index_t index;
+    manifest_t manifest;
+    manifest_init(&manifest);
+    size_t hashed;
+    if (scan_tree(&index, dir, &manifest, &hashed) < 0) {
+        perror("scan index");
+    } else {
+        save_index(&index, &manifest);
+        stat_index_close(&index);
+    }
+    manifest_free(&manifest);
+}
+
+static int run_push(mc_conn_t *conn, unsigned long request_id, const char *world_dir, const char *world_name_override) {
     struct stat st;
     if (stat(world_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
         fprintf(stderr, "World directory not found: %s\n", world_dir);
-        return -1;
+        return CMD_REFUSED;
     }
     const char *base_name = world_name_override ? world_name_override : basename_safely(world_dir);
     if (sanitize_name(base_name) < 0) {
         fprintf(stderr, "Invalid world name: %s\n", base_name);
-        return -1;
+        return CMD_REFUSED;
+    }
+    /* a chunk-backed server only needs the chunks it has not seen, in any world */
+    int chunked = (conn->caps & PROTO_CAP_CHUNKS) != 0;
+    /* a tree-backed one only needs the files that changed since the last push */
+    int incremental = !chunked && (conn->caps & PROTO_CAP_INCREMENTAL) != 0;
+    manifest_t manifest;
+    manifest_init(&manifest);
+    stat_index_t index;
+    size_t hashed = 0;
+    conn_stats_begin(conn);
+    if ((chunked || incremental) && scan_tree(&index, world_dir, &manifest, &hashed) < 0) {
+        perror("scan world");
+        manifest_free(&manifest);
+        return CMD_REFUSED;
+    }
+    uint16_t flags = chunked ? PROTO_FLAG_CHUNKED : incremental ? PROTO_FLAG_INCREMENTAL : 0;
+    int rc = send_request(conn, request_id, PROTO_PUSH, flags, base_name);
+    proto_msg_t msg;
+    if (rc == CMD_OK) {
+        rc = read_reply(conn, request_id, &msg, PROTO_OK);
+    }
+    size_t sent = 0;
+    if (rc == CMD_OK && chunked) {
+        rc = push_chunks(conn, request_id, world_dir, &manifest, &sent);
+    } else if (rc == CMD_OK && incremental) {
+        rc = push_changed_files(conn, request_id, world_dir, &manifest, &sent);
+    } else if (rc == CMD_OK && (send_directory_entries(conn, world_dir, NULL, 0) < 0 || proto_send_end(conn) < 0)) {
+        perror("send world data");
+        rc = CMD_BROKEN;
     }
-    size_t name_len = strlen(base_name);
-    int sock = connect_to_remote(config);
-    if (sock < 0) {
-        perror("connect");
-        return -1;
+    if (rc == CMD_OK) {
+        rc = read_reply(conn, request_id, &msg, PROTO_DONE);
     }
-    if (send_fmt(sock, "PUSH %zu\n", name_len) < 0) {
-        perror("send");
-        close(sock);
-        return -1;
+    if ((chunked || incremental) && rc == CMD_OK) {
+        save_index(&index, &manifest);
     }
-    if (send_all(sock, base_name, name_len) < 0) {
-        perror("send");
-        close(sock);
-        return -1;
+    if (chunked || incremental) {
+        stat_index_close(&index);
     }
-    char line[MCSYNC_MAX_LINE];
-    if (recv_line(sock, line, sizeof(line)) < 0) {
-        perror("recv");
-        close(sock);
-        return -1;
+    size_t chunk_count = manifest.chunk_count;
+    size_t file_count = 0;
+    for (size_t i = 0; i < manifest.entry_count; ++i) {
+        file_count += manifest.entries[i].type == MANIFEST_FILE;
     }
-    if (strncmp(line, "ERR ", 4) == 0) {
-        fprintf(stderr, "Server error: %s\n", line + 4);
-        close(sock);
-        return -1;
+    manifest_free(&manifest);
+    if (rc != CMD_OK) {
+        return rc;
     }
-    if (strcmp(line, "OK") != 0) {
-        fprintf(stderr, "Unexpected response: %s\n", line);
-        close(sock);
-        return -1;
+    char summary[256];
+    conn_stats_format(conn, &conn->sent, summary, sizeof(summary));
+    if (chunked) {
+        printf("Pushed world '%s' (%s, %zu of %zu chunks sent, %zu files hashed)\n", base_name, summary, sent, chunk_count, hashed);
+    } else if (incremental) {
+        printf("Pushed world '%s' (%s, %zu of %zu files changed, %zu hashed)\n", base_name, summary, sent, file_count, hashed);
+    } else {
+        printf("Pushed world '%s' (%s)\n", base_name, summary);
     }
-    if (send_directory_entries(sock, world_dir, "") < 0) {
-        perror("send world data");
-        close(sock);
-        return -1;
+    return CMD_OK;
+}
+
+static int prepare_pull(const char *world_name, const char *destination_dir) {
+    char name[PATH_MAX];
+    unsigned long version;
+    if (parse_world_ref(world_name, name, sizeof(name), &version) < 0) {
+        fprintf(stderr, "Invalid world name: %s\n", world_name);
+        return CMD_REFUSED;
+    }
+    if (ensure_directory(destination_dir, 0755) < 0) {
+        perror("destination");
+        return CMD_REFUSED;
+    }
+    return CMD_OK;
+}
+
+/*
+ * With incremental pulls the request carries the digest of everything the
+ * destination already holds, and with delta support signatures of it too.
+ */
+static int start_pull(mc_conn_t *conn, unsigned long request_id, const char *world_name, const char *destination_dir) {
+    if (strchr(world_name, '@') && !(conn->caps & PROTO_CAP_HISTORY)) {
+        fprintf(stderr, "Server keeps no history\n");
+        return CMD_REFUSED;
+    }
+    int incremental = (conn->caps & PROTO_CAP_INCREMENTAL_PULL) != 0;
+    int delta = (conn->caps & PROTO_CAP_DELTA) != 0;
+    uint16_t flags = (incremental ? PROTO_FLAG_INCREMENTAL : 0) | (delta ? PROTO_FLAG_DELTA : 0);
+    manifest_t held;
+    manifest_init(&held);
+    if (incremental) {
+        stat_index_t index;
+        size_t hashed;
+        if (scan_tree(&index, destination_dir, &held, &hashed) < 0) {
+            perror("scan destination");
+            manifest_free(&held);
+            return CMD_REFUSED;
+        }
+        save_index(&index, &held);
+        stat_index_close(&index);
     }
-    if (send_fmt(sock, "END\n") < 0) {
+    int rc = send_request(conn, request_id, PROTO_PULL, flags, world_name);
+    if (rc == CMD_OK && incremental && send_manifest(conn, &held, 0) < 0) {
         perror("send");
-        close(sock);
-        return -1;
+        rc = CMD_BROKEN;
     }
-    if (wait_for_done_or_error(sock) < 0) {
-        close(sock);
-        return -1;
+    if (rc == CMD_OK && delta && send_tree_signatures(conn, destination_dir) < 0) {
+        perror("scan destination");
+        rc = CMD_BROKEN;
     }
-    printf("Pushed world '%s'\n", base_name);
-    close(sock);
-    return 0;
+    manifest_free(&held);
+    return rc;
 }
 
-static int cmd_pull(const mc_config_t *config, const char *world_name, const char *destination_dir) {
-    if (sanitize_name(world_name) < 0) {
-        fprintf(stderr, "Invalid world name: %s\n", world_name);
-        return -1;
+static int finish_pull(mc_conn_t *conn, unsigned long request_id, const char *world_name, const char *destination_dir) {
+    proto_msg_t msg;
+    int rc = read_reply(conn, request_id, &msg, PROTO_FOUND);
+    if (rc != CMD_OK) {
+        return rc;
+    }
+    conn_stats_begin(conn);
+    if (receive_world_entries(conn, destination_dir, destination_dir, 0) < 0) {
+        fprintf(stderr, "Failed to receive world data\n");
+        return CMD_BROKEN;
     }
-    if (ensure_directory(destination_dir, 0755) < 0) {
-        perror("destination");
-        return -1;
+    rc = read_reply(conn, request_id, &msg, PROTO_DONE);
+    if (rc != CMD_OK) {
+        return rc;
+    }
+    char summary[256];
+    conn_stats_format(conn, &conn->received, summary, sizeof(summary));
+    if (conn->caps & PROTO_CAP_INCREMENTAL_PULL) {
+        printf("Pulled world '%s' into %s (%s, %llu removed)\n", world_name, destination_dir, summary, conn->received.deleted);
+    } else {
+        printf("Pulled world '%s' into %s (%s)\n", world_name, destination_dir, summary);
     }
-    size_t name_len = strlen(world_name);
-    int sock = connect_to_remote(config);
-    if (sock < 0) {
+    if (conn->caps & PROTO_CAP_INCREMENTAL_PULL) {
+        /* only the files just received are read, so the next pull starts from an up to date index */
+        refresh_index(destination_dir);
+    }
+    return CMD_OK;
+}
+
+static int cmd_list(const mc_config_t *config, const char *prefix) {
+    mc_conn_t conn;
+    if (open_connection(config, &conn) < 0) {
         perror("connect");
         return -1;
     }
-    if (send_fmt(sock, "PULL %zu\n", name_len) < 0) {
-        perror("send");
-        close(sock);
+    int rc = run_list(&conn, 0, prefix);
+    close_connection(&conn);
+    return rc == CMD_OK ? 0 : -1;
+}
+
+static int cmd_log(const mc_config_t *config, const char *world_name) {
+    mc_conn_t conn;
+    if (open_connection(config, &conn) < 0) {
+        perror("connect");
         return -1;
     }
-    if (send_all(sock, world_name, name_len) < 0) {
-        perror("send");
-        close(sock);
+    int rc = run_log(&conn, 0, world_name);
+    close_connection(&conn);
+    return rc == CMD_OK ? 0 : -1;
+}
+
+static int cmd_clone(const mc_config_t *config, const char *source, const char *target) {
+    mc_conn_t conn;
+    if (open_connection(config, &conn) < 0) {
+        perror("connect");
         return -1;
     }
-    char line[MCSYNC_MAX_LINE];
-    if (recv_line(sock, line, sizeof(line)) < 0) {
-        perror("recv");
-        close(sock);
+    int rc = run_clone(&conn, 0, source, target);
+    close_connection(&conn);
+    return rc == CMD_OK ? 0 : -1;
+}
+
+static int cmd_push(const mc_config_t *config, const char *world_dir, const char *world_name_override) {
+    mc_conn_t conn;
+    if (open_connection(config, &conn) < 0) {
+        perror("connect");
         return -1;
     }
-    if (strncmp(line, "ERR ", 4) == 0) {
-        fprintf(stderr, "Server error: %s\n", line + 4);
-        close(sock);
+    int rc = run_push(&conn, 0, world_dir, world_name_override);
+    close_connection(&conn);
+    return rc == CMD_OK ? 0 : -1;
+}
+
+static int cmd_pull(const mc_config_t *config, const char *world_name, const char *destination_dir) {
+    if (prepare_pull(world_name, destination_dir) != CMD_OK) {
         return -1;
     }
-    if (strcmp(line, "FOUND") != 0) {
-        fprintf(stderr, "Unexpected response: %s\n", line);
-        close(sock);
+    mc_conn_t conn;
+    if (open_connection(config, &conn) < 0) {
+        perror("connect");
         return -1;
     }
-    if (receive_world_entries(sock, destination_dir) < 0) {
-        fprintf(stderr, "Failed to receive world data\n");
-        close(sock);
-        return -1;
+    int rc = start_pull(&conn, 0, world_name, destination_dir);
+    if (rc == CMD_OK) {
+        rc = finish_pull(&conn, 0, world_name, destination_dir);
     }
-    if (wait_for_done_or_error(sock) < 0) {
-        close(sock);
+    close_connection(&conn);
+    return rc == CMD_OK ? 0 : -1;
+}
+
+typedef struct {
+    unsigned long request_id;
+    char world_name[PATH_MAX];
+    char destination_dir[PATH_MAX];
+} pending_pull_t;
+
+static int stdin_has_more(void) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* a pull into a directory with anything in it sends its manifest and signatures with the request */
+static int holds_entries(const char *dir) {
+    DIR *listing = opendir(dir);
+    if (!listing) {
+        return 0;
+    }
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(listing)) != NULL) {
+        found = strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+    }
+    closedir(listing);
+    return found;
+}
+
+static int drain_pulls(mc_conn_t *conn, pending_pull_t *queue, size_t *queued, int *failures) {
+    for (size_t i = 0; i < *queued; ++i) {
+        int rc = finish_pull(conn, queue[i].request_id, queue[i].world_name, queue[i].destination_dir);
+        if (rc == CMD_BROKEN) {
+            *queued = 0;
+            return CMD_BROKEN;
+        }
+        if (rc != CMD_OK) {
+            ++*failures;
+        }
+    }
+    *queued = 0;
+    return CMD_OK;
+}
+
+/*
+ * Reads commands from stdin and runs them over one connection. Consecutive
+ * pulls are sent back to back and their replies read afterwards. A pull
+ * that sends a manifest or signatures waits for the replies before it:
+ * writing that much while the server streams them could fill both socket
+ * buffers, leaving each side blocked on the other.
+ */
+static int cmd_session(const mc_config_t *config) {
+    mc_conn_t conn;
+    if (open_connection(config, &conn) < 0) {
+        perror("connect");
         return -1;
     }
-    printf("Pulled world '%s' into %s\n", world_name, destination_dir);
-    close(sock);
-    return 0;
+    /* unbuffered so poll() on stdin tells whether another command is already waiting */
+    setvbuf(stdin, NULL, _IONBF, 0);
+    pending_pull_t *queue = calloc(PIPELINE_DEPTH, sizeof(*queue));
+    if (!queue) {
+        close_connection(&conn);
+        return -1;
+    }
+    size_t queued = 0;
+    unsigned long next_id = 1;
+    int failures = 0;
+    int rc = CMD_OK;
+    char input[2 * PATH_MAX + 64];
+    while (rc != CMD_BROKEN && fgets(input, sizeof(input), stdin)) {
+        char *args[4];
+        int argc = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(input, " \t\r\n", &save); tok && argc < 4; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            args[argc++] = tok;
+        }
+        if (argc == 0 || args[0][0] == '#') {
+            continue;
+        }
+        if (strcmp(args[0], "pull") == 0 && argc == 3) {
+            if (prepare_pull(args[1], args[2]) != CMD_OK) {
+                ++failures;
+                continue;
+            }
+            if (queued > 0 && holds_entries(args[2]) && (rc = drain_pulls(&conn, queue, &queued, &failures)) != CMD_OK) {
+                break;
+            }
+            pending_pull_t *slot = &queue[queued];
+            slot->request_id = next_id++;
+            snprintf(slot->world_name, sizeof(slot->world_name), "%s", args[1]);
+            snprintf(slot->destination_dir, sizeof(slot->destination_dir), "%s", args[2]);
+            rc = start_pull(&conn, slot->request_id, slot->world_name, slot->destination_dir);
+            if (rc == CMD_REFUSED) {
+                ++failures;
+                rc = CMD_OK;
+                continue;
+            }
+            if (rc != CMD_OK) {
+                break;
+            }
+            ++queued;
+            if (queued == PIPELINE_DEPTH || !stdin_has_more()) {
+                rc = drain_pulls(&conn, queue, &queued, &failures);
+            }
+            continue;
+        }
+        rc = drain_pulls(&conn, queue, &queued, &failures);
+        if (rc != CMD_OK) {
+            break;
+        }
+        if (strcmp(args[0], "quit") == 0 && argc == 1) {
+            break;
+        }
+        if (strcmp(args[0], "list") == 0 && (argc == 1 || argc == 2)) {
+            rc = run_list(&conn, next_id++, argc == 2 ? args[1] : NULL);
+        } else if (strcmp(args[0], "log") == 0 && argc == 2) {
+            rc = run_log(&conn, next_id++, args[1]);
+        } else if (strcmp(args[0], "clone") == 0 && argc == 3) {
+            rc = run_clone(&conn, next_id++, args[1], args[2]);
+        } else if (strcmp(args[0], "push") == 0 && (argc == 2 || argc == 3)) {
+            rc = run_push(&conn, next_id++, args[1], argc == 3 ? args[2] : NULL);
+        } else {
+            fprintf(stderr, "Unknown session command: %s\n", args[0]);
+            rc = CMD_REFUSED;
+        }
+        if (rc == CMD_REFUSED) {
+            ++failures;
+        }
+    }
+    if (rc != CMD_BROKEN) {
+        rc = drain_pulls(&conn, queue, &queued, &failures);
+    }
+    if (rc != CMD_BROKEN) {
+        proto_send_request(&conn, PROTO_QUIT, 0, 0, NULL);
+    }
+    free(queue);
+    close_connection(&conn);
+    return rc == CMD_BROKEN || failures > 0 ? -1 : 0;
 }
 
 int main(int argc, char **argv) {
@@ -372,6 +864,16 @@ int main(int argc, char **argv) {
         }
         return EXIT_SUCCESS;
     }
+    if (strcmp(command, "hash") == 0) {
+        if (argc != 3) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (cmd_hash(argv[2]) < 0) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
     char config_path[PATH_MAX];
     mc_config_t config;
     if (find_config_path(config_path, sizeof(config_path)) < 0) {
@@ -383,11 +885,41 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
     if (strcmp(command, "list") == 0) {
+        if (argc != 2 && argc != 3) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (cmd_list(&config, argc == 3 ? argv[2] : NULL) < 0) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(command, "log") == 0) {
+        if (argc != 3) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (cmd_log(&config, argv[2]) < 0) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(command, "clone") == 0) {
+        if (argc != 4) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (cmd_clone(&config, argv[2], argv[3]) < 0) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(command, "session") == 0) {
         if (argc != 2) {
             print_usage(argv[0]);
             return EXIT_FAILURE;
         }
-        if (cmd_list(&config) < 0) {
+        if (cmd_session(&config) < 0) {
             return EXIT_FAILURE;
         }
         return EXIT_SUCCESS;
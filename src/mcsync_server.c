@@ -1,9 +1,15 @@
 #include "platform.h"
+#include "chunk_sync.h"
 #include "common.h"
+#include "durable.h"
 #include "fs_utils.h"
+#include "pack.h"
+#include "protocol.h"
+#include "server_engine.h"
+#include "tree_sync.h"
+#include "world_store.h"
 
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <errno.h>
 #include <limits.h>
 #include <netinet/in.h>
@@ -14,6 +20,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 static volatile sig_atomic_t keep_running = 1;
@@ -31,219 +38,678 @@ static int join_paths(const char *a, const char *b, char *out, size_t out_len) {
     return 0;
 }
 
-static int send_error(int sock, const char *message) {
-    return send_fmt(sock, "ERR %s\n", message);
+typedef struct {
+    const char *storage_dir;
+    /* how new pushes are stored; either kind of version can be pulled */
+    enum world_format format;
+    world_store_t store;
+} server_ctx_t;
+
+/* handlers return 0 while the connection is still in sync and -1 when it must be closed */
+static int send_error(mc_conn_t *conn, const char *message) {
+    return proto_send_error(conn, message);
 }
 
-static int handle_push(int client_fd, const char *storage_dir, const char *line) {
-    unsigned long name_len;
-    if (sscanf(line, "PUSH %lu", &name_len) != 1) {
-        return send_error(client_fd, "InvalidCommand");
-    }
-    if (name_len == 0 || name_len >= PATH_MAX) {
-        return send_error(client_fd, "InvalidName");
-    }
-    char *world_name = malloc(name_len + 1);
-    if (!world_name) {
-        return send_error(client_fd, "OutOfMemory");
-    }
-    if (recv_all(client_fd, world_name, name_len) < 0) {
-        free(world_name);
+/* saves a manifest to a fresh temporary file next to the worlds */
+static int save_temp_manifest(server_ctx_t *ctx, const char *world_name, const manifest_t *manifest, char *tmp_path, size_t tmp_len) {
+    if (snprintf(tmp_path, tmp_len, "%s/.%s.tmpXXXXXX", ctx->storage_dir, world_name) >= (int)tmp_len) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    world_name[name_len] = '\0';
-    if (sanitize_name(world_name) < 0) {
-        send_error(client_fd, "InvalidName");
-        free(world_name);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
         return -1;
     }
-    if (send_fmt(client_fd, "OK\n") < 0) {
-        free(world_name);
+    close(fd);
+    if (manifest_save(manifest, tmp_path) < 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
         return -1;
     }
-    char tmp_template[PATH_MAX];
-    if (snprintf(tmp_template, sizeof(tmp_template), "%s/.%s.tmpXXXXXX", storage_dir, world_name) >= (int)sizeof(tmp_template)) {
-        send_error(client_fd, "ServerError");
-        free(world_name);
+    return 0;
+}
+
+/* publishes a pinned manifest; the pins pass to the new version unless this returns -1, as world_store_publish does */
+static int publish_manifest(server_ctx_t *ctx, const char *world_name, const manifest_t *manifest) {
+    char tmp_path[PATH_MAX];
+    if (save_temp_manifest(ctx, world_name, manifest, tmp_path, sizeof(tmp_path)) < 0) {
         return -1;
     }
-    if (ensure_directory(storage_dir, 0755) < 0) {
-        send_error(client_fd, "ServerError");
-        free(world_name);
+    int rc = world_store_publish(&ctx->store, world_name, tmp_path, WORLD_FORMAT_CHUNKS, NULL, manifest);
+    if (rc < 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+    }
+    return rc;
+}
+
+/* the version a push is compared with; a pack's is opened so its files can be read */
+static int load_base(server_ctx_t *ctx, const world_version_t *version, manifest_t *manifest, pack_t *pack, tree_base_t *base) {
+    if (world_store_load_manifest(&ctx->store, version, manifest) < 0) {
         return -1;
     }
-    char *tmp_dir = mkdtemp(tmp_template);
-    if (!tmp_dir) {
-        send_error(client_fd, "ServerError");
-        free(world_name);
+    if (version->format == WORLD_FORMAT_PACK && pack_open(pack, version->path) < 0) {
+        int saved = errno;
+        manifest_free(manifest);
+        errno = saved;
         return -1;
     }
-    if (receive_world_entries(client_fd, tmp_dir) < 0) {
-        send_error(client_fd, "ReceiveFailed");
-        remove_recursive(tmp_dir);
-        free(world_name);
+    base->manifest = manifest;
+    base->format = version->format;
+    base->path = version->path;
+    base->pack = version->format == WORLD_FORMAT_PACK ? pack : NULL;
+    return 0;
+}
+
+/* unchanged files come from the current version; only the rest cross the wire */
+static int receive_incremental(mc_conn_t *conn, server_ctx_t *ctx, const char *world_name, const char *tmp_dir,
+                               manifest_t *manifest, size_t *sent_files) {
+    world_version_t *version = world_store_acquire(&ctx->store, world_name, 0);
+    manifest_t base_manifest;
+    manifest_init(&base_manifest);
+    pack_t pack;
+    tree_base_t base;
+    int has_base = 0;
+    if (version && version->format != WORLD_FORMAT_CHUNKS) {
+        has_base = load_base(ctx, version, &base_manifest, &pack, &base) == 0;
+        if (!has_base) {
+            fprintf(stderr, "cannot index world %s, receiving it whole: %s\n", world_name, strerror(errno));
+        }
+    }
+    int rc = tree_sync_receive(conn, has_base ? &base : NULL, tmp_dir, ctx->format, manifest, sent_files);
+    if (has_base && base.pack) {
+        pack_close(&pack);
+    }
+    manifest_free(&base_manifest);
+    world_store_release(&ctx->store, version);
+    return rc;
+}
+
+/* a whole push is indexed here instead, and shares what it has in common with the current version */
+static int share_unchanged(server_ctx_t *ctx, const char *world_name, const char *tmp_dir, manifest_t *manifest) {
+    if (manifest_scan_dir(manifest, tmp_dir, NULL, NULL) < 0) {
         return -1;
     }
-    char world_path[PATH_MAX];
-    if (join_paths(storage_dir, world_name, world_path, sizeof(world_path)) < 0) {
-        send_error(client_fd, "ServerError");
-        remove_recursive(tmp_dir);
-        free(world_name);
+    world_version_t *version = world_store_acquire(&ctx->store, world_name, 0);
+    manifest_t base_manifest;
+    manifest_init(&base_manifest);
+    pack_t pack;
+    tree_base_t base;
+    int has_base = version && version->format != WORLD_FORMAT_CHUNKS && version->format != WORLD_FORMAT_PACK &&
+                   load_base(ctx, version, &base_manifest, &pack, &base) == 0;
+    int rc = tree_sync_share(has_base ? &base : NULL, tmp_dir, ctx->format, manifest);
+    manifest_free(&base_manifest);
+    world_store_release(&ctx->store, version);
+    return rc;
+}
+
+/*
+ * Writes tree_dir, as manifest describes it, into a pack that becomes the
+ * world's new version. Files the current version's pack already holds are
+ * copied from it, so tree_dir need not have them.
+ */
+static int publish_pack(server_ctx_t *ctx, const char *world_name, const char *tree_dir, const manifest_t *manifest) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.tmpXXXXXX", ctx->storage_dir, world_name) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    if (remove_recursive(world_path) < 0) {
-        send_error(client_fd, "ServerError");
-        remove_recursive(tmp_dir);
-        free(world_name);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
         return -1;
     }
-    if (rename(tmp_dir, world_path) < 0) {
-        send_error(client_fd, "ServerError");
-        remove_recursive(tmp_dir);
-        free(world_name);
+    world_version_t *version = world_store_acquire(&ctx->store, world_name, 0);
+    pack_t base;
+    int has_base = version && version->format == WORLD_FORMAT_PACK && pack_open(&base, version->path) == 0;
+    int rc = pack_write(fd, manifest, tree_dir, has_base ? &base : NULL);
+    if (has_base) {
+        pack_close(&base);
+    }
+    world_store_release(&ctx->store, version);
+    if (rc == 0) {
+        rc = fchmod(fd, 0644);
+    }
+    durable_written(fd);
+    if (close(fd) < 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = world_store_publish(&ctx->store, world_name, tmp_path, WORLD_FORMAT_PACK, NULL, manifest);
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+    }
+    return rc;
+}
+
+static int handle_chunked_push(mc_conn_t *conn, server_ctx_t *ctx, const char *world_name) {
+    manifest_t manifest;
+    size_t new_chunks;
+    conn_stats_begin(conn);
+    if (chunk_sync_receive(conn, &ctx->store.chunks, &manifest, &new_chunks) < 0) {
+        send_error(conn, "ReceiveFailed");
         return -1;
     }
-    if (send_fmt(client_fd, "DONE\n") < 0) {
-        free(world_name);
+    int rc = publish_manifest(ctx, world_name, &manifest);
+    if (rc != 0) {
+        if (rc < 0) {
+            chunk_store_unref_manifest(&ctx->store.chunks, &manifest, manifest.chunk_count);
+        }
+        manifest_free(&manifest);
+        return send_error(conn, "ServerError");
+    }
+    size_t chunk_count = manifest.chunk_count;
+    manifest_free(&manifest);
+    if (proto_send_status(conn, PROTO_DONE) < 0) {
         return -1;
     }
-    free(world_name);
+    char summary[256];
+    conn_stats_format(conn, &conn->received, summary, sizeof(summary));
+    printf("push %s: %s, %zu of %zu chunks new\n", world_name, summary, new_chunks, chunk_count);
     return 0;
 }
 
-static int handle_pull(int client_fd, const char *storage_dir, const char *line) {
-    unsigned long name_len;
-    if (sscanf(line, "PULL %lu", &name_len) != 1) {
-        return send_error(client_fd, "InvalidCommand");
+static int handle_push(mc_conn_t *conn, server_ctx_t *ctx, const proto_msg_t *request) {
+    const char *storage_dir = ctx->storage_dir;
+    const char *world_name = request->text;
+    if (request->text_len == 0 || sanitize_name(world_name) < 0) {
+        return send_error(conn, "InvalidName");
     }
-    if (name_len == 0 || name_len >= PATH_MAX) {
-        return send_error(client_fd, "InvalidName");
+    if (proto_send_status(conn, PROTO_OK) < 0) {
+        return -1;
     }
-    char *world_name = malloc(name_len + 1);
-    if (!world_name) {
-        return send_error(client_fd, "OutOfMemory");
+    if ((request->flags & PROTO_FLAG_CHUNKED) && (conn->caps & PROTO_CAP_CHUNKS)) {
+        return handle_chunked_push(conn, ctx, world_name);
     }
-    if (recv_all(client_fd, world_name, name_len) < 0) {
-        free(world_name);
+    char tmp_template[PATH_MAX];
+    if (snprintf(tmp_template, sizeof(tmp_template), "%s/.%s.tmpXXXXXX", storage_dir, world_name) >= (int)sizeof(tmp_template)) {
+        send_error(conn, "ServerError");
         return -1;
     }
-    world_name[name_len] = '\0';
-    if (sanitize_name(world_name) < 0) {
-        send_error(client_fd, "InvalidName");
-        free(world_name);
+    if (ensure_directory(storage_dir, 0755) < 0) {
+        send_error(conn, "ServerError");
         return -1;
     }
-    char world_path[PATH_MAX];
-    if (join_paths(storage_dir, world_name, world_path, sizeof(world_path)) < 0) {
-        send_error(client_fd, "ServerError");
-        free(world_name);
+    char *tmp_dir = mkdtemp(tmp_template);
+    if (!tmp_dir) {
+        send_error(conn, "ServerError");
         return -1;
     }
-    struct stat st;
-    if (stat(world_path, &st) < 0 || !S_ISDIR(st.st_mode)) {
-        send_error(client_fd, "NotFound");
-        free(world_name);
+    conn_stats_begin(conn);
+    int incremental = (request->flags & PROTO_FLAG_INCREMENTAL) && (conn->caps & PROTO_CAP_INCREMENTAL);
+    manifest_t manifest;
+    manifest_init(&manifest);
+    size_t sent_files = 0;
+    if ((incremental ? receive_incremental(conn, ctx, world_name, tmp_dir, &manifest, &sent_files)
+                     : receive_world_entries(conn, tmp_dir, NULL, 0)) < 0) {
+        send_error(conn, "ReceiveFailed");
+        world_store_discard(&ctx->store, tmp_dir);
         return -1;
     }
-    if (send_fmt(client_fd, "FOUND\n") < 0) {
-        free(world_name);
-        return -1;
+    int rc;
+    if (ctx->format == WORLD_FORMAT_CHUNKS) {
+        /* peers without chunk support still get their data deduplicated, at the server's expense */
+        manifest_free(&manifest);
+        rc = chunk_sync_import_tree(&ctx->store.chunks, tmp_dir, &manifest);
+        world_store_discard(&ctx->store, tmp_dir);
+        if (rc == 0) {
+            rc = publish_manifest(ctx, world_name, &manifest);
+            if (rc < 0) {
+                chunk_store_unref_manifest(&ctx->store.chunks, &manifest, manifest.chunk_count);
+            }
+        }
+    } else if (ctx->format == WORLD_FORMAT_PACK) {
+        rc = incremental ? 0 : manifest_scan_dir(&manifest, tmp_dir, NULL, NULL);
+        if (rc == 0) {
+            rc = publish_pack(ctx, world_name, tmp_dir, &manifest);
+        }
+        world_store_discard(&ctx->store, tmp_dir);
+    } else {
+        rc = incremental ? 0 : share_unchanged(ctx, world_name, tmp_dir, &manifest);
+        /* the manifest is kept so the next push need not rescan this version */
+        char sidecar[PATH_MAX];
+        int has_sidecar = rc == 0 && save_temp_manifest(ctx, world_name, &manifest, sidecar, sizeof(sidecar)) == 0;
+        if (rc == 0) {
+            rc = world_store_publish(&ctx->store, world_name, tmp_dir, ctx->format, has_sidecar ? sidecar : NULL, &manifest);
+        }
+        if (rc < 0) {
+            world_store_discard(&ctx->store, tmp_dir);
+            if (has_sidecar) {
+                unlink(sidecar);
+            }
+        }
     }
-    if (send_directory_entries(client_fd, world_path, "") < 0) {
-        free(world_name);
-        return -1;
+    size_t file_count = 0;
+    for (size_t i = 0; i < manifest.entry_count; ++i) {
+        file_count += manifest.entries[i].type == MANIFEST_FILE;
     }
-    if (send_fmt(client_fd, "END\nDONE\n") < 0) {
-        free(world_name);
+    manifest_free(&manifest);
+    /* also when the version is published but not durable: the client must not count on it */
+    if (rc != 0) {
+        return send_error(conn, "ServerError");
+    }
+    if (proto_send_status(conn, PROTO_DONE) < 0) {
         return -1;
     }
-    free(world_name);
+    char summary[256];
+    conn_stats_format(conn, &conn->received, summary, sizeof(summary));
+    if (incremental) {
+        printf("push %s: %s, %zu of %zu files sent\n", world_name, summary, sent_files, file_count);
+    } else {
+        printf("push %s: %s\n", world_name, summary);
+    }
     return 0;
 }
 
-static int handle_list(int client_fd, const char *storage_dir) {
-    if (ensure_directory(storage_dir, 0755) < 0) {
-        return send_error(client_fd, "ServerError");
+/* wanted holds ascending indexes into the pack's index, or is NULL for all of it */
+static int send_pack(mc_conn_t *conn, const world_version_t *version, const uint32_t *wanted, size_t wanted_count, delta_basis_set_t *bases) {
+    pack_t pack;
+    if (pack_open(&pack, version->path) < 0) {
+        return -1;
     }
-    DIR *dir = opendir(storage_dir);
-    if (!dir) {
-        return send_error(client_fd, "ServerError");
+    int rc = pack_send_world(conn, &pack, wanted, wanted_count, bases);
+    pack_close(&pack);
+    return rc;
+}
+
+static int send_version(mc_conn_t *conn, server_ctx_t *ctx, const world_version_t *version, delta_basis_set_t *bases) {
+    if (version->format == WORLD_FORMAT_PACK) {
+        return send_pack(conn, version, NULL, 0, bases);
     }
-    struct dirent *entry;
-    size_t count = 0;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    if (version->format != WORLD_FORMAT_CHUNKS) {
+        return send_directory_entries(conn, version->path, bases, version->format == WORLD_FORMAT_COMPRESSED);
+    }
+    manifest_t manifest;
+    if (manifest_load(&manifest, version->path) < 0) {
+        return -1;
+    }
+    int rc = chunk_sync_send_world(conn, &ctx->store.chunks, &manifest, NULL, 0, bases);
+    manifest_free(&manifest);
+    return rc;
+}
+
+/*
+ * Sends only what turns the client's tree, as held describes it, into the
+ * version: deletions first, deepest paths first, then the new and changed
+ * entries in walk order.
+ */
+static int send_version_changes(mc_conn_t *conn, server_ctx_t *ctx, const world_version_t *version, const manifest_t *held,
+                                delta_basis_set_t *bases) {
+    manifest_t manifest;
+    manifest_init(&manifest);
+    if (world_store_load_manifest(&ctx->store, version, &manifest) < 0) {
+        /* without an index the whole version goes out, as for a plain pull */
+        fprintf(stderr, "cannot index world %s, sending it whole: %s\n", version->world->name, strerror(errno));
+        return send_version(conn, ctx, version, bases);
+    }
+    uint32_t *changed = NULL;
+    uint32_t *removed = NULL;
+    size_t changed_count;
+    size_t removed_count;
+    int rc = manifest_diff(held, &manifest, &changed, &changed_count, &removed, &removed_count);
+    for (size_t i = removed_count; rc == 0 && i > 0; --i) {
+        const manifest_entry_t *entry = &held->entries[removed[i - 1]];
+        rc = proto_send_entry_delete(conn, entry->path, strlen(entry->path));
+    }
+    if (rc == 0 && version->format == WORLD_FORMAT_PACK) {
+        /* a pack's manifest lists its index in order, so the indexes carry over */
+        rc = send_pack(conn, version, changed, changed_count, bases);
+    } else if (rc == 0 && version->format != WORLD_FORMAT_CHUNKS) {
+        rc = send_wanted_files(conn, version->path, version->format == WORLD_FORMAT_COMPRESSED, &manifest, changed, changed_count, bases);
+    } else if (rc == 0) {
+        rc = chunk_sync_send_world(conn, &ctx->store.chunks, &manifest, changed, changed_count, bases);
+    }
+    free(changed);
+    free(removed);
+    manifest_free(&manifest);
+    return rc;
+}
+
+static int handle_pull(mc_conn_t *conn, server_ctx_t *ctx, const proto_msg_t *request) {
+    const char *world_name = request->text;
+    char name[PATH_MAX];
+    unsigned long seq = 0;
+    /* what the client holds and its signatures follow the request whatever the answer is */
+    int incremental = (request->flags & PROTO_FLAG_INCREMENTAL) && (conn->caps & PROTO_CAP_INCREMENTAL_PULL);
+    manifest_t held;
+    manifest_init(&held);
+    delta_basis_set_t bases;
+    delta_basis_set_init(&bases);
+    if ((incremental && proto_recv_digests(conn, &held) < 0) ||
+        ((request->flags & PROTO_FLAG_DELTA) && (conn->caps & PROTO_CAP_DELTA) && proto_recv_signatures(conn, &bases) < 0)) {
+        manifest_free(&held);
+        delta_basis_set_free(&bases);
+        return -1;
+    }
+    int rc = -1;
+    world_version_t *version = NULL;
+    if (request->text_len == 0 || parse_world_ref(world_name, name, sizeof(name), &seq) < 0) {
+        rc = send_error(conn, "InvalidName");
+    } else if (!(version = world_store_acquire(&ctx->store, name, seq))) {
+        rc = send_error(conn, "NotFound");
+    } else {
+        conn_stats_begin(conn);
+        if (proto_send_status(conn, PROTO_FOUND) == 0 &&
+            (incremental ? send_version_changes(conn, ctx, version, &held, &bases) : send_version(conn, ctx, version, &bases)) == 0 &&
+            proto_send_end(conn) == 0 &&
+            proto_send_status(conn, PROTO_DONE) == 0) {
+            rc = 0;
+            char summary[256];
+            conn_stats_format(conn, &conn->sent, summary, sizeof(summary));
+            printf("pull %s: %s\n", world_name, summary);
         }
-        char full_path[PATH_MAX];
-        if (join_paths(storage_dir, entry->d_name, full_path, sizeof(full_path)) < 0) {
-            closedir(dir);
-            return send_error(client_fd, "ServerError");
+        world_store_release(&ctx->store, version);
+    }
+    manifest_free(&held);
+    delta_basis_set_free(&bases);
+    return rc;
+}
+
+static const char *format_name(enum world_format format) {
+    switch (format) {
+    case WORLD_FORMAT_CHUNKS:
+        return "chunks";
+    case WORLD_FORMAT_COMPRESSED:
+        return "lz4";
+    case WORLD_FORMAT_PACK:
+        return "pack";
+    default:
+        return "tree";
+    }
+}
+
+static int send_history(mc_conn_t *conn, server_ctx_t *ctx, world_version_t **versions, size_t count) {
+    if (proto_send_count(conn, count) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        manifest_t manifest;
+        manifest_init(&manifest);
+        unsigned long long bytes = 0;
+        uint32_t files = 0;
+        /* a version that cannot be indexed is still listed, without its size */
+        if (world_store_load_manifest(&ctx->store, versions[i], &manifest) == 0) {
+            for (size_t j = 0; j < manifest.entry_count; ++j) {
+                if (manifest.entries[j].type == MANIFEST_FILE) {
+                    bytes += manifest.entries[j].size;
+                    ++files;
+                }
+            }
+            manifest_free(&manifest);
         }
-        struct stat st;
-        if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-            ++count;
+        if (proto_send_version(conn, versions[i]->seq, (int64_t)versions[i]->created, bytes, files,
+                               format_name(versions[i]->format)) < 0) {
+            return -1;
         }
     }
-    rewinddir(dir);
-    if (send_fmt(client_fd, "COUNT %zu\n", count) < 0) {
-        closedir(dir);
+    return proto_send_status(conn, PROTO_DONE);
+}
+
+static int handle_log(mc_conn_t *conn, server_ctx_t *ctx, const proto_msg_t *request) {
+    const char *world_name = request->text;
+    if (request->text_len == 0 || sanitize_name(world_name) < 0) {
+        return send_error(conn, "InvalidName");
+    }
+    world_version_t **versions;
+    size_t count;
+    if (world_store_history(&ctx->store, world_name, &versions, &count) < 0) {
+        return send_error(conn, errno == ENOENT ? "NotFound" : "ServerError");
+    }
+    int rc = send_history(conn, ctx, versions, count);
+    for (size_t i = 0; i < count; ++i) {
+        world_store_release(&ctx->store, versions[i]);
+    }
+    free(versions);
+    return rc;
+}
+
+/* a pack never changes either, so the clone is one more link to the same file */
+static int clone_pack(server_ctx_t *ctx, const world_version_t *version, const char *target_name, const manifest_t *manifest) {
+    char tmp_template[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_template, sizeof(tmp_template), "%s/.%s.tmpXXXXXX", ctx->storage_dir, target_name) >= (int)sizeof(tmp_template)) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    char *tmp_dir = mkdtemp(tmp_template);
+    if (!tmp_dir) {
+        return -1;
+    }
+    int rc = join_paths(tmp_dir, "pack", tmp_path, sizeof(tmp_path));
+    if (rc == 0) {
+        rc = link_or_copy(version->path, tmp_path);
+    }
+    if (rc == 0) {
+        rc = world_store_publish(&ctx->store, target_name, tmp_path, WORLD_FORMAT_PACK, NULL, manifest);
+    }
+    int saved = errno;
+    world_store_discard(&ctx->store, tmp_dir);
+    errno = saved;
+    return rc;
+}
+
+/* a tree version is copied by linking its files into a new one, a chunks version by pinning its chunks again */
+static int clone_version(server_ctx_t *ctx, const world_version_t *version, const char *target_name, manifest_t *manifest) {
+    if (version->format == WORLD_FORMAT_PACK) {
+        return clone_pack(ctx, version, target_name, manifest);
+    }
+    if (version->format == WORLD_FORMAT_CHUNKS) {
+        if (chunk_store_ref_manifest(&ctx->store.chunks, manifest) < 0) {
+            return -1;
         }
-        char full_path[PATH_MAX];
-        if (join_paths(storage_dir, entry->d_name, full_path, sizeof(full_path)) < 0) {
-            closedir(dir);
-            return send_error(client_fd, "ServerError");
+        int rc = publish_manifest(ctx, target_name, manifest);
+        if (rc < 0) {
+            chunk_store_unref_manifest(&ctx->store.chunks, manifest, manifest->chunk_count);
         }
-        struct stat st;
-        if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-            size_t name_len = strnlen(entry->d_name, PATH_MAX);
-            if (send_fmt(client_fd, "WORLD %zu\n", name_len) < 0) {
-                closedir(dir);
-                return -1;
-            }
-            if (send_all(client_fd, entry->d_name, name_len) < 0) {
-                closedir(dir);
-                return -1;
-            }
+        return rc;
+    }
+    char tmp_template[PATH_MAX];
+    if (snprintf(tmp_template, sizeof(tmp_template), "%s/.%s.tmpXXXXXX", ctx->storage_dir, target_name) >= (int)sizeof(tmp_template)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    char *tmp_dir = mkdtemp(tmp_template);
+    if (!tmp_dir) {
+        return -1;
+    }
+    char sidecar[PATH_MAX];
+    int has_sidecar = 0;
+    int rc = tree_sync_clone(version->path, manifest, tmp_dir);
+    if (rc == 0) {
+        has_sidecar = save_temp_manifest(ctx, target_name, manifest, sidecar, sizeof(sidecar)) == 0;
+        rc = world_store_publish(&ctx->store, target_name, tmp_dir, version->format, has_sidecar ? sidecar : NULL, manifest);
+    }
+    if (rc < 0) {
+        int saved = errno;
+        world_store_discard(&ctx->store, tmp_dir);
+        if (has_sidecar) {
+            unlink(sidecar);
         }
+        errno = saved;
     }
-    closedir(dir);
-    if (send_fmt(client_fd, "DONE\n") < 0) {
+    return rc;
+}
+
+static int handle_clone(mc_conn_t *conn, server_ctx_t *ctx, const proto_msg_t *request) {
+    char source_ref[PATH_MAX];
+    char source_name[PATH_MAX];
+    unsigned long seq;
+    const char *space = strchr(request->text, ' ');
+    const char *target_name = space ? space + 1 : "";
+    if (!space || (size_t)(space - request->text) >= sizeof(source_ref)) {
+        return send_error(conn, "InvalidName");
+    }
+    memcpy(source_ref, request->text, (size_t)(space - request->text));
+    source_ref[space - request->text] = '\0';
+    if (parse_world_ref(source_ref, source_name, sizeof(source_name), &seq) < 0 || sanitize_name(target_name) < 0) {
+        return send_error(conn, "InvalidName");
+    }
+    world_version_t *version = world_store_acquire(&ctx->store, source_name, seq);
+    if (!version) {
+        return send_error(conn, "NotFound");
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    manifest_t manifest;
+    manifest_init(&manifest);
+    int rc = world_store_load_manifest(&ctx->store, version, &manifest);
+    if (rc == 0) {
+        rc = clone_version(ctx, version, target_name, &manifest);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "cannot clone world %s to %s: %s\n", source_ref, target_name, strerror(errno));
+    }
+    world_store_release(&ctx->store, version);
+    size_t file_count = 0;
+    for (size_t i = 0; i < manifest.entry_count; ++i) {
+        file_count += manifest.entries[i].type == MANIFEST_FILE;
+    }
+    manifest_free(&manifest);
+    if (rc != 0) {
+        return send_error(conn, "ServerError");
+    }
+    if (proto_send_count(conn, file_count) < 0 || proto_send_status(conn, PROTO_DONE) < 0) {
         return -1;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("clone %s to %s: %zu files in %.1f ms\n", source_ref, target_name, file_count,
+           (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
     return 0;
 }
 
-static void handle_client(int client_fd, const char *storage_dir) {
-    char line[MCSYNC_MAX_LINE];
-    if (recv_line(client_fd, line, sizeof(line)) < 0) {
-        return;
-    }
-    if (strncmp(line, "PUSH ", 5) == 0) {
-        handle_push(client_fd, storage_dir, line);
-    } else if (strncmp(line, "PULL ", 5) == 0) {
-        handle_pull(client_fd, storage_dir, line);
-    } else if (strcmp(line, "LIST") == 0) {
-        handle_list(client_fd, storage_dir);
-    } else {
-        send_error(client_fd, "UnknownCommand");
+/* answered from the store's catalog; a v1 request names no prefix and lists every world */
+static int handle_list(mc_conn_t *conn, server_ctx_t *ctx, const proto_msg_t *request) {
+    world_info_t *worlds;
+    size_t count;
+    if (world_store_list(&ctx->store, request->text_len > 0 ? request->text : NULL, &worlds, &count) < 0) {
+        return send_error(conn, "ServerError");
+    }
+    int rc = proto_send_count(conn, count);
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        const world_info_t *world = &worlds[i];
+        rc = conn->caps & PROTO_CAP_CATALOG
+                 ? proto_send_world_info(conn, world->name, world->seq, (int64_t)world->pushed, world->bytes, (uint32_t)world->files)
+                 : proto_send_world(conn, world->name, strlen(world->name));
+    }
+    free(worlds);
+    if (rc < 0 || proto_send_status(conn, PROTO_DONE) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int handle_client(mc_conn_t *conn, const proto_msg_t *request, void *arg) {
+    server_ctx_t *ctx = arg;
+    if (request->type == PROTO_HELLO) {
+        /* a chunk store already skips unchanged data, so incremental pushes are for trees only */
+        unsigned int caps = ctx->format == WORLD_FORMAT_CHUNKS ? PROTO_CAPS_SUPPORTED & ~PROTO_CAP_INCREMENTAL
+                                                               : PROTO_CAPS_SUPPORTED & ~PROTO_CAP_CHUNKS;
+        return proto_server_hello(conn, request, caps);
+    }
+    /* a tagged request lets a pipelining client match the reply */
+    if (proto_begin_reply(conn, request->request_id) < 0) {
+        return -1;
+    }
+    switch (request->type) {
+    case PROTO_PUSH:
+        return handle_push(conn, ctx, request);
+    case PROTO_PULL:
+        return handle_pull(conn, ctx, request);
+    case PROTO_LIST:
+        return handle_list(conn, ctx, request);
+    case PROTO_LOG:
+        return handle_log(conn, ctx, request);
+    case PROTO_CLONE:
+        return handle_clone(conn, ctx, request);
+    case PROTO_QUIT:
+        return -1;
+    default:
+        send_error(conn, "UnknownCommand");
+        return -1;
     }
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s -d <storage_dir> [-p port]\n", prog);
+    fprintf(stderr,
+            "Usage: %s -d <storage_dir> [-p port] [-t worker_threads] [-s tree|chunks|lz4|pack]\n"
+            "          [-k last=N,hourly=N,daily=N] [-r files_per_second] [-f none|batch|strict] [-c]\n",
+            prog);
+}
+
+/* "last=5,hourly=24,daily=30"; rules left out keep their value */
+static int parse_retention(const char *spec, world_retention_t *retention) {
+    char copy[256];
+    if (snprintf(copy, sizeof(copy), "%s", spec) >= (int)sizeof(copy)) {
+        return -1;
+    }
+    char *save = NULL;
+    for (char *rule = strtok_r(copy, ",", &save); rule; rule = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(rule, '=');
+        char *end;
+        if (!equals || equals[1] < '0' || equals[1] > '9') {
+            return -1;
+        }
+        *equals = '\0';
+        unsigned long value = strtoul(equals + 1, &end, 10);
+        if (*end != '\0' || value > 1000000) {
+            return -1;
+        }
+        if (strcmp(rule, "last") == 0) {
+            retention->keep_last = (unsigned int)value;
+        } else if (strcmp(rule, "hourly") == 0) {
+            retention->keep_hourly = (unsigned int)value;
+        } else if (strcmp(rule, "daily") == 0) {
+            retention->keep_daily = (unsigned int)value;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* packs the current version of every world stored as a plain tree; the trees age out of history as usual */
+static int convert_to_packs(server_ctx_t *ctx) {
+    int failures = 0;
+    for (world_slot_t *slot = ctx->store.worlds; slot; slot = slot->next) {
+        world_version_t *version = world_store_acquire(&ctx->store, slot->name, 0);
+        if (!version || version->format != WORLD_FORMAT_TREE) {
+            world_store_release(&ctx->store, version);
+            continue;
+        }
+        manifest_t manifest;
+        manifest_init(&manifest);
+        int rc = world_store_load_manifest(&ctx->store, version, &manifest);
+        if (rc == 0) {
+            rc = publish_pack(ctx, slot->name, version->path, &manifest);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "cannot pack world %s: %s\n", slot->name, strerror(errno));
+            ++failures;
+        } else {
+            printf("packed world %s: %zu entries\n", slot->name, manifest.entry_count);
+        }
+        manifest_free(&manifest);
+        world_store_release(&ctx->store, version);
+    }
+    return failures ? -1 : 0;
 }
 
 int main(int argc, char **argv) {
     const char *storage_dir = NULL;
     int port = 25570;
+    int workers = server_engine_default_workers();
+    enum world_format format = WORLD_FORMAT_TREE;
+    world_retention_t retention = { WORLD_KEEP_LAST, WORLD_KEEP_HOURLY, WORLD_KEEP_DAILY };
+    unsigned int reap_rate = TRASH_DEFAULT_RATE;
+    enum durable_mode durability = DURABLE_BATCH;
+    int convert = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "d:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:p:t:s:k:r:f:c")) != -1) {
         switch (opt) {
         case 'd':
             storage_dir = optarg;
@@ -251,6 +717,58 @@ int main(int argc, char **argv) {
         case 'p':
             port = atoi(optarg);
             break;
+        case 't':
+            workers = atoi(optarg);
+            if (workers <= 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "tree") == 0) {
+                format = WORLD_FORMAT_TREE;
+            } else if (strcmp(optarg, "chunks") == 0) {
+                format = WORLD_FORMAT_CHUNKS;
+            } else if (strcmp(optarg, "lz4") == 0) {
+                format = WORLD_FORMAT_COMPRESSED;
+            } else if (strcmp(optarg, "pack") == 0) {
+                format = WORLD_FORMAT_PACK;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            if (parse_retention(optarg, &retention) < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r': {
+            char *end;
+            unsigned long value = strtoul(optarg, &end, 10);
+            if (*optarg < '0' || *optarg > '9' || *end != '\0' || value > 100000000) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            reap_rate = (unsigned int)value;
+            break;
+        }
+        case 'f':
+            if (strcmp(optarg, "none") == 0) {
+                durability = DURABLE_NONE;
+            } else if (strcmp(optarg, "batch") == 0) {
+                durability = DURABLE_BATCH;
+            } else if (strcmp(optarg, "strict") == 0) {
+                durability = DURABLE_STRICT;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            convert = 1;
+            break;
         default:
             usage(argv[0]);
             return EXIT_FAILURE;
@@ -260,12 +778,23 @@ int main(int argc, char **argv) {
         usage(argv[0]);
         return EXIT_FAILURE;
     }
-    if (ensure_directory(storage_dir, 0755) < 0) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    durable_set_mode(durability);
+    static server_ctx_t ctx;
+    ctx.storage_dir = storage_dir;
+    ctx.format = format;
+    if (world_store_open(&ctx.store, storage_dir, &retention, reap_rate) < 0) {
         perror("storage directory");
         return EXIT_FAILURE;
     }
+    if (convert) {
+        int rc = convert_to_packs(&ctx);
+        world_store_close(&ctx.store);
+        return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
 
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
@@ -285,27 +814,31 @@ int main(int argc, char **argv) {
         close(listen_fd);
         return EXIT_FAILURE;
     }
-    if (listen(listen_fd, 16) < 0) {
+    if (listen(listen_fd, SOMAXCONN) < 0) {
         perror("listen");
         close(listen_fd);
         return EXIT_FAILURE;
     }
-    printf("mcsync server listening on port %d, storage dir %s\n", port, storage_dir);
-    while (keep_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            perror("accept");
-            break;
-        }
-        handle_client(client_fd, storage_dir);
-        close(client_fd);
+    printf("mcsync server listening on port %d, storage dir %s (%s), %d workers, keeping last %u, hourly %u, daily %u, %s durability\n",
+           port, storage_dir, format_name(format), workers, retention.keep_last, retention.keep_hourly, retention.keep_daily,
+           durable_mode_name(durability));
+    server_engine_config_t engine_config;
+    memset(&engine_config, 0, sizeof(engine_config));
+    engine_config.listen_fd = listen_fd;
+    engine_config.worker_count = workers;
+    engine_config.on_command = handle_client;
+    engine_config.ctx = &ctx;
+    if (server_engine_run(&engine_config, &keep_running) < 0) {
+        perror("server engine");
     }
     close(listen_fd);
+    world_store_close(&ctx.store);
+    unsigned long long syncs;
+    unsigned long long sync_nanos;
+    durable_stats(&syncs, &sync_nanos);
+    if (syncs > 0) {
+        printf("%llu syncs took %.1f ms (%s durability)\n", syncs, (double)sync_nanos / 1e6, durable_mode_name(durability));
+    }
     printf("mcsync server shutting down\n");
     return EXIT_SUCCESS;
 }
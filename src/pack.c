@@ -0,0 +1,380 @@
+#include "platform.h"
+#include "pack.h"
+
+#include "common.h"
+#include "durable.h"
+#include "fs_utils.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the index starts on a page of its own so it can be mapped on its own */
+#define PACK_INDEX_ALIGN 4096
+
+static int join_paths(const char *a, const char *b, char *out, size_t out_len) {
+    if (snprintf(out, out_len, "%s/%s", a, b) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/* a pack that ends early is damaged */
+static int read_full(int fd, unsigned char *out, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(fd, out + done, length - done, offset + (off_t)done);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const unsigned char *data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int compare_entry_paths(const void *a, const void *b) {
+    const manifest_entry_t *left = *(const manifest_entry_t *const *)a;
+    const manifest_entry_t *right = *(const manifest_entry_t *const *)b;
+    return strcmp(left->path, right->path);
+}
+
+/* an unchanged file is copied from base, which the caller trusts more than anything received */
+static int write_body(int out, off_t offset, const manifest_entry_t *entry, const char *dir, const pack_t *base) {
+    pack_entry_t held;
+    if (base && pack_find(base, entry->path, &held) == 0 && held.type == MANIFEST_FILE && held.size == entry->size &&
+        memcmp(held.digest, entry->digest, HASH_SIZE) == 0) {
+        return copy_file_span(base->fd, (off_t)held.offset, out, offset, held.size);
+    }
+    char full_path[PATH_MAX];
+    if (join_paths(dir, entry->path, full_path, sizeof(full_path)) < 0) {
+        return -1;
+    }
+    int in = open(full_path, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    struct stat st;
+    int rc = fstat(in, &st);
+    if (rc == 0 && (unsigned long long)st.st_size != entry->size) {
+        errno = EBADMSG;
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = copy_file_span(in, 0, out, offset, entry->size);
+    }
+    close(in);
+    return rc;
+}
+
+int pack_write(int out, const manifest_t *manifest, const char *dir, const pack_t *base) {
+    size_t count = manifest->entry_count;
+    const manifest_entry_t **sorted = malloc((count + 1) * sizeof(*sorted));
+    if (!sorted) {
+        return -1;
+    }
+    size_t paths_len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = &manifest->entries[i];
+        paths_len += strlen(manifest->entries[i].path) + 1;
+    }
+    qsort(sorted, count, sizeof(*sorted), compare_entry_paths);
+    size_t index_len = count * PACK_RECORD_SIZE + paths_len;
+    unsigned char *index = malloc(index_len + PACK_TRAILER_SIZE);
+    unsigned char header[PACK_HEADER_SIZE] = { 0 };
+    memcpy(header, PACK_MAGIC, 8);
+    int rc = index ? write_full(out, header, sizeof(header), 0) : -1;
+    unsigned long long offset = PACK_HEADER_SIZE;
+    char *paths = (char *)index + count * PACK_RECORD_SIZE;
+    size_t path_offset = 0;
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        const manifest_entry_t *entry = sorted[i];
+        size_t path_len = strlen(entry->path);
+        if (i > 0 && strcmp(sorted[i - 1]->path, entry->path) == 0) {
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+        if (path_offset > UINT32_MAX) {
+            errno = EFBIG;
+            rc = -1;
+            break;
+        }
+        unsigned char *record = index + i * PACK_RECORD_SIZE;
+        int is_file = entry->type == MANIFEST_FILE;
+        put_le64(record, is_file ? offset : 0);
+        put_le64(record + 8, is_file ? entry->size : 0);
+        put_le64(record + 16, (uint64_t)entry->mtime);
+        put_le32(record + 24, (uint32_t)path_offset);
+        put_le32(record + 28, (uint32_t)path_len);
+        put_le32(record + 32, (uint32_t)entry->type);
+        put_le32(record + 36, 0);
+        memcpy(record + 40, entry->digest, HASH_SIZE);
+        memcpy(paths + path_offset, entry->path, path_len + 1);
+        path_offset += path_len + 1;
+        if (is_file) {
+            rc = write_body(out, (off_t)offset, entry, dir, base);
+            offset += entry->size;
+        }
+    }
+    if (rc == 0) {
+        unsigned long long index_offset = (offset + PACK_INDEX_ALIGN - 1) / PACK_INDEX_ALIGN * PACK_INDEX_ALIGN;
+        unsigned char *trailer = index + index_len;
+        memcpy(trailer, PACK_INDEX_MAGIC, 8);
+        put_le64(trailer + 8, index_offset);
+        put_le64(trailer + 16, count);
+        put_le64(trailer + 24, paths_len);
+        /* the gap before the index is left as a hole */
+        rc = write_full(out, index, index_len + PACK_TRAILER_SIZE, (off_t)index_offset);
+    }
+    free(index);
+    free(sorted);
+    return rc;
+}
+
+static const char *record_path(const pack_t *pack, size_t index) {
+    return pack->paths + get_le32(pack->records + index * PACK_RECORD_SIZE + 24);
+}
+
+/* every record is checked once, so lookups and sends can trust the index */
+static int check_index(const pack_t *pack, unsigned long long paths_len) {
+    for (size_t i = 0; i < pack->count; ++i) {
+        const unsigned char *record = pack->records + i * PACK_RECORD_SIZE;
+        unsigned long long offset = get_le64(record);
+        unsigned long long size = get_le64(record + 8);
+        unsigned long long path_offset = get_le32(record + 24);
+        unsigned long long path_len = get_le32(record + 28);
+        uint32_t type = get_le32(record + 32);
+        if (path_len == 0 || path_offset + path_len >= paths_len || pack->paths[path_offset + path_len] != '\0' ||
+            strlen(pack->paths + path_offset) != path_len || (type != MANIFEST_DIR && type != MANIFEST_FILE) ||
+            (type == MANIFEST_FILE && (offset < PACK_HEADER_SIZE || offset > pack->index_offset || size > pack->index_offset - offset)) ||
+            (i > 0 && strcmp(record_path(pack, i - 1), pack->paths + path_offset) >= 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pack_open(pack_t *pack, const char *path) {
+    memset(pack, 0, sizeof(*pack));
+    pack->fd = open(path, O_RDONLY);
+    if (pack->fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    unsigned char header[PACK_HEADER_SIZE];
+    unsigned char trailer[PACK_TRAILER_SIZE];
+    if (fstat(pack->fd, &st) < 0) {
+        pack_close(pack);
+        return -1;
+    }
+    unsigned long long file_size = (unsigned long long)st.st_size;
+    if (file_size < PACK_HEADER_SIZE + PACK_TRAILER_SIZE || read_full(pack->fd, header, sizeof(header), 0) < 0 ||
+        read_full(pack->fd, trailer, sizeof(trailer), (off_t)(file_size - PACK_TRAILER_SIZE)) < 0 ||
+        memcmp(header, PACK_MAGIC, 8) != 0 || memcmp(trailer, PACK_INDEX_MAGIC, 8) != 0) {
+        pack_close(pack);
+        errno = EBADMSG;
+        return -1;
+    }
+    unsigned long long index_offset = get_le64(trailer + 8);
+    unsigned long long count = get_le64(trailer + 16);
+    unsigned long long paths_len = get_le64(trailer + 24);
+    if (index_offset < PACK_HEADER_SIZE || index_offset > file_size || count > file_size / PACK_RECORD_SIZE ||
+        paths_len > file_size || index_offset + count * PACK_RECORD_SIZE + paths_len + PACK_TRAILER_SIZE != file_size) {
+        pack_close(pack);
+        errno = EBADMSG;
+        return -1;
+    }
+    pack->index_offset = index_offset;
+    pack->count = (size_t)count;
+    unsigned long long page = (unsigned long long)sysconf(_SC_PAGESIZE);
+    unsigned long long start = index_offset - index_offset % page;
+    pack->map_len = (size_t)(file_size - PACK_TRAILER_SIZE - start);
+    if (pack->map_len > 0) {
+        pack->map = mmap(NULL, pack->map_len, PROT_READ, MAP_SHARED, pack->fd, (off_t)start);
+        if (pack->map == MAP_FAILED) {
+            pack->map = NULL;
+            pack_close(pack);
+            return -1;
+        }
+        pack->records = pack->map + (index_offset - start);
+        pack->paths = (const char *)pack->records + count * PACK_RECORD_SIZE;
+    }
+    if (check_index(pack, paths_len) < 0) {
+        pack_close(pack);
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+void pack_close(pack_t *pack) {
+    if (pack->map) {
+        munmap(pack->map, pack->map_len);
+    }
+    if (pack->fd >= 0) {
+        close(pack->fd);
+    }
+    memset(pack, 0, sizeof(*pack));
+    pack->fd = -1;
+}
+
+void pack_entry(const pack_t *pack, size_t index, pack_entry_t *entry) {
+    const unsigned char *record = pack->records + index * PACK_RECORD_SIZE;
+    entry->offset = get_le64(record);
+    entry->size = get_le64(record + 8);
+    entry->mtime = (int64_t)get_le64(record + 16);
+    entry->path = pack->paths + get_le32(record + 24);
+    entry->type = (int)get_le32(record + 32);
+    entry->digest = record + 40;
+}
+
+int pack_find(const pack_t *pack, const char *path, pack_entry_t *entry) {
+    size_t low = 0;
+    size_t high = pack->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strcmp(path, record_path(pack, middle));
+        if (order == 0) {
+            pack_entry(pack, middle, entry);
+            return 0;
+        }
+        if (order < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+int pack_to_manifest(const pack_t *pack, manifest_t *manifest) {
+    manifest_init(manifest);
+    for (size_t i = 0; i < pack->count; ++i) {
+        pack_entry_t entry;
+        pack_entry(pack, i, &entry);
+        if (manifest_add_entry(manifest, entry.type, entry.path, strlen(entry.path), entry.size) < 0) {
+            manifest_free(manifest);
+            return -1;
+        }
+        manifest_entry_t *added = &manifest->entries[manifest->entry_count - 1];
+        added->mtime = entry.mtime;
+        memcpy(added->digest, entry.digest, HASH_SIZE);
+    }
+    return 0;
+}
+
+int pack_extract(const pack_t *pack, const pack_entry_t *entry, const char *target) {
+    int out = open(target, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        return -1;
+    }
+    int rc = copy_file_span(pack->fd, (off_t)entry->offset, out, 0, entry->size);
+    durable_written(out);
+    if (close(out) < 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(target);
+        errno = saved;
+    }
+    return rc;
+}
+
+/* a delta needs the whole file in view, so its span of the pack is mapped */
+static int send_pack_delta(mc_conn_t *conn, const pack_t *pack, const pack_entry_t *entry, const delta_signature_t *signature) {
+    unsigned long long page = (unsigned long long)sysconf(_SC_PAGESIZE);
+    unsigned long long start = entry->offset - entry->offset % page;
+    size_t lead = (size_t)(entry->offset - start);
+    size_t length = lead + (size_t)entry->size;
+    unsigned char *data = mmap(NULL, length, PROT_READ, MAP_SHARED, pack->fd, (off_t)start);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
+    int rc = send_delta_entry(conn, entry->path, signature, data + lead, (size_t)entry->size);
+    munmap(data, length);
+    return rc;
+}
+
+int pack_send_world(mc_conn_t *conn, const pack_t *pack, const uint32_t *wanted, size_t wanted_count, delta_basis_set_t *bases) {
+    proto_batch_t batch;
+    int batching = (conn->caps & PROTO_CAP_BATCH) != 0;
+    if (batching && proto_batch_init(&batch) < 0) {
+        return -1;
+    }
+    /* bodies go out in index order, which is the order they were written in */
+    posix_fadvise(pack->fd, 0, (off_t)pack->index_offset, POSIX_FADV_SEQUENTIAL);
+    int rc = 0;
+    size_t count = wanted ? wanted_count : pack->count;
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        if (wanted && wanted[i] >= pack->count) {
+            errno = EINVAL;
+            rc = -1;
+            break;
+        }
+        pack_entry_t entry;
+        pack_entry(pack, wanted ? wanted[i] : i, &entry);
+        size_t path_len = strlen(entry.path);
+        if (entry.type == MANIFEST_DIR) {
+            rc = proto_send_entry_dir(conn, entry.path, path_len);
+            continue;
+        }
+        const delta_signature_t *signature = entry.size >= DELTA_MIN_SIZE ? delta_basis_set_find(bases, entry.path) : NULL;
+        if (signature) {
+            rc = send_pack_delta(conn, pack, &entry, signature);
+            continue;
+        }
+        if (batching && entry.size < PROTO_BATCH_FILE_MAX) {
+            unsigned char *body = proto_batch_reserve(conn, &batch, entry.path, path_len, (size_t)entry.size);
+            rc = body ? read_full(pack->fd, body, (size_t)entry.size, (off_t)entry.offset) : -1;
+        } else {
+            rc = proto_send_entry_file(conn, entry.path, path_len, entry.size);
+            if (rc == 0) {
+                rc = conn_send_file(conn, pack->fd, (off_t)entry.offset, entry.size);
+            }
+        }
+        if (rc == 0) {
+            conn->sent.files++;
+            conn->sent.bytes += entry.size;
+        }
+    }
+    if (batching) {
+        if (rc == 0) {
+            rc = proto_batch_flush(conn, &batch);
+        }
+        proto_batch_free(&batch);
+    }
+    return rc;
+}
@@ -0,0 +1,79 @@
+#ifndef MCSYNC_PACK_H
+#define MCSYNC_PACK_H
+
+#include "platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "delta.h"
+#include "manifest.h"
+
+/*
+ * A pack holds a whole version in one file, so a world of 100k small files
+ * costs one inode to list, back up or remove. A 16-byte header, the magic
+ * "MCSYNCP1" and eight zero bytes, is followed by the contents of every
+ * file back to back in path order, then, at a page boundary, the index:
+ * one PACK_RECORD_SIZE record per entry, sorted by path,
+ *
+ *   u64 offset | u64 size | i64 mtime | u32 path offset | u32 path length |
+ *   u32 type | u32 reserved | digest
+ *
+ * then the NUL-terminated paths the records point into, and a 32-byte
+ * trailer: the magic "MCSYNCPI", the u64 offset of the index, the u64
+ * record count and the u64 length of the paths. Sorted paths put every
+ * directory ahead of what it holds, so the index is also an order the
+ * tree can be recreated in, and a pull in that order reads the file
+ * front to back.
+ */
+#define PACK_MAGIC "MCSYNCP1"
+#define PACK_INDEX_MAGIC "MCSYNCPI"
+#define PACK_HEADER_SIZE 16
+#define PACK_RECORD_SIZE (8 + 8 + 8 + 4 + 4 + 4 + 4 + HASH_SIZE)
+#define PACK_TRAILER_SIZE 32
+
+typedef struct {
+    int fd;
+    /* the index and paths, mapped read-only from the page the index starts in */
+    unsigned char *map;
+    size_t map_len;
+    const unsigned char *records;
+    const char *paths;
+    size_t count;
+    /* every body lies before the index */
+    unsigned long long index_offset;
+} pack_t;
+
+typedef struct {
+    int type;
+    const char *path;
+    unsigned long long offset;
+    unsigned long long size;
+    int64_t mtime;
+    const unsigned char *digest;
+} pack_entry_t;
+
+/*
+ * Writes the pack of the tree manifest describes to out. A file base
+ * holds at the same path with the same size and digest is copied from
+ * base; the rest are read from dir.
+ */
+int pack_write(int out, const manifest_t *manifest, const char *dir, const pack_t *base);
+int pack_open(pack_t *pack, const char *path);
+void pack_close(pack_t *pack);
+void pack_entry(const pack_t *pack, size_t index, pack_entry_t *entry);
+/* the entry at path, found by binary search of the index */
+int pack_find(const pack_t *pack, const char *path, pack_entry_t *entry);
+/* the index as a manifest, entry i of which is record i */
+int pack_to_manifest(const pack_t *pack, manifest_t *manifest);
+/* writes the contents of a file entry to a new file at target */
+int pack_extract(const pack_t *pack, const pack_entry_t *entry, const char *target);
+/*
+ * Streams the pack as ordinary entries, as chunk_sync_send_world does for
+ * manifests. wanted holds ascending record indexes to send, or is NULL for
+ * all of them.
+ */
+int pack_send_world(mc_conn_t *conn, const pack_t *pack, const uint32_t *wanted, size_t wanted_count, delta_basis_set_t *bases);
+
+#endif /* MCSYNC_PACK_H */
@@ -0,0 +1,975 @@
+#include "platform.h"
+#include "protocol.h"
+
+#include "common.h"
+#include "region.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* largest request payload accepted while a connection waits in epoll */
+#define MAX_REQUEST_PAYLOAD PATH_MAX
+/* indexes per WANT frame */
+#define WANT_FRAME_MAX 16384
+
+static int binary(const mc_conn_t *conn) {
+    return conn->proto_version >= PROTO_VERSION_BINARY;
+}
+
+static int send_header(mc_conn_t *conn, int type, uint16_t flags, uint64_t length) {
+    unsigned char header[PROTO_HEADER_SIZE];
+    put_le16(header, (uint16_t)type);
+    put_le16(header + 2, flags);
+    put_le32(header + 4, conn->request_id);
+    put_le64(header + 8, length);
+    return conn_write(conn, header, sizeof(header));
+}
+
+static int send_frame(mc_conn_t *conn, int type, const void *payload, size_t length) {
+    if (send_header(conn, type, 0, length) < 0) {
+        return -1;
+    }
+    return length > 0 ? conn_write(conn, payload, length) : 0;
+}
+
+static int store_text(proto_msg_t *msg, const void *data, size_t length) {
+    if (length >= sizeof(msg->text)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(msg->text, data, length);
+    msg->text[length] = '\0';
+    msg->text_len = length;
+    return 0;
+}
+
+static int read_text(mc_conn_t *conn, proto_msg_t *msg, size_t length) {
+    if (length >= sizeof(msg->text)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (conn_read(conn, msg->text, length) < 0) {
+        return -1;
+    }
+    msg->text[length] = '\0';
+    msg->text_len = length;
+    return 0;
+}
+
+static int skip_bytes(mc_conn_t *conn, unsigned long long length) {
+    while (length > 0) {
+        const void *data;
+        ssize_t got = conn_read_some(conn, &data, length < CONN_BUFFER_SIZE ? (size_t)length : CONN_BUFFER_SIZE);
+        if (got < 0) {
+            return -1;
+        }
+        length -= (unsigned long long)got;
+    }
+    return 0;
+}
+
+static unsigned int offered_caps(void) {
+    unsigned int caps = PROTO_CAPS_SUPPORTED;
+    if (getenv("MCSYNC_NO_BATCH")) {
+        caps &= ~PROTO_CAP_BATCH;
+    }
+    if (getenv("MCSYNC_NO_CHUNKS")) {
+        caps &= ~PROTO_CAP_CHUNKS;
+    }
+    if (getenv("MCSYNC_NO_INCREMENTAL")) {
+        caps &= ~(PROTO_CAP_INCREMENTAL | PROTO_CAP_INCREMENTAL_PULL);
+    }
+    if (getenv("MCSYNC_NO_DELTA")) {
+        caps &= ~PROTO_CAP_DELTA;
+    }
+    if (getenv("MCSYNC_NO_REGION")) {
+        caps &= ~PROTO_CAP_REGION;
+    }
+    if (getenv("MCSYNC_NO_COMPRESS")) {
+        caps &= ~PROTO_CAP_COMPRESS;
+    }
+    return caps;
+}
+
+int proto_client_hello(mc_conn_t *conn) {
+    const char *forced = getenv("MCSYNC_PROTOCOL");
+    if (forced && atoi(forced) == PROTO_VERSION_TEXT) {
+        return 0;
+    }
+    if (conn_printf(conn, "HELLO %d %x\n", PROTO_VERSION_BINARY, offered_caps()) < 0) {
+        return -1;
+    }
+    char line[MCSYNC_MAX_LINE];
+    if (conn_read_line(conn, line, sizeof(line)) < 0) {
+        return -1;
+    }
+    if (strncmp(line, "ERR ", 4) == 0) {
+        /* a server from before version negotiation; it drops the connection after errors */
+        return 1;
+    }
+    unsigned int version;
+    unsigned int caps;
+    if (sscanf(line, "HELLO %u %x", &version, &caps) != 2 || version < PROTO_VERSION_TEXT) {
+        errno = EPROTO;
+        return -1;
+    }
+    conn->proto_version = version > PROTO_VERSION_BINARY ? PROTO_VERSION_BINARY : (int)version;
+    conn->caps = conn->proto_version >= PROTO_VERSION_BINARY ? caps & offered_caps() : 0;
+    if ((conn->caps & PROTO_CAP_COMPRESS) && conn_start_compression(conn) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* server_caps masks out features the server can offer in its current configuration */
+int proto_server_hello(mc_conn_t *conn, const proto_msg_t *hello, unsigned int server_caps) {
+    unsigned int version = hello->version > PROTO_VERSION_BINARY ? PROTO_VERSION_BINARY : hello->version;
+    if (version < PROTO_VERSION_TEXT) {
+        version = PROTO_VERSION_TEXT;
+    }
+    unsigned int caps = version >= PROTO_VERSION_BINARY ? hello->caps & offered_caps() & server_caps : 0;
+    if (conn_printf(conn, "HELLO %u %x\n", version, caps) < 0) {
+        return -1;
+    }
+    conn->proto_version = (int)version;
+    conn->caps = caps;
+    /* the reply itself still goes out plain */
+    if ((caps & PROTO_CAP_COMPRESS) && (conn_flush(conn) < 0 || conn_start_compression(conn) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static const char *request_verb(int type) {
+    switch (type) {
+    case PROTO_LIST:
+        return "LIST";
+    case PROTO_PUSH:
+        return "PUSH";
+    case PROTO_PULL:
+        return "PULL";
+    case PROTO_QUIT:
+        return "QUIT";
+    default:
+        return NULL;
+    }
+}
+
+int proto_send_request(mc_conn_t *conn, int type, uint16_t flags, uint32_t request_id, const char *name) {
+    size_t name_len = name ? strlen(name) : 0;
+    conn->request_id = request_id;
+    if (binary(conn)) {
+        if (send_header(conn, type, flags, name_len) < 0) {
+            return -1;
+        }
+        return name_len > 0 ? conn_write(conn, name, name_len) : 0;
+    }
+    const char *verb = request_verb(type);
+    if (!verb) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (request_id != 0 && conn_printf(conn, "@%u ", request_id) < 0) {
+        return -1;
+    }
+    if (!name) {
+        return conn_printf(conn, "%s\n", verb);
+    }
+    if (conn_printf(conn, "%s %zu\n", verb, name_len) < 0) {
+        return -1;
+    }
+    return conn_write(conn, name, name_len);
+}
+
+/* parses one request out of the buffer without consuming anything until it is complete */
+static int try_text_request(mc_conn_t *conn, proto_msg_t *msg) {
+    const unsigned char *newline;
+    while (1) {
+        newline = memchr(conn_peek(conn), '\n', conn_buffered(conn));
+        if (newline) {
+            break;
+        }
+        if (conn_buffered(conn) + 1 >= MCSYNC_MAX_LINE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        int rc = conn_try_buffer(conn, conn_buffered(conn) + 1);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+    size_t line_len = (size_t)(newline - conn_peek(conn));
+    char line[MCSYNC_MAX_LINE];
+    memcpy(line, conn_peek(conn), line_len);
+    line[line_len] = '\0';
+
+    const char *command = line;
+    msg->request_id = 0;
+    if (command[0] == '@') {
+        unsigned int request_id;
+        int consumed = 0;
+        if (sscanf(command, "@%u %n", &request_id, &consumed) != 1 || consumed == 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        msg->request_id = request_id;
+        command += consumed;
+    }
+    size_t payload_len = 0;
+    unsigned long name_len;
+    if (strncmp(command, "PUSH ", 5) == 0 || strncmp(command, "PULL ", 5) == 0) {
+        if (sscanf(command + 5, "%lu", &name_len) != 1 || name_len == 0 || name_len >= PATH_MAX) {
+            errno = EPROTO;
+            return -1;
+        }
+        msg->type = strncmp(command, "PUSH", 4) == 0 ? PROTO_PUSH : PROTO_PULL;
+        payload_len = name_len;
+    } else if (strcmp(command, "LIST") == 0) {
+        msg->type = PROTO_LIST;
+    } else if (strcmp(command, "QUIT") == 0) {
+        msg->type = PROTO_QUIT;
+    } else if (strncmp(command, "HELLO ", 6) == 0) {
+        if (sscanf(command, "HELLO %u %x", &msg->version, &msg->caps) != 2) {
+            errno = EPROTO;
+            return -1;
+        }
+        msg->type = PROTO_HELLO;
+    } else {
+        /* consumed so the handler can still answer it before hanging up */
+        msg->type = PROTO_UNKNOWN;
+    }
+    int rc = conn_try_buffer(conn, line_len + 1 + payload_len);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (store_text(msg, conn_peek(conn) + line_len + 1, payload_len) < 0) {
+        return -1;
+    }
+    conn_consume(conn, line_len + 1 + payload_len);
+    return 1;
+}
+
+static int try_binary_request(mc_conn_t *conn, proto_msg_t *msg) {
+    int rc = conn_try_buffer(conn, PROTO_HEADER_SIZE);
+    if (rc <= 0) {
+        return rc;
+    }
+    const unsigned char *header = conn_peek(conn);
+    uint64_t length = get_le64(header + 8);
+    if (length >= MAX_REQUEST_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    rc = conn_try_buffer(conn, PROTO_HEADER_SIZE + (size_t)length);
+    if (rc <= 0) {
+        return rc;
+    }
+    header = conn_peek(conn);
+    msg->type = get_le16(header);
+    msg->flags = get_le16(header + 2);
+    msg->request_id = get_le32(header + 4);
+    if (store_text(msg, header + PROTO_HEADER_SIZE, (size_t)length) < 0) {
+        return -1;
+    }
+    conn_consume(conn, PROTO_HEADER_SIZE + (size_t)length);
+    return 1;
+}
+
+/* 1 with a complete request in msg, 0 if more input is needed, -1 on EOF or garbage */
+int proto_try_recv_request(mc_conn_t *conn, proto_msg_t *msg) {
+    memset(msg, 0, offsetof(proto_msg_t, text));
+    msg->text[0] = '\0';
+    return binary(conn) ? try_binary_request(conn, msg) : try_text_request(conn, msg);
+}
+
+int proto_begin_reply(mc_conn_t *conn, uint32_t request_id) {
+    conn->request_id = request_id;
+    if (!binary(conn) && request_id != 0) {
+        return conn_printf(conn, "BEGIN %u\n", request_id);
+    }
+    return 0;
+}
+
+int proto_send_status(mc_conn_t *conn, int type) {
+    if (binary(conn)) {
+        return send_frame(conn, type, NULL, 0);
+    }
+    switch (type) {
+    case PROTO_OK:
+        return conn_printf(conn, "OK\n");
+    case PROTO_FOUND:
+        return conn_printf(conn, "FOUND\n");
+    case PROTO_DONE:
+        return conn_printf(conn, "DONE\n");
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+int proto_send_error(mc_conn_t *conn, const char *message) {
+    if (binary(conn)) {
+        return send_frame(conn, PROTO_ERR, message, strlen(message));
+    }
+    return conn_printf(conn, "ERR %s\n", message);
+}
+
+int proto_send_count(mc_conn_t *conn, unsigned long long count) {
+    if (binary(conn)) {
+        unsigned char payload[8];
+        put_le64(payload, count);
+        return send_frame(conn, PROTO_COUNT, payload, sizeof(payload));
+    }
+    return conn_printf(conn, "COUNT %llu\n", count);
+}
+
+int proto_send_world(mc_conn_t *conn, const char *name, size_t name_len) {
+    if (binary(conn)) {
+        return send_frame(conn, PROTO_WORLD, name, name_len);
+    }
+    if (conn_printf(conn, "WORLD %zu\n", name_len) < 0) {
+        return -1;
+    }
+    return conn_write(conn, name, name_len);
+}
+
+/* only sent on connections that negotiated PROTO_CAP_HISTORY, so always binary */
+int proto_send_version(mc_conn_t *conn, unsigned long long seq, int64_t created, unsigned long long bytes, uint32_t files,
+                       const char *format) {
+    size_t format_len = strlen(format);
+    unsigned char meta[PROTO_VERSION_META_SIZE];
+    put_le64(meta, seq);
+    put_le64(meta + 8, (uint64_t)created);
+    put_le64(meta + 16, bytes);
+    put_le32(meta + 24, files);
+    put_le32(meta + 28, 0);
+    if (send_header(conn, PROTO_VERSION, 0, sizeof(meta) + format_len) < 0 || conn_write(conn, meta, sizeof(meta)) < 0) {
+        return -1;
+    }
+    return conn_write(conn, format, format_len);
+}
+
+/* only sent on connections that negotiated PROTO_CAP_CATALOG */
+int proto_send_world_info(mc_conn_t *conn, const char *name, unsigned long long seq, int64_t pushed, unsigned long long bytes,
+                          uint32_t files) {
+    size_t name_len = strlen(name);
+    unsigned char meta[PROTO_VERSION_META_SIZE];
+    put_le64(meta, seq);
+    put_le64(meta + 8, (uint64_t)pushed);
+    put_le64(meta + 16, bytes);
+    put_le32(meta + 24, files);
+    put_le32(meta + 28, 0);
+    if (send_header(conn, PROTO_WORLD_INFO, 0, sizeof(meta) + name_len) < 0 || conn_write(conn, meta, sizeof(meta)) < 0) {
+        return -1;
+    }
+    return conn_write(conn, name, name_len);
+}
+
+int proto_send_entry_dir(mc_conn_t *conn, const char *path, size_t path_len) {
+    if (binary(conn)) {
+        return send_frame(conn, PROTO_ENTRY_DIR, path, path_len);
+    }
+    if (conn_printf(conn, "ENTRY 2 %zu 0\n", path_len) < 0) {
+        return -1;
+    }
+    return conn_write(conn, path, path_len);
+}
+
+/* the caller streams exactly `size` body bytes right after this */
+int proto_send_entry_file(mc_conn_t *conn, const char *path, size_t path_len, unsigned long long size) {
+    if (binary(conn)) {
+        unsigned char meta[PROTO_ENTRY_META_SIZE];
+        put_le64(meta, size);
+        put_le32(meta + 8, (uint32_t)path_len);
+        put_le32(meta + 12, 0);
+        if (send_header(conn, PROTO_ENTRY_FILE, 0, PROTO_ENTRY_META_SIZE + path_len + size) < 0 ||
+            conn_write(conn, meta, sizeof(meta)) < 0) {
+            return -1;
+        }
+        return conn_write(conn, path, path_len);
+    }
+    if (conn_printf(conn, "ENTRY 1 %zu %llu\n", path_len, size) < 0) {
+        return -1;
+    }
+    return conn_write(conn, path, path_len);
+}
+
+int proto_send_end(mc_conn_t *conn) {
+    if (binary(conn)) {
+        return send_frame(conn, PROTO_END, NULL, 0);
+    }
+    return conn_printf(conn, "END\n");
+}
+
+/* the chunk hashes and lengths follow the path; the body stays with the sender unless wanted */
+int proto_send_entry_chunked(mc_conn_t *conn, const manifest_t *manifest, const manifest_entry_t *entry) {
+    size_t path_len = strlen(entry->path);
+    unsigned char meta[PROTO_ENTRY_META_SIZE];
+    put_le64(meta, entry->size);
+    put_le32(meta + 8, (uint32_t)path_len);
+    put_le32(meta + 12, (uint32_t)entry->chunk_count);
+    if (send_header(conn, PROTO_ENTRY_CHUNKED, 0, sizeof(meta) + path_len + entry->chunk_count * PROTO_CHUNK_REF_SIZE) < 0 ||
+        conn_write(conn, meta, sizeof(meta)) < 0 ||
+        conn_write(conn, entry->path, path_len) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < entry->chunk_count; ++i) {
+        const manifest_chunk_t *chunk = &manifest->chunks[entry->first_chunk + i];
+        unsigned char *ref = conn_write_reserve(conn, PROTO_CHUNK_REF_SIZE);
+        if (!ref) {
+            return -1;
+        }
+        memcpy(ref, chunk->hash, HASH_SIZE);
+        put_le32(ref + HASH_SIZE, chunk->length);
+        conn_write_commit(conn, PROTO_CHUNK_REF_SIZE);
+    }
+    return 0;
+}
+
+/* a file's size, mtime and digest stand in for its body */
+int proto_send_entry_digest(mc_conn_t *conn, const manifest_entry_t *entry) {
+    size_t path_len = strlen(entry->path);
+    unsigned char meta[PROTO_DIGEST_META_SIZE];
+    put_le64(meta, entry->size);
+    put_le32(meta + 8, (uint32_t)path_len);
+    put_le32(meta + 12, 0);
+    put_le64(meta + 16, (uint64_t)entry->mtime);
+    memcpy(meta + 24, entry->digest, HASH_SIZE);
+    if (send_header(conn, PROTO_ENTRY_DIGEST, 0, sizeof(meta) + path_len) < 0 ||
+        conn_write(conn, meta, sizeof(meta)) < 0) {
+        return -1;
+    }
+    return conn_write(conn, entry->path, path_len);
+}
+
+/* as many WANT frames as the list needs, then END */
+int proto_send_wants(mc_conn_t *conn, const uint32_t *indexes, size_t count) {
+    for (size_t sent = 0; sent < count; sent += WANT_FRAME_MAX) {
+        size_t frame_count = count - sent < WANT_FRAME_MAX ? count - sent : WANT_FRAME_MAX;
+        if (send_header(conn, PROTO_WANT, 0, frame_count * 4) < 0) {
+            return -1;
+        }
+        for (size_t i = sent; i < sent + frame_count; ++i) {
+            unsigned char *out = conn_write_reserve(conn, 4);
+            if (!out) {
+                return -1;
+            }
+            put_le32(out, indexes[i]);
+            conn_write_commit(conn, 4);
+        }
+    }
+    return proto_send_end(conn);
+}
+
+int proto_send_entry_delete(mc_conn_t *conn, const char *path, size_t path_len) {
+    return send_frame(conn, PROTO_ENTRY_DELETE, path, path_len);
+}
+
+int proto_send_signature(mc_conn_t *conn, const char *path, const delta_signature_t *signature) {
+    size_t path_len = strlen(path);
+    unsigned char meta[PROTO_ENTRY_META_SIZE];
+    put_le64(meta, signature->size);
+    put_le32(meta + 8, (uint32_t)path_len);
+    put_le32(meta + 12, signature->block_size);
+    uint16_t flags = signature->region ? PROTO_FLAG_REGION : 0;
+    if (send_header(conn, PROTO_SIGNATURE, flags, sizeof(meta) + path_len + (uint64_t)signature->block_count * DELTA_BLOCK_WIRE_SIZE) < 0 ||
+        conn_write(conn, meta, sizeof(meta)) < 0 ||
+        conn_write(conn, path, path_len) < 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < signature->block_count; ++i) {
+        unsigned char *out = conn_write_reserve(conn, DELTA_BLOCK_WIRE_SIZE);
+        if (!out) {
+            return -1;
+        }
+        put_le32(out, signature->blocks[i].weak);
+        memcpy(out + 4, signature->blocks[i].strong, DELTA_STRONG_SIZE);
+        conn_write_commit(conn, DELTA_BLOCK_WIRE_SIZE);
+    }
+    return 0;
+}
+
+/* the DELTA_COPY and DELTA_DATA frames that rebuild the file follow, then END */
+int proto_send_entry_delta(mc_conn_t *conn, const char *path, size_t path_len, unsigned long long size, const unsigned char hash[HASH_SIZE]) {
+    unsigned char meta[PROTO_DELTA_META_SIZE];
+    put_le64(meta, size);
+    put_le32(meta + 8, (uint32_t)path_len);
+    put_le32(meta + 12, 0);
+    memcpy(meta + 16, hash, HASH_SIZE);
+    if (send_header(conn, PROTO_ENTRY_DELTA, 0, sizeof(meta) + path_len) < 0 ||
+        conn_write(conn, meta, sizeof(meta)) < 0) {
+        return -1;
+    }
+    return conn_write(conn, path, path_len);
+}
+
+int proto_send_delta_copy(mc_conn_t *conn, unsigned long long offset, unsigned long long length) {
+    unsigned char payload[16];
+    put_le64(payload, offset);
+    put_le64(payload + 8, length);
+    return send_frame(conn, PROTO_DELTA_COPY, payload, sizeof(payload));
+}
+
+int proto_send_delta_data(mc_conn_t *conn, const void *data, size_t length) {
+    return send_frame(conn, PROTO_DELTA_DATA, data, length);
+}
+
+/* the caller streams exactly chunk->length bytes after this */
+int proto_send_chunk_data(mc_conn_t *conn, const manifest_chunk_t *chunk) {
+    if (send_header(conn, PROTO_CHUNK_DATA, 0, HASH_SIZE + (uint64_t)chunk->length) < 0) {
+        return -1;
+    }
+    return conn_write(conn, chunk->hash, HASH_SIZE);
+}
+
+static int recv_text(mc_conn_t *conn, proto_msg_t *msg) {
+    char line[MCSYNC_MAX_LINE];
+    while (1) {
+        if (conn_read_line(conn, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        unsigned int begin_id;
+        if (sscanf(line, "BEGIN %u", &begin_id) == 1) {
+            conn->request_id = begin_id;
+            continue;
+        }
+        break;
+    }
+    msg->request_id = conn->request_id;
+    if (strcmp(line, "OK") == 0) {
+        msg->type = PROTO_OK;
+    } else if (strcmp(line, "FOUND") == 0) {
+        msg->type = PROTO_FOUND;
+    } else if (strcmp(line, "DONE") == 0) {
+        msg->type = PROTO_DONE;
+    } else if (strcmp(line, "END") == 0) {
+        msg->type = PROTO_END;
+    } else if (strncmp(line, "ERR ", 4) == 0) {
+        msg->type = PROTO_ERR;
+        return store_text(msg, line + 4, strlen(line + 4));
+    } else if (sscanf(line, "COUNT %llu", &msg->size) == 1) {
+        msg->type = PROTO_COUNT;
+    } else if (strncmp(line, "WORLD ", 6) == 0) {
+        unsigned long name_len;
+        if (sscanf(line, "WORLD %lu", &name_len) != 1) {
+            errno = EPROTO;
+            return -1;
+        }
+        msg->type = PROTO_WORLD;
+        return read_text(conn, msg, name_len);
+    } else if (strncmp(line, "ENTRY ", 6) == 0) {
+        int type;
+        unsigned long path_len;
+        if (sscanf(line, "ENTRY %d %lu %llu", &type, &path_len, &msg->size) != 3 || (type != 1 && type != 2)) {
+            errno = EPROTO;
+            return -1;
+        }
+        msg->type = type == 1 ? PROTO_ENTRY_FILE : PROTO_ENTRY_DIR;
+        return read_text(conn, msg, path_len);
+    } else {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static int recv_binary(mc_conn_t *conn, proto_msg_t *msg) {
+    while (1) {
+        unsigned char header[PROTO_HEADER_SIZE];
+        if (conn_read(conn, header, sizeof(header)) < 0) {
+            return -1;
+        }
+        msg->type = get_le16(header);
+        msg->flags = get_le16(header + 2);
+        msg->request_id = get_le32(header + 4);
+        uint64_t length = get_le64(header + 8);
+        switch (msg->type) {
+        case PROTO_ENTRY_FILE: {
+            unsigned char meta[PROTO_ENTRY_META_SIZE];
+            if (length < PROTO_ENTRY_META_SIZE || conn_read(conn, meta, sizeof(meta)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = get_le64(meta);
+            uint32_t path_len = get_le32(meta + 8);
+            if (msg->size > length || length != PROTO_ENTRY_META_SIZE + (uint64_t)path_len + msg->size) {
+                errno = EPROTO;
+                return -1;
+            }
+            return read_text(conn, msg, path_len);
+        }
+        case PROTO_ENTRY_CHUNKED: {
+            unsigned char meta[PROTO_ENTRY_META_SIZE];
+            if (length < PROTO_ENTRY_META_SIZE || conn_read(conn, meta, sizeof(meta)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = get_le64(meta);
+            uint32_t path_len = get_le32(meta + 8);
+            msg->count = get_le32(meta + 12);
+            if (length != PROTO_ENTRY_META_SIZE + (uint64_t)path_len + (uint64_t)msg->count * PROTO_CHUNK_REF_SIZE) {
+                errno = EPROTO;
+                return -1;
+            }
+            return read_text(conn, msg, path_len);
+        }
+        case PROTO_ENTRY_DIGEST: {
+            unsigned char meta[PROTO_DIGEST_META_SIZE];
+            if (length < PROTO_DIGEST_META_SIZE || conn_read(conn, meta, sizeof(meta)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = get_le64(meta);
+            uint32_t path_len = get_le32(meta + 8);
+            msg->mtime = (int64_t)get_le64(meta + 16);
+            memcpy(msg->hash, meta + 24, HASH_SIZE);
+            if (length != PROTO_DIGEST_META_SIZE + (uint64_t)path_len) {
+                errno = EPROTO;
+                return -1;
+            }
+            return read_text(conn, msg, path_len);
+        }
+        case PROTO_SIGNATURE: {
+            unsigned char meta[PROTO_ENTRY_META_SIZE];
+            if (length < PROTO_ENTRY_META_SIZE || conn_read(conn, meta, sizeof(meta)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = get_le64(meta);
+            uint32_t path_len = get_le32(meta + 8);
+            msg->block_size = get_le32(meta + 12);
+            if (msg->flags & PROTO_FLAG_REGION) {
+                if (msg->block_size != REGION_SECTOR_SIZE || msg->size < REGION_HEADER_SIZE ||
+                    length != PROTO_ENTRY_META_SIZE + (uint64_t)path_len + REGION_CHUNKS * DELTA_BLOCK_WIRE_SIZE) {
+                    errno = EPROTO;
+                    return -1;
+                }
+                msg->count = REGION_CHUNKS;
+                return read_text(conn, msg, path_len);
+            }
+            if (msg->block_size < DELTA_BLOCK_MIN || msg->block_size > DELTA_BLOCK_MAX ||
+                msg->size / msg->block_size > DELTA_SIGNATURE_BLOCKS_MAX ||
+                length != PROTO_ENTRY_META_SIZE + (uint64_t)path_len + msg->size / msg->block_size * DELTA_BLOCK_WIRE_SIZE) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->count = (uint32_t)(msg->size / msg->block_size);
+            return read_text(conn, msg, path_len);
+        }
+        case PROTO_ENTRY_DELTA: {
+            unsigned char meta[PROTO_DELTA_META_SIZE];
+            if (length < PROTO_DELTA_META_SIZE || conn_read(conn, meta, sizeof(meta)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = get_le64(meta);
+            uint32_t path_len = get_le32(meta + 8);
+            memcpy(msg->hash, meta + 16, HASH_SIZE);
+            if (length != PROTO_DELTA_META_SIZE + (uint64_t)path_len) {
+                errno = EPROTO;
+                return -1;
+            }
+            return read_text(conn, msg, path_len);
+        }
+        case PROTO_DELTA_COPY: {
+            unsigned char payload[16];
+            if (length != sizeof(payload) || conn_read(conn, payload, sizeof(payload)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->offset = get_le64(payload);
+            msg->size = get_le64(payload + 8);
+            return 0;
+        }
+        case PROTO_DELTA_DATA:
+            /* the caller reads the bytes */
+            msg->size = length;
+            return 0;
+        case PROTO_WANT:
+            if (length % 4 != 0 || length / 4 > UINT32_MAX) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->count = (uint32_t)(length / 4);
+            return 0;
+        case PROTO_CHUNK_DATA:
+            if (length < HASH_SIZE || conn_read(conn, msg->hash, HASH_SIZE) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = length - HASH_SIZE;
+            return 0;
+        case PROTO_VERSION:
+        case PROTO_WORLD_INFO: {
+            unsigned char meta[PROTO_VERSION_META_SIZE];
+            if (length < PROTO_VERSION_META_SIZE || conn_read(conn, meta, sizeof(meta)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->seq = get_le64(meta);
+            msg->mtime = (int64_t)get_le64(meta + 8);
+            msg->size = get_le64(meta + 16);
+            msg->count = get_le32(meta + 24);
+            return read_text(conn, msg, (size_t)(length - PROTO_VERSION_META_SIZE));
+        }
+        case PROTO_COUNT: {
+            unsigned char payload[8];
+            if (length != sizeof(payload) || conn_read(conn, payload, sizeof(payload)) < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            msg->size = get_le64(payload);
+            return 0;
+        }
+        case PROTO_ENTRY_BATCH:
+            /* the caller reads the payload itself, see proto_batch_next */
+            if (length > PROTO_BATCH_MAX) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            msg->size = length;
+            return 0;
+        case PROTO_ERR:
+        case PROTO_WORLD:
+        case PROTO_ENTRY_DIR:
+        case PROTO_ENTRY_DELETE:
+        case PROTO_LIST:
+        case PROTO_PUSH:
+        case PROTO_PULL:
+        case PROTO_LOG:
+        case PROTO_CLONE:
+            return read_text(conn, msg, (size_t)length);
+        case PROTO_OK:
+        case PROTO_FOUND:
+        case PROTO_DONE:
+        case PROTO_END:
+        case PROTO_QUIT:
+            return skip_bytes(conn, length);
+        default:
+            /* newer peers may interleave frames we don't know; their length lets us step over them */
+            if (skip_bytes(conn, length) < 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+}
+
+int proto_recv(mc_conn_t *conn, proto_msg_t *msg) {
+    memset(msg, 0, offsetof(proto_msg_t, text));
+    msg->text[0] = '\0';
+    return binary(conn) ? recv_binary(conn, msg) : recv_text(conn, msg);
+}
+
+/* appends the refs of an ENTRY_CHUNKED frame to the file entry added last */
+int proto_recv_chunk_refs(mc_conn_t *conn, manifest_t *manifest, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        unsigned char ref[PROTO_CHUNK_REF_SIZE];
+        if (conn_read(conn, ref, sizeof(ref)) < 0 ||
+            manifest_add_chunk(manifest, ref, get_le32(ref + HASH_SIZE)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int proto_recv_indexes(mc_conn_t *conn, uint32_t *indexes, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        unsigned char value[4];
+        if (conn_read(conn, value, sizeof(value)) < 0) {
+            return -1;
+        }
+        indexes[i] = get_le32(value);
+    }
+    return 0;
+}
+
+/* collects SIGNATURE frames up to END */
+/*
+ * Memory follows the blocks that actually arrive, and all signatures
+ * together stop at DELTA_SET_BLOCKS_MAX: later ones are read and dropped,
+ * so their files are sent whole.
+ */
+int proto_recv_signatures(mc_conn_t *conn, delta_basis_set_t *set) {
+    proto_msg_t msg;
+    size_t total_blocks = 0;
+    while (1) {
+        if (proto_recv(conn, &msg) < 0) {
+            return -1;
+        }
+        if (msg.type == PROTO_END) {
+            return 0;
+        }
+        if (msg.type != PROTO_SIGNATURE || msg.text_len == 0) {
+            errno = EPROTO;
+            return -1;
+        }
+        unsigned char block[DELTA_BLOCK_WIRE_SIZE];
+        if (total_blocks + msg.count > DELTA_SET_BLOCKS_MAX) {
+            for (uint32_t i = 0; i < msg.count; ++i) {
+                if (conn_read(conn, block, sizeof(block)) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+        total_blocks += msg.count;
+        delta_signature_t *signature = delta_basis_set_add(set, msg.text, msg.text_len);
+        if (!signature) {
+            return -1;
+        }
+        if (msg.flags & PROTO_FLAG_REGION) {
+            if (delta_region_signature_init(signature, msg.size) < 0) {
+                return -1;
+            }
+            for (size_t i = 0; i < REGION_CHUNKS; ++i) {
+                if (conn_read(conn, block, sizeof(block)) < 0) {
+                    return -1;
+                }
+                signature->blocks[i].weak = get_le32(block);
+                memcpy(signature->blocks[i].strong, block + 4, DELTA_STRONG_SIZE);
+            }
+            continue;
+        }
+        delta_signature_begin(signature, msg.size, msg.block_size);
+        for (uint32_t i = 0; i < msg.count; ++i) {
+            if (conn_read(conn, block, sizeof(block)) < 0 || delta_signature_add_block(signature, block) < 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+int proto_check_path(const char *path, size_t path_len) {
+    if (path_len == 0 || memchr(path, '\0', path_len) != NULL) {
+        return -1;
+    }
+    const char *end = path + path_len;
+    for (const char *part = path; part <= end;) {
+        const char *slash = memchr(part, '/', (size_t)(end - part));
+        size_t len = slash ? (size_t)(slash - part) : (size_t)(end - part);
+        if (len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.')) {
+            return -1;
+        }
+        part += len + 1;
+    }
+    return 0;
+}
+
+/* collects ENTRY_DIR and ENTRY_DIGEST frames up to END */
+int proto_recv_digests(mc_conn_t *conn, manifest_t *manifest) {
+    proto_msg_t msg;
+    while (1) {
+        if (proto_recv(conn, &msg) < 0) {
+            return -1;
+        }
+        if (msg.type == PROTO_END) {
+            return 0;
+        }
+        if ((msg.type != PROTO_ENTRY_DIR && msg.type != PROTO_ENTRY_DIGEST) || proto_check_path(msg.text, msg.text_len) < 0 ||
+            manifest->entry_count >= UINT32_MAX) {
+            errno = EPROTO;
+            return -1;
+        }
+        int type = msg.type == PROTO_ENTRY_DIR ? MANIFEST_DIR : MANIFEST_FILE;
+        if (manifest_add_entry(manifest, type, msg.text, msg.text_len, msg.size) < 0) {
+            return -1;
+        }
+        manifest_entry_t *entry = &manifest->entries[manifest->entry_count - 1];
+        entry->mtime = msg.mtime;
+        memcpy(entry->digest, msg.hash, HASH_SIZE);
+    }
+}
+
+int proto_batch_init(proto_batch_t *batch) {
+    batch->len = 0;
+    batch->data = malloc(PROTO_BATCH_MAX);
+    return batch->data ? 0 : -1;
+}
+
+void proto_batch_free(proto_batch_t *batch) {
+    free(batch->data);
+    batch->data = NULL;
+    batch->len = 0;
+}
+
+int proto_batch_flush(mc_conn_t *conn, proto_batch_t *batch) {
+    if (batch->len == 0) {
+        return 0;
+    }
+    int rc = send_frame(conn, PROTO_ENTRY_BATCH, batch->data, batch->len);
+    batch->len = 0;
+    return rc;
+}
+
+/* room for one record's body, sending the batch first if it is full */
+unsigned char *proto_batch_reserve(mc_conn_t *conn, proto_batch_t *batch, const char *path, size_t path_len, size_t size) {
+    size_t record_len = PROTO_ENTRY_META_SIZE + path_len + size;
+    if (record_len > PROTO_BATCH_MAX) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    if (batch->len + record_len > PROTO_BATCH_MAX && proto_batch_flush(conn, batch) < 0) {
+        return NULL;
+    }
+    unsigned char *record = batch->data + batch->len;
+    put_le64(record, size);
+    put_le32(record + 8, (uint32_t)path_len);
+    put_le32(record + 12, 0);
+    memcpy(record + PROTO_ENTRY_META_SIZE, path, path_len);
+    batch->len += record_len;
+    return record + PROTO_ENTRY_META_SIZE + path_len;
+}
+
+/* reads the whole body of fd into the batch */
+int proto_batch_add_file(mc_conn_t *conn, proto_batch_t *batch, const char *path, size_t path_len, int fd, size_t size) {
+    unsigned char *body = proto_batch_reserve(conn, batch, path, path_len, size);
+    if (!body) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = read(fd, body + done, size - done);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            /* the file shrank after it was stat'ed */
+            errno = EIO;
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+/* 1 with the next record, 0 at the end of the payload, -1 if it is malformed */
+int proto_batch_next(const unsigned char *payload, size_t length, size_t *offset, proto_batch_record_t *record) {
+    size_t pos = *offset;
+    if (pos == length) {
+        return 0;
+    }
+    if (length - pos < PROTO_ENTRY_META_SIZE) {
+        errno = EPROTO;
+        return -1;
+    }
+    uint64_t size = get_le64(payload + pos);
+    uint32_t path_len = get_le32(payload + pos + 8);
+    size_t rest = length - pos - PROTO_ENTRY_META_SIZE;
+    if (path_len == 0 || path_len >= PATH_MAX || path_len > rest || size > rest - path_len) {
+        errno = EPROTO;
+        return -1;
+    }
+    record->path = (const char *)payload + pos + PROTO_ENTRY_META_SIZE;
+    record->path_len = path_len;
+    record->body = payload + pos + PROTO_ENTRY_META_SIZE + path_len;
+    record->size = (size_t)size;
+    *offset = pos + PROTO_ENTRY_META_SIZE + path_len + (size_t)size;
+    return 1;
+}
@@ -0,0 +1,237 @@
+#ifndef MCSYNC_PROTOCOL_H
+#define MCSYNC_PROTOCOL_H
+
+#include "platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "delta.h"
+#include "hash.h"
+#include "manifest.h"
+
+/*
+ * Version 1 is the original line protocol. Version 2 is negotiated with a
+ * "HELLO <version> <caps>" line right after connect; from then on both sides
+ * exchange frames with a fixed 16-byte little-endian header:
+ *
+ *   u16 type | u16 flags | u32 request_id | u64 payload length
+ *
+ * A file entry's payload is u64 size, u32 path length, u32 reserved, the
+ * path and then the body, so bodies still stream straight from and to disk.
+ * Frames of unknown type are skipped by length.
+ */
+#define PROTO_VERSION_TEXT 1
+#define PROTO_VERSION_BINARY 2
+#define PROTO_HEADER_SIZE 16
+#define PROTO_ENTRY_META_SIZE 16
+
+/* optional features, negotiated per connection in HELLO */
+#define PROTO_CAP_BATCH 0x1u
+#define PROTO_CAP_CHUNKS 0x2u
+#define PROTO_CAP_INCREMENTAL 0x4u
+#define PROTO_CAP_DELTA 0x8u
+#define PROTO_CAP_REGION 0x10u
+#define PROTO_CAP_INCREMENTAL_PULL 0x20u
+/* everything after the HELLO exchange travels in compressed records, see conn.h */
+#define PROTO_CAP_COMPRESS 0x40u
+#define PROTO_CAP_HISTORY 0x80u
+#define PROTO_CAP_CLONE 0x100u
+#define PROTO_CAP_CATALOG 0x200u
+#define PROTO_CAPS_SUPPORTED \
+    (PROTO_CAP_BATCH | PROTO_CAP_CHUNKS | PROTO_CAP_INCREMENTAL | PROTO_CAP_DELTA | PROTO_CAP_REGION | \
+     PROTO_CAP_INCREMENTAL_PULL | PROTO_CAP_COMPRESS | PROTO_CAP_HISTORY | PROTO_CAP_CLONE | PROTO_CAP_CATALOG)
+
+/*
+ * A PUSH with PROTO_FLAG_CHUNKED sends the world as ENTRY_DIR and
+ * ENTRY_CHUNKED frames (the file's chunk hashes instead of its body) and
+ * END. The server answers with WANT frames listing the indexes of chunks
+ * it lacks and END, then the client sends those as CHUNK_DATA and END.
+ */
+#define PROTO_FLAG_CHUNKED 0x1u
+#define PROTO_CHUNK_REF_SIZE (HASH_SIZE + 4)
+
+/*
+ * A PUSH with PROTO_FLAG_INCREMENTAL sends ENTRY_DIR and ENTRY_DIGEST frames
+ * (size, mtime and digest of every file) and END. The server answers with
+ * WANT frames listing the entry indexes of the files it has no identical
+ * copy of and END; the client sends just those as ordinary entries and END.
+ * Whatever the manifest leaves out is deleted.
+ *
+ * With PROTO_CAP_INCREMENTAL_PULL, a PULL may carry the flag as well and is
+ * followed by the same frames for what the destination already holds. The
+ * reply lists the paths to remove as ENTRY_DELETE frames, then sends only
+ * the directories and files the destination lacks or holds otherwise.
+ */
+#define PROTO_FLAG_INCREMENTAL 0x2u
+#define PROTO_DIGEST_META_SIZE (PROTO_ENTRY_META_SIZE + 8 + HASH_SIZE)
+
+/*
+ * With PROTO_CAP_DELTA, whoever holds an old copy of a changed file sends a
+ * SIGNATURE frame for it (basis size, block size, path, then weak and
+ * strong sums per block) and the other side may answer with ENTRY_DELTA
+ * (new size, whole-file hash, path) followed by DELTA_COPY and DELTA_DATA
+ * frames and END instead of an ENTRY_FILE. On an incremental push the
+ * server sends signatures after its WANT list; a PULL with PROTO_FLAG_DELTA
+ * is followed by the client's signatures for the destination and END.
+ */
+#define PROTO_FLAG_DELTA 0x4u
+#define PROTO_DELTA_META_SIZE (PROTO_ENTRY_META_SIZE + HASH_SIZE)
+
+/*
+ * With PROTO_CAP_REGION as well, the signature of a region file may carry
+ * PROTO_FLAG_REGION: block size is the sector size and there is one block
+ * per chunk slot, its location and the hash of its sectors.
+ */
+#define PROTO_FLAG_REGION 0x8u
+
+/*
+ * With PROTO_CAP_HISTORY the server keeps older versions of each world. A
+ * LOG request names a world and is answered with COUNT, one VERSION frame
+ * per kept version, newest first, and DONE. A VERSION payload is u64
+ * version, i64 publication time, u64 total file size, u32 file count,
+ * u32 reserved and the storage format's name. A PULL may name a version
+ * as "<world>@<version>".
+ */
+#define PROTO_VERSION_META_SIZE 32
+
+/*
+ * With PROTO_CAP_CLONE, a CLONE request names "<source>[@<version>] <target>"
+ * and the server publishes a copy of the source as a new version of the
+ * target without any data crossing the wire. It answers with COUNT, the
+ * number of files cloned, and DONE.
+ */
+
+/*
+ * A binary LIST may name a prefix, and only worlds whose names start with
+ * it are listed. With PROTO_CAP_CATALOG each world comes as a WORLD_INFO
+ * frame instead of WORLD, laid out like VERSION with the world's name in
+ * place of the format: its current version, when that was pushed, its
+ * total file size and file count.
+ */
+/*
+ * An ENTRY_BATCH frame packs whole small files back to back, each laid out
+ * like an ENTRY_FILE payload (meta, path, body), so a world full of tiny
+ * .dat/.json files costs one frame per PROTO_BATCH_MAX bytes.
+ */
+#define PROTO_BATCH_MAX (1024 * 1024)
+/* bodies below the sendfile threshold are copied through user space anyway */
+#define PROTO_BATCH_FILE_MAX CONN_SENDFILE_MIN
+
+enum proto_type {
+    PROTO_UNKNOWN = -1,
+    PROTO_HELLO = 0x00,
+    PROTO_LIST = 0x01,
+    PROTO_PUSH = 0x02,
+    PROTO_PULL = 0x03,
+    PROTO_QUIT = 0x04,
+    PROTO_LOG = 0x05,
+    PROTO_CLONE = 0x06,
+    PROTO_OK = 0x10,
+    PROTO_FOUND = 0x11,
+    PROTO_DONE = 0x12,
+    PROTO_ERR = 0x13,
+    PROTO_WORLD = 0x14,
+    PROTO_COUNT = 0x15,
+    PROTO_VERSION = 0x16,
+    PROTO_WORLD_INFO = 0x17,
+    PROTO_ENTRY_DIR = 0x20,
+    PROTO_ENTRY_FILE = 0x21,
+    PROTO_END = 0x22,
+    PROTO_ENTRY_BATCH = 0x23,
+    PROTO_ENTRY_CHUNKED = 0x24,
+    PROTO_WANT = 0x25,
+    PROTO_CHUNK_DATA = 0x26,
+    PROTO_ENTRY_DIGEST = 0x27,
+    PROTO_SIGNATURE = 0x28,
+    PROTO_ENTRY_DELTA = 0x29,
+    PROTO_DELTA_COPY = 0x2a,
+    PROTO_DELTA_DATA = 0x2b,
+    PROTO_ENTRY_DELETE = 0x2c
+};
+
+typedef struct {
+    int type;
+    uint16_t flags;
+    uint32_t request_id;
+    /*
+     * ENTRY_FILE body size, ENTRY_BATCH payload size, CHUNK_DATA length,
+     * COUNT value, SIGNATURE basis size, DELTA_COPY or DELTA_DATA length,
+     * VERSION or WORLD_INFO total file size
+     */
+    unsigned long long size;
+    /* DELTA_COPY basis offset */
+    unsigned long long offset;
+    uint32_t block_size;
+    /* ENTRY_CHUNKED chunk refs or WANT indexes that follow, read by the caller; VERSION or WORLD_INFO file count */
+    uint32_t count;
+    /* VERSION number, or WORLD_INFO current version */
+    unsigned long long seq;
+    /* CHUNK_DATA hash, ENTRY_DIGEST digest or ENTRY_DELTA whole-file hash */
+    unsigned char hash[HASH_SIZE];
+    /* ENTRY_DIGEST mtime, VERSION publication time or WORLD_INFO last push */
+    int64_t mtime;
+    unsigned int version;
+    uint32_t caps;
+    /* world name, entry path, error message or VERSION format; WORLD_INFO world name */
+    size_t text_len;
+    char text[PATH_MAX];
+} proto_msg_t;
+
+int proto_client_hello(mc_conn_t *conn);
+int proto_server_hello(mc_conn_t *conn, const proto_msg_t *hello, unsigned int server_caps);
+
+int proto_send_request(mc_conn_t *conn, int type, uint16_t flags, uint32_t request_id, const char *name);
+int proto_try_recv_request(mc_conn_t *conn, proto_msg_t *msg);
+
+int proto_begin_reply(mc_conn_t *conn, uint32_t request_id);
+int proto_send_status(mc_conn_t *conn, int type);
+int proto_send_error(mc_conn_t *conn, const char *message);
+int proto_send_count(mc_conn_t *conn, unsigned long long count);
+int proto_send_world(mc_conn_t *conn, const char *name, size_t name_len);
+int proto_send_version(mc_conn_t *conn, unsigned long long seq, int64_t created, unsigned long long bytes, uint32_t files,
+                       const char *format);
+int proto_send_world_info(mc_conn_t *conn, const char *name, unsigned long long seq, int64_t pushed, unsigned long long bytes,
+                          uint32_t files);
+int proto_send_entry_dir(mc_conn_t *conn, const char *path, size_t path_len);
+int proto_send_entry_file(mc_conn_t *conn, const char *path, size_t path_len, unsigned long long size);
+int proto_send_end(mc_conn_t *conn);
+int proto_send_entry_chunked(mc_conn_t *conn, const manifest_t *manifest, const manifest_entry_t *entry);
+int proto_send_entry_digest(mc_conn_t *conn, const manifest_entry_t *entry);
+int proto_send_wants(mc_conn_t *conn, const uint32_t *indexes, size_t count);
+int proto_send_entry_delete(mc_conn_t *conn, const char *path, size_t path_len);
+int proto_send_signature(mc_conn_t *conn, const char *path, const delta_signature_t *signature);
+int proto_send_entry_delta(mc_conn_t *conn, const char *path, size_t path_len, unsigned long long size, const unsigned char hash[HASH_SIZE]);
+int proto_send_delta_copy(mc_conn_t *conn, unsigned long long offset, unsigned long long length);
+int proto_send_delta_data(mc_conn_t *conn, const void *data, size_t length);
+int proto_send_chunk_data(mc_conn_t *conn, const manifest_chunk_t *chunk);
+
+int proto_recv(mc_conn_t *conn, proto_msg_t *msg);
+int proto_recv_chunk_refs(mc_conn_t *conn, manifest_t *manifest, uint32_t count);
+int proto_recv_indexes(mc_conn_t *conn, uint32_t *indexes, uint32_t count);
+int proto_recv_signatures(mc_conn_t *conn, delta_basis_set_t *set);
+int proto_recv_digests(mc_conn_t *conn, manifest_t *manifest);
+/* 0 if a path sent by the peer stays inside the tree: relative, no NUL, no empty, "." or ".." components */
+int proto_check_path(const char *path, size_t path_len);
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+} proto_batch_t;
+
+typedef struct {
+    const char *path;
+    size_t path_len;
+    const unsigned char *body;
+    size_t size;
+} proto_batch_record_t;
+
+int proto_batch_init(proto_batch_t *batch);
+void proto_batch_free(proto_batch_t *batch);
+unsigned char *proto_batch_reserve(mc_conn_t *conn, proto_batch_t *batch, const char *path, size_t path_len, size_t size);
+int proto_batch_add_file(mc_conn_t *conn, proto_batch_t *batch, const char *path, size_t path_len, int fd, size_t size);
+int proto_batch_flush(mc_conn_t *conn, proto_batch_t *batch);
+int proto_batch_next(const unsigned char *payload, size_t length, size_t *offset, proto_batch_record_t *record);
+
+#endif /* MCSYNC_PROTOCOL_H */
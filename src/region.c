@@ -0,0 +1,54 @@
+#include "region.h"
+
+#include <errno.h>
+#include <string.h>
+
+static const char *const region_dirs[] = { "region", "entities", "poi" };
+
+/* by name only; the content is checked when the file is read */
+int region_is_path(const char *relative) {
+    size_t len = strlen(relative);
+    if (len < 4 || strcmp(relative + len - 4, ".mca") != 0) {
+        return 0;
+    }
+    const char *name = strrchr(relative, '/');
+    if (!name) {
+        return 0;
+    }
+    const char *parent = name;
+    while (parent > relative && parent[-1] != '/') {
+        --parent;
+    }
+    for (size_t i = 0; i < sizeof(region_dirs) / sizeof(region_dirs[0]); ++i) {
+        size_t dir_len = strlen(region_dirs[i]);
+        if ((size_t)(name - parent) == dir_len && memcmp(parent, region_dirs[i], dir_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int region_read_locations(const unsigned char *data, size_t size, uint32_t locations[REGION_CHUNKS]) {
+    if (size < REGION_HEADER_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t sectors = size / REGION_SECTOR_SIZE;
+    for (size_t i = 0; i < REGION_CHUNKS; ++i) {
+        const unsigned char *entry = data + i * 4;
+        uint32_t location = (uint32_t)entry[0] << 24 | (uint32_t)entry[1] << 16 | (uint32_t)entry[2] << 8 | entry[3];
+        uint32_t first = REGION_FIRST_SECTOR(location);
+        uint32_t count = REGION_SECTOR_COUNT(location);
+        if (count == 0) {
+            /* the game treats a slot without sectors as absent, whatever its offset */
+            locations[i] = 0;
+            continue;
+        }
+        if (first < REGION_HEADER_SIZE / REGION_SECTOR_SIZE || first + count > sectors) {
+            errno = EINVAL;
+            return -1;
+        }
+        locations[i] = location;
+    }
+    return 0;
+}
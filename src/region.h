@@ -0,0 +1,24 @@
+#ifndef MCSYNC_REGION_H
+#define MCSYNC_REGION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Anvil region files (r.X.Z.mca under region/, entities/ and poi/ of every
+ * dimension): a table of 1024 chunk locations, a table of 1024 chunk
+ * timestamps, then each chunk's compressed payload in whole 4 KiB sectors.
+ * A location is a big-endian u32 of first sector << 8 | sector count.
+ */
+#define REGION_SECTOR_SIZE 4096
+#define REGION_CHUNKS 1024
+#define REGION_HEADER_SIZE (2 * REGION_SECTOR_SIZE)
+
+#define REGION_FIRST_SECTOR(location) ((location) >> 8)
+#define REGION_SECTOR_COUNT(location) ((location) & 0xffu)
+
+int region_is_path(const char *relative);
+/* fails with EINVAL unless every chunk lies within size past the header */
+int region_read_locations(const unsigned char *data, size_t size, uint32_t locations[REGION_CHUNKS]);
+
+#endif /* MCSYNC_REGION_H */
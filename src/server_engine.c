@@ -0,0 +1,359 @@
+#include "platform.h"
+#include "server_engine.h"
+
+#include "common.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define EPOLL_TIMEOUT_MS 500
+/* a transfer whose peer sends or takes nothing for this long gives its worker back */
+#define IO_TIMEOUT_SECONDS 120
+/* a peer that vanished without a FIN is found after about two minutes of silence */
+#define KEEPALIVE_IDLE_SECONDS 60
+#define KEEPALIVE_INTERVAL_SECONDS 10
+#define KEEPALIVE_PROBES 6
+
+/*
+ * Connections wait for their next request in epoll; only a connection
+ * with a complete command occupies a worker, so idle sessions or
+ * slow-to-speak clients never hold up anyone else.
+ *
+ * The -t workers run anything. One more worker reads requests too but
+ * only runs quick ones (HELLO, LIST, LOG, QUIT) and queues the rest for
+ * the others, so listing worlds never waits behind long pushes and pulls.
+ */
+enum conn_state {
+    CONN_READ_COMMAND,
+    CONN_RUN_COMMAND,
+    CONN_CLOSING
+};
+
+typedef struct server_conn {
+    int fd;
+    enum conn_state state;
+    mc_conn_t io;
+    proto_msg_t request;
+    /* request holds a command the quick worker passed on, not yet run */
+    int request_pending;
+    struct server_conn *next_ready;
+    struct server_conn *prev;
+    struct server_conn *next;
+} server_conn_t;
+
+typedef struct {
+    const server_engine_config_t *config;
+    int epoll_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    server_conn_t *ready_head;
+    server_conn_t *ready_tail;
+    /* commands read by the quick worker, waiting for a transfer worker */
+    server_conn_t *transfer_head;
+    server_conn_t *transfer_tail;
+    server_conn_t *conns;
+    int stopping;
+} server_engine_t;
+
+typedef struct {
+    server_engine_t *engine;
+    pthread_t thread;
+    int quick;
+} server_worker_t;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* failures only cost the protection, so they are ignored */
+static void set_timeouts(int fd) {
+    struct timeval timeout = { IO_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    int idle = KEEPALIVE_IDLE_SECONDS;
+    int interval = KEEPALIVE_INTERVAL_SECONDS;
+    int probes = KEEPALIVE_PROBES;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+}
+
+static int arm_conn(server_engine_t *engine, server_conn_t *conn, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    return epoll_ctl(engine->epoll_fd, op, conn->fd, &ev);
+}
+
+static void destroy_conn(server_engine_t *engine, server_conn_t *conn) {
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    pthread_mutex_lock(&engine->lock);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        engine->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&engine->lock);
+    conn_destroy(&conn->io);
+    close(conn->fd);
+    free(conn);
+}
+
+static void accept_clients(server_engine_t *engine) {
+    while (1) {
+        int fd = accept4(engine->config->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        set_timeouts(fd);
+        server_conn_t *conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->state = CONN_READ_COMMAND;
+        if (conn_init(&conn->io, fd) < 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_mutex_lock(&engine->lock);
+        conn->next = engine->conns;
+        if (engine->conns) {
+            engine->conns->prev = conn;
+        }
+        engine->conns = conn;
+        pthread_mutex_unlock(&engine->lock);
+        if (arm_conn(engine, conn, EPOLL_CTL_ADD) < 0) {
+            destroy_conn(engine, conn);
+        }
+    }
+}
+
+/* lock held */
+static void push_conn(server_conn_t **head, server_conn_t **tail, server_conn_t *conn) {
+    conn->next_ready = NULL;
+    if (*tail) {
+        (*tail)->next_ready = conn;
+    } else {
+        *head = conn;
+    }
+    *tail = conn;
+}
+
+/* lock held */
+static server_conn_t *pop_conn(server_conn_t **head, server_conn_t **tail) {
+    server_conn_t *conn = *head;
+    if (conn) {
+        *head = conn->next_ready;
+        if (!*head) {
+            *tail = NULL;
+        }
+    }
+    return conn;
+}
+
+static void enqueue_ready(server_engine_t *engine, server_conn_t *conn) {
+    pthread_mutex_lock(&engine->lock);
+    push_conn(&engine->ready_head, &engine->ready_tail, conn);
+    /* both kinds of worker wait on the one condition, so a single wakeup could go to the wrong kind */
+    pthread_cond_broadcast(&engine->ready_cond);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+static int is_quick(const proto_msg_t *request) {
+    return request->type == PROTO_HELLO || request->type == PROTO_LIST || request->type == PROTO_LOG || request->type == PROTO_QUIT;
+}
+
+static void step_conn(server_engine_t *engine, server_conn_t *conn, int quick) {
+    /* pipelined commands already in the buffer run back to back without a trip through epoll */
+    while (1) {
+        /* the socket stays blocking; waiting for a command only reads with MSG_DONTWAIT */
+        int rc = conn->request_pending ? 1 : proto_try_recv_request(&conn->io, &conn->request);
+        conn->request_pending = 0;
+        if (rc > 0 && quick && !is_quick(&conn->request)) {
+            pthread_mutex_lock(&engine->lock);
+            conn->request_pending = 1;
+            push_conn(&engine->transfer_head, &engine->transfer_tail, conn);
+            pthread_cond_broadcast(&engine->ready_cond);
+            pthread_mutex_unlock(&engine->lock);
+            return;
+        }
+        if (rc == 0) {
+            if (arm_conn(engine, conn, EPOLL_CTL_MOD) < 0) {
+                destroy_conn(engine, conn);
+            }
+            return;
+        }
+        if (rc < 0) {
+            destroy_conn(engine, conn);
+            return;
+        }
+        pthread_mutex_lock(&engine->lock);
+        conn->state = engine->stopping ? CONN_CLOSING : CONN_RUN_COMMAND;
+        pthread_mutex_unlock(&engine->lock);
+        if (conn->state == CONN_CLOSING) {
+            destroy_conn(engine, conn);
+            return;
+        }
+        int keep = engine->config->on_command(&conn->io, &conn->request, engine->config->ctx);
+        if (conn_flush(&conn->io) < 0) {
+            keep = -1;
+        }
+        pthread_mutex_lock(&engine->lock);
+        conn->state = keep == 0 && !engine->stopping ? CONN_READ_COMMAND : CONN_CLOSING;
+        pthread_mutex_unlock(&engine->lock);
+        if (conn->state == CONN_CLOSING) {
+            destroy_conn(engine, conn);
+            return;
+        }
+    }
+}
+
+/* transfer workers take commands the quick worker passed on before reading new ones */
+static void *worker_main(void *arg) {
+    server_worker_t *self = arg;
+    server_engine_t *engine = self->engine;
+    while (1) {
+        pthread_mutex_lock(&engine->lock);
+        while (!engine->ready_head && (self->quick || !engine->transfer_head) && !engine->stopping) {
+            pthread_cond_wait(&engine->ready_cond, &engine->lock);
+        }
+        server_conn_t *conn = self->quick ? NULL : pop_conn(&engine->transfer_head, &engine->transfer_tail);
+        if (!conn) {
+            conn = pop_conn(&engine->ready_head, &engine->ready_tail);
+        }
+        pthread_mutex_unlock(&engine->lock);
+        if (!conn) {
+            return NULL;
+        }
+        step_conn(engine, conn, self->quick);
+    }
+}
+
+int server_engine_default_workers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 2) {
+        cpus = 2;
+    }
+    return (int)(cpus * 2);
+}
+
+int server_engine_run(const server_engine_config_t *config, volatile sig_atomic_t *keep_running) {
+    server_engine_t engine;
+    memset(&engine, 0, sizeof(engine));
+    engine.config = config;
+    if (set_nonblocking(config->listen_fd) < 0) {
+        return -1;
+    }
+    engine.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine.epoll_fd < 0) {
+        return -1;
+    }
+    struct epoll_event listen_ev;
+    memset(&listen_ev, 0, sizeof(listen_ev));
+    listen_ev.events = EPOLLIN;
+    listen_ev.data.ptr = NULL;
+    if (epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, config->listen_fd, &listen_ev) < 0) {
+        close(engine.epoll_fd);
+        return -1;
+    }
+    pthread_mutex_init(&engine.lock, NULL);
+    pthread_cond_init(&engine.ready_cond, NULL);
+
+    /* the last one is the quick worker */
+    int worker_count = (config->worker_count > 0 ? config->worker_count : server_engine_default_workers()) + 1;
+    server_worker_t *workers = calloc((size_t)worker_count, sizeof(*workers));
+    if (!workers) {
+        close(engine.epoll_fd);
+        return -1;
+    }
+    /* workers must not swallow SIGINT/SIGTERM meant for the event loop */
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    int started = 0;
+    for (; started < worker_count; ++started) {
+        workers[started].engine = &engine;
+        workers[started].quick = started == worker_count - 1;
+        if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    /* without the quick worker the others still run everything */
+    int rc = started > 0 ? 0 : -1;
+    struct epoll_event events[MAX_EVENTS];
+    while (rc == 0 && *keep_running) {
+        int ready = epoll_wait(engine.epoll_fd, events, MAX_EVENTS, EPOLL_TIMEOUT_MS);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            rc = -1;
+            break;
+        }
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(&engine);
+            } else {
+                enqueue_ready(&engine, events[i].data.ptr);
+            }
+        }
+    }
+
+    /* unblock in-flight transfers so workers can drain and exit */
+    pthread_mutex_lock(&engine.lock);
+    engine.stopping = 1;
+    for (server_conn_t *conn = engine.conns; conn; conn = conn->next) {
+        if (conn->state == CONN_RUN_COMMAND) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    pthread_cond_broadcast(&engine.ready_cond);
+    pthread_mutex_unlock(&engine.lock);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    while (engine.conns) {
+        destroy_conn(&engine, engine.conns);
+    }
+    close(engine.epoll_fd);
+    pthread_cond_destroy(&engine.ready_cond);
+    pthread_mutex_destroy(&engine.lock);
+    return rc;
+}
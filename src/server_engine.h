@@ -0,0 +1,26 @@
+#ifndef MCSYNC_SERVER_ENGINE_H
+#define MCSYNC_SERVER_ENGINE_H
+
+#include <signal.h>
+
+#include "conn.h"
+#include "protocol.h"
+
+/*
+ * Called on a worker thread with the socket in blocking mode once a whole
+ * request, including its world name, has been buffered. Returning 0
+ * keeps the session open for the next command, -1 closes it.
+ */
+typedef int (*server_command_fn)(mc_conn_t *conn, const proto_msg_t *request, void *ctx);
+
+typedef struct {
+    int listen_fd;
+    int worker_count;
+    server_command_fn on_command;
+    void *ctx;
+} server_engine_config_t;
+
+int server_engine_default_workers(void);
+int server_engine_run(const server_engine_config_t *config, volatile sig_atomic_t *keep_running);
+
+#endif /* MCSYNC_SERVER_ENGINE_H */
@@ -0,0 +1,384 @@
+#include "platform.h"
+#include "stat_index.h"
+
+#include "common.h"
+#include "fs_utils.h"
+#include "hash.h"
+#include "hash_pool.h"
+#include "walker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "MCSYNCX1"
+/* magic, entry count, chunk count, trusted_before, string table length */
+#define INDEX_HEADER_SIZE 40
+/* path offset, path length, reserved, size, mtime, ctime, inode, device, first chunk, chunk count, digest */
+#define INDEX_RECORD_SIZE (8 + 4 + 4 + 8 + 8 + 8 + 8 + 8 + 8 + 8 + HASH_SIZE)
+#define INDEX_CHUNK_SIZE (HASH_SIZE + 4)
+/*
+ * A file written in the same timestamp tick as it was scanned can change
+ * again without its mtime moving, so files touched this close to a scan
+ * are read again next time.
+ */
+#define RACY_WINDOW_NS 1000000000LL
+
+static int64_t timespec_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void stat_of(const struct stat *st, stat_index_stat_t *out) {
+    out->size = (unsigned long long)st->st_size;
+    out->mtime = timespec_ns(&st->st_mtim);
+    out->ctime = timespec_ns(&st->st_ctim);
+    out->inode = (uint64_t)st->st_ino;
+    out->device = (uint64_t)st->st_dev;
+}
+
+static void unmap(stat_index_t *index) {
+    if (index->map) {
+        munmap((void *)index->map, index->map_len);
+    }
+    index->map = NULL;
+    index->map_len = 0;
+    index->entry_count = 0;
+    index->chunk_count = 0;
+}
+
+/* maps the index at index->path if it is there and well formed */
+static void map_index(stat_index_t *index) {
+    int fd = open(index->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < INDEX_HEADER_SIZE) {
+        close(fd);
+        return;
+    }
+    size_t len = (size_t)st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    const unsigned char *header = map;
+    uint64_t entry_count = get_le64(header + 8);
+    uint64_t chunk_count = get_le64(header + 16);
+    uint64_t strings_len = get_le64(header + 32);
+    size_t body = len - INDEX_HEADER_SIZE;
+    if (memcmp(header, INDEX_MAGIC, 8) != 0 || entry_count > body / INDEX_RECORD_SIZE ||
+        chunk_count > (body - entry_count * INDEX_RECORD_SIZE) / INDEX_CHUNK_SIZE ||
+        strings_len != body - entry_count * INDEX_RECORD_SIZE - chunk_count * INDEX_CHUNK_SIZE) {
+        munmap(map, len);
+        return;
+    }
+    index->map = map;
+    index->map_len = len;
+    index->entry_count = (size_t)entry_count;
+    index->chunk_count = (size_t)chunk_count;
+    index->trusted_before = (int64_t)get_le64(header + 24);
+}
+
+int stat_index_open(stat_index_t *index, const char *state_dir, const char *tree_dir) {
+    memset(index, 0, sizeof(*index));
+    if (getenv("MCSYNC_NO_INDEX")) {
+        return 0;
+    }
+    char real[PATH_MAX];
+    if (!realpath(tree_dir, real)) {
+        return -1;
+    }
+    unsigned char key[HASH_SIZE];
+    char hex[HASH_HEX_SIZE];
+    hash_buffer(real, strlen(real), key);
+    hash_to_hex(key, hex);
+    if (snprintf(index->path, sizeof(index->path), "%s/index/%s", state_dir, hex) >= (int)sizeof(index->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    map_index(index);
+    return 0;
+}
+
+void stat_index_close(stat_index_t *index) {
+    unmap(index);
+    free(index->stats);
+    free(index->pending);
+    index->stats = NULL;
+    index->stat_capacity = 0;
+    index->pending = NULL;
+    index->pending_count = 0;
+    index->pending_capacity = 0;
+}
+
+static const unsigned char *record_at(const stat_index_t *index, size_t i) {
+    return index->map + INDEX_HEADER_SIZE + i * INDEX_RECORD_SIZE;
+}
+
+static const unsigned char *chunk_at(const stat_index_t *index, size_t i) {
+    return index->map + INDEX_HEADER_SIZE + index->entry_count * INDEX_RECORD_SIZE + i * INDEX_CHUNK_SIZE;
+}
+
+static const char *strings(const stat_index_t *index) {
+    return (const char *)chunk_at(index, index->chunk_count);
+}
+
+/* the record for path, by binary search over the mapped records */
+static const unsigned char *find_record(const stat_index_t *index, const char *path) {
+    size_t path_len = strlen(path);
+    size_t strings_len = index->map_len - (size_t)((const unsigned char *)strings(index) - index->map);
+    size_t lo = 0;
+    size_t hi = index->entry_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const unsigned char *record = record_at(index, mid);
+        uint64_t offset = get_le64(record);
+        uint32_t len = get_le32(record + 8);
+        if (offset > strings_len || len > strings_len - offset) {
+            return NULL;
+        }
+        int cmp = memcmp(path, strings(index) + offset, path_len < len ? path_len : len);
+        if (cmp == 0) {
+            cmp = path_len < len ? -1 : path_len > len;
+        }
+        if (cmp == 0) {
+            return record;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static int record_stat(stat_index_t *index, size_t entry, const stat_index_stat_t *st) {
+    if (entry >= index->stat_capacity) {
+        size_t capacity = index->stat_capacity ? index->stat_capacity * 2 : 1024;
+        while (capacity <= entry) {
+            capacity *= 2;
+        }
+        stat_index_stat_t *grown = realloc(index->stats, capacity * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        index->stats = grown;
+        index->stat_capacity = capacity;
+    }
+    index->stats[entry] = *st;
+    return 0;
+}
+
+/* lists a file whose stat changed, to be read on the hash pool once the walk is done */
+static int add_pending(stat_index_t *index, manifest_t *manifest, const char *relative, const stat_index_stat_t *st) {
+    if (index->pending_count == index->pending_capacity) {
+        size_t capacity = index->pending_capacity ? index->pending_capacity * 2 : 256;
+        uint32_t *grown = realloc(index->pending, capacity * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        index->pending = grown;
+        index->pending_capacity = capacity;
+    }
+    index->pending[index->pending_count++] = (uint32_t)manifest->entry_count;
+    return manifest_add_entry(manifest, MANIFEST_FILE, relative, strlen(relative), st->size);
+}
+
+/* appends the file from its record if the stat still matches; 1 if it did */
+static int reuse_record(stat_index_t *index, manifest_t *manifest, const char *relative, const stat_index_stat_t *st) {
+    const unsigned char *record = index->map ? find_record(index, relative) : NULL;
+    if (!record || get_le64(record + 16) != st->size || (int64_t)get_le64(record + 24) != st->mtime ||
+        (int64_t)get_le64(record + 32) != st->ctime || get_le64(record + 40) != st->inode || get_le64(record + 48) != st->device ||
+        st->mtime >= index->trusted_before || st->ctime >= index->trusted_before) {
+        return 0;
+    }
+    uint64_t first_chunk = get_le64(record + 56);
+    uint64_t chunk_count = get_le64(record + 64);
+    if (first_chunk > index->chunk_count || chunk_count > index->chunk_count - first_chunk) {
+        return 0;
+    }
+    if (manifest_add_entry(manifest, MANIFEST_FILE, relative, strlen(relative), st->size) < 0) {
+        return -1;
+    }
+    for (uint64_t c = first_chunk; c < first_chunk + chunk_count; ++c) {
+        const unsigned char *chunk = chunk_at(index, (size_t)c);
+        if (manifest_add_chunk(manifest, chunk, get_le32(chunk + HASH_SIZE)) < 0) {
+            return -1;
+        }
+    }
+    manifest_entry_t *entry = &manifest->entries[manifest->entry_count - 1];
+    entry->mtime = st->mtime;
+    memcpy(entry->digest, record + 72, HASH_SIZE);
+    return 1;
+}
+
+static int scan_tree(stat_index_t *index, manifest_t *manifest, const char *tree_dir) {
+    walker_t walker;
+    if (walker_open(&walker, tree_dir) < 0) {
+        return -1;
+    }
+    walker_entry_t entry;
+    int rc;
+    while ((rc = walker_next(&walker, &entry)) > 0) {
+        stat_index_stat_t seen;
+        memset(&seen, 0, sizeof(seen));
+        if (entry.kind == WALKER_DIR) {
+            rc = manifest_add_entry(manifest, MANIFEST_DIR, entry.path, entry.path_len, 0);
+            if (rc == 0) {
+                rc = record_stat(index, manifest->entry_count - 1, &seen);
+            }
+        } else if (entry.kind == WALKER_FILE) {
+            /* stat before reading, so a write racing the read shows up as a change next time */
+            stat_of(entry.st, &seen);
+            rc = reuse_record(index, manifest, entry.path, &seen);
+            if (rc == 0) {
+                rc = add_pending(index, manifest, entry.path, &seen);
+            }
+            if (rc >= 0) {
+                rc = record_stat(index, manifest->entry_count - 1, &seen);
+            }
+        }
+        if (rc < 0) {
+            break;
+        }
+    }
+    walker_close(&walker);
+    return rc;
+}
+
+int stat_index_scan(stat_index_t *index, const char *tree_dir, manifest_t *manifest, size_t *hashed) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    index->scan_started = timespec_ns(&now);
+    index->pending_count = 0;
+    int rc = scan_tree(index, manifest, tree_dir);
+    if (rc == 0) {
+        rc = hash_pool_scan(manifest, tree_dir, index->pending, index->pending_count);
+    }
+    *hashed = index->pending_count;
+    return rc;
+}
+
+static int compare_entry_paths(const void *a, const void *b) {
+    const manifest_entry_t *left = *(const manifest_entry_t *const *)a;
+    const manifest_entry_t *right = *(const manifest_entry_t *const *)b;
+    return strcmp(left->path, right->path);
+}
+
+/* files holds the manifest's file entries sorted by path */
+static int write_index(FILE *fp, const stat_index_t *index, const manifest_t *manifest, const manifest_entry_t **files, size_t file_count) {
+    uint64_t chunk_count = 0;
+    uint64_t strings_len = 0;
+    for (size_t i = 0; i < file_count; ++i) {
+        chunk_count += files[i]->chunk_count;
+        strings_len += strlen(files[i]->path);
+    }
+    unsigned char header[INDEX_HEADER_SIZE];
+    memcpy(header, INDEX_MAGIC, 8);
+    put_le64(header + 8, file_count);
+    put_le64(header + 16, chunk_count);
+    put_le64(header + 24, (uint64_t)(index->scan_started - RACY_WINDOW_NS));
+    put_le64(header + 32, strings_len);
+    int ok = fwrite(header, sizeof(header), 1, fp) == 1;
+    uint64_t next_chunk = 0;
+    uint64_t next_string = 0;
+    for (size_t i = 0; ok && i < file_count; ++i) {
+        const manifest_entry_t *entry = files[i];
+        const stat_index_stat_t *st = &index->stats[entry - manifest->entries];
+        size_t path_len = strlen(entry->path);
+        unsigned char record[INDEX_RECORD_SIZE];
+        put_le64(record, next_string);
+        put_le32(record + 8, (uint32_t)path_len);
+        put_le32(record + 12, 0);
+        put_le64(record + 16, st->size);
+        put_le64(record + 24, (uint64_t)st->mtime);
+        put_le64(record + 32, (uint64_t)st->ctime);
+        put_le64(record + 40, st->inode);
+        put_le64(record + 48, st->device);
+        put_le64(record + 56, next_chunk);
+        put_le64(record + 64, entry->chunk_count);
+        memcpy(record + 72, entry->digest, HASH_SIZE);
+        ok = fwrite(record, sizeof(record), 1, fp) == 1;
+        next_chunk += entry->chunk_count;
+        next_string += path_len;
+    }
+    for (size_t i = 0; ok && i < file_count; ++i) {
+        const manifest_entry_t *entry = files[i];
+        for (size_t c = 0; ok && c < entry->chunk_count; ++c) {
+            const manifest_chunk_t *chunk = &manifest->chunks[entry->first_chunk + c];
+            unsigned char record[INDEX_CHUNK_SIZE];
+            memcpy(record, chunk->hash, HASH_SIZE);
+            put_le32(record + HASH_SIZE, chunk->length);
+            ok = fwrite(record, sizeof(record), 1, fp) == 1;
+        }
+    }
+    for (size_t i = 0; ok && i < file_count; ++i) {
+        const char *path = files[i]->path;
+        ok = fwrite(path, 1, strlen(path), fp) == strlen(path);
+    }
+    return ok ? 0 : -1;
+}
+
+int stat_index_save(stat_index_t *index, const manifest_t *manifest) {
+    if (index->path[0] == '\0') {
+        return 0;
+    }
+    if (manifest->entry_count > index->stat_capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+    char dir[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    const char *slash = strrchr(index->path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - index->path), index->path);
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmpXXXXXX", index->path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    const manifest_entry_t **files = malloc((manifest->entry_count + 1) * sizeof(*files));
+    if (!files) {
+        return -1;
+    }
+    size_t file_count = 0;
+    for (size_t i = 0; i < manifest->entry_count; ++i) {
+        if (manifest->entries[i].type == MANIFEST_FILE) {
+            files[file_count++] = &manifest->entries[i];
+        }
+    }
+    qsort(files, file_count, sizeof(*files), compare_entry_paths);
+    int fd = ensure_directory(dir, 0755) == 0 ? mkstemp(tmp_path) : -1;
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!fp) {
+        int saved = errno;
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(files);
+        errno = saved;
+        return -1;
+    }
+    int rc = write_index(fp, index, manifest, files, file_count);
+    if (fclose(fp) != 0) {
+        rc = -1;
+    }
+    free(files);
+    if (rc == 0) {
+        rc = rename(tmp_path, index->path);
+    }
+    if (rc < 0) {
+        int saved = errno;
+        unlink(tmp_path);
+        errno = saved;
+    }
+    return rc;
+}
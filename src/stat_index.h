@@ -0,0 +1,54 @@
+#ifndef MCSYNC_STAT_INDEX_H
+#define MCSYNC_STAT_INDEX_H
+
+#include "platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "manifest.h"
+
+/*
+ * The client's cache of what it last scanned in a tree, kept in
+ * <state_dir>/index/<hash of the tree's real path>. Each file's record
+ * holds its size, mtime, ctime, inode and device next to its digest and
+ * chunk list, so a scan only reads the files whose stat changed. The file
+ * is mapped and searched in place: a header, fixed-size records sorted by
+ * path, the chunk table, then the path strings.
+ */
+typedef struct {
+    unsigned long long size;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t inode;
+    uint64_t device;
+} stat_index_stat_t;
+
+typedef struct {
+    /* empty when the index is turned off */
+    char path[PATH_MAX];
+    const unsigned char *map;
+    size_t map_len;
+    size_t entry_count;
+    size_t chunk_count;
+    /* records last changed at or after this may have changed again unseen */
+    int64_t trusted_before;
+    /* the stat each entry of the last scanned manifest was read with */
+    stat_index_stat_t *stats;
+    size_t stat_capacity;
+    int64_t scan_started;
+    /* entries of the last scan whose file had to be read */
+    uint32_t *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+} stat_index_t;
+
+/* a missing or unreadable index is not an error; the scan just reads every file */
+int stat_index_open(stat_index_t *index, const char *state_dir, const char *tree_dir);
+void stat_index_close(stat_index_t *index);
+/* like manifest_scan_dir, taking unchanged files from the index; hashed counts the files read */
+int stat_index_scan(stat_index_t *index, const char *tree_dir, manifest_t *manifest, size_t *hashed);
+/* replaces the index with manifest, which must come from the last scan */
+int stat_index_save(stat_index_t *index, const manifest_t *manifest);
+
+#endif /* MCSYNC_STAT_INDEX_H */
@@ -0,0 +1,342 @@
+#include "platform.h"
+#include "trash.h"
+
+#include "fs_utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* how many unlinks pass between looks at the clock and at trash_close, fewer at rates below it */
+#define TRASH_CHECK_EVERY 64
+/* how often a long run logs what is still pending */
+#define TRASH_REPORT_SECONDS 60
+
+typedef struct {
+    trash_t *trash;
+    struct timespec start;
+    struct timespec reported;
+    unsigned long long files;
+    unsigned long long bytes;
+    int stopped;
+} reap_run_t;
+
+static int join_paths(const char *a, const char *b, char *out, size_t out_len) {
+    if (snprintf(out, out_len, "%s/%s", a, b) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static void enqueue(trash_t *trash, trash_item_t *item) {
+    pthread_mutex_lock(&trash->lock);
+    *trash->queue_tail = item;
+    trash->queue_tail = &item->next;
+    pthread_cond_signal(&trash->wake);
+    pthread_mutex_unlock(&trash->lock);
+}
+
+/* a file linked from anywhere else frees nothing when the trash lets go of it */
+static unsigned long long measure(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return S_ISREG(st.st_mode) && st.st_nlink == 1 ? (unsigned long long)st.st_size : 0;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    unsigned long long bytes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char child[PATH_MAX];
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+            join_paths(path, entry->d_name, child, sizeof(child)) == 0) {
+            bytes += measure(child);
+        }
+    }
+    closedir(dir);
+    return bytes;
+}
+
+/*
+ * Keeps the run at or below rate unlinks per second; fails once trash_close
+ * asks the reaper to stop. The pause is a wait on wake, which trash_close
+ * signals, so even a rate of 1 never holds up shutdown.
+ */
+static int throttle(reap_run_t *run) {
+    trash_t *trash = run->trash;
+    unsigned int every = trash->rate > 0 && trash->rate < TRASH_CHECK_EVERY ? trash->rate : TRASH_CHECK_EVERY;
+    if (run->files % every != 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&trash->lock);
+    if (trash->rate > 0) {
+        /* the moment the run may have unlinked this many files */
+        unsigned long long due_ns = run->files * 1000000000ull / trash->rate;
+        struct timespec due = run->start;
+        due.tv_sec += (time_t)(due_ns / 1000000000ull);
+        due.tv_nsec += (long)(due_ns % 1000000000ull);
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        /* wake is also signalled by new discards; those just go back to waiting */
+        int rc = 0;
+        while (!trash->stopping && rc == 0) {
+            rc = pthread_cond_timedwait(&trash->wake, &trash->lock, &due);
+        }
+    }
+    int stop = trash->stopping;
+    unsigned long long pending = trash->pending_bytes;
+    pthread_mutex_unlock(&trash->lock);
+    if (stop) {
+        run->stopped = 1;
+        errno = EINTR;
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - run->reported.tv_sec >= TRASH_REPORT_SECONDS) {
+        run->reported = now;
+        printf("reclaiming trash: %llu files, %.1f MiB so far, %.1f MiB pending\n", run->files, (double)run->bytes / 1048576.0,
+               (double)pending / 1048576.0);
+    }
+    return 0;
+}
+
+/* like remove_recursive, paced by throttle; remaining is what the item still counts toward pending_bytes */
+static int reap_path(reap_run_t *run, const char *path, unsigned long long *remaining) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            return -1;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char child[PATH_MAX];
+            if (join_paths(path, entry->d_name, child, sizeof(child)) < 0 || reap_path(run, child, remaining) < 0) {
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+        return rmdir(path);
+    }
+    if (unlink(path) < 0) {
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && st.st_nlink == 1) {
+        unsigned long long freed = (unsigned long long)st.st_size < *remaining ? (unsigned long long)st.st_size : *remaining;
+        *remaining -= freed;
+        run->bytes += freed;
+        pthread_mutex_lock(&run->trash->lock);
+        run->trash->pending_bytes -= freed;
+        pthread_mutex_unlock(&run->trash->lock);
+    }
+    ++run->files;
+    return throttle(run);
+}
+
+static void release_chunks(const trash_item_t *item) {
+    manifest_t manifest;
+    if (manifest_load(&manifest, item->manifest) < 0) {
+        fprintf(stderr, "cannot read retired manifest %s: %s\n", item->manifest, strerror(errno));
+        return;
+    }
+    chunk_store_unref_manifest(item->chunks, &manifest, manifest.chunk_count);
+    manifest_free(&manifest);
+}
+
+static unsigned long long trash_pending_bytes(trash_t *trash) {
+    pthread_mutex_lock(&trash->lock);
+    unsigned long long bytes = trash->pending_bytes;
+    pthread_mutex_unlock(&trash->lock);
+    return bytes;
+}
+
+/* everything queued so far is measured first, so pending_bytes covers all of it while the slow part runs */
+static void reap_batch(trash_t *trash, trash_item_t *batch) {
+    size_t count = 0;
+    for (trash_item_t *item = batch; item; item = item->next) {
+        ++count;
+    }
+    unsigned long long *remaining = calloc(count, sizeof(*remaining));
+    size_t i = 0;
+    for (trash_item_t *item = batch; item && remaining; item = item->next) {
+        remaining[i] = measure(item->path);
+        pthread_mutex_lock(&trash->lock);
+        trash->pending_bytes += remaining[i++];
+        pthread_mutex_unlock(&trash->lock);
+    }
+    reap_run_t run = { trash, { 0, 0 }, { 0, 0 }, 0, 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &run.start);
+    run.reported = run.start;
+    unsigned long long left_behind = 0;
+    i = 0;
+    while (batch) {
+        trash_item_t *item = batch;
+        batch = item->next;
+        unsigned long long unmeasured = 0;
+        unsigned long long *left = remaining ? &remaining[i++] : &unmeasured;
+        if (!run.stopped) {
+            if (item->chunks) {
+                release_chunks(item);
+            }
+            if (reap_path(&run, item->path, left) < 0 && !run.stopped) {
+                /* left where it is; the next open queues it again */
+                fprintf(stderr, "cannot remove %s from trash: %s\n", item->path, strerror(errno));
+            }
+        }
+        if (run.stopped) {
+            left_behind += *left;
+        }
+        pthread_mutex_lock(&trash->lock);
+        trash->pending_bytes -= *left;
+        pthread_mutex_unlock(&trash->lock);
+        free(item);
+    }
+    free(remaining);
+    if (run.stopped) {
+        printf("stopped reclaiming trash after %llu files, %.1f MiB left for the next start\n", run.files,
+               (double)left_behind / 1048576.0);
+    } else if (run.files > 0) {
+        printf("reclaimed %llu files, %.1f MiB from trash, %.1f MiB pending\n", run.files, (double)run.bytes / 1048576.0,
+               (double)trash_pending_bytes(trash) / 1048576.0);
+    }
+}
+
+static void *reaper_main(void *arg) {
+    trash_t *trash = arg;
+    pthread_mutex_lock(&trash->lock);
+    while (!trash->stopping) {
+        trash_item_t *batch = trash->queue;
+        if (!batch) {
+            pthread_cond_wait(&trash->wake, &trash->lock);
+            continue;
+        }
+        trash->queue = NULL;
+        trash->queue_tail = &trash->queue;
+        pthread_mutex_unlock(&trash->lock);
+        reap_batch(trash, batch);
+        pthread_mutex_lock(&trash->lock);
+    }
+    pthread_mutex_unlock(&trash->lock);
+    return NULL;
+}
+
+int trash_open(trash_t *trash, const char *dir, unsigned int rate) {
+    memset(trash, 0, sizeof(*trash));
+    if (snprintf(trash->dir, sizeof(trash->dir), "%s", dir) >= (int)sizeof(trash->dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (ensure_directory(dir, 0755) < 0) {
+        return -1;
+    }
+    trash->rate = rate;
+    trash->queue_tail = &trash->queue;
+    pthread_mutex_init(&trash->lock, NULL);
+    /* throttle's deadlines are on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&trash->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    DIR *listing = opendir(dir);
+    if (!listing) {
+        return -1;
+    }
+    size_t left_over = 0;
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        trash_item_t *item = calloc(1, sizeof(*item));
+        if (!item || join_paths(dir, entry->d_name, item->path, sizeof(item->path)) < 0) {
+            free(item);
+            continue;
+        }
+        enqueue(trash, item);
+        ++left_over;
+    }
+    closedir(listing);
+    if (left_over > 0) {
+        printf("%zu entries left in trash, reclaiming them in the background\n", left_over);
+    }
+    if (pthread_create(&trash->reaper, NULL, reaper_main, trash) != 0) {
+        /* trash_discard refuses, so callers remove things themselves */
+        fprintf(stderr, "cannot start trash reaper\n");
+        return 0;
+    }
+    trash->running = 1;
+    return 0;
+}
+
+void trash_close(trash_t *trash) {
+    if (trash->running) {
+        pthread_mutex_lock(&trash->lock);
+        trash->stopping = 1;
+        pthread_cond_broadcast(&trash->wake);
+        pthread_mutex_unlock(&trash->lock);
+        pthread_join(trash->reaper, NULL);
+        trash->running = 0;
+    }
+    while (trash->queue) {
+        trash_item_t *next = trash->queue->next;
+        free(trash->queue);
+        trash->queue = next;
+    }
+    trash->queue_tail = &trash->queue;
+    pthread_cond_destroy(&trash->wake);
+    pthread_mutex_destroy(&trash->lock);
+}
+
+int trash_discard(trash_t *trash, const char *path, chunk_store_t *chunks) {
+    if (!trash->running) {
+        errno = EAGAIN;
+        return -1;
+    }
+    trash_item_t *item = calloc(1, sizeof(*item));
+    if (!item) {
+        return -1;
+    }
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    char target[PATH_MAX];
+    if (snprintf(item->path, sizeof(item->path), "%s/XXXXXX", trash->dir) >= (int)sizeof(item->path) || !mkdtemp(item->path)) {
+        free(item);
+        return -1;
+    }
+    if (join_paths(item->path, base, target, sizeof(target)) < 0 || rename(path, target) < 0) {
+        int saved = errno;
+        rmdir(item->path);
+        free(item);
+        errno = saved;
+        return -1;
+    }
+    if (chunks) {
+        item->chunks = chunks;
+        memcpy(item->manifest, target, sizeof(target));
+    }
+    enqueue(trash, item);
+    return 0;
+}
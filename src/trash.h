@@ -0,0 +1,48 @@
+#ifndef MCSYNC_TRASH_H
+#define MCSYNC_TRASH_H
+
+#include "platform.h"
+
+#include <pthread.h>
+
+#include "chunk_store.h"
+
+/*
+ * Takes trees and files off the caller's hands in constant time: each is
+ * renamed into a fresh <dir>/<XXXXXX>/ and removed later by a reaper thread
+ * that unlinks at most rate files per second, so retiring a world of 100k
+ * files costs a push one rename. Whatever is left in <dir> when the process
+ * stops is queued again on the next open.
+ */
+#define TRASH_DEFAULT_RATE 5000
+
+typedef struct trash_item {
+    char path[PATH_MAX];
+    /* a retired chunks manifest, whose chunks are released before it is removed */
+    chunk_store_t *chunks;
+    char manifest[PATH_MAX];
+    struct trash_item *next;
+} trash_item_t;
+
+typedef struct {
+    char dir[PATH_MAX];
+    /* files unlinked per second, 0 for no limit */
+    unsigned int rate;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t reaper;
+    int running;
+    int stopping;
+    trash_item_t *queue;
+    trash_item_t **queue_tail;
+    /* what the files only the trash still links to take up, as the reaper measured them */
+    unsigned long long pending_bytes;
+} trash_t;
+
+int trash_open(trash_t *trash, const char *dir, unsigned int rate);
+/* stops the reaper; what it has not removed stays for the next open */
+void trash_close(trash_t *trash);
+/* moves path into the trash; chunks is set for a chunks manifest whose references the reaper drops */
+int trash_discard(trash_t *trash, const char *path, chunk_store_t *chunks);
+
+#endif /* MCSYNC_TRASH_H */
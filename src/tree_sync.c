@@ -0,0 +1,301 @@
+#include "platform.h"
+#include "tree_sync.h"
+
+#include "compressed_tree.h"
+#include "delta.h"
+#include "fs_utils.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int join_paths(const char *a, const char *b, char *out, size_t out_len) {
+    if (snprintf(out, out_len, "%s/%s", a, b) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_entry_paths(const void *a, const void *b) {
+    const manifest_entry_t *left = *(const manifest_entry_t *const *)a;
+    const manifest_entry_t *right = *(const manifest_entry_t *const *)b;
+    return strcmp(left->path, right->path);
+}
+
+/*
+ * For every claimed file, the base entry at the same path in previous and,
+ * if its contents are identical, in matches as well.
+ */
+static int match_base(const manifest_t *base, const manifest_t *claimed, const manifest_entry_t **previous,
+                      const manifest_entry_t **matches) {
+    const manifest_entry_t **by_path = malloc((base->entry_count + 1) * sizeof(*by_path));
+    if (!by_path) {
+        return -1;
+    }
+    size_t file_count = 0;
+    for (size_t i = 0; i < base->entry_count; ++i) {
+        if (base->entries[i].type == MANIFEST_FILE) {
+            by_path[file_count++] = &base->entries[i];
+        }
+    }
+    qsort(by_path, file_count, sizeof(*by_path), compare_entry_paths);
+    for (size_t i = 0; i < claimed->entry_count; ++i) {
+        const manifest_entry_t *entry = &claimed->entries[i];
+        if (entry->type != MANIFEST_FILE) {
+            continue;
+        }
+        const manifest_entry_t **found = bsearch(&entry, by_path, file_count, sizeof(*by_path), compare_entry_paths);
+        previous[i] = found ? *found : NULL;
+        if (found && (*found)->size == entry->size && memcmp((*found)->digest, entry->digest, HASH_SIZE) == 0) {
+            matches[i] = *found;
+        }
+    }
+    free(by_path);
+    return 0;
+}
+
+/* the sent files are hashed again, so a client cannot publish contents that differ from its manifest */
+static int build_manifest(const char *staging_dir, const manifest_t *base, const manifest_t *claimed,
+                          const manifest_entry_t **matches, manifest_t *manifest) {
+    for (size_t i = 0; i < claimed->entry_count; ++i) {
+        const manifest_entry_t *entry = &claimed->entries[i];
+        if (entry->type == MANIFEST_DIR) {
+            if (manifest_add_entry(manifest, MANIFEST_DIR, entry->path, strlen(entry->path), 0) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (matches[i]) {
+            if (manifest_copy_entry(manifest, base, matches[i]) < 0) {
+                return -1;
+            }
+        } else {
+            char full_path[PATH_MAX];
+            if (join_paths(staging_dir, entry->path, full_path, sizeof(full_path)) < 0 ||
+                manifest_scan_file(manifest, full_path, entry->path, NULL, NULL) < 0) {
+                return -1;
+            }
+            const manifest_entry_t *stored = &manifest->entries[manifest->entry_count - 1];
+            if (stored->size != entry->size || memcmp(stored->digest, entry->digest, HASH_SIZE) != 0) {
+                errno = EBADMSG;
+                return -1;
+            }
+        }
+        manifest->entries[manifest->entry_count - 1].mtime = entry->mtime;
+    }
+    return 0;
+}
+
+/* the old copy of a file a delta is offered against; a pack's is taken out into staging_dir, where the delta then replaces it */
+static int offer_signature(mc_conn_t *conn, const tree_base_t *base, const manifest_entry_t *old, const char *staging_dir) {
+    char full_path[PATH_MAX];
+    if (base->format != WORLD_FORMAT_PACK) {
+        if (join_paths(base->path, old->path, full_path, sizeof(full_path)) < 0) {
+            return -1;
+        }
+        return send_file_signature(conn, full_path, old->path, base->format == WORLD_FORMAT_COMPRESSED);
+    }
+    pack_entry_t held;
+    if (join_paths(staging_dir, old->path, full_path, sizeof(full_path)) < 0 || pack_find(base->pack, old->path, &held) < 0 ||
+        pack_extract(base->pack, &held, full_path) < 0) {
+        return -1;
+    }
+    return send_file_signature(conn, full_path, old->path, 0);
+}
+
+/* puts an unchanged file of base at target */
+static int take_match(const tree_base_t *base, const manifest_entry_t *match, const char *target, enum world_format target_format) {
+    if (base->format == WORLD_FORMAT_PACK) {
+        pack_entry_t held;
+        if (pack_find(base->pack, match->path, &held) < 0) {
+            return -1;
+        }
+        return pack_extract(base->pack, &held, target);
+    }
+    char source[PATH_MAX];
+    if (join_paths(base->path, match->path, source, sizeof(source)) < 0) {
+        return -1;
+    }
+    /* a plain staging tree cannot share files with a compressed base */
+    if (base->format == WORLD_FORMAT_COMPRESSED && target_format != WORLD_FORMAT_COMPRESSED) {
+        return ctree_expand_file(source, target);
+    }
+    return link_or_copy(source, target);
+}
+
+/*
+ * The wanted files are received before anything is linked: a stray entry
+ * for an unchanged path then fails on the existing link instead of writing
+ * through it into the previous version.
+ */
+static int apply_claims(mc_conn_t *conn, const tree_base_t *base, const manifest_t *claimed, const manifest_entry_t **previous,
+                        const manifest_entry_t **matches, const char *staging_dir, enum world_format target, size_t *sent_files) {
+    uint32_t *wanted = malloc((claimed->entry_count + 1) * sizeof(*wanted));
+    if (!wanted) {
+        return -1;
+    }
+    size_t wanted_count = 0;
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < claimed->entry_count; ++i) {
+        const manifest_entry_t *entry = &claimed->entries[i];
+        if (entry->type == MANIFEST_DIR) {
+            char full_path[PATH_MAX];
+            rc = join_paths(staging_dir, entry->path, full_path, sizeof(full_path));
+            if (rc == 0) {
+                rc = ensure_directory(full_path, 0755);
+            }
+        } else if (!matches[i]) {
+            wanted[wanted_count++] = (uint32_t)i;
+        }
+    }
+    unsigned long long received_before = conn->received.files;
+    if (rc == 0) {
+        rc = proto_send_wants(conn, wanted, wanted_count);
+    }
+    if (rc == 0 && (conn->caps & PROTO_CAP_DELTA)) {
+        /* changed files we hold an older copy of can come back as deltas against it */
+        for (size_t i = 0; rc == 0 && i < wanted_count; ++i) {
+            const manifest_entry_t *old = previous[wanted[i]];
+            if (old && old->size >= DELTA_MIN_SIZE) {
+                rc = offer_signature(conn, base, old, staging_dir);
+            }
+        }
+        if (rc == 0) {
+            rc = proto_send_end(conn);
+        }
+    }
+    if (rc == 0) {
+        const char *basis_dir = !base ? NULL : base->format == WORLD_FORMAT_PACK ? staging_dir : base->path;
+        rc = receive_world_entries(conn, staging_dir, basis_dir, base && base->format == WORLD_FORMAT_COMPRESSED);
+    }
+    if (rc == 0 && conn->received.files - received_before != wanted_count) {
+        errno = EPROTO;
+        rc = -1;
+    }
+    /* a pack is built from the received files and the base pack, so packs need nothing more here */
+    int packed = base && base->format == WORLD_FORMAT_PACK && target == WORLD_FORMAT_PACK;
+    for (size_t i = 0; rc == 0 && !packed && i < claimed->entry_count; ++i) {
+        if (!matches[i]) {
+            continue;
+        }
+        char target_path[PATH_MAX];
+        rc = join_paths(staging_dir, claimed->entries[i].path, target_path, sizeof(target_path));
+        if (rc == 0) {
+            rc = take_match(base, matches[i], target_path, target);
+        }
+    }
+    *sent_files = wanted_count;
+    free(wanted);
+    return rc;
+}
+
+/* files arrive plain and files linked from a plain base are plain too */
+static int compress_staged(const char *staging_dir, const manifest_t *claimed, const manifest_entry_t **matches, int base_compressed) {
+    for (size_t i = 0; i < claimed->entry_count; ++i) {
+        const manifest_entry_t *entry = &claimed->entries[i];
+        if (entry->type != MANIFEST_FILE || (matches[i] && base_compressed)) {
+            continue;
+        }
+        char full_path[PATH_MAX];
+        if (join_paths(staging_dir, entry->path, full_path, sizeof(full_path)) < 0 || ctree_compress_file(full_path) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int tree_sync_receive(mc_conn_t *conn, const tree_base_t *base, const char *staging_dir, enum world_format target, manifest_t *manifest,
+                      size_t *sent_files) {
+    *sent_files = 0;
+    manifest_init(manifest);
+    manifest_t claimed;
+    manifest_init(&claimed);
+    const manifest_entry_t **previous = NULL;
+    const manifest_entry_t **matches = NULL;
+    int rc = proto_recv_digests(conn, &claimed);
+    if (rc == 0) {
+        previous = calloc(claimed.entry_count + 1, sizeof(*previous));
+        matches = calloc(claimed.entry_count + 1, sizeof(*matches));
+        rc = previous && matches ? 0 : -1;
+    }
+    if (rc == 0 && base) {
+        rc = match_base(base->manifest, &claimed, previous, matches);
+    }
+    if (rc == 0) {
+        rc = apply_claims(conn, base, &claimed, previous, matches, staging_dir, target, sent_files);
+    }
+    if (rc == 0) {
+        rc = build_manifest(staging_dir, base ? base->manifest : NULL, &claimed, matches, manifest);
+    }
+    if (rc == 0 && target == WORLD_FORMAT_COMPRESSED) {
+        rc = compress_staged(staging_dir, &claimed, matches, base && base->format == WORLD_FORMAT_COMPRESSED);
+    }
+    int saved = errno;
+    free(previous);
+    free(matches);
+    manifest_free(&claimed);
+    if (rc < 0) {
+        manifest_free(manifest);
+    }
+    errno = saved;
+    return rc;
+}
+
+int tree_sync_share(const tree_base_t *base, const char *staging_dir, enum world_format target, const manifest_t *manifest) {
+    const manifest_entry_t **previous = calloc(manifest->entry_count + 1, sizeof(*previous));
+    const manifest_entry_t **matches = calloc(manifest->entry_count + 1, sizeof(*matches));
+    int rc = previous && matches ? 0 : -1;
+    /* a compressed file and a plain one cannot be the same inode, and a pack shares nothing with a tree */
+    if (rc == 0 && base && base->format == target && target != WORLD_FORMAT_PACK) {
+        rc = match_base(base->manifest, manifest, previous, matches);
+    }
+    for (size_t i = 0; rc == 0 && i < manifest->entry_count; ++i) {
+        if (!matches[i]) {
+            continue;
+        }
+        char source[PATH_MAX];
+        char target_path[PATH_MAX];
+        rc = join_paths(base->path, matches[i]->path, source, sizeof(source));
+        if (rc == 0) {
+            rc = join_paths(staging_dir, manifest->entries[i].path, target_path, sizeof(target_path));
+        }
+        if (rc == 0) {
+            rc = unlink(target_path);
+        }
+        if (rc == 0) {
+            rc = link_or_copy(source, target_path);
+        }
+    }
+    if (rc == 0 && target == WORLD_FORMAT_COMPRESSED) {
+        rc = compress_staged(staging_dir, manifest, matches, base && base->format == WORLD_FORMAT_COMPRESSED);
+    }
+    int saved = errno;
+    free(previous);
+    free(matches);
+    errno = saved;
+    return rc;
+}
+
+int tree_sync_clone(const char *source_dir, const manifest_t *manifest, const char *staging_dir) {
+    for (size_t i = 0; i < manifest->entry_count; ++i) {
+        const manifest_entry_t *entry = &manifest->entries[i];
+        char source[PATH_MAX];
+        char target[PATH_MAX];
+        if (join_paths(staging_dir, entry->path, target, sizeof(target)) < 0) {
+            return -1;
+        }
+        if (entry->type == MANIFEST_DIR) {
+            if (ensure_directory(target, 0755) < 0) {
+                return -1;
+            }
+        } else if (join_paths(source_dir, entry->path, source, sizeof(source)) < 0 || link_or_copy(source, target) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
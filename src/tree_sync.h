@@ -0,0 +1,49 @@
+#ifndef MCSYNC_TREE_SYNC_H
+#define MCSYNC_TREE_SYNC_H
+
+#include <stddef.h>
+
+#include "conn.h"
+#include "manifest.h"
+#include "pack.h"
+#include "world_store.h"
+
+/*
+ * The version a push is compared with: its manifest, its format and path
+ * and, for a pack, the open pack.
+ */
+typedef struct {
+    const manifest_t *manifest;
+    enum world_format format;
+    const char *path;
+    const pack_t *pack;
+} tree_base_t;
+
+/*
+ * Server side of incremental pushes into tree versions. The client's
+ * manifest is compared with base's (base may be NULL when there is none);
+ * files with the same size and digest are linked into staging_dir and only
+ * the rest are requested, as deltas against the old copy where the peer
+ * supports them. On success manifest describes staging_dir, ready to be
+ * kept as its sidecar.
+ *
+ * target is the format staging_dir is left in: a plain tree, a compressed
+ * one (see compressed_tree.h) or, for a pack, a tree holding just the
+ * received files when base is a pack too, since pack_write copies the
+ * rest from base.
+ */
+int tree_sync_receive(mc_conn_t *conn, const tree_base_t *base, const char *staging_dir, enum world_format target, manifest_t *manifest,
+                      size_t *sent_files);
+
+/*
+ * For pushes that sent the whole tree: files of staging_dir, as manifest
+ * describes it, that are identical to one in base are replaced with links
+ * to it, so the new version only costs what changed. For a compressed
+ * target the rest is then compressed, as tree_sync_receive does.
+ */
+int tree_sync_share(const tree_base_t *base, const char *staging_dir, enum world_format target, const manifest_t *manifest);
+
+/* fills staging_dir with the tree of source_dir that manifest describes, every file shared with its source */
+int tree_sync_clone(const char *source_dir, const manifest_t *manifest, const char *staging_dir);
+
+#endif /* MCSYNC_TREE_SYNC_H */
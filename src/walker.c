@@ -0,0 +1,567 @@
+#include "platform.h"
+#include "walker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define GETDENTS_BUFFER (32 * 1024)
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+};
+
+/* reading a directory, or stat'ing entries [begin, end) of one that was read */
+typedef struct walk_job {
+    struct walk_dir *dir;
+    int listing;
+    uint32_t begin;
+    uint32_t end;
+    enum job_state state;
+    int error;
+} walk_job_t;
+
+typedef struct {
+    const char *name;
+    struct stat st;
+    /* set for a subdirectory until the caller enters it */
+    struct walk_dir *child;
+} walk_item_t;
+
+typedef struct walk_dir {
+    struct walk_dir *parent;
+    /* in the parent's names */
+    const char *name;
+    int fd;
+    walk_item_t *items;
+    uint32_t count;
+    char *names;
+    walk_job_t listing;
+    walk_job_t *chunks;
+    uint32_t chunk_count;
+    /* what it adds to live_bytes once read */
+    size_t bytes;
+    /* deque slots still pointing at its jobs; it is freed once retired and this is 0 */
+    unsigned int queued;
+    int retired;
+} walk_dir_t;
+
+typedef struct walk_deque {
+    walk_job_t **jobs;
+    /* thieves take the oldest at head, the owner pushes and pops at tail */
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} walk_deque_t;
+
+typedef struct walk_frame {
+    walk_dir_t *dir;
+    uint32_t next;
+    /* length of the directory's own path in walker->path */
+    size_t path_len;
+    int done;
+} walk_frame_t;
+
+typedef struct walk_worker {
+    walker_t *walker;
+    int index;
+    pthread_t thread;
+} walk_worker_t;
+
+/* the layout getdents64 fills in */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int walker_threads(void) {
+    const char *env = getenv("MCSYNC_WALK_THREADS");
+    if (env && atoi(env) >= 0 && *env >= '0' && *env <= '9') {
+        return atoi(env);
+    }
+    return WALKER_DEFAULT_THREADS;
+}
+
+static walk_dir_t *new_dir(walk_dir_t *parent, const char *name) {
+    walk_dir_t *dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        return NULL;
+    }
+    dir->parent = parent;
+    dir->name = name;
+    dir->fd = -1;
+    dir->listing.dir = dir;
+    dir->listing.listing = 1;
+    return dir;
+}
+
+/* lock held, except from walker_close once the threads are gone */
+static void free_dir(walker_t *walker, walk_dir_t *dir) {
+    if (dir->items) {
+        walker->live_dirs--;
+        walker->live_bytes -= dir->bytes;
+        pthread_cond_broadcast(&walker->work);
+    }
+    if (dir->fd >= 0) {
+        close(dir->fd);
+    }
+    free(dir->items);
+    free(dir->names);
+    free(dir->chunks);
+    free(dir);
+}
+
+/* lock held */
+static int push(walker_t *walker, int deque_index, walk_job_t *job) {
+    walk_deque_t *deque = &walker->deques[deque_index];
+    if (deque->head == deque->tail) {
+        deque->head = deque->tail = 0;
+    }
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->jobs, deque->jobs + deque->head, (deque->tail - deque->head) * sizeof(*deque->jobs));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            walk_job_t **jobs = realloc(deque->jobs, capacity * sizeof(*jobs));
+            if (!jobs) {
+                return -1;
+            }
+            deque->jobs = jobs;
+            deque->capacity = capacity;
+        }
+    }
+    deque->jobs[deque->tail++] = job;
+    job->dir->queued++;
+    walker->queued_total++;
+    return 0;
+}
+
+/* lock held; drops a deque's hold on job's directory */
+static void release(walker_t *walker, walk_job_t *job) {
+    walk_dir_t *dir = job->dir;
+    if (--dir->queued == 0 && dir->retired) {
+        free_dir(walker, dir);
+    }
+}
+
+/* lock held; the newest job of the thread's own deque, else the oldest of another's */
+static walk_job_t *take(walker_t *walker, int index) {
+    int deques = walker->thread_count + 1;
+    for (int i = 0; i < deques; ++i) {
+        walk_deque_t *deque = &walker->deques[(index + i) % deques];
+        while (deque->tail > deque->head) {
+            walk_job_t *job = i == 0 ? deque->jobs[--deque->tail] : deque->jobs[deque->head++];
+            int runnable = job->state == JOB_QUEUED;
+            release(walker, job);
+            if (runnable) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const walk_item_t *)a)->name, ((const walk_item_t *)b)->name);
+}
+
+/* names land back to back in one buffer; items point into it only once it stops moving */
+static int read_names(walk_dir_t *dir, char **names_out, size_t *names_capacity, uint32_t **offsets_out, uint32_t *count_out) {
+    unsigned char *buffer = malloc(GETDENTS_BUFFER);
+    if (!buffer) {
+        return -1;
+    }
+    char *names = NULL;
+    size_t names_len = 0;
+    size_t capacity = 0;
+    uint32_t *offsets = NULL;
+    uint32_t count = 0;
+    size_t offsets_capacity = 0;
+    int rc = 0;
+    while (rc == 0) {
+        long got = syscall(SYS_getdents64, dir->fd, buffer, GETDENTS_BUFFER);
+        if (got <= 0) {
+            rc = got < 0 ? -1 : 0;
+            break;
+        }
+        for (long pos = 0; pos < got;) {
+            struct linux_dirent64 *record = (struct linux_dirent64 *)(buffer + pos);
+            pos += record->d_reclen;
+            const char *name = record->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            size_t len = strlen(name) + 1;
+            if (names_len + len > capacity) {
+                size_t grown = capacity ? capacity * 2 : 4096;
+                while (grown < names_len + len) {
+                    grown *= 2;
+                }
+                char *moved = realloc(names, grown);
+                if (!moved) {
+                    rc = -1;
+                    break;
+                }
+                names = moved;
+                capacity = grown;
+            }
+            if (count == offsets_capacity) {
+                size_t grown = offsets_capacity ? offsets_capacity * 2 : 256;
+                uint32_t *moved = realloc(offsets, grown * sizeof(*offsets));
+                if (!moved) {
+                    rc = -1;
+                    break;
+                }
+                offsets = moved;
+                offsets_capacity = grown;
+            }
+            memcpy(names + names_len, name, len);
+            offsets[count++] = (uint32_t)names_len;
+            names_len += len;
+        }
+    }
+    free(buffer);
+    if (rc < 0) {
+        int saved = errno;
+        free(names);
+        free(offsets);
+        errno = saved;
+        return -1;
+    }
+    *names_out = names;
+    *names_capacity = capacity;
+    *offsets_out = offsets;
+    *count_out = count;
+    return 0;
+}
+
+static int list_dir(walker_t *walker, walk_dir_t *dir, int deque_index) {
+    if (dir->fd < 0 && (dir->fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    char *names;
+    size_t names_capacity;
+    uint32_t *offsets;
+    uint32_t count;
+    if (read_names(dir, &names, &names_capacity, &offsets, &count) < 0) {
+        return -1;
+    }
+    uint32_t chunk_count = (count + WALKER_CHUNK - 1) / WALKER_CHUNK;
+    walk_item_t *items = calloc(count ? count : 1, sizeof(*items));
+    walk_job_t *chunks = calloc(chunk_count ? chunk_count : 1, sizeof(*chunks));
+    if (!items || !chunks) {
+        free(items);
+        free(chunks);
+        free(names);
+        free(offsets);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        items[i].name = names + offsets[i];
+    }
+    free(offsets);
+    qsort(items, count, sizeof(*items), compare_items);
+    for (uint32_t i = 0; i < chunk_count; ++i) {
+        chunks[i].dir = dir;
+        chunks[i].begin = i * WALKER_CHUNK;
+        chunks[i].end = i + 1 < chunk_count ? (i + 1) * WALKER_CHUNK : count;
+    }
+
+    pthread_mutex_lock(&walker->lock);
+    dir->items = items;
+    dir->count = count;
+    dir->names = names;
+    dir->chunks = chunks;
+    dir->chunk_count = chunk_count;
+    dir->bytes = names_capacity + count * sizeof(*items) + chunk_count * sizeof(*chunks);
+    walker->live_dirs++;
+    walker->live_bytes += dir->bytes;
+    /* the last chunk goes in first, so the owner's next pop is the first chunk and thieves get the far end */
+    int rc = 0;
+    for (uint32_t i = chunk_count; i-- > 0 && rc == 0;) {
+        rc = push(walker, deque_index, &chunks[i]);
+    }
+    pthread_cond_broadcast(&walker->work);
+    pthread_mutex_unlock(&walker->lock);
+    return rc;
+}
+
+static int stat_chunk(walker_t *walker, walk_job_t *job, int deque_index) {
+    walk_dir_t *dir = job->dir;
+    for (uint32_t i = job->begin; i < job->end; ++i) {
+        walk_item_t *item = &dir->items[i];
+        if (fstatat(dir->fd, item->name, &item->st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return -1;
+        }
+        if (S_ISDIR(item->st.st_mode) && !(item->child = new_dir(dir, item->name))) {
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&walker->lock);
+    int rc = 0;
+    for (uint32_t i = job->end; i-- > job->begin && rc == 0;) {
+        if (dir->items[i].child) {
+            rc = push(walker, deque_index, &dir->items[i].child->listing);
+        }
+    }
+    pthread_cond_broadcast(&walker->work);
+    pthread_mutex_unlock(&walker->lock);
+    return rc;
+}
+
+/* lock held on entry and exit; the job is already marked running */
+static void run_job(walker_t *walker, walk_job_t *job, int deque_index) {
+    pthread_mutex_unlock(&walker->lock);
+    int rc = job->listing ? list_dir(walker, job->dir, deque_index) : stat_chunk(walker, job, deque_index);
+    int error = rc < 0 ? (errno ? errno : EIO) : 0;
+    pthread_mutex_lock(&walker->lock);
+    job->error = error;
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&walker->done);
+}
+
+static void *worker_main(void *arg) {
+    walk_worker_t *self = arg;
+    walker_t *walker = self->walker;
+    pthread_mutex_lock(&walker->lock);
+    while (!walker->stopping) {
+        walk_job_t *job = NULL;
+        if (walker->live_dirs < WALKER_AHEAD_DIRS && walker->live_bytes < WALKER_AHEAD_BYTES) {
+            job = take(walker, self->index);
+        }
+        if (!job) {
+            pthread_cond_wait(&walker->work, &walker->lock);
+            continue;
+        }
+        job->state = JOB_RUNNING;
+        run_job(walker, job, self->index);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    return NULL;
+}
+
+/* lock held; a thread that cannot be started leaves its deque to be stolen from */
+static void start_pool(walker_t *walker) {
+    walker->started = 1;
+    for (int i = 0; i < walker->thread_count; ++i) {
+        walk_worker_t *worker = &walker->workers[i];
+        worker->walker = walker;
+        worker->index = i + 1;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            worker->index = 0;
+        }
+    }
+}
+
+/* runs job on the caller's thread unless a worker has it, and waits for it either way */
+static int finish(walker_t *walker, walk_job_t *job) {
+    pthread_mutex_lock(&walker->lock);
+    if (job->state == JOB_QUEUED) {
+        /* usually the newest in the caller's deque, since the walk goes in the order jobs were pushed */
+        walk_deque_t *own = &walker->deques[0];
+        if (own->tail > own->head && own->jobs[own->tail - 1] == job) {
+            own->tail--;
+            job->dir->queued--;
+        }
+        job->state = JOB_RUNNING;
+        run_job(walker, job, 0);
+    }
+    while (job->state != JOB_DONE) {
+        pthread_cond_wait(&walker->done, &walker->lock);
+    }
+    int error = job->error;
+    if (!walker->started && walker->thread_count > 0 && walker->queued_total >= WALKER_PARALLEL_MIN) {
+        start_pool(walker);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    if (error) {
+        walker->error = error;
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int push_frame(walker_t *walker, walk_dir_t *dir, size_t path_len) {
+    if (walker->depth == walker->frames_capacity) {
+        size_t capacity = walker->frames_capacity ? walker->frames_capacity * 2 : 16;
+        walk_frame_t *frames = realloc(walker->frames, capacity * sizeof(*frames));
+        if (!frames) {
+            return -1;
+        }
+        walker->frames = frames;
+        walker->frames_capacity = capacity;
+    }
+    walk_frame_t *frame = &walker->frames[walker->depth++];
+    frame->dir = dir;
+    frame->next = 0;
+    frame->path_len = path_len;
+    frame->done = 0;
+    return 0;
+}
+
+int walker_open(walker_t *walker, const char *root) {
+    memset(walker, 0, sizeof(*walker));
+    pthread_mutex_init(&walker->lock, NULL);
+    pthread_cond_init(&walker->work, NULL);
+    pthread_cond_init(&walker->done, NULL);
+    walker->thread_count = walker_threads();
+    walker->deques = calloc((size_t)walker->thread_count + 1, sizeof(*walker->deques));
+    walker->workers = calloc(walker->thread_count > 0 ? (size_t)walker->thread_count : 1, sizeof(*walker->workers));
+    walk_dir_t *dir = new_dir(NULL, "");
+    if (!walker->deques || !walker->workers || !dir || push_frame(walker, dir, 0) < 0) {
+        free(dir);
+        walker_close(walker);
+        errno = ENOMEM;
+        return -1;
+    }
+    if ((dir->fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        int saved = errno;
+        walker_close(walker);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/* a directory that was read has its chunks' entries ready once the chunk is done */
+int walker_next(walker_t *walker, walker_entry_t *entry) {
+    if (walker->error) {
+        errno = walker->error;
+        return -1;
+    }
+    while (walker->depth > 0) {
+        walk_frame_t *frame = &walker->frames[walker->depth - 1];
+        walk_dir_t *dir = frame->dir;
+        if (frame->next == 0 && !frame->done && finish(walker, &dir->listing) < 0) {
+            return -1;
+        }
+        if (frame->next < dir->count) {
+            uint32_t i = frame->next;
+            if (i % WALKER_CHUNK == 0 && finish(walker, &dir->chunks[i / WALKER_CHUNK]) < 0) {
+                return -1;
+            }
+            frame->next++;
+            walk_item_t *item = &dir->items[i];
+            size_t start = frame->path_len ? frame->path_len + 1 : 0;
+            size_t name_len = strlen(item->name);
+            if (start + name_len >= sizeof(walker->path)) {
+                walker->error = ENAMETOOLONG;
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            if (frame->path_len) {
+                walker->path[frame->path_len] = '/';
+            }
+            memcpy(walker->path + start, item->name, name_len + 1);
+            entry->path = walker->path;
+            entry->path_len = start + name_len;
+            entry->name = item->name;
+            entry->dir_fd = dir->fd;
+            entry->st = &item->st;
+            if (S_ISDIR(item->st.st_mode)) {
+                entry->kind = WALKER_DIR;
+                walk_dir_t *child = item->child;
+                item->child = NULL;
+                if (push_frame(walker, child, entry->path_len) < 0) {
+                    item->child = child;
+                    walker->error = ENOMEM;
+                    errno = ENOMEM;
+                    return -1;
+                }
+            } else {
+                entry->kind = S_ISREG(item->st.st_mode) ? WALKER_FILE : WALKER_OTHER;
+            }
+            return 1;
+        }
+        if (!frame->done) {
+            frame->done = 1;
+            walker->path[frame->path_len] = '\0';
+            entry->kind = WALKER_DIR_DONE;
+            entry->path = walker->path;
+            entry->path_len = frame->path_len;
+            entry->name = dir->name;
+            entry->dir_fd = dir->fd;
+            entry->st = NULL;
+            return 1;
+        }
+        walker->depth--;
+        pthread_mutex_lock(&walker->lock);
+        dir->retired = 1;
+        if (dir->queued == 0) {
+            free_dir(walker, dir);
+        }
+        pthread_mutex_unlock(&walker->lock);
+    }
+    return 0;
+}
+
+/* frees dir and every subdirectory under it the caller never entered, without recursing */
+static void free_tree(walker_t *walker, walk_dir_t *dir) {
+    while (dir) {
+        walk_dir_t *child = NULL;
+        for (uint32_t i = 0; i < dir->count && !child; ++i) {
+            child = dir->items ? dir->items[i].child : NULL;
+            if (child) {
+                dir->items[i].child = NULL;
+            }
+        }
+        if (child) {
+            /* free the child's subtree first; its parent link leads back here */
+            dir = child;
+            continue;
+        }
+        walk_dir_t *parent = dir->parent;
+        int was_entered = dir->retired;
+        free_dir(walker, dir);
+        dir = was_entered ? NULL : parent;
+    }
+}
+
+void walker_close(walker_t *walker) {
+    if (walker->started) {
+        pthread_mutex_lock(&walker->lock);
+        walker->stopping = 1;
+        pthread_cond_broadcast(&walker->work);
+        pthread_mutex_unlock(&walker->lock);
+        for (int i = 0; i < walker->thread_count; ++i) {
+            if (walker->workers[i].index > 0) {
+                pthread_join(walker->workers[i].thread, NULL);
+            }
+        }
+    }
+    if (walker->deques) {
+        for (int i = 0; i <= walker->thread_count; ++i) {
+            walk_deque_t *deque = &walker->deques[i];
+            while (deque->tail > deque->head) {
+                release(walker, deque->jobs[--deque->tail]);
+            }
+            free(deque->jobs);
+        }
+    }
+    /* each frame's directory heads the subtrees its unvisited entries lead to */
+    while (walker->depth > 0) {
+        walk_dir_t *dir = walker->frames[--walker->depth].dir;
+        dir->retired = 1;
+        free_tree(walker, dir);
+    }
+    free(walker->frames);
+    free(walker->deques);
+    free(walker->workers);
+    pthread_cond_destroy(&walker->done);
+    pthread_cond_destroy(&walker->work);
+    pthread_mutex_destroy(&walker->lock);
+    memset(walker, 0, sizeof(*walker));
+}
@@ -0,0 +1,91 @@
+#ifndef MCSYNC_WALKER_H
+#define MCSYNC_WALKER_H
+
+#include "platform.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Walks a tree in one fixed order: a directory, then its entries sorted
+ * bytewise by name, each subdirectory's contents right after it, so every
+ * walk of the same tree yields the same stream. Directories are read with
+ * getdents64 and everything is opened and stat'ed relative to its parent's
+ * fd, and the walk is a loop over a stack of frames on the heap, so a deep
+ * tree costs no more C stack than a flat one.
+ *
+ * A directory is stat'ed WALKER_CHUNK entries at a time. Once a walk has
+ * queued WALKER_PARALLEL_MIN listings or chunks, a pool of threads takes
+ * them ahead of the caller. Each thread keeps a deque of the work it
+ * found: it takes the newest from its own deque and steals the oldest from
+ * the others, so threads spread over separate subtrees and the chunks of
+ * one big directory such as region/. They stop reading ahead at
+ * WALKER_AHEAD_DIRS open directories or WALKER_AHEAD_BYTES of listings,
+ * after which the caller does its own work. The heap then holds the
+ * lookahead plus the listings of the directories on the current path.
+ */
+#define WALKER_CHUNK 128
+#define WALKER_PARALLEL_MIN 8
+#define WALKER_AHEAD_DIRS 64
+#define WALKER_AHEAD_BYTES (8 * 1024 * 1024)
+#define WALKER_DEFAULT_THREADS 8
+
+enum walker_kind {
+    /* a directory, before its contents */
+    WALKER_DIR,
+    /* the same directory after them, the root's last; dir_fd is its own, open until the next call */
+    WALKER_DIR_DONE,
+    WALKER_FILE,
+    /* anything else: symlinks, sockets, devices */
+    WALKER_OTHER
+};
+
+typedef struct {
+    enum walker_kind kind;
+    /* relative to the root, "" for the root itself; valid until the next call */
+    const char *path;
+    size_t path_len;
+    const char *name;
+    /* the directory holding name */
+    int dir_fd;
+    /* lstat of the entry; NULL for WALKER_DIR_DONE */
+    const struct stat *st;
+} walker_entry_t;
+
+struct walk_dir;
+struct walk_frame;
+struct walk_deque;
+struct walk_worker;
+
+typedef struct {
+    struct walk_frame *frames;
+    size_t depth;
+    size_t frames_capacity;
+    char path[PATH_MAX];
+    pthread_mutex_t lock;
+    /* jobs were queued or lookahead was freed */
+    pthread_cond_t work;
+    /* a job finished */
+    pthread_cond_t done;
+    /* [0] is the caller's, then one per thread */
+    struct walk_deque *deques;
+    struct walk_worker *workers;
+    int thread_count;
+    int started;
+    int stopping;
+    size_t queued_total;
+    /* listings in memory, each holding its directory open */
+    size_t live_dirs;
+    size_t live_bytes;
+    int error;
+} walker_t;
+
+/* MCSYNC_WALK_THREADS overrides WALKER_DEFAULT_THREADS; 0 walks on the caller's thread only */
+int walker_threads(void);
+int walker_open(walker_t *walker, const char *root);
+/* 1 with the next entry, 0 after the root's WALKER_DIR_DONE, -1 if a directory or entry could not be read */
+int walker_next(walker_t *walker, walker_entry_t *entry);
+void walker_close(walker_t *walker);
+
+#endif /* MCSYNC_WALKER_H */
@@ -0,0 +1,912 @@
+#include "platform.h"
+#include "world_store.h"
+
+#include "durable.h"
+#include "fs_utils.h"
+#include "pack.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STORE_META_DIR ".mcsync"
+#define CHUNKS_SUFFIX ".chunks"
+#define COMPRESSED_SUFFIX ".lz4"
+#define PACK_SUFFIX ".pack"
+#define MANIFEST_SUFFIX ".manifest"
+#define HISTORY_FILE "history"
+#define CATALOG_FILE "catalog"
+
+typedef struct {
+    unsigned long seq;
+    enum world_format format;
+    time_t created;
+} found_version_t;
+
+static int parse_seq(const char *name, unsigned long *seq, enum world_format *format) {
+    if (*name < '0' || *name > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(name, &end, 10);
+    if (errno != 0 || value == 0) {
+        return -1;
+    }
+    if (*end == '\0') {
+        *format = WORLD_FORMAT_TREE;
+    } else if (strcmp(end, CHUNKS_SUFFIX) == 0) {
+        *format = WORLD_FORMAT_CHUNKS;
+    } else if (strcmp(end, COMPRESSED_SUFFIX) == 0) {
+        *format = WORLD_FORMAT_COMPRESSED;
+    } else if (strcmp(end, PACK_SUFFIX) == 0) {
+        *format = WORLD_FORMAT_PACK;
+    } else {
+        return -1;
+    }
+    *seq = value;
+    return 0;
+}
+
+/* <seq>.manifest records the digests of tree or compressed tree version <seq> */
+static int parse_sidecar(const char *name, unsigned long *seq) {
+    if (*name < '0' || *name > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(name, &end, 10);
+    if (errno != 0 || value == 0 || strcmp(end, MANIFEST_SUFFIX) != 0) {
+        return -1;
+    }
+    *seq = value;
+    return 0;
+}
+
+static const char *format_suffix(enum world_format format) {
+    switch (format) {
+    case WORLD_FORMAT_CHUNKS:
+        return CHUNKS_SUFFIX;
+    case WORLD_FORMAT_COMPRESSED:
+        return COMPRESSED_SUFFIX;
+    case WORLD_FORMAT_PACK:
+        return PACK_SUFFIX;
+    default:
+        return "";
+    }
+}
+
+static int version_path(const world_store_t *store, const char *name, unsigned long seq, enum world_format format, char *out, size_t out_len) {
+    if (snprintf(out, out_len, "%s/%s/%lu%s", store->versions_dir, name, seq, format_suffix(format)) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int sidecar_path(const world_store_t *store, const char *name, unsigned long seq, char *out, size_t out_len) {
+    if (snprintf(out, out_len, "%s/%s/%lu" MANIFEST_SUFFIX, store->versions_dir, name, seq) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int history_path(const world_store_t *store, const char *name, char *out, size_t out_len) {
+    if (snprintf(out, out_len, "%s/%s/" HISTORY_FILE, store->versions_dir, name) >= (int)out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * A history or catalog file is written to a temporary under the lock and
+ * synced and renamed into place after it, so a strict store does not fsync
+ * while every other push waits. Each write takes a generation; one that
+ * reaches the rename after a newer one of the same file is dropped.
+ */
+typedef struct {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    FILE *out;
+    unsigned long generation;
+} staged_meta_t;
+
+static int create_meta(staged_meta_t *meta) {
+    int fd = mkstemp(meta->tmp_path);
+    if (fd < 0) {
+        return -1;
+    }
+    meta->out = fdopen(fd, "w");
+    if (!meta->out) {
+        int saved = errno;
+        close(fd);
+        unlink(meta->tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static int flush_meta(staged_meta_t *meta) {
+    if (fflush(meta->out) != 0) {
+        int saved = errno;
+        fclose(meta->out);
+        unlink(meta->tmp_path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+/* called without the lock; placed is the newest generation already renamed */
+static int place_meta(world_store_t *store, staged_meta_t *meta, unsigned long *placed) {
+    int synced = durable_file(fileno(meta->out)) == 0;
+    if (fclose(meta->out) != 0 || !synced) {
+        int saved = errno;
+        unlink(meta->tmp_path);
+        errno = saved;
+        return -1;
+    }
+    pthread_mutex_lock(&store->meta_lock);
+    int rc = 0;
+    if (meta->generation <= *placed) {
+        unlink(meta->tmp_path);
+    } else if (rename(meta->tmp_path, meta->path) < 0) {
+        int saved = errno;
+        unlink(meta->tmp_path);
+        errno = saved;
+        rc = -1;
+    } else {
+        *placed = meta->generation;
+    }
+    pthread_mutex_unlock(&store->meta_lock);
+    return rc;
+}
+
+/* one "<seq> <unix time>" line per kept version, replaced whole; called with the lock held */
+static int write_history(world_store_t *store, world_slot_t *slot, staged_meta_t *meta) {
+    if (history_path(store, slot->name, meta->path, sizeof(meta->path)) < 0 ||
+        snprintf(meta->tmp_path, sizeof(meta->tmp_path), "%s/%s/." HISTORY_FILE ".tmpXXXXXX", store->versions_dir, slot->name) >= (int)sizeof(meta->tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (create_meta(meta) < 0) {
+        return -1;
+    }
+    for (const world_version_t *version = slot->current; version; version = version->older) {
+        fprintf(meta->out, "%lu %lld\n", version->seq, (long long)version->created);
+    }
+    meta->generation = ++slot->history_generation;
+    return flush_meta(meta);
+}
+
+static int save_history(world_store_t *store, world_slot_t *slot) {
+    staged_meta_t meta;
+    if (write_history(store, slot, &meta) < 0) {
+        return -1;
+    }
+    return place_meta(store, &meta, &slot->history_placed);
+}
+
+/* fills in the publication times the history records; versions it lacks keep 0 */
+static void load_history(const world_store_t *store, const char *name, found_version_t *found, size_t count) {
+    char path[PATH_MAX];
+    if (history_path(store, name, path, sizeof(path)) < 0) {
+        return;
+    }
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return;
+    }
+    unsigned long seq;
+    long long created;
+    while (fscanf(in, "%lu %lld", &seq, &created) == 2) {
+        for (size_t i = 0; i < count; ++i) {
+            if (found[i].seq == seq) {
+                found[i].created = (time_t)created;
+            }
+        }
+    }
+    fclose(in);
+}
+
+/* the local day and hour a time falls in, so both buckets turn over on the same clock */
+static void buckets_of(time_t when, long long *hour, long long *day) {
+    struct tm tm;
+    if (!localtime_r(&when, &tm)) {
+        *day = (long long)(when / 86400);
+        *hour = (long long)(when / 3600);
+        return;
+    }
+    *day = (long long)tm.tm_year * 400 + tm.tm_yday;
+    *hour = *day * 24 + tm.tm_hour;
+}
+
+/*
+ * Unlinks the versions the policy no longer keeps from the history and
+ * returns them chained through older. Walking back from the current
+ * version, the first one met in an hour or a day is its newest.
+ */
+static world_version_t *prune_history(const world_retention_t *retention, world_slot_t *slot, time_t now) {
+    world_version_t *retired = NULL;
+    world_version_t **retired_tail = &retired;
+    world_version_t **link = &slot->current;
+    long long previous_hour = -1;
+    long long previous_day = -1;
+    unsigned int position = 0;
+    while (*link) {
+        world_version_t *version = *link;
+        time_t age = now - version->created;
+        long long hour, day;
+        buckets_of(version->created, &hour, &day);
+        int keep = position == 0 || position < retention->keep_last ||
+                   (age < (time_t)retention->keep_hourly * 3600 && hour != previous_hour) ||
+                   (age < (time_t)retention->keep_daily * 86400 && day != previous_day);
+        previous_hour = hour;
+        previous_day = day;
+        ++position;
+        if (keep) {
+            link = &version->older;
+        } else {
+            *link = version->older;
+            version->older = NULL;
+            *retired_tail = version;
+            retired_tail = &version->older;
+        }
+    }
+    return retired;
+}
+
+static world_slot_t *find_slot(world_store_t *store, const char *name) {
+    for (world_slot_t *slot = store->worlds; slot; slot = slot->next) {
+        if (strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static world_slot_t *find_or_add_slot(world_store_t *store, const char *name) {
+    world_slot_t *slot = find_slot(store, name);
+    if (slot) {
+        return slot;
+    }
+    slot = calloc(1, sizeof(*slot));
+    if (!slot) {
+        return NULL;
+    }
+    slot->name = strdup(name);
+    if (!slot->name) {
+        free(slot);
+        return NULL;
+    }
+    slot->next_seq = 1;
+    slot->next = store->worlds;
+    store->worlds = slot;
+    return slot;
+}
+
+static void set_contents(world_slot_t *slot, const manifest_t *contents) {
+    slot->bytes = 0;
+    slot->files = 0;
+    for (size_t i = 0; i < contents->entry_count; ++i) {
+        if (contents->entries[i].type == MANIFEST_FILE) {
+            slot->bytes += contents->entries[i].size;
+            ++slot->files;
+        }
+    }
+    slot->cataloged = 1;
+}
+
+/*
+ * One "<seq> <unix time> <bytes> <files> <world>" line per world, naming its
+ * current version, replaced whole; called with the lock held.
+ */
+static int write_catalog(world_store_t *store, staged_meta_t *meta) {
+    if (snprintf(meta->path, sizeof(meta->path), "%s/%s/" CATALOG_FILE, store->storage_dir, STORE_META_DIR) >= (int)sizeof(meta->path) ||
+        snprintf(meta->tmp_path, sizeof(meta->tmp_path), "%s/%s/." CATALOG_FILE ".tmpXXXXXX", store->storage_dir, STORE_META_DIR) >= (int)sizeof(meta->tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (create_meta(meta) < 0) {
+        return -1;
+    }
+    for (const world_slot_t *slot = store->worlds; slot; slot = slot->next) {
+        if (slot->current && slot->cataloged) {
+            fprintf(meta->out, "%lu %lld %llu %lu %s\n", slot->current->seq, (long long)slot->current->created, slot->bytes, slot->files, slot->name);
+        }
+    }
+    meta->generation = ++store->catalog_generation;
+    return flush_meta(meta);
+}
+
+static int save_catalog(world_store_t *store) {
+    staged_meta_t meta;
+    if (write_catalog(store, &meta) < 0) {
+        return -1;
+    }
+    return place_meta(store, &meta, &store->catalog_placed);
+}
+
+/* takes the sizes the catalog records for versions that are still current */
+static void load_catalog(world_store_t *store) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s/" CATALOG_FILE, store->storage_dir, STORE_META_DIR) >= (int)sizeof(path)) {
+        return;
+    }
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return;
+    }
+    unsigned long seq;
+    long long pushed;
+    unsigned long long bytes;
+    unsigned long files;
+    char name[NAME_MAX + 1];
+    while (fscanf(in, "%lu %lld %llu %lu %255s", &seq, &pushed, &bytes, &files, name) == 5) {
+        world_slot_t *slot = find_slot(store, name);
+        if (slot && slot->current && slot->current->seq == seq) {
+            slot->bytes = bytes;
+            slot->files = files;
+            slot->cataloged = 1;
+        }
+    }
+    fclose(in);
+}
+
+static world_version_t *new_version(world_store_t *store, world_slot_t *slot, unsigned long seq, enum world_format format) {
+    world_version_t *version = calloc(1, sizeof(*version));
+    if (!version) {
+        return NULL;
+    }
+    if (version_path(store, slot->name, seq, format, version->path, sizeof(version->path)) < 0) {
+        free(version);
+        return NULL;
+    }
+    version->world = slot;
+    version->seq = seq;
+    version->format = format;
+    version->refs = 1;
+    return version;
+}
+
+/* storage_dir/<world> mirrors the current version so the tree stays browsable */
+static int update_world_link(const world_store_t *store, const char *name, unsigned long seq, enum world_format format) {
+    char target[PATH_MAX];
+    char link_path[PATH_MAX];
+    char tmp_link[PATH_MAX];
+    if (snprintf(target, sizeof(target), "%s/versions/%s/%lu%s", STORE_META_DIR, name, seq, format_suffix(format)) >= (int)sizeof(target) ||
+        snprintf(link_path, sizeof(link_path), "%s/%s", store->storage_dir, name) >= (int)sizeof(link_path) ||
+        snprintf(tmp_link, sizeof(tmp_link), "%s/.%s.lnk%lu", store->storage_dir, name, seq) >= (int)sizeof(tmp_link)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    unlink(tmp_link);
+    if (symlink(target, tmp_link) < 0) {
+        return -1;
+    }
+    if (rename(tmp_link, link_path) < 0) {
+        unlink(tmp_link);
+        return -1;
+    }
+    return 0;
+}
+
+/* moves a pre-versioning storage_dir/<world> tree into the version store */
+static int adopt_legacy_world(world_store_t *store, const char *name) {
+    char world_dir[PATH_MAX];
+    char legacy_path[PATH_MAX];
+    char adopted_path[PATH_MAX];
+    if (snprintf(world_dir, sizeof(world_dir), "%s/%s", store->versions_dir, name) >= (int)sizeof(world_dir) ||
+        snprintf(legacy_path, sizeof(legacy_path), "%s/%s", store->storage_dir, name) >= (int)sizeof(legacy_path) ||
+        version_path(store, name, 1, WORLD_FORMAT_TREE, adopted_path, sizeof(adopted_path)) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (ensure_directory(world_dir, 0755) < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(adopted_path, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(legacy_path, adopted_path);
+}
+
+/* a kept chunks version holds one reference per chunk it lists */
+static int ref_chunks(world_store_t *store, const world_version_t *version) {
+    manifest_t manifest;
+    if (manifest_load(&manifest, version->path) < 0) {
+        return -1;
+    }
+    int rc = chunk_store_ref_manifest(&store->chunks, &manifest);
+    manifest_free(&manifest);
+    return rc;
+}
+
+static int compare_newest_first(const void *a, const void *b) {
+    unsigned long left = ((const found_version_t *)a)->seq;
+    unsigned long right = ((const found_version_t *)b)->seq;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static int compare_info_names(const void *a, const void *b) {
+    return strcmp(((const world_info_t *)a)->name, ((const world_info_t *)b)->name);
+}
+
+static world_version_t *find_version(const world_slot_t *slot, unsigned long seq) {
+    world_version_t *version = slot->current;
+    while (version && version->seq != seq) {
+        version = version->older;
+    }
+    return version;
+}
+
+static void drop_version(world_store_t *store, world_version_t *version) {
+    pthread_mutex_lock(&store->lock);
+    int remaining = --version->refs;
+    pthread_mutex_unlock(&store->lock);
+    if (remaining == 0) {
+        if (version->format != WORLD_FORMAT_CHUNKS) {
+            char sidecar[PATH_MAX];
+            if (sidecar_path(store, version->world->name, version->seq, sidecar, sizeof(sidecar)) == 0) {
+                unlink(sidecar);
+            }
+        }
+        /* the reaper drops a chunks manifest's references before removing it */
+        if (trash_discard(&store->trash, version->path, version->format == WORLD_FORMAT_CHUNKS ? &store->chunks : NULL) < 0) {
+            if (version->format == WORLD_FORMAT_CHUNKS) {
+                manifest_t manifest;
+                if (manifest_load(&manifest, version->path) == 0) {
+                    chunk_store_unref_manifest(&store->chunks, &manifest, manifest.chunk_count);
+                    manifest_free(&manifest);
+                } else {
+                    fprintf(stderr, "cannot read retired manifest %s: %s\n", version->path, strerror(errno));
+                }
+            }
+            remove_recursive(version->path);
+        }
+        free(version);
+    }
+}
+
+static void drop_retired(world_store_t *store, world_version_t *retired) {
+    while (retired) {
+        world_version_t *next = retired->older;
+        retired->older = NULL;
+        drop_version(store, retired);
+        retired = next;
+    }
+}
+
+static int load_world(world_store_t *store, const char *name) {
+    char world_dir[PATH_MAX];
+    if (snprintf(world_dir, sizeof(world_dir), "%s/%s", store->versions_dir, name) >= (int)sizeof(world_dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    DIR *dir = opendir(world_dir);
+    if (!dir) {
+        return -1;
+    }
+    found_version_t *found = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        found_version_t version = { 0, WORLD_FORMAT_TREE, 0 };
+        if (parse_seq(entry->d_name, &version.seq, &version.format) < 0) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t grown_capacity = capacity ? capacity * 2 : 16;
+            found_version_t *grown = realloc(found, grown_capacity * sizeof(*found));
+            if (!grown) {
+                free(found);
+                closedir(dir);
+                return -1;
+            }
+            found = grown;
+            capacity = grown_capacity;
+        }
+        found[count++] = version;
+    }
+    if (count == 0) {
+        closedir(dir);
+        return 0;
+    }
+    qsort(found, count, sizeof(*found), compare_newest_first);
+    load_history(store, name, found, count);
+
+    world_slot_t *slot = find_or_add_slot(store, name);
+    if (!slot) {
+        free(found);
+        closedir(dir);
+        return -1;
+    }
+    world_version_t **tail = &slot->current;
+    for (size_t i = 0; i < count; ++i) {
+        world_version_t *version = new_version(store, slot, found[i].seq, found[i].format);
+        if (!version) {
+            break;
+        }
+        struct stat st;
+        /* versions from before the history was kept are dated by their own mtime */
+        version->created = found[i].created ? found[i].created : lstat(version->path, &st) == 0 ? st.st_mtime : 0;
+        if (version->format == WORLD_FORMAT_CHUNKS && ref_chunks(store, version) < 0) {
+            /* left on disk; its chunks are swept unless another version lists them */
+            fprintf(stderr, "cannot load version %lu of world %s: %s\n", version->seq, name, strerror(errno));
+            free(version);
+            continue;
+        }
+        *tail = version;
+        tail = &version->older;
+    }
+    slot->next_seq = found[0].seq + 1;
+    free(found);
+    if (!slot->current) {
+        closedir(dir);
+        return -1;
+    }
+    drop_retired(store, prune_history(&store->retention, slot, time(NULL)));
+
+    /* sidecars of versions retired before a restart */
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long seq;
+        world_version_t *version;
+        if (parse_sidecar(entry->d_name, &seq) == 0 &&
+            (!(version = find_version(slot, seq)) || version->format == WORLD_FORMAT_CHUNKS)) {
+            char stale[PATH_MAX];
+            if (sidecar_path(store, name, seq, stale, sizeof(stale)) == 0) {
+                unlink(stale);
+            }
+        }
+    }
+    closedir(dir);
+    if (save_history(store, slot) < 0) {
+        fprintf(stderr, "cannot record history of world %s: %s\n", name, strerror(errno));
+    }
+    return update_world_link(store, name, slot->current->seq, slot->current->format);
+}
+
+int world_store_open(world_store_t *store, const char *storage_dir, const world_retention_t *retention, unsigned int reap_rate) {
+    memset(store, 0, sizeof(*store));
+    store->retention = *retention;
+    if (snprintf(store->storage_dir, sizeof(store->storage_dir), "%s", storage_dir) >= (int)sizeof(store->storage_dir) ||
+        snprintf(store->versions_dir, sizeof(store->versions_dir), "%s/%s/versions", storage_dir, STORE_META_DIR) >= (int)sizeof(store->versions_dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    char meta_dir[PATH_MAX];
+    char chunks_dir[PATH_MAX];
+    char trash_dir[PATH_MAX];
+    snprintf(meta_dir, sizeof(meta_dir), "%s/%s", storage_dir, STORE_META_DIR);
+    if (snprintf(chunks_dir, sizeof(chunks_dir), "%s/%s/chunks", storage_dir, STORE_META_DIR) >= (int)sizeof(chunks_dir) ||
+        snprintf(trash_dir, sizeof(trash_dir), "%s/%s/trash", storage_dir, STORE_META_DIR) >= (int)sizeof(trash_dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (ensure_directory(storage_dir, 0755) < 0 || ensure_directory(meta_dir, 0755) < 0 ||
+        ensure_directory(store->versions_dir, 0755) < 0 || chunk_store_open(&store->chunks, chunks_dir) < 0 ||
+        trash_open(&store->trash, trash_dir, reap_rate) < 0) {
+        return -1;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_mutex_init(&store->meta_lock, NULL);
+
+    DIR *dir = opendir(storage_dir);
+    if (!dir) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || sanitize_name(entry->d_name) < 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", storage_dir, entry->d_name) >= (int)sizeof(path)) {
+            continue;
+        }
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && adopt_legacy_world(store, entry->d_name) < 0) {
+            fprintf(stderr, "cannot adopt legacy world %s: %s\n", entry->d_name, strerror(errno));
+        }
+    }
+    closedir(dir);
+
+    dir = opendir(store->versions_dir);
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || sanitize_name(entry->d_name) < 0) {
+            continue;
+        }
+        if (load_world(store, entry->d_name) < 0) {
+            fprintf(stderr, "cannot load world %s: %s\n", entry->d_name, strerror(errno));
+        }
+    }
+    closedir(dir);
+
+    load_catalog(store);
+    int cataloged = 1;
+    for (world_slot_t *slot = store->worlds; slot; slot = slot->next) {
+        manifest_t contents;
+        if (slot->cataloged || !slot->current) {
+            continue;
+        }
+        cataloged = 0;
+        if (world_store_load_manifest(store, slot->current, &contents) == 0) {
+            set_contents(slot, &contents);
+            manifest_free(&contents);
+        } else {
+            fprintf(stderr, "cannot size world %s: %s\n", slot->name, strerror(errno));
+        }
+    }
+    if (!cataloged && save_catalog(store) < 0) {
+        fprintf(stderr, "cannot record catalog: %s\n", strerror(errno));
+    }
+    int swept = chunk_store_sweep(&store->chunks);
+    if (swept > 0) {
+        printf("removed %d unreferenced chunks\n", swept);
+    }
+    return 0;
+}
+
+void world_store_close(world_store_t *store) {
+    trash_close(&store->trash);
+    world_slot_t *slot = store->worlds;
+    while (slot) {
+        world_slot_t *next = slot->next;
+        /* versions still pinned by a reader are leaked deliberately; the process is exiting */
+        world_version_t *version = slot->current;
+        while (version) {
+            world_version_t *older = version->older;
+            if (--version->refs == 0) {
+                free(version);
+            }
+            version = older;
+        }
+        free(slot->name);
+        free(slot);
+        slot = next;
+    }
+    store->worlds = NULL;
+    pthread_mutex_destroy(&store->lock);
+    pthread_mutex_destroy(&store->meta_lock);
+    chunk_store_close(&store->chunks);
+}
+
+world_version_t *world_store_acquire(world_store_t *store, const char *name, unsigned long seq) {
+    pthread_mutex_lock(&store->lock);
+    world_slot_t *slot = find_slot(store, name);
+    world_version_t *version = slot ? seq == 0 ? slot->current : find_version(slot, seq) : NULL;
+    if (version) {
+        ++version->refs;
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (!version) {
+        errno = ENOENT;
+    }
+    return version;
+}
+
+int world_store_history(world_store_t *store, const char *name, world_version_t ***versions, size_t *count) {
+    *versions = NULL;
+    *count = 0;
+    pthread_mutex_lock(&store->lock);
+    world_slot_t *slot = find_slot(store, name);
+    size_t total = 0;
+    for (world_version_t *version = slot ? slot->current : NULL; version; version = version->older) {
+        ++total;
+    }
+    world_version_t **pinned = total > 0 ? malloc(total * sizeof(*pinned)) : NULL;
+    if (!pinned) {
+        pthread_mutex_unlock(&store->lock);
+        errno = total > 0 ? ENOMEM : ENOENT;
+        return -1;
+    }
+    size_t used = 0;
+    for (world_version_t *version = slot->current; version; version = version->older) {
+        ++version->refs;
+        pinned[used++] = version;
+    }
+    pthread_mutex_unlock(&store->lock);
+    *versions = pinned;
+    *count = total;
+    return 0;
+}
+
+void world_store_release(world_store_t *store, world_version_t *version) {
+    if (version) {
+        drop_version(store, version);
+    }
+}
+
+int world_store_list(world_store_t *store, const char *prefix, world_info_t **worlds, size_t *count) {
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    *worlds = NULL;
+    *count = 0;
+    pthread_mutex_lock(&store->lock);
+    size_t total = 0;
+    for (const world_slot_t *slot = store->worlds; slot; slot = slot->next) {
+        ++total;
+    }
+    world_info_t *infos = total > 0 ? malloc(total * sizeof(*infos)) : NULL;
+    if (total > 0 && !infos) {
+        pthread_mutex_unlock(&store->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t used = 0;
+    for (const world_slot_t *slot = store->worlds; slot; slot = slot->next) {
+        if (!slot->current || strncmp(slot->name, prefix ? prefix : "", prefix_len) != 0) {
+            continue;
+        }
+        world_info_t *info = &infos[used++];
+        snprintf(info->name, sizeof(info->name), "%s", slot->name);
+        info->seq = slot->current->seq;
+        info->format = slot->current->format;
+        info->pushed = slot->current->created;
+        info->bytes = slot->bytes;
+        info->files = slot->files;
+    }
+    pthread_mutex_unlock(&store->lock);
+    qsort(infos, used, sizeof(*infos), compare_info_names);
+    *worlds = infos;
+    *count = used;
+    return 0;
+}
+
+/*
+ * A chunks manifest is published with its chunks already pinned; the version
+ * takes over those references. A tree may come with the manifest of its
+ * contents in sidecar, which is moved next to it. contents sizes the
+ * version in the catalog. The versions the retention policy stops keeping
+ * are retired. Both the version and its renames are durable, as far as the
+ * durability mode asks, by the time this returns 0. It returns 1 if the
+ * version was published but its directories could not be synced: it stays,
+ * but the push must not be acknowledged as safe.
+ */
+int world_store_publish(world_store_t *store, const char *name, const char *staging_path, enum world_format format, const char *sidecar,
+                        const manifest_t *contents) {
+    char world_dir[PATH_MAX];
+    if (snprintf(world_dir, sizeof(world_dir), "%s/%s", store->versions_dir, name) >= (int)sizeof(world_dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (ensure_directory(world_dir, 0755) < 0) {
+        return -1;
+    }
+    const char *staged[] = { staging_path, sidecar };
+    if (durable_commit(staged, sidecar ? 2 : 1) < 0) {
+        return -1;
+    }
+    /* held across the rename so concurrent pushes of one world publish in seq order */
+    pthread_mutex_lock(&store->lock);
+    world_slot_t *slot = find_or_add_slot(store, name);
+    world_version_t *version = slot ? new_version(store, slot, slot->next_seq, format) : NULL;
+    if (!version) {
+        pthread_mutex_unlock(&store->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (rename(staging_path, version->path) < 0) {
+        int saved = errno;
+        pthread_mutex_unlock(&store->lock);
+        free(version);
+        errno = saved;
+        return -1;
+    }
+    ++slot->next_seq;
+    char sidecar_final[PATH_MAX];
+    if (sidecar && (sidecar_path(store, name, version->seq, sidecar_final, sizeof(sidecar_final)) < 0 ||
+                    rename(sidecar, sidecar_final) < 0)) {
+        /* only a cache; the next incremental push rebuilds it */
+        fprintf(stderr, "cannot store manifest for world %s: %s\n", name, strerror(errno));
+        unlink(sidecar);
+    }
+    version->created = time(NULL);
+    version->older = slot->current;
+    slot->current = version;
+    if (update_world_link(store, name, version->seq, format) < 0) {
+        fprintf(stderr, "cannot update link for world %s: %s\n", name, strerror(errno));
+    }
+    world_version_t *retired = prune_history(&store->retention, slot, version->created);
+    staged_meta_t history, catalog;
+    int history_written = write_history(store, slot, &history) == 0;
+    if (!history_written) {
+        fprintf(stderr, "cannot record history of world %s: %s\n", name, strerror(errno));
+    }
+    set_contents(slot, contents);
+    int catalog_written = write_catalog(store, &catalog) == 0;
+    if (!catalog_written) {
+        fprintf(stderr, "cannot record catalog: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (history_written && place_meta(store, &history, &slot->history_placed) < 0) {
+        fprintf(stderr, "cannot record history of world %s: %s\n", name, strerror(errno));
+    }
+    if (catalog_written && place_meta(store, &catalog, &store->catalog_placed) < 0) {
+        fprintf(stderr, "cannot record catalog: %s\n", strerror(errno));
+    }
+    drop_retired(store, retired);
+    /* the version, its history, the world's link and the catalog */
+    char meta_dir[PATH_MAX];
+    const char *renamed[] = { world_dir, store->storage_dir, meta_dir };
+    if (snprintf(meta_dir, sizeof(meta_dir), "%s/%s", store->storage_dir, STORE_META_DIR) >= (int)sizeof(meta_dir) ||
+        durable_sync_dirs(renamed, 3) < 0) {
+        /* too late to take the version back; it is published, just not yet safe */
+        fprintf(stderr, "cannot sync world %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+void world_store_discard(world_store_t *store, const char *path) {
+    if (trash_discard(&store->trash, path, NULL) < 0) {
+        remove_recursive(path);
+    }
+}
+
+/*
+ * The contents of a version as a manifest. A pack's comes from its index, in
+ * index order. A tree's manifest is kept in its sidecar; versions published
+ * without one are scanned once and the result is saved, which is safe
+ * because versions never change. A damaged sidecar is replaced the same way.
+ */
+int world_store_load_manifest(world_store_t *store, const world_version_t *version, manifest_t *manifest) {
+    if (version->format == WORLD_FORMAT_CHUNKS) {
+        return manifest_load(manifest, version->path);
+    }
+    if (version->format == WORLD_FORMAT_PACK) {
+        pack_t pack;
+        if (pack_open(&pack, version->path) < 0) {
+            return -1;
+        }
+        int rc = pack_to_manifest(&pack, manifest);
+        pack_close(&pack);
+        return rc;
+    }
+    const char *name = version->world->name;
+    char sidecar[PATH_MAX];
+    if (sidecar_path(store, name, version->seq, sidecar, sizeof(sidecar)) < 0) {
+        return -1;
+    }
+    if (manifest_load(manifest, sidecar) == 0) {
+        return 0;
+    }
+    if (version->format == WORLD_FORMAT_COMPRESSED) {
+        /* scanning would hash the compressed bytes; callers fall back to sending whole files */
+        errno = ENOENT;
+        return -1;
+    }
+    if (manifest_scan_dir(manifest, version->path, NULL, NULL) < 0) {
+        int saved = errno;
+        manifest_free(manifest);
+        errno = saved;
+        return -1;
+    }
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.tmpXXXXXX", store->storage_dir, name) >= (int)sizeof(tmp_path)) {
+        return 0;
+    }
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return 0;
+    }
+    close(fd);
+    if (manifest_save(manifest, tmp_path) < 0 || rename(tmp_path, sidecar) < 0) {
+        unlink(tmp_path);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef MCSYNC_WORLD_STORE_H
+#define MCSYNC_WORLD_STORE_H
+
+#include "platform.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "chunk_store.h"
+#include "trash.h"
+
+/*
+ * Each push becomes an immutable version under <storage>/.mcsync/versions/<world>/<seq>.
+ * Readers pin a version; publishing makes the new one current and keeps the
+ * older ones as history until the retention policy retires them. A retired
+ * version is moved to <storage>/.mcsync/trash once its last reader releases
+ * it, and removed from there in the background. Versions share
+ * unchanged files as hard links, or chunks in the chunk store, so each costs
+ * only what changed. <world>/history records when each was published, and
+ * <storage>/.mcsync/catalog the current version of every world with its
+ * size, so listing worlds needs neither a directory walk nor a stat.
+ *
+ * A version is either a plain tree or, named <seq>.chunks, a manifest whose
+ * chunks live in the shared chunk store under <storage>/.mcsync/chunks, or,
+ * named <seq>.lz4, a tree of compressed files (see compressed_tree.h), or,
+ * named <seq>.pack, a single file holding the whole tree (see pack.h). A
+ * tree may have a <seq>.manifest sidecar listing its contents; a
+ * compressed tree always has one and a pack is its own.
+ */
+enum world_format {
+    WORLD_FORMAT_TREE,
+    WORLD_FORMAT_CHUNKS,
+    WORLD_FORMAT_COMPRESSED,
+    WORLD_FORMAT_PACK
+};
+
+typedef struct world_version {
+    struct world_slot *world;
+    unsigned long seq;
+    enum world_format format;
+    time_t created;
+    int refs;
+    /* the next older version still kept */
+    struct world_version *older;
+    char path[PATH_MAX];
+} world_version_t;
+
+typedef struct world_slot {
+    char *name;
+    /* newest first through older */
+    world_version_t *current;
+    unsigned long next_seq;
+    /* what the current version holds, from the catalog */
+    unsigned long long bytes;
+    unsigned long files;
+    int cataloged;
+    /* the newest history written, and the newest renamed into place under meta_lock */
+    unsigned long history_generation;
+    unsigned long history_placed;
+    struct world_slot *next;
+} world_slot_t;
+
+/*
+ * Which versions outlive later pushes: the newest keep_last, and the newest
+ * of every hour in the last keep_hourly hours and of every day in the last
+ * keep_daily days. The current version is always kept.
+ */
+typedef struct {
+    unsigned int keep_last;
+    unsigned int keep_hourly;
+    unsigned int keep_daily;
+} world_retention_t;
+
+#define WORLD_KEEP_LAST 5
+#define WORLD_KEEP_HOURLY 24
+#define WORLD_KEEP_DAILY 30
+
+/* a world as the catalog describes it */
+typedef struct {
+    char name[NAME_MAX + 1];
+    unsigned long seq;
+    enum world_format format;
+    time_t pushed;
+    unsigned long long bytes;
+    unsigned long files;
+} world_info_t;
+
+typedef struct {
+    char storage_dir[PATH_MAX];
+    char versions_dir[PATH_MAX];
+    pthread_mutex_t lock;
+    /* orders the renames of history and catalog files written under lock */
+    pthread_mutex_t meta_lock;
+    unsigned long catalog_generation;
+    unsigned long catalog_placed;
+    world_slot_t *worlds;
+    chunk_store_t chunks;
+    trash_t trash;
+    world_retention_t retention;
+} world_store_t;
+
+/* reap_rate caps how many files a second the trash reaper unlinks, 0 for no limit */
+int world_store_open(world_store_t *store, const char *storage_dir, const world_retention_t *retention, unsigned int reap_rate);
+void world_store_close(world_store_t *store);
+/* pins version seq of a world, or the current one for seq 0 */
+world_version_t *world_store_acquire(world_store_t *store, const char *name, unsigned long seq);
+/* pins every kept version of a world, newest first, into a new array */
+int world_store_history(world_store_t *store, const char *name, world_version_t ***versions, size_t *count);
+/* the worlds whose names start with prefix, sorted by name, copied into a new array */
+int world_store_list(world_store_t *store, const char *prefix, world_info_t **worlds, size_t *count);
+void world_store_release(world_store_t *store, world_version_t *version);
+/* 0 once published and durable, 1 if published but not durable, -1 if nothing was published */
+int world_store_publish(world_store_t *store, const char *name, const char *staging_path, enum world_format format, const char *sidecar,
+                        const manifest_t *contents);
+/* hands a staging tree the caller is done with to the trash */
+void world_store_discard(world_store_t *store, const char *path);
+int world_store_load_manifest(world_store_t *store, const world_version_t *version, manifest_t *manifest);
+
+#endif /* MCSYNC_WORLD_STORE_H */
@@ -0,0 +1,62 @@
+#ifndef MCSYNC_CHECK_H
+#define MCSYNC_CHECK_H
+
+#include "platform.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * The few helpers the tests under tests/ share. Each test binary runs its
+ * cases in order, reports every failed CHECK with its line and exits
+ * non-zero if any failed, so `make check` stops at the first broken binary.
+ */
+static int check_failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++check_failures;                                               \
+        }                                                                   \
+    } while (0)
+
+static inline int check_report(const char *name) {
+    if (check_failures > 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+/* a connected pair of stream sockets, as two ends of one connection */
+static inline int check_socketpair(int fds[2]) {
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+}
+
+static inline int check_write_all(int fd, const void *data, size_t length) {
+    const unsigned char *p = data;
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+        if (written < 0) {
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/* deterministic filler, so a failure reproduces */
+static inline void check_fill(unsigned char *data, size_t length, unsigned int seed) {
+    unsigned int state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < length; ++i) {
+        state = state * 1103515245u + 12345u;
+        data[i] = (unsigned char)(state >> 16);
+    }
+}
+
+#endif /* MCSYNC_CHECK_H */
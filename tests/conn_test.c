@@ -0,0 +1,193 @@
+#include "platform.h"
+#include "conn.h"
+
+#include "check.h"
+#include "common.h"
+#include "lz4.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* text-like: short repeats an LZ4 block finds, with some noise between them */
+static void fill_compressible(unsigned char *data, size_t length, unsigned int seed) {
+    static const char words[] = "minecraft:stone minecraft:dirt minecraft:air Level Data Entities ";
+    check_fill(data, length, seed);
+    for (size_t i = 0; i < length; ++i) {
+        if (data[i] % 8 != 0) {
+            data[i] = (unsigned char)words[i % (sizeof(words) - 1)];
+        }
+    }
+}
+
+static void test_lz4_blocks(void) {
+    size_t size = LZ4_BLOCK_MAX;
+    unsigned char *in = malloc(size);
+    unsigned char *out = malloc(lz4_bound(size));
+    unsigned char *back = malloc(size);
+    for (int kind = 0; kind < 3; ++kind) {
+        if (kind == 0) {
+            fill_compressible(in, size, 1);
+        } else if (kind == 1) {
+            check_fill(in, size, 2);
+        } else {
+            memset(in, 0, size);
+        }
+        for (int level = LZ4_LEVEL_MIN; level <= LZ4_LEVEL_MAX; ++level) {
+            size_t packed = lz4_compress(in, size, out, lz4_bound(size), level);
+            CHECK(packed > 0 && packed <= lz4_bound(size));
+            CHECK(lz4_decompress(out, packed, back, size) == 0 && memcmp(in, back, size) == 0);
+            if (kind != 1) {
+                CHECK(packed < size / 2);
+            }
+            /* the wrong expected size, and every cut of the block, are refused */
+            CHECK(lz4_decompress(out, packed, back, size - 1) < 0);
+            for (size_t cut = 1; cut < packed; cut += packed / 97 + 1) {
+                CHECK(lz4_decompress(out, packed - cut, back, size) < 0);
+            }
+        }
+    }
+    /* corrupt blocks must fail or expand to the size asked for, never run past either buffer */
+    fill_compressible(in, size, 3);
+    size_t packed = lz4_compress(in, size, out, lz4_bound(size), 2);
+    for (unsigned int round = 0; round < 2000; ++round) {
+        unsigned char *bad = malloc(packed);
+        memcpy(bad, out, packed);
+        unsigned char noise[4];
+        check_fill(noise, sizeof(noise), round);
+        bad[(noise[0] | noise[1] << 8 | (size_t)noise[2] << 16) % packed] ^= (unsigned char)(noise[3] | 1);
+        lz4_decompress(bad, packed, back, size);
+        free(bad);
+    }
+    /* a match reaching back before the start of the output, and a zero offset */
+    static const unsigned char before_start[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+    CHECK(lz4_decompress(before_start, sizeof(before_start), back, 5) < 0);
+    static const unsigned char zero_offset[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+    CHECK(lz4_decompress(zero_offset, sizeof(zero_offset), back, 5) < 0);
+    /* a literal run longer than the input, through the extended length bytes */
+    static const unsigned char long_literal[] = { 0xf0, 0xff, 0xff, 0x10, 'a' };
+    CHECK(lz4_decompress(long_literal, sizeof(long_literal), back, size) < 0);
+    free(in);
+    free(out);
+    free(back);
+}
+
+typedef struct {
+    int fd;
+    const unsigned char *data;
+    size_t size;
+    int rc;
+} writer_t;
+
+static void *write_compressed(void *arg) {
+    writer_t *writer = arg;
+    mc_conn_t conn;
+    conn_init(&conn, writer->fd);
+    writer->rc = conn_start_compression(&conn) < 0 || conn_write(&conn, writer->data, writer->size) < 0 || conn_flush(&conn) < 0 ? -1 : 0;
+    conn_destroy(&conn);
+    close(writer->fd);
+    return NULL;
+}
+
+static void test_record_round_trip(void) {
+    size_t size = 5 * CONN_BUFFER_SIZE + 1234;
+    unsigned char *data = malloc(size);
+    unsigned char *back = malloc(size);
+    fill_compressible(data, 3 * CONN_BUFFER_SIZE, 4);
+    check_fill(data + 3 * CONN_BUFFER_SIZE, size - 3 * CONN_BUFFER_SIZE, 5);
+    int fds[2];
+    CHECK(check_socketpair(fds) == 0);
+    writer_t writer = { fds[1], data, size, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, write_compressed, &writer);
+    mc_conn_t conn;
+    conn_init(&conn, fds[0]);
+    CHECK(conn_start_compression(&conn) == 0);
+    CHECK(conn_read(&conn, back, size) == 0 && memcmp(data, back, size) == 0);
+    CHECK(conn.received.wire_bytes < size);
+    pthread_join(thread, NULL);
+    CHECK(writer.rc == 0);
+    conn_destroy(&conn);
+    close(fds[0]);
+    free(data);
+    free(back);
+}
+
+/* hands raw bytes, as a peer would put them on the wire, to a compressing reader */
+static int read_records(const unsigned char *wire, size_t wire_len, unsigned char *out, size_t out_len) {
+    int fds[2];
+    if (check_socketpair(fds) < 0) {
+        return -2;
+    }
+    check_write_all(fds[1], wire, wire_len);
+    close(fds[1]);
+    mc_conn_t conn;
+    conn_init(&conn, fds[0]);
+    int rc = conn_start_compression(&conn);
+    if (rc == 0) {
+        rc = conn_read(&conn, out, out_len);
+    }
+    int saved = errno;
+    conn_destroy(&conn);
+    close(fds[0]);
+    errno = saved;
+    return rc;
+}
+
+static size_t record_header(unsigned char *out, uint32_t kind, uint32_t length, uint32_t raw_length) {
+    put_le32(out, kind);
+    put_le32(out + 4, length);
+    put_le32(out + 8, raw_length);
+    return CONN_RECORD_HEADER_SIZE;
+}
+
+static void test_hostile_records(void) {
+    size_t raw = 4096;
+    unsigned char *plain = malloc(raw);
+    unsigned char *wire = malloc(CONN_RECORD_HEADER_SIZE * 2 + lz4_bound(raw) + 16);
+    unsigned char *out = malloc(raw + 16);
+    fill_compressible(plain, raw, 6);
+    size_t packed = lz4_compress(plain, raw, wire + CONN_RECORD_HEADER_SIZE, lz4_bound(raw), 2);
+
+    /* a well-formed LZ4 record followed by a stored one */
+    size_t len = record_header(wire, CONN_RECORD_LZ4, (uint32_t)packed, (uint32_t)raw) + packed;
+    len += record_header(wire + len, CONN_RECORD_STORED, 5, 5);
+    memcpy(wire + len, "plain", 5);
+    len += 5;
+    CHECK(read_records(wire, len, out, raw + 5) == 0 && memcmp(out, plain, raw) == 0 && memcmp(out + raw, "plain", 5) == 0);
+
+    /* an unknown kind, an expansion beyond a block, a length beyond any block's bound */
+    record_header(wire, 7, (uint32_t)packed, (uint32_t)raw);
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + packed, out, raw) < 0 && errno == EPROTO);
+    record_header(wire, CONN_RECORD_LZ4, (uint32_t)packed, CONN_BUFFER_SIZE + 1);
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + packed, out, raw) < 0 && errno == EPROTO);
+    record_header(wire, CONN_RECORD_LZ4, (uint32_t)lz4_bound(CONN_BUFFER_SIZE) + 1, (uint32_t)raw);
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + packed, out, raw) < 0 && errno == EPROTO);
+    /* a block that does not expand to the size its header claims */
+    record_header(wire, CONN_RECORD_LZ4, (uint32_t)packed, (uint32_t)raw - 1);
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + packed, out, raw - 1) < 0 && errno == EPROTO);
+    /* a corrupt block */
+    record_header(wire, CONN_RECORD_LZ4, (uint32_t)packed, (uint32_t)raw);
+    wire[CONN_RECORD_HEADER_SIZE + packed / 2] ^= 0xff;
+    wire[CONN_RECORD_HEADER_SIZE + packed - 3] ^= 0x40;
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + packed, out, raw) < 0 || memcmp(out, plain, raw) != 0);
+    /* records cut short by the peer */
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + packed / 2, out, raw) < 0);
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE - 1, out, 1) < 0);
+    record_header(wire, CONN_RECORD_STORED, 100, 100);
+    CHECK(read_records(wire, CONN_RECORD_HEADER_SIZE + 50, out, 100) < 0);
+    free(plain);
+    free(wire);
+    free(out);
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+    test_lz4_blocks();
+    test_record_round_trip();
+    test_hostile_records();
+    return check_report("conn_test");
+}
@@ -0,0 +1,255 @@
+#include "platform.h"
+#include "delta.h"
+
+#include "check.h"
+#include "hash.h"
+#include "protocol.h"
+#include "region.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+    const delta_signature_t *signature;
+    const unsigned char *data;
+    size_t size;
+    /* sent in the ENTRY_DELTA in place of the data's own hash when set */
+    const unsigned char *hash;
+    unsigned long long data_bytes;
+    int rc;
+} sender_t;
+
+/* the sending half runs on its own thread, so neither side stalls on a full socket */
+static void *send_delta(void *arg) {
+    sender_t *sender = arg;
+    mc_conn_t conn;
+    conn_init(&conn, sender->fd);
+    conn.proto_version = PROTO_VERSION_BINARY;
+    unsigned char hash[HASH_SIZE];
+    hash_buffer(sender->data, sender->size, hash);
+    sender->rc = proto_send_entry_delta(&conn, "f", 1, sender->size, sender->hash ? sender->hash : hash) < 0 ||
+                         delta_send(&conn, sender->signature, sender->data, sender->size) < 0 || conn_flush(&conn) < 0
+                     ? -1
+                     : 0;
+    sender->data_bytes = conn.sent.bytes;
+    conn_destroy(&conn);
+    close(sender->fd);
+    return NULL;
+}
+
+static int temp_file_with(const unsigned char *data, size_t size) {
+    FILE *file = tmpfile();
+    if (!file) {
+        return -1;
+    }
+    int fd = dup(fileno(file));
+    fclose(file);
+    if (fd >= 0 && size > 0 && check_write_all(fd, data, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* sends new against the signature of basis and rebuilds it; 0 if the copy matches */
+static int round_trip(const unsigned char *basis, size_t basis_size, const delta_signature_t *signature, const unsigned char *data,
+                      size_t size, const unsigned char *hash, unsigned long long *data_bytes) {
+    int fds[2];
+    if (check_socketpair(fds) < 0) {
+        return -1;
+    }
+    sender_t sender = { fds[1], signature, data, size, hash, 0, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, send_delta, &sender);
+    mc_conn_t conn;
+    conn_init(&conn, fds[0]);
+    conn.proto_version = PROTO_VERSION_BINARY;
+    int basis_fd = temp_file_with(basis, basis_size);
+    int out_fd = temp_file_with(NULL, 0);
+    proto_msg_t msg;
+    int rc = proto_recv(&conn, &msg);
+    if (rc == 0 && msg.type != PROTO_ENTRY_DELTA) {
+        errno = EPROTO;
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = delta_apply(&conn, basis_fd, out_fd, msg.size, msg.hash);
+    }
+    int saved = errno;
+    if (rc == 0) {
+        unsigned char *copy = malloc(size + 1);
+        rc = copy && pread(out_fd, copy, size + 1, 0) == (ssize_t)size && memcmp(copy, data, size) == 0 ? 0 : -1;
+        free(copy);
+    }
+    conn_destroy(&conn);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    close(basis_fd);
+    close(out_fd);
+    if (data_bytes) {
+        *data_bytes = sender.data_bytes;
+    }
+    errno = saved;
+    return rc;
+}
+
+static void test_block_delta(void) {
+    size_t basis_size = 1 << 20;
+    unsigned char *basis = malloc(basis_size);
+    unsigned char *data = malloc(basis_size + 4096);
+    check_fill(basis, basis_size, 1);
+
+    delta_signature_t signature;
+    CHECK(delta_signature_compute(&signature, basis, basis_size) == 0);
+    CHECK(signature.block_size == DELTA_BLOCK_MIN && signature.block_count == basis_size / DELTA_BLOCK_MIN);
+
+    /* unchanged: all copies */
+    unsigned long long data_bytes;
+    CHECK(round_trip(basis, basis_size, &signature, basis, basis_size, NULL, &data_bytes) == 0);
+    CHECK(data_bytes == 0);
+
+    /* bytes inserted, one overwritten and a tail appended: only those travel as data */
+    memcpy(data, basis, 300000);
+    memset(data + 300000, 'x', 100);
+    memcpy(data + 300100, basis + 300000, basis_size - 300000);
+    data[700000] ^= 0xff;
+    size_t size = basis_size + 100;
+    check_fill(data + size, 3000, 2);
+    size += 3000;
+    CHECK(round_trip(basis, basis_size, &signature, data, size, NULL, &data_bytes) == 0);
+    CHECK(data_bytes > 0 && data_bytes < 4 * DELTA_BLOCK_MIN + 3000);
+
+    /* nothing in common, and an empty result */
+    check_fill(data, basis_size, 3);
+    CHECK(round_trip(basis, basis_size, &signature, data, basis_size, NULL, NULL) == 0);
+    CHECK(round_trip(basis, basis_size, &signature, data, 0, NULL, NULL) == 0);
+
+    /* a result that does not hash as announced is refused */
+    unsigned char wrong[HASH_SIZE];
+    memset(wrong, 0x5a, sizeof(wrong));
+    CHECK(round_trip(basis, basis_size, &signature, basis, basis_size, wrong, NULL) < 0 && errno == EBADMSG);
+
+    /* a signature of some other basis makes copies the receiver cannot satisfy */
+    delta_signature_t longer;
+    unsigned char *big = malloc(2 * basis_size);
+    memcpy(big, basis, basis_size);
+    memcpy(big + basis_size, basis, basis_size);
+    CHECK(delta_signature_init(&longer, 2 * basis_size, DELTA_BLOCK_MIN) == 0);
+    for (size_t i = 0; i < longer.block_count; ++i) {
+        longer.blocks[i] = signature.blocks[i % signature.block_count];
+    }
+    CHECK(round_trip(basis, basis_size / 2, &longer, big, 2 * basis_size, NULL, NULL) < 0 && errno == EPROTO);
+    delta_signature_free(&longer);
+    free(big);
+
+    delta_signature_free(&signature);
+    free(basis);
+    free(data);
+}
+
+static void put_location(unsigned char *data, size_t slot, uint32_t location) {
+    data[slot * 4] = (unsigned char)(location >> 24);
+    data[slot * 4 + 1] = (unsigned char)(location >> 16);
+    data[slot * 4 + 2] = (unsigned char)(location >> 8);
+    data[slot * 4 + 3] = (unsigned char)location;
+}
+
+/* a region file with a chunk of sectors sectors in each of the first count slots, laid out last slot first if reversed */
+static size_t make_region(unsigned char *data, size_t count, size_t sectors, unsigned int seed, int reversed) {
+    memset(data, 0, REGION_HEADER_SIZE);
+    size_t next = REGION_HEADER_SIZE / REGION_SECTOR_SIZE;
+    for (size_t i = 0; i < count; ++i) {
+        size_t slot = reversed ? count - 1 - i : i;
+        put_location(data, slot, (uint32_t)(next << 8 | sectors));
+        check_fill(data + next * REGION_SECTOR_SIZE, sectors * REGION_SECTOR_SIZE, seed + (unsigned int)slot);
+        next += sectors;
+    }
+    return next * REGION_SECTOR_SIZE;
+}
+
+static void test_region_locations(void) {
+    size_t capacity = REGION_HEADER_SIZE + 16 * REGION_SECTOR_SIZE;
+    unsigned char *data = malloc(capacity);
+    uint32_t locations[REGION_CHUNKS];
+    size_t size = make_region(data, 8, 2, 10, 0);
+    CHECK(region_read_locations(data, size, locations) == 0);
+    CHECK(REGION_FIRST_SECTOR(locations[0]) == 2 && REGION_SECTOR_COUNT(locations[0]) == 2);
+    CHECK(locations[8] == 0 && locations[REGION_CHUNKS - 1] == 0);
+
+    CHECK(region_read_locations(data, REGION_HEADER_SIZE - 1, locations) < 0 && errno == EINVAL);
+    CHECK(region_read_locations(data, size - 1, locations) < 0 && errno == EINVAL);
+    /* a slot without sectors is absent, wherever it points */
+    put_location(data, 20, 0xffffff00u);
+    CHECK(region_read_locations(data, size, locations) == 0 && locations[20] == 0);
+    /* chunks inside the header tables or past the end of the file */
+    put_location(data, 20, 1u << 8 | 1);
+    CHECK(region_read_locations(data, size, locations) < 0 && errno == EINVAL);
+    put_location(data, 20, (uint32_t)(size / REGION_SECTOR_SIZE) << 8 | 1);
+    CHECK(region_read_locations(data, size, locations) < 0 && errno == EINVAL);
+    put_location(data, 20, 0xffffffffu);
+    CHECK(region_read_locations(data, size, locations) < 0 && errno == EINVAL);
+    free(data);
+}
+
+static void test_region_delta(void) {
+    size_t capacity = REGION_HEADER_SIZE + 64 * 3 * REGION_SECTOR_SIZE;
+    unsigned char *basis = malloc(capacity);
+    unsigned char *data = malloc(capacity);
+    size_t basis_size = make_region(basis, 64, 3, 20, 0);
+    delta_signature_t signature;
+    CHECK(delta_region_signature_compute(&signature, basis, basis_size) == 0);
+    CHECK(signature.region && signature.block_count == REGION_CHUNKS);
+
+    /* one chunk rewritten and the rest unchanged */
+    memcpy(data, basis, basis_size);
+    check_fill(data + REGION_HEADER_SIZE + 5 * 3 * REGION_SECTOR_SIZE, 3 * REGION_SECTOR_SIZE, 99);
+    unsigned long long data_bytes;
+    CHECK(round_trip(basis, basis_size, &signature, data, basis_size, NULL, &data_bytes) == 0);
+    CHECK(data_bytes <= REGION_HEADER_SIZE + 3 * REGION_SECTOR_SIZE);
+
+    /* chunks the game moved within the file are still copied from where the basis keeps them */
+    size_t size = make_region(data, 64, 3, 20, 1);
+    CHECK(round_trip(basis, basis_size, &signature, data, size, NULL, &data_bytes) == 0);
+    CHECK(data_bytes <= REGION_HEADER_SIZE);
+
+    /* not a region file at all */
+    delta_signature_t other;
+    check_fill(data, REGION_HEADER_SIZE, 5);
+    CHECK(delta_region_signature_compute(&other, data, REGION_HEADER_SIZE) < 0 && errno == EINVAL);
+
+    delta_signature_free(&signature);
+    free(basis);
+    free(data);
+}
+
+static void test_signature_growth(void) {
+    delta_signature_t signature;
+    delta_signature_begin(&signature, 1 << 30, DELTA_BLOCK_MIN);
+    CHECK(signature.blocks == NULL && signature.block_count == 0);
+    unsigned char wire[DELTA_BLOCK_WIRE_SIZE];
+    memset(wire, 0, sizeof(wire));
+    for (uint32_t i = 0; i < 1000; ++i) {
+        wire[0] = (unsigned char)i;
+        CHECK(delta_signature_add_block(&signature, wire) == 0);
+    }
+    CHECK(signature.block_count == 1000 && signature.block_capacity < 2048);
+    CHECK(signature.blocks[999].weak == (999 & 0xff));
+    delta_signature_free(&signature);
+    CHECK(delta_signature_init(&signature, 1, 0) < 0 && errno == EINVAL);
+}
+
+int main(void) {
+    /* a receiver that gives up closes its end under the sender */
+    signal(SIGPIPE, SIG_IGN);
+    test_block_delta();
+    test_region_locations();
+    test_region_delta();
+    test_signature_growth();
+    return check_report("delta_test");
+}
@@ -0,0 +1,276 @@
+#include "platform.h"
+#include "protocol.h"
+
+#include "check.h"
+#include "common.h"
+#include "region.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void test_check_path(void) {
+    CHECK(proto_check_path("level.dat", 9) == 0);
+    CHECK(proto_check_path("region/r.0.0.mca", 16) == 0);
+    CHECK(proto_check_path("a/..b/c..", 9) == 0);
+    CHECK(proto_check_path("", 0) < 0);
+    CHECK(proto_check_path("/etc/passwd", 11) < 0);
+    CHECK(proto_check_path("..", 2) < 0);
+    CHECK(proto_check_path("../x", 4) < 0);
+    CHECK(proto_check_path("a/../../x", 9) < 0);
+    CHECK(proto_check_path("a/..", 4) < 0);
+    CHECK(proto_check_path(".", 1) < 0);
+    CHECK(proto_check_path("a/./b", 5) < 0);
+    CHECK(proto_check_path("a//b", 4) < 0);
+    CHECK(proto_check_path("a/", 2) < 0);
+    CHECK(proto_check_path("a\0/../b", 7) < 0);
+    CHECK(proto_check_path("ok\0", 3) < 0);
+}
+
+/*
+ * Feeds one frame, as a peer would send it, to proto_recv and returns its
+ * result. The sending end is closed after the bytes given, so a frame that
+ * claims more than it carries ends in a read error rather than a hang.
+ */
+static int recv_frame(int type, uint16_t flags, uint64_t length, const void *payload, size_t payload_len, proto_msg_t *msg) {
+    int fds[2];
+    if (check_socketpair(fds) < 0) {
+        return -2;
+    }
+    unsigned char header[PROTO_HEADER_SIZE];
+    put_le16(header, (uint16_t)type);
+    put_le16(header + 2, flags);
+    put_le32(header + 4, 7);
+    put_le64(header + 8, length);
+    check_write_all(fds[1], header, sizeof(header));
+    check_write_all(fds[1], payload, payload_len);
+    close(fds[1]);
+    mc_conn_t conn;
+    conn_init(&conn, fds[0]);
+    conn.proto_version = PROTO_VERSION_BINARY;
+    int rc = proto_recv(&conn, msg);
+    conn_destroy(&conn);
+    close(fds[0]);
+    return rc;
+}
+
+/* an ENTRY_FILE-style meta: u64 size, u32 path length, u32 reserved or count */
+static size_t entry_meta(unsigned char *out, uint64_t size, uint32_t path_len, uint32_t last, const char *path) {
+    put_le64(out, size);
+    put_le32(out + 8, path_len);
+    put_le32(out + 12, last);
+    memcpy(out + PROTO_ENTRY_META_SIZE, path, strlen(path));
+    return PROTO_ENTRY_META_SIZE + strlen(path);
+}
+
+static void test_entry_frames(void) {
+    unsigned char payload[256];
+    proto_msg_t msg;
+
+    size_t len = entry_meta(payload, 5, 3, 0, "a/b");
+    memcpy(payload + len, "hello", 5);
+    CHECK(recv_frame(PROTO_ENTRY_FILE, 0, len + 5, payload, len + 5, &msg) == 0);
+    CHECK(msg.type == PROTO_ENTRY_FILE && msg.request_id == 7 && msg.size == 5);
+    CHECK(msg.text_len == 3 && strcmp(msg.text, "a/b") == 0);
+    /* shorter than its meta, or not meta + path + body */
+    CHECK(recv_frame(PROTO_ENTRY_FILE, 0, 8, payload, 8, &msg) < 0 && errno == EPROTO);
+    CHECK(recv_frame(PROTO_ENTRY_FILE, 0, len + 4, payload, len + 4, &msg) < 0 && errno == EPROTO);
+    /* a body size that only adds up to the length by wrapping around */
+    len = entry_meta(payload, UINT64_MAX, 3, 0, "a/b");
+    CHECK(recv_frame(PROTO_ENTRY_FILE, 0, PROTO_ENTRY_META_SIZE + 2, payload, len, &msg) < 0 && errno == EPROTO);
+    /* a path that cannot fit is refused before any of it is read */
+    len = entry_meta(payload, 0, PATH_MAX, 0, "");
+    CHECK(recv_frame(PROTO_ENTRY_FILE, 0, PROTO_ENTRY_META_SIZE + PATH_MAX, payload, len, &msg) < 0 && errno == ENAMETOOLONG);
+    /* a frame cut short by the peer */
+    len = entry_meta(payload, 0, 10, 0, "abc");
+    CHECK(recv_frame(PROTO_ENTRY_FILE, 0, PROTO_ENTRY_META_SIZE + 10, payload, len, &msg) < 0);
+
+    len = entry_meta(payload, 100, 1, 2, "f");
+    CHECK(recv_frame(PROTO_ENTRY_CHUNKED, 0, len + 2 * PROTO_CHUNK_REF_SIZE, payload, len, &msg) == 0);
+    CHECK(msg.count == 2 && msg.size == 100);
+    CHECK(recv_frame(PROTO_ENTRY_CHUNKED, 0, len + PROTO_CHUNK_REF_SIZE, payload, len, &msg) < 0 && errno == EPROTO);
+    len = entry_meta(payload, 100, 1, UINT32_MAX, "f");
+    CHECK(recv_frame(PROTO_ENTRY_CHUNKED, 0, len, payload, len, &msg) < 0 && errno == EPROTO);
+
+    unsigned char digest[PROTO_DIGEST_META_SIZE + 1];
+    memset(digest, 0, sizeof(digest));
+    put_le64(digest, 42);
+    put_le32(digest + 8, 1);
+    put_le64(digest + 16, 1234);
+    memset(digest + 24, 0xab, HASH_SIZE);
+    digest[PROTO_DIGEST_META_SIZE] = 'x';
+    CHECK(recv_frame(PROTO_ENTRY_DIGEST, 0, sizeof(digest), digest, sizeof(digest), &msg) == 0);
+    CHECK(msg.size == 42 && msg.mtime == 1234 && msg.hash[0] == 0xab && strcmp(msg.text, "x") == 0);
+    CHECK(recv_frame(PROTO_ENTRY_DIGEST, 0, sizeof(digest) + 1, digest, sizeof(digest), &msg) < 0 && errno == EPROTO);
+    CHECK(recv_frame(PROTO_ENTRY_DIGEST, 0, 20, digest, 20, &msg) < 0 && errno == EPROTO);
+
+    unsigned char delta[PROTO_DELTA_META_SIZE + 1];
+    memset(delta, 0, sizeof(delta));
+    put_le64(delta, 9);
+    put_le32(delta + 8, 1);
+    delta[PROTO_DELTA_META_SIZE] = 'd';
+    CHECK(recv_frame(PROTO_ENTRY_DELTA, 0, sizeof(delta), delta, sizeof(delta), &msg) == 0);
+    CHECK(msg.size == 9 && strcmp(msg.text, "d") == 0);
+    CHECK(recv_frame(PROTO_ENTRY_DELTA, 0, sizeof(delta) - 1, delta, sizeof(delta) - 1, &msg) < 0 && errno == EPROTO);
+}
+
+static void test_signature_frames(void) {
+    unsigned char payload[64];
+    proto_msg_t msg;
+    /* two whole blocks and a tail */
+    size_t len = entry_meta(payload, 2 * DELTA_BLOCK_MIN + 100, 1, DELTA_BLOCK_MIN, "s");
+    uint64_t blocks = 2 * DELTA_BLOCK_WIRE_SIZE;
+    CHECK(recv_frame(PROTO_SIGNATURE, 0, len + blocks, payload, len, &msg) == 0);
+    CHECK(msg.count == 2 && msg.block_size == DELTA_BLOCK_MIN);
+    CHECK(recv_frame(PROTO_SIGNATURE, 0, len + blocks - 1, payload, len, &msg) < 0 && errno == EPROTO);
+    len = entry_meta(payload, 1 << 20, 1, DELTA_BLOCK_MIN - 1, "s");
+    CHECK(recv_frame(PROTO_SIGNATURE, 0, len, payload, len, &msg) < 0 && errno == EPROTO);
+    len = entry_meta(payload, 1 << 20, 1, 0, "s");
+    CHECK(recv_frame(PROTO_SIGNATURE, 0, len, payload, len, &msg) < 0 && errno == EPROTO);
+    len = entry_meta(payload, 1 << 20, 1, DELTA_BLOCK_MAX * 2, "s");
+    CHECK(recv_frame(PROTO_SIGNATURE, 0, len, payload, len, &msg) < 0 && errno == EPROTO);
+    /* more blocks than any signature may announce, even with a matching length */
+    uint64_t size = (uint64_t)(DELTA_SIGNATURE_BLOCKS_MAX + 1) * DELTA_BLOCK_MIN;
+    len = entry_meta(payload, size, 1, DELTA_BLOCK_MIN, "s");
+    CHECK(recv_frame(PROTO_SIGNATURE, 0, len + (DELTA_SIGNATURE_BLOCKS_MAX + 1) * (uint64_t)DELTA_BLOCK_WIRE_SIZE, payload, len, &msg) < 0 &&
+          errno == EPROTO);
+
+    len = entry_meta(payload, REGION_HEADER_SIZE, 1, REGION_SECTOR_SIZE, "r");
+    uint64_t slots = REGION_CHUNKS * DELTA_BLOCK_WIRE_SIZE;
+    CHECK(recv_frame(PROTO_SIGNATURE, PROTO_FLAG_REGION, len + slots, payload, len, &msg) == 0);
+    CHECK(msg.count == REGION_CHUNKS);
+    CHECK(recv_frame(PROTO_SIGNATURE, PROTO_FLAG_REGION, len + slots - DELTA_BLOCK_WIRE_SIZE, payload, len, &msg) < 0 && errno == EPROTO);
+    len = entry_meta(payload, REGION_HEADER_SIZE - 1, 1, REGION_SECTOR_SIZE, "r");
+    CHECK(recv_frame(PROTO_SIGNATURE, PROTO_FLAG_REGION, len + slots, payload, len, &msg) < 0 && errno == EPROTO);
+    len = entry_meta(payload, REGION_HEADER_SIZE, 1, DELTA_BLOCK_MIN * 2, "r");
+    CHECK(recv_frame(PROTO_SIGNATURE, PROTO_FLAG_REGION, len + slots, payload, len, &msg) < 0 && errno == EPROTO);
+}
+
+static void test_fixed_frames(void) {
+    unsigned char payload[PROTO_VERSION_META_SIZE + 8];
+    proto_msg_t msg;
+    memset(payload, 0, sizeof(payload));
+
+    put_le64(payload, 100);
+    put_le64(payload + 8, 200);
+    CHECK(recv_frame(PROTO_DELTA_COPY, 0, 16, payload, 16, &msg) == 0);
+    CHECK(msg.offset == 100 && msg.size == 200);
+    CHECK(recv_frame(PROTO_DELTA_COPY, 0, 15, payload, 15, &msg) < 0 && errno == EPROTO);
+    CHECK(recv_frame(PROTO_DELTA_COPY, 0, 17, payload, 17, &msg) < 0 && errno == EPROTO);
+
+    CHECK(recv_frame(PROTO_WANT, 0, 12, payload, 12, &msg) == 0 && msg.count == 3);
+    CHECK(recv_frame(PROTO_WANT, 0, 10, payload, 10, &msg) < 0 && errno == EPROTO);
+    CHECK(recv_frame(PROTO_WANT, 0, (UINT64_C(1) << 34) + 4, payload, 0, &msg) < 0 && errno == EPROTO);
+
+    CHECK(recv_frame(PROTO_CHUNK_DATA, 0, HASH_SIZE + 5, payload, HASH_SIZE, &msg) == 0 && msg.size == 5);
+    CHECK(recv_frame(PROTO_CHUNK_DATA, 0, HASH_SIZE - 1, payload, HASH_SIZE - 1, &msg) < 0 && errno == EPROTO);
+
+    put_le64(payload, 3);
+    CHECK(recv_frame(PROTO_COUNT, 0, 8, payload, 8, &msg) == 0 && msg.size == 3);
+    CHECK(recv_frame(PROTO_COUNT, 0, 4, payload, 4, &msg) < 0 && errno == EPROTO);
+
+    memset(payload, 0, sizeof(payload));
+    put_le64(payload, 4);
+    put_le32(payload + 24, 12);
+    memcpy(payload + PROTO_VERSION_META_SIZE, "tree", 4);
+    CHECK(recv_frame(PROTO_VERSION, 0, PROTO_VERSION_META_SIZE + 4, payload, PROTO_VERSION_META_SIZE + 4, &msg) == 0);
+    CHECK(msg.seq == 4 && msg.count == 12 && strcmp(msg.text, "tree") == 0);
+    CHECK(recv_frame(PROTO_WORLD_INFO, 0, PROTO_VERSION_META_SIZE - 1, payload, PROTO_VERSION_META_SIZE - 1, &msg) < 0 &&
+          errno == EPROTO);
+    CHECK(recv_frame(PROTO_WORLD_INFO, 0, PROTO_VERSION_META_SIZE + PATH_MAX, payload, PROTO_VERSION_META_SIZE, &msg) < 0 &&
+          errno == ENAMETOOLONG);
+
+    CHECK(recv_frame(PROTO_ENTRY_BATCH, 0, PROTO_BATCH_MAX, payload, 0, &msg) == 0 && msg.size == PROTO_BATCH_MAX);
+    CHECK(recv_frame(PROTO_ENTRY_BATCH, 0, PROTO_BATCH_MAX + 1, payload, 0, &msg) < 0 && errno == EMSGSIZE);
+    CHECK(recv_frame(PROTO_DELTA_DATA, 0, 99, payload, 0, &msg) == 0 && msg.size == 99);
+}
+
+static void test_text_frames(void) {
+    static const int types[] = { PROTO_ERR, PROTO_WORLD, PROTO_ENTRY_DIR, PROTO_ENTRY_DELETE, PROTO_LIST,
+                                 PROTO_PUSH, PROTO_PULL, PROTO_LOG, PROTO_CLONE };
+    proto_msg_t msg;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        CHECK(recv_frame(types[i], 0, 5, "world", 5, &msg) == 0 && msg.type == types[i] && strcmp(msg.text, "world") == 0);
+        CHECK(recv_frame(types[i], 0, PATH_MAX, "", 0, &msg) < 0 && errno == ENAMETOOLONG);
+        CHECK(recv_frame(types[i], 0, 9, "world", 5, &msg) < 0);
+    }
+    CHECK(recv_frame(PROTO_DONE, 0, 3, "abc", 3, &msg) == 0 && msg.type == PROTO_DONE);
+
+    /* a frame of a type from a newer peer is stepped over by its length */
+    unsigned char frames[PROTO_HEADER_SIZE + 5];
+    memcpy(frames, "junk!", 5);
+    put_le16(frames + 5, PROTO_END);
+    put_le16(frames + 7, 0);
+    put_le32(frames + 9, 1);
+    put_le64(frames + 13, 0);
+    CHECK(recv_frame(0x7f, 0, 5, frames, sizeof(frames), &msg) == 0 && msg.type == PROTO_END);
+    CHECK(recv_frame(0x7f, 0, 1 << 20, frames, sizeof(frames), &msg) < 0);
+}
+
+static void test_batch_records(void) {
+    unsigned char payload[128];
+    size_t len = entry_meta(payload, 2, 1, 0, "a");
+    memcpy(payload + len, "xy", 2);
+    len += 2;
+    size_t second = entry_meta(payload + len, 0, 2, 0, "bc");
+    len += second;
+    size_t offset = 0;
+    proto_batch_record_t record;
+    CHECK(proto_batch_next(payload, len, &offset, &record) == 1 && record.size == 2 && memcmp(record.body, "xy", 2) == 0);
+    CHECK(proto_batch_next(payload, len, &offset, &record) == 1 && record.path_len == 2 && record.size == 0);
+    CHECK(proto_batch_next(payload, len, &offset, &record) == 0);
+
+    offset = 0;
+    CHECK(proto_batch_next(payload, len - 1, &offset, &record) == 1);
+    CHECK(proto_batch_next(payload, len - 1, &offset, &record) < 0 && errno == EPROTO);
+    offset = 0;
+    put_le64(payload, UINT64_MAX);
+    CHECK(proto_batch_next(payload, len, &offset, &record) < 0 && errno == EPROTO);
+    offset = 0;
+    put_le64(payload, 2);
+    put_le32(payload + 8, 0);
+    CHECK(proto_batch_next(payload, len, &offset, &record) < 0 && errno == EPROTO);
+}
+
+/* a signature set is grown only by the blocks that actually arrive */
+static void test_recv_signatures(void) {
+    int fds[2];
+    if (check_socketpair(fds) < 0) {
+        CHECK(0);
+        return;
+    }
+    unsigned char frame[PROTO_HEADER_SIZE + PROTO_ENTRY_META_SIZE + 1 + DELTA_BLOCK_WIRE_SIZE];
+    uint64_t size = (uint64_t)DELTA_SIGNATURE_BLOCKS_MAX * DELTA_BLOCK_MIN;
+    put_le16(frame, PROTO_SIGNATURE);
+    put_le16(frame + 2, 0);
+    put_le32(frame + 4, 0);
+    put_le64(frame + 8, PROTO_ENTRY_META_SIZE + 1 + (uint64_t)DELTA_SIGNATURE_BLOCKS_MAX * DELTA_BLOCK_WIRE_SIZE);
+    entry_meta(frame + PROTO_HEADER_SIZE, size, 1, DELTA_BLOCK_MIN, "s");
+    memset(frame + PROTO_HEADER_SIZE + PROTO_ENTRY_META_SIZE + 1, 0x11, DELTA_BLOCK_WIRE_SIZE);
+    check_write_all(fds[1], frame, sizeof(frame));
+    close(fds[1]);
+    mc_conn_t conn;
+    conn_init(&conn, fds[0]);
+    conn.proto_version = PROTO_VERSION_BINARY;
+    delta_basis_set_t set;
+    delta_basis_set_init(&set);
+    CHECK(proto_recv_signatures(&conn, &set) < 0);
+    for (size_t i = 0; i < set.count; ++i) {
+        CHECK(set.items[i].signature.block_capacity < DELTA_SIGNATURE_BLOCKS_MAX);
+    }
+    delta_basis_set_free(&set);
+    conn_destroy(&conn);
+    close(fds[0]);
+}
+
+int main(void) {
+    test_check_path();
+    test_entry_frames();
+    test_signature_frames();
+    test_fixed_frames();
+    test_text_frames();
+    test_batch_records();
+    test_recv_signatures();
+    return check_report("protocol_test");
+}